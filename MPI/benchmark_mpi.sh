@@ -28,6 +28,9 @@ fi
 
 # Results file
 results_file="results/benchmark_mpi_results.txt"
+# One CSV row per run (--metrics), for spreadsheets and plotting
+metrics_file="results/benchmark_mpi_results.csv"
+rm -f "$metrics_file"
 echo "MPI Benchmark Results - $(date)" > $results_file
 echo "======================================" >> $results_file
 
@@ -59,7 +62,7 @@ for size_name in "${!images[@]}"; do
 
             # Run with mpirun and capture output
             # Add --oversubscribe to allow more processes than physical cores
-            output=$(mpirun --oversubscribe -np $np ./image_proc_mpi.exe "$input_file" "$output_file" "$filter" 2>&1)
+            output=$(mpirun --oversubscribe -np $np ./image_proc_mpi.exe "$input_file" "$output_file" "$filter" --metrics "csv:$metrics_file" 2>&1)
             exit_code=$?
 
             if [ $exit_code -ne 0 ]; then
@@ -86,6 +89,7 @@ echo ""
 echo "======================================"
 echo "Benchmark complete!"
 echo "Results saved to: $results_file"
+echo "Per-run metrics (CSV): $metrics_file"
 echo "Output images saved to: results/"
 echo "======================================"
 
@@ -43,6 +43,9 @@ fi
 
 # Results file
 results_file="results/benchmark_mpi_local_results.txt"
+# One CSV row per run (--metrics), for spreadsheets and plotting
+metrics_file="results/benchmark_mpi_local_results.csv"
+rm -f "$metrics_file"
 error_log="results/benchmark_mpi_errors.log"
 echo "MPI Local Benchmark Results - $(date)" > $results_file
 echo "System: $NUM_CORES cores detected" >> $results_file
@@ -77,7 +80,7 @@ for size_name in "${!images[@]}"; do
 
             # Run with mpirun and capture output
             # Add --oversubscribe flag to allow more processes than cores if needed
-            output=$(mpirun --oversubscribe -np $np ./image_proc_mpi.exe "$input_file" "$output_file" "$filter" 2>&1)
+            output=$(mpirun --oversubscribe -np $np ./image_proc_mpi.exe "$input_file" "$output_file" "$filter" --metrics "csv:$metrics_file" 2>&1)
             exit_code=$?
 
             if [ $exit_code -ne 0 ]; then
@@ -110,6 +113,7 @@ echo ""
 echo "======================================"
 echo "Benchmark complete!"
 echo "Results saved to: $results_file"
+echo "Per-run metrics (CSV): $metrics_file"
 echo "Errors logged to: $error_log"
 echo "Output images saved to: results/"
 echo "======================================"
@@ -1,74 +1,594 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
 #include <math.h>
+#include <time.h>
 #include <mpi.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 typedef struct {
     unsigned char *data;
     int width;
     int height;
     int channels;
+    unsigned char *map;     /* non-NULL: data points into this mmap'd file */
+    size_t map_size;
 } Image;
 
+// Netpbm input: P5 (gray), P6 (RGB) or P7 (gray, RGB or RGBA), 8 or 16
+// bits per sample; 16-bit samples are rescaled to 8 bits on load
+typedef struct {
+    int width;
+    int height;
+    int channels;
+    int max_val;
+} PnmInfo;
+
 // Function prototypes
 Image* load_image(const char* filename);
-void save_image(const char* filename, Image* img);
+// Returns 1 on success; P5, P6 or P7 by channel count
+int save_image(const char* filename, Image* img);
+Image* load_image_mmap(const char* filename);
+Image* create_image_mmap(const char* filename, int width, int height, int channels);
+int format_pnm_header(char* buf, size_t size, int width, int height, int channels);
+int read_pnm_header_all(const char* filename, PnmInfo* info, MPI_Offset* data_offset,
+                        int rank);
+// Gray results: a .pgm output is channel 0 of the result, which needs a
+// grayscale or edge stage (pipeline_gray_stage >= 0) unless the input is
+// gray already. A chain that starts with one runs on one channel from
+// the start: the input is reduced as it is loaded, so halos, scatter and
+// gather move one byte per pixel.
+int output_is_pgm(const char* path);
+// One byte per pixel from channels-byte pixels: channel 0, or with luma
+// the grayscale of channels 0-2 (what a leading grayscale stage computes)
+void copy_gray(const unsigned char* src, size_t src_pitch, int channels, int luma,
+               unsigned char* dst, size_t dst_pitch, int rows, int cols,
+               int thread_count);
+// The part of the image one rank owns: rows x cols pixels from
+// (row_start, col_start). Row bands span the full width.
+typedef struct {
+    int row_start;
+    int rows;
+    int col_start;
+    int cols;
+} Block;
+
+int read_block_mpiio(const char* filename, MPI_Offset data_offset, int width, int height,
+                     int channels, const Block* blk, unsigned char* buf, size_t pitch);
+int write_block_mpiio(const char* filename, int width, int height, int channels,
+                      const Block* blk, const unsigned char* buf, size_t pitch, int rank);
+void scatter_blocks(const unsigned char* image, int width, int height, int channels,
+                    const Block* blocks, unsigned char* buf, size_t pitch, int rank, int size);
+void gather_blocks(unsigned char* image, int width, int height, int channels,
+                   const Block* blocks, const unsigned char* buf, size_t pitch, int rank, int size);
 void free_image(Image* img);
 Image* create_image(int width, int height, int channels);
 
 void grayscale_filter_mpi(unsigned char* local_data, int local_height,
-                          int width, int channels);
-void gaussian_blur_filter_mpi(unsigned char* local_data, unsigned char* halo_top,
-                              unsigned char* halo_bottom, int local_height,
-                              int width, int channels, int rank, int size);
-void sobel_edge_filter_mpi(unsigned char* local_data, unsigned char* halo_top,
-                           unsigned char* halo_bottom, int local_height,
-                           int width, int channels, int rank, int size);
+                          int width, int channels, int thread_count);
 void brightness_filter_mpi(unsigned char* local_data, int local_height,
-                           int width, int channels, int brightness);
+                           int width, int channels, int brightness, int thread_count);
+void lut_filter_mpi(unsigned char* local_data, int local_height,
+                    int width, int channels, const unsigned char* table, int thread_count);
+
+// Process grid: dims[0] x dims[1] ranks in row-major order (rank r sits
+// at row r / dims[1], column r % dims[1]). Row bands are a dims[1] == 1
+// grid. neighbors[] is indexed by direction; opposite directions differ
+// in the low bit, and MPI_PROC_NULL marks the image edge.
+enum {
+    NB_UP, NB_DOWN, NB_LEFT, NB_RIGHT,
+    NB_UP_LEFT, NB_DOWN_RIGHT, NB_UP_RIGHT, NB_DOWN_LEFT,
+    NB_COUNT
+};
+
+typedef struct {
+    MPI_Comm comm;      /* Cartesian communicator for the halo exchange */
+    MPI_Comm row_comm;  /* the ranks of this grid row, left to right */
+    MPI_Comm col_comm;  /* the ranks of this grid column, top to bottom */
+    int dims[2];
+    int coords[2];
+    int neighbors[NB_COUNT];
+} ProcessGrid;
+
+// Collective over parent, which must have grid_rows * grid_cols ranks
+void process_grid_init(ProcessGrid* g, MPI_Comm parent, int grid_rows, int grid_cols);
+void process_grid_solo(ProcessGrid* g);
+void process_grid_free(ProcessGrid* g);
+// Collective over the grid: 1 if ok on every rank of it
+int grid_all_ok(int ok, const ProcessGrid* g);
+void choose_grid(int width, int height, int size, int* grid_rows, int* grid_cols);
+
+// A rank's block, twice, each with `ghost` halo rows above and below and
+// `ghost_cols` halo columns left and right: stencils receive halos
+// straight into the ghost cells of the current buffer and write the
+// other one, which then becomes current. Point filters work in place.
+typedef struct {
+    unsigned char* buf[2];
+    int cur;            /* index of the buffer holding the current rows */
+    int ghost;          /* halo rows on each side (largest stage radius) */
+    int ghost_cols;     /* halo columns on each side (0 for row bands) */
+    int local_height;
+    int width;          /* block width in pixels */
+    int channels;
+    size_t pitch;       /* bytes per buffer row, ghost columns included */
+} BandBuffers;
+
+void band_buffers_init(BandBuffers* b, int local_height, int width, int channels,
+                       int ghost, int ghost_cols);
+void band_buffers_free(BandBuffers* b);
+
+// First owned pixel of buffer `which`
+static inline unsigned char* band_buffer_rows(const BandBuffers* b, int which) {
+    return b->buf[which] + (size_t)b->ghost * b->pitch + (size_t)b->ghost_cols * b->channels;
+}
+
+// One rank's block as a stencil sees it: src rows -radius..local_height +
+// radius - 1 and columns -radius..width + radius - 1 are valid wherever a
+// neighbour exists (ghost cells hold the neighbours' halos)
+typedef struct {
+    const unsigned char* src;
+    size_t pitch;
+    int radius;
+    int local_height;
+    int width;
+    int channels;
+    int first_band;     /* block edge is the image edge: no halo there */
+    int last_band;
+    int left_edge;
+    int right_edge;
+    const void* params; /* filter parameters (GaussKernel for gauss) */
+    int thread_count;   /* OpenMP threads for the rows (hybrid build) */
+} StencilBand;
+
+// Computes output rows [row_begin, row_end), columns [col_begin, col_end)
+// of the block into out; returns 0 if it could not allocate its buffers
+typedef int (*StencilRowsFn)(const StencilBand* band, unsigned char* out,
+                             int row_begin, int row_end, int col_begin, int col_end);
+
+typedef struct {
+    MPI_Request requests[2 * NB_COUNT];
+    int count;
+} HaloExchange;
+
+void halo_exchange_begin(HaloExchange* hx, const BandBuffers* bands, unsigned char* rows,
+                         int radius, const ProcessGrid* grid);
+void halo_exchange_end(HaloExchange* hx);
+// Returns this rank's status (the halo exchange completes either way);
+// callers whose rows can fail make it collective with grid_all_ok
+int stencil_filter_mpi(StencilRowsFn rows_fn, int radius, const void* params,
+                       BandBuffers* bands, const ProcessGrid* grid, int thread_count);
+
+int gaussian_blur_rows_mpi(const StencilBand* band, unsigned char* out,
+                           int row_begin, int row_end, int col_begin, int col_end);
+int sobel_edge_rows_mpi(const StencilBand* band, unsigned char* out,
+                        int row_begin, int row_end, int col_begin, int col_end);
+
+// Separable Gaussian: Q14 weights up to GAUSS_MAX_RADIUS taps each side,
+// three running-sum box passes above GAUSS_BOX_SIGMA
+#define GAUSS_SHIFT 14
+#define GAUSS_MAX_RADIUS 30
+#define GAUSS_BOX_SIGMA 10.0f
+#define GAUSS_COL_BLOCK 256     /* bytes per thread block in the box passes */
+
+typedef struct {
+    float sigma;
+    int radius;         /* halo rows needed on each side */
+    int use_box;
+    int box_radius[3];
+    int weights[2 * GAUSS_MAX_RADIUS + 1];
+} GaussKernel;
+
+void gauss_kernel_init(GaussKernel* k, float sigma);
+int gaussian_separable_rows_mpi(const StencilBand* band, unsigned char* out,
+                                int row_begin, int row_end, int col_begin, int col_end);
+
+// Filter chain ("grayscale,blur,edge"), applied stage by stage on the band
+#define MAX_STAGES 16
+
+typedef enum {
+    FILTER_GRAYSCALE,
+    FILTER_BLUR,
+    FILTER_EDGE,
+    FILTER_BRIGHTEN,
+    FILTER_GAUSS,
+    FILTER_BOX,
+    FILTER_THRESH,
+    FILTER_EQUALIZE,
+    FILTER_AUTOLEVELS,
+    FILTER_STRETCH,
+    FILTER_CONTRAST,
+    FILTER_GAMMA,
+    FILTER_INVERT,
+    FILTER_THRESHOLD,
+    FILTER_LUT          /* a run of per-channel point ops folded into one table */
+} FilterType;
+
+// Sobel output, as in the OpenMP build: the magnitude or |gx| + |gy|,
+// clamped to 255, or with a mask level 255 where it reaches the level
+// (compared without sqrt) and 0 elsewhere
+typedef enum { EDGE_L2, EDGE_L1 } EdgeNorm;
+
+typedef struct {
+    FilterType type;
+    int radius;         /* halo rows the stage reads on each side */
+    int offset;         /* FILTER_THRESH: pixels above local mean - offset turn white */
+    int param;          /* FILTER_BRIGHTEN offset, FILTER_THRESHOLD level,
+                           FILTER_EDGE mask level (0 for the magnitude) */
+    EdgeNorm norm;      /* FILTER_EDGE only */
+    float amount;       /* FILTER_CONTRAST gain, FILTER_GAMMA exponent */
+    float clip[2];      /* FILTER_STRETCH: low and high percentiles kept */
+    unsigned char table[256];   /* FILTER_LUT */
+    GaussKernel kernel; /* FILTER_GAUSS only */
+} FilterStage;
+
+// Per-channel point ops, same tables as the OpenMP build
+#define BRIGHTEN_DEFAULT 50
+#define CONTRAST_DEFAULT 1.5f
+#define GAMMA_DEFAULT 2.2f
+#define THRESHOLD_DEFAULT 128
+
+// box:R and thresh:R[:C] read a summed-area table of 32-bit entries that
+// wrap; windows of up to 2^32 / 255 pixels still come out exact
+#define SAT_MAX_RADIUS 2047
+#define SAT_COL_BLOCK 256       /* entries per thread block in the column scan */
+#define BOX_DEFAULT_RADIUS 5
+#define THRESH_DEFAULT_RADIUS 7
+#define THRESH_DEFAULT_OFFSET 5
+
+// Returns 0 on every rank of the grid if any of them could not allocate
+// its table
+int integral_filter_mpi(const FilterStage* st, BandBuffers* bands, const ProcessGrid* grid,
+                        int thread_count);
+
+// Tone stages: HIST_BINS counts per channel, summed over all ranks of the
+// grid, become one lookup table per channel
+#define HIST_BINS 256
+#define HIST_COPIES 4       /* private histograms per thread */
+#define STRETCH_DEFAULT_LOW 1.0f
+#define STRETCH_DEFAULT_HIGH 99.0f
+
+// Returns 0 on every rank of the grid if any of them could not allocate
+// its histograms
+int tone_filter_mpi(const FilterStage* st, BandBuffers* bands, const ProcessGrid* grid,
+                    int thread_count);
+
+int parse_pipeline(const char* spec, FilterStage* stages, int max_stages, int rank);
+int pipeline_gray_stage(const FilterStage* stages, int stage_count);
+// Returns 0 on every rank of the grid if a stage failed on any of them
+int apply_pipeline_mpi(const FilterStage* stages, int stage_count, BandBuffers* bands,
+                       const ProcessGrid* grid, int thread_count, int verbose);
+
+// Row decomposition: rank r owns rows [row_starts[r], row_starts[r + 1])
+#define CALIBRATION_ROWS 32
+void decompose_rows(int height, int size, const double* weights, int min_rows,
+                    int* row_starts);
+double calibrate_throughput(const FilterStage* stages, int stage_count, int width,
+                            int channels, int thread_count);
+int read_balance_hints(const char* path, double* weights, int size);
+
+// Batch mode: rank 0 hands the images of a manifest or directory to the
+// other ranks one at a time; returns 0 on rank 0 if all succeeded
+int run_batch_mpi(const char* source, const char* out_dir, const FilterStage* stages,
+                  int stage_count, int use_mmap, int thread_count, int rank, int size);
+
+// Bench mode: time the chain on 1, 2, 4, ... size ranks, reps timed runs
+// after warmup ones each; rank 0 prints the table
+#define BENCH_SIZES "512x512,1024x1024,2048x2048,4096x4096"
+#define BENCH_WARMUP 3
+#define BENCH_REPS 10
+int run_bench_mpi(const char* source, const FilterStage* stages, int stage_count, int ghost,
+                  int use_grid, int thread_count, int warmup, int reps, int rank, int size);
+
+// --metrics: per-rank phase timers and counters, gathered on rank 0 and
+// written as a JSON object or a CSV row
+#define METRIC_EVENTS 3     /* cycles, instructions, cache misses */
+typedef enum { METRICS_JSON, METRICS_CSV } MetricsFormat;
+typedef enum { PHASE_LOAD, PHASE_SCATTER, PHASE_HALO, PHASE_COMPUTE, PHASE_GATHER,
+               PHASE_SAVE, PHASE_COUNT } Phase;
+typedef struct {
+    MetricsFormat format;
+    const char* path;       /* NULL: stderr (stdout has the report) */
+} MetricsSpec;
+typedef struct {
+    double phase[PHASE_COUNT];          /* seconds */
+    double cpu;                         /* CPU seconds of all threads in the filters */
+    long long events[METRIC_EVENTS];    /* summed over threads; -1: not available */
+} RankMetrics;
+typedef struct {
+    const char* input;
+    const char* filter;
+    const char* io;
+    int width, height, channels;
+    int grid_rows, grid_cols;
+    int thread_count;
+    int stage_count;
+    double processing;      /* barrier to barrier, scatter to gather */
+} MetricsRun;
+int parse_metrics(const char* spec, MetricsSpec* m);
+// Bracket the filters; parallel regions of thread_count in the hybrid build
+void metrics_probe_begin(int thread_count);
+void metrics_probe_end(RankMetrics* rm, int thread_count);
+// Collective; rank 0 writes. Returns 0 if the output could not be written.
+int metrics_report(const MetricsSpec* m, const RankMetrics* mine, const MetricsRun* run,
+                   const Block* blocks, int rank, int size);
+
+// Seconds this rank has spent in halo exchanges and in the filters' scans
+// and reductions over the grid (reported as the halo phase)
+static double halo_seconds = 0.0;
 
 int main(int argc, char* argv[]) {
-    int rank, size;
-    MPI_Init(&argc, &argv);
+    int rank, size, provided;
+    // Only the master thread of each rank makes MPI calls
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
     
     if (argc < 4) {
         if (rank == 0) {
-            fprintf(stderr, "Usage: %s <input.ppm> <output.ppm> <filter>\n", argv[0]);
-            fprintf(stderr, "Filters: grayscale, blur, edge, brighten\n");
+            fprintf(stderr, "Usage: %s <input.ppm> <output.ppm> <filter> [--io mpiio|stdio|mmap] [--threads N]\n"
+                    "       [--balance static|calibrate|file:HINTS] [--grid PxQ|auto] [--batch]\n"
+                    "       [--metrics json|csv[:FILE]]\n"
+                    "       %s --bench <input.ppm|synthetic[:WxH,...]> <filter> [--warmup M] [--reps N]\n"
+                    "       [--threads N] [--grid auto]\n", argv[0], argv[0]);
+            fprintf(stderr, "Filters: grayscale, blur, edge[:l1], edgemask:T[:l1], brighten:N, contrast:F,\n"
+                    "         gamma:G, invert, threshold:T, gauss:SIGMA, box:R, thresh:R[:C],\n"
+                    "         equalize, autolevels, stretch:LOW:HIGH\n");
+            fprintf(stderr, "Chain filters with commas, e.g. grayscale,blur,edge\n");
+            fprintf(stderr, "Inputs are P5, P6 or P7 PAM (1, 3 or 4 channels), 8- or 16-bit (rescaled\n"
+                    "to 8 bits); a .pgm output is channel 0 and needs grayscale or edge\n");
+            fprintf(stderr, "--batch: <input> is a manifest or directory of .ppm/.pgm/.pam files and\n"
+                    "<output> a directory; whole images go to ranks from a work queue\n");
+            fprintf(stderr, "--bench: min/median/p95 time, speedup and efficiency on 1, 2, 4, ...\n"
+                    "ranks, in memory (synthetic: %s)\n", BENCH_SIZES);
         }
         MPI_Finalize();
         return 1;
     }
     
-    const char* input_file = argv[1];
-    const char* output_file = argv[2];
+    // --bench SOURCE <filter>: in-memory rank sweep, nothing is written
+    const char* bench_source = (strcmp(argv[1], "--bench") == 0) ? argv[2] : NULL;
+    const char* input_file = bench_source ? NULL : argv[1];
+    const char* output_file = bench_source ? NULL : argv[2];
     const char* filter_type = argv[3];
     
+    // --io mpiio (default): every rank reads and writes its own band.
+    // --io stdio|mmap: rank 0 loads the image and scatters/gathers it; mmap
+    // scatters straight from the mapped input and gathers straight into the
+    // mapped output file
+    const char* io_mode = "mpiio";
+    int thread_count = 1;   /* OpenMP threads per rank (hybrid build) */
+    // --balance static (default): equal bands, remainder to low ranks.
+    // calibrate: bands proportional to each rank's measured throughput on
+    // a calibration band. file:HINTS: one relative throughput per line in
+    // rank order.
+    const char* balance = "static";
+    // --grid PxQ: 2D blocks on a P x Q process grid (auto: least halo
+    // traffic for the image shape). Without it ranks own row bands.
+    const char* grid_spec = NULL;
+    int grid_rows = size, grid_cols = 1;
+    int batch = 0;
+    MetricsSpec metrics;
+    int want_metrics = 0;
+    int bench_warmup = BENCH_WARMUP;
+    int bench_reps = BENCH_REPS;
+    for (int a = 4; a < argc; a++) {
+        if (strcmp(argv[a], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[a], "--warmup") == 0 && a + 1 < argc && bench_source &&
+                   atoi(argv[a + 1]) >= 0) {
+            bench_warmup = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--reps") == 0 && a + 1 < argc && bench_source &&
+                   atoi(argv[a + 1]) > 0) {
+            bench_reps = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--metrics") == 0 && a + 1 < argc &&
+                   parse_metrics(argv[a + 1], &metrics)) {
+            want_metrics = 1;
+            a++;
+        } else if (strcmp(argv[a], "--grid") == 0 && a + 1 < argc &&
+            (strcmp(argv[a + 1], "auto") == 0 ||
+             sscanf(argv[a + 1], "%dx%d", &grid_rows, &grid_cols) == 2)) {
+            grid_spec = argv[++a];
+        } else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) {
+            thread_count = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--balance") == 0 && a + 1 < argc &&
+                   (strcmp(argv[a + 1], "static") == 0 || strcmp(argv[a + 1], "calibrate") == 0 ||
+                    strncmp(argv[a + 1], "file:", 5) == 0)) {
+            balance = argv[++a];
+        } else if (strcmp(argv[a], "--io") == 0 && a + 1 < argc &&
+            (strcmp(argv[a + 1], "mpiio") == 0 || strcmp(argv[a + 1], "mmap") == 0 ||
+             strcmp(argv[a + 1], "stdio") == 0)) {
+            io_mode = argv[++a];
+        } else {
+            if (rank == 0) fprintf(stderr, "Error: Unknown option '%s'\n", argv[a]);
+            MPI_Finalize();
+            return 1;
+        }
+    }
+#ifndef _OPENMP
+    if (thread_count > 1 && rank == 0) {
+        fprintf(stderr, "Warning: built without OpenMP, --threads %d ignored "
+                "(use the hybrid target)\n", thread_count);
+    }
+    thread_count = 1;
+#endif
+    if (grid_spec && strcmp(grid_spec, "auto") != 0 &&
+        (grid_rows <= 0 || grid_cols <= 0 || grid_rows * grid_cols != size)) {
+        if (rank == 0) fprintf(stderr, "Error: --grid %s does not match %d processes\n",
+                               grid_spec, size);
+        MPI_Finalize();
+        return 1;
+    }
+    if (grid_spec && strcmp(balance, "static") != 0) {
+        if (rank == 0) fprintf(stderr, "Error: --balance %s only applies to row bands, not --grid\n",
+                               balance);
+        MPI_Finalize();
+        return 1;
+    }
+    if (bench_source && (batch || want_metrics || strcmp(io_mode, "mpiio") != 0 ||
+                         strcmp(balance, "static") != 0 ||
+                         (grid_spec && strcmp(grid_spec, "auto") != 0))) {
+        if (rank == 0) fprintf(stderr, "Error: --bench sweeps rank counts in memory; only "
+                               "--threads and --grid auto apply\n");
+        MPI_Finalize();
+        return 1;
+    }
+    if (batch && want_metrics) {
+        if (rank == 0) fprintf(stderr, "Error: --metrics times the phases of one image; not with --batch\n");
+        MPI_Finalize();
+        return 1;
+    }
+    if (batch && (grid_spec || strcmp(balance, "static") != 0)) {
+        if (rank == 0) fprintf(stderr, "Error: --batch processes whole images; no --grid or --balance\n");
+        MPI_Finalize();
+        return 1;
+    }
+    // Whole images per rank: plain file I/O unless mmap was asked for
+    if (batch && strcmp(io_mode, "mpiio") == 0) io_mode = "stdio";
+    if (thread_count > 1 && provided < MPI_THREAD_FUNNELED && rank == 0) {
+        fprintf(stderr, "Warning: MPI library does not provide MPI_THREAD_FUNNELED\n");
+    }
+    
+    FilterStage stages[MAX_STAGES];
+    int stage_count = parse_pipeline(filter_type, stages, MAX_STAGES, rank);
+    if (stage_count <= 0) {
+        MPI_Finalize();
+        return 1;
+    }
+    int ghost = 0;
+    for (int s = 0; s < stage_count; s++) {
+        if (stages[s].radius > ghost) ghost = stages[s].radius;
+    }
+    
+    if (bench_source) {
+        if (rank == 0) {
+            printf("\n========================================\n");
+            printf("Image Processing with MPI: benchmark\n");
+            printf("========================================\n");
+            printf("Source: %s\n", bench_source);
+            printf("Filter: %s\n", filter_type);
+            printf("MPI Processes: 1..%d\n", size);
+            printf("OpenMP threads per process: %d\n", thread_count);
+            printf("Decomposition: %s\n", grid_spec ? "grid auto" : "row bands");
+            printf("Runs: %d warmup + %d timed per rank count\n", bench_warmup, bench_reps);
+            printf("========================================\n\n");
+        }
+        int status = run_bench_mpi(bench_source, stages, stage_count, ghost, grid_spec != NULL,
+                                   thread_count, bench_warmup, bench_reps, rank, size);
+        MPI_Finalize();
+        return status;
+    }
+    
+    int use_mpiio = strcmp(io_mode, "mpiio") == 0;
+    int use_mmap = strcmp(io_mode, "mmap") == 0;
+    if (use_mmap && strcmp(input_file, output_file) == 0) {
+        if (rank == 0) fprintf(stderr, "Error: --io mmap needs distinct input and output files\n");
+        MPI_Finalize();
+        return 1;
+    }
+    
     Image* full_image = NULL;
+    Image* result_image = NULL;     /* gather target; full_image unless mapped */
     int width, height, channels;
+    MPI_Offset data_offset = 0;     /* first pixel byte, mpiio only */
     
     double start_time, end_time;
+    double load_time = 0.0, save_time = 0.0;
     
     // Root process loads image
     if (rank == 0) {
         printf("\n========================================\n");
         printf("Image Processing with MPI\n");
         printf("========================================\n");
-        printf("Input:  %s\n", input_file);
+        printf("Input:  %s%s\n", input_file, batch ? " (batch)" : "");
         printf("Output: %s\n", output_file);
         printf("Filter: %s\n", filter_type);
         printf("MPI Processes: %d\n", size);
+        printf("OpenMP threads per process: %d\n", thread_count);
+        printf("I/O: %s\n", io_mode);
         printf("========================================\n\n");
-        
+    }
+    
+    if (batch) {
+        int status = run_batch_mpi(input_file, output_file, stages, stage_count,
+                                   use_mmap, thread_count, rank, size);
+        MPI_Finalize();
+        return status;
+    }
+    
+    if (use_mpiio) {
+        PnmInfo info;
+        if (!read_pnm_header_all(input_file, &info, &data_offset, rank)) {
+            if (rank == 0) fprintf(stderr, "Error: Could not load image\n");
+            MPI_Finalize();
+            return 1;
+        }
+        width = info.width;
+        height = info.height;
+        channels = info.channels;
+        if (rank == 0) printf("Image header: %dx%d, %d channels\n", width, height, channels);
+        // 16-bit samples are rescaled on load, which the blocks read
+        // straight from the file cannot be; rank 0 loads those
+        if (info.max_val > 255) {
+            if (rank == 0) printf("16-bit samples: loading on rank 0 (--io stdio)\n");
+            use_mpiio = 0;
+            io_mode = "stdio";
+        }
+    }
+    // A .pgm output runs on one channel when the chain starts with
+    // grayscale or edge; other chains are collapsed on save
+    int pgm_output = output_is_pgm(output_file);
+    int gray_luma = stage_count > 0 && stages[0].type == FILTER_GRAYSCALE;
+    if (!use_mpiio && rank == 0) {
         printf("Loading image...\n");
-        full_image = load_image(input_file);
+        double io_start = MPI_Wtime();
+        full_image = use_mmap ? load_image_mmap(input_file) : load_image(input_file);
         if (!full_image) {
             fprintf(stderr, "Error: Could not load image\n");
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
+        if (pgm_output && full_image->channels > 1 &&
+            pipeline_gray_stage(stages, stage_count) == 0) {
+            Image* gray = create_image(full_image->width, full_image->height, 1);
+            if (!gray) {
+                fprintf(stderr, "Error: Could not allocate gray image\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            copy_gray(full_image->data, (size_t)full_image->width * full_image->channels,
+                      full_image->channels, gray_luma, gray->data, full_image->width,
+                      full_image->height, full_image->width, thread_count);
+            free_image(full_image);
+            full_image = gray;
+            printf("Reduced to 1 channel for %s\n", output_file);
+        }
+        result_image = full_image;
+        if (use_mmap && pgm_output && full_image->channels > 1) {
+            result_image = create_image(full_image->width, full_image->height,
+                                        full_image->channels);
+        } else if (use_mmap) {
+            result_image = create_image_mmap(output_file, full_image->width,
+                                             full_image->height, full_image->channels);
+            if (!result_image) {
+                fprintf(stderr, "Error: Could not map output file\n");
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        load_time = MPI_Wtime() - io_start;
         printf("Image loaded: %dx%d, %d channels\n", 
                full_image->width, full_image->height, full_image->channels);
         
@@ -78,339 +598,479 @@ int main(int argc, char* argv[]) {
     }
     
     // Broadcast image dimensions
-    MPI_Bcast(&width, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&height, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&channels, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!use_mpiio) {
+        MPI_Bcast(&width, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&height, 1, MPI_INT, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&channels, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    
+    // With MPI-IO every rank reduces the block it reads
+    int file_channels = channels;
+    if (use_mpiio && pgm_output && channels > 1 && pipeline_gray_stage(stages, stage_count) == 0) {
+        channels = 1;
+        if (rank == 0) printf("Reduced to 1 channel for %s\n", output_file);
+    }
     
-    // Calculate rows per process
-    int rows_per_process = height / size;
-    int remainder = height % size;
+    int out_channels = pgm_output ? 1 : channels;
+    if (out_channels < channels && pipeline_gray_stage(stages, stage_count) < 0) {
+        if (rank == 0) {
+            fprintf(stderr, "Error: %s is a .pgm but %s keeps %d distinct channels; "
+                    "add grayscale or edge\n", output_file, filter_type, channels);
+            if (!use_mpiio && result_image != full_image) free_image(result_image);
+            if (!use_mpiio) free_image(full_image);
+        }
+        MPI_Finalize();
+        return 1;
+    }
     
-    // Adjust for remainder rows
-    int local_height = rows_per_process;
-    if (rank < remainder) {
-        local_height++;
+    if (grid_spec && strcmp(grid_spec, "auto") == 0) {
+        choose_grid(width, height, size, &grid_rows, &grid_cols);
     }
     
-    // Calculate displacement for each process
-    int* sendcounts = NULL;
-    int* displs = NULL;
+    // Decompose rows (and columns on a 2D grid); every block must be able
+    // to feed `ghost` halo rows and columns to its neighbours
+    int* row_starts = (int*)malloc((grid_rows + 1) * sizeof(int));
+    int* col_starts = (int*)malloc((grid_cols + 1) * sizeof(int));
+    int min_rows = (size > 1) ? ghost : 0;
+    int decompose_ok = 1;
     
-    if (rank == 0) {
-        sendcounts = (int*)malloc(size * sizeof(int));
-        displs = (int*)malloc(size * sizeof(int));
-        
-        int offset = 0;
-        for (int i = 0; i < size; i++) {
-            int rows = rows_per_process;
-            if (i < remainder) rows++;
-            
-            sendcounts[i] = rows * width * channels;
-            displs[i] = offset;
-            offset += sendcounts[i];
+    decompose_rows(width, grid_cols, NULL, 0, col_starts);
+    if (strcmp(balance, "static") == 0) {
+        decompose_rows(height, grid_rows, NULL, 0, row_starts);
+        decompose_ok = (grid_rows == 1 || height / grid_rows >= ghost) &&
+                       (grid_cols == 1 || width / grid_cols >= ghost);
+    } else {
+        double* weights = (double*)malloc(size * sizeof(double));
+        if (strcmp(balance, "calibrate") == 0) {
+            double mine = calibrate_throughput(stages, stage_count, width, channels, thread_count);
+            MPI_Allgather(&mine, 1, MPI_DOUBLE, weights, 1, MPI_DOUBLE, MPI_COMM_WORLD);
+        } else {
+            int ok = (rank == 0) ? read_balance_hints(balance + 5, weights, size) : 1;
+            MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            if (!ok) {
+                if (rank == 0) fprintf(stderr, "Error: Could not read %d weights from %s\n",
+                                       size, balance + 5);
+                MPI_Finalize();
+                return 1;
+            }
+            MPI_Bcast(weights, size, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        }
+        decompose_ok = (height >= size * min_rows);
+        if (decompose_ok) decompose_rows(height, size, weights, min_rows, row_starts);
+        if (rank == 0 && decompose_ok) {
+            printf("Balanced decomposition (%s):\n", balance);
+            for (int r = 0; r < size; r++) {
+                printf("  rank %d: weight %.3g, rows %d-%d\n", r, weights[r],
+                       row_starts[r], row_starts[r + 1] - 1);
+            }
         }
+        free(weights);
     }
     
-    // Allocate local data
-    int local_size = local_height * width * channels;
-    unsigned char* local_data = (unsigned char*)malloc(local_size);
+    // Halo depth matches the largest stage radius; a neighbour can only
+    // provide that many rows if its band is at least that tall
+    if (!decompose_ok) {
+        if (rank == 0 && grid_spec) {
+            fprintf(stderr, "Error: %s needs %d halo pixels but %dx%d grid blocks are only %d rows x %d columns; "
+                    "use fewer processes\n", filter_type, ghost, grid_rows, grid_cols,
+                    height / grid_rows, width / grid_cols);
+        } else if (rank == 0) {
+            fprintf(stderr, "Error: %s needs %d halo rows but bands are only %d rows; "
+                    "use fewer processes\n", filter_type, ghost, height / size);
+        }
+        if (rank == 0 && !use_mpiio) {
+            if (result_image != full_image) free_image(result_image);
+            free_image(full_image);
+        }
+        free(row_starts);
+        free(col_starts);
+        MPI_Finalize();
+        return 1;
+    }
+    
+    ProcessGrid grid;
+    process_grid_init(&grid, MPI_COMM_WORLD, grid_rows, grid_cols);
+    if (rank == 0 && grid_spec) {
+        printf("Process grid: %d x %d (blocks of about %dx%d pixels)\n",
+               grid_rows, grid_cols, width / grid_cols, height / grid_rows);
+    }
+    
+    Block* blocks = (Block*)malloc(size * sizeof(Block));
+    for (int r = 0; r < size; r++) {
+        int gr = r / grid_cols, gc = r % grid_cols;
+        blocks[r].row_start = row_starts[gr];
+        blocks[r].rows = row_starts[gr + 1] - row_starts[gr];
+        blocks[r].col_start = col_starts[gc];
+        blocks[r].cols = col_starts[gc + 1] - col_starts[gc];
+    }
+    const Block* mine = &blocks[rank];
+    
+    // Allocate local data with ghost rows (and columns) for the halos
+    BandBuffers bands;
+    band_buffers_init(&bands, mine->rows, mine->cols, channels, ghost,
+                      (grid_cols > 1) ? ghost : 0);
+    unsigned char* local_data = band_buffer_rows(&bands, bands.cur);
+    
+    if (use_mpiio) {
+        if (rank == 0) printf("Reading %s with MPI-IO...\n", grid_spec ? "blocks" : "row bands");
+        double io_start = MPI_Wtime();
+        int read_ok;
+        if (channels < file_channels) {
+            size_t wide_pitch = (size_t)mine->cols * file_channels;
+            unsigned char* wide = (unsigned char*)malloc(wide_pitch * mine->rows + 1);
+            read_ok = wide && read_block_mpiio(input_file, data_offset, width, height,
+                                               file_channels, mine, wide, wide_pitch);
+            if (read_ok) {
+                copy_gray(wide, wide_pitch, file_channels, gray_luma, local_data, bands.pitch,
+                          mine->rows, mine->cols, thread_count);
+            }
+            free(wide);
+        } else {
+            read_ok = read_block_mpiio(input_file, data_offset, width, height, channels,
+                                       mine, local_data, bands.pitch);
+        }
+        if (!read_ok) {
+            if (rank == 0) fprintf(stderr, "Error: Could not read image data\n");
+            band_buffers_free(&bands);
+            process_grid_free(&grid);
+            free(blocks);
+            free(row_starts);
+            free(col_starts);
+            MPI_Finalize();
+            return 1;
+        }
+        load_time = MPI_Wtime() - io_start;
+    }
     
     // Scatter image data
+    RankMetrics rm;
+    memset(&rm, 0, sizeof(rm));
     MPI_Barrier(MPI_COMM_WORLD);
     start_time = MPI_Wtime();
     
-    MPI_Scatterv(
-        (rank == 0) ? full_image->data : NULL,
-        sendcounts,
-        displs,
-        MPI_UNSIGNED_CHAR,
-        local_data,
-        local_size,
-        MPI_UNSIGNED_CHAR,
-        0,
-        MPI_COMM_WORLD
-    );
-    
-    // Apply filter based on type
-    if (strcmp(filter_type, "grayscale") == 0) {
-        if (rank == 0) printf("Applying grayscale filter...\n");
-        grayscale_filter_mpi(local_data, local_height, width, channels);
-        
-    } else if (strcmp(filter_type, "blur") == 0) {
-        if (rank == 0) printf("Applying Gaussian blur filter...\n");
-        
-        // Allocate halo rows for neighbors
-        int row_size = width * channels;
-        unsigned char* halo_top = (unsigned char*)calloc(row_size, 1);
-        unsigned char* halo_bottom = (unsigned char*)calloc(row_size, 1);
-        
-        // Exchange halo rows with neighbors
-        MPI_Request requests[4];
-        int req_count = 0;
-        
-        // Send/receive with upper neighbor
-        if (rank > 0) {
-            MPI_Isend(local_data, row_size, MPI_UNSIGNED_CHAR, 
-                     rank - 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(halo_top, row_size, MPI_UNSIGNED_CHAR, 
-                     rank - 1, 1, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        // Send/receive with lower neighbor
-        if (rank < size - 1) {
-            MPI_Isend(local_data + (local_height - 1) * row_size, row_size, 
-                     MPI_UNSIGNED_CHAR, rank + 1, 1, MPI_COMM_WORLD, 
-                     &requests[req_count++]);
-            MPI_Irecv(halo_bottom, row_size, MPI_UNSIGNED_CHAR, 
-                     rank + 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-        
-        MPI_Waitall(req_count, requests, MPI_STATUSES_IGNORE);
-        
-        // Apply blur with halo data
-        gaussian_blur_filter_mpi(local_data, halo_top, halo_bottom, 
-                                local_height, width, channels, rank, size);
-        
-        free(halo_top);
-        free(halo_bottom);
-
-    } else if (strcmp(filter_type, "edge") == 0) {
-        if (rank == 0) printf("Applying Sobel edge detection filter...\n");
-
-        // Allocate halo rows for neighbors
-        int row_size = width * channels;
-        unsigned char* halo_top = (unsigned char*)calloc(row_size, 1);
-        unsigned char* halo_bottom = (unsigned char*)calloc(row_size, 1);
-
-        // Exchange halo rows with neighbors
-        MPI_Request requests[4];
-        int req_count = 0;
-
-        // Send/receive with upper neighbor
-        if (rank > 0) {
-            MPI_Isend(local_data, row_size, MPI_UNSIGNED_CHAR,
-                     rank - 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-            MPI_Irecv(halo_top, row_size, MPI_UNSIGNED_CHAR,
-                     rank - 1, 1, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-
-        // Send/receive with lower neighbor
-        if (rank < size - 1) {
-            MPI_Isend(local_data + (local_height - 1) * row_size, row_size,
-                     MPI_UNSIGNED_CHAR, rank + 1, 1, MPI_COMM_WORLD,
-                     &requests[req_count++]);
-            MPI_Irecv(halo_bottom, row_size, MPI_UNSIGNED_CHAR,
-                     rank + 1, 0, MPI_COMM_WORLD, &requests[req_count++]);
-        }
-
-        MPI_Waitall(req_count, requests, MPI_STATUSES_IGNORE);
-
-        // Apply edge detection with halo data
-        sobel_edge_filter_mpi(local_data, halo_top, halo_bottom,
-                             local_height, width, channels, rank, size);
-
-        free(halo_top);
-        free(halo_bottom);
-
-    } else if (strcmp(filter_type, "brighten") == 0) {
-        if (rank == 0) printf("Applying brightness adjustment...\n");
-        brightness_filter_mpi(local_data, local_height, width, channels, 50);
-
-    } else {
+    if (!use_mpiio) {
+        scatter_blocks((rank == 0) ? full_image->data : NULL, width, height, channels,
+                       blocks, local_data, bands.pitch, rank, size);
+    }
+    rm.phase[PHASE_SCATTER] = MPI_Wtime() - start_time;
+    
+    // Apply the filters in order
+    if (want_metrics) metrics_probe_begin(thread_count);
+    double halo_start = halo_seconds;
+    double compute_start = MPI_Wtime();
+    int filter_ok = apply_pipeline_mpi(stages, stage_count, &bands, &grid, thread_count,
+                                       rank == 0);
+    double compute_time = MPI_Wtime() - compute_start;
+    if (want_metrics) metrics_probe_end(&rm, thread_count);
+    if (!filter_ok) {
+        // The ranks that failed have said what they could not allocate
         if (rank == 0) {
-            fprintf(stderr, "Error: Unknown filter '%s'\n", filter_type);
+            fprintf(stderr, "Error: The filters could not run on every rank\n");
+            if (result_image != full_image) free_image(result_image);
+            free_image(full_image);
         }
-        free(local_data);
-        if (rank == 0) free_image(full_image);
+        band_buffers_free(&bands);
+        process_grid_free(&grid);
+        free(blocks);
+        free(row_starts);
+        free(col_starts);
         MPI_Finalize();
         return 1;
     }
+    rm.phase[PHASE_HALO] = halo_seconds - halo_start;
+    rm.phase[PHASE_COMPUTE] = compute_time - rm.phase[PHASE_HALO];
+    local_data = band_buffer_rows(&bands, bands.cur);
     
     // Gather results
-    MPI_Gatherv(
-        local_data,
-        local_size,
-        MPI_UNSIGNED_CHAR,
-        (rank == 0) ? full_image->data : NULL,
-        sendcounts,
-        displs,
-        MPI_UNSIGNED_CHAR,
-        0,
-        MPI_COMM_WORLD
-    );
+    double gather_start = MPI_Wtime();
+    if (!use_mpiio) {
+        gather_blocks((rank == 0) ? result_image->data : NULL, width, height, channels,
+                      blocks, local_data, bands.pitch, rank, size);
+    }
+    rm.phase[PHASE_GATHER] = MPI_Wtime() - gather_start;
     
     MPI_Barrier(MPI_COMM_WORLD);
     end_time = MPI_Wtime();
     
+    // The barrier above hides imbalance in Processing time; show it here
+    double* compute_times = (rank == 0) ? (double*)malloc(size * sizeof(double)) : NULL;
+    MPI_Gather(&compute_time, 1, MPI_DOUBLE, compute_times, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    
     if (rank == 0) {
         printf("\nProcessing time: %.6f seconds\n", end_time - start_time);
         
-        printf("Saving output image...\n");
-        save_image(output_file, full_image);
-        printf("Done!\n\n");
+        double max_time = 0.0, sum_time = 0.0;
+        printf("Per-rank compute time:\n");
+        for (int r = 0; r < size; r++) {
+            if (grid_spec) {
+                printf("  rank %d: %dx%d block at row %d, col %d, %.6f seconds\n", r,
+                       blocks[r].cols, blocks[r].rows, blocks[r].row_start,
+                       blocks[r].col_start, compute_times[r]);
+            } else {
+                printf("  rank %d: %d rows, %.6f seconds\n", r, blocks[r].rows,
+                       compute_times[r]);
+            }
+            if (compute_times[r] > max_time) max_time = compute_times[r];
+            sum_time += compute_times[r];
+        }
+        if (sum_time > 0) {
+            printf("Compute imbalance (max/mean): %.2f\n", max_time / (sum_time / size));
+        }
+        free(compute_times);
         
-        free(sendcounts);
-        free(displs);
+        printf("Saving output image...\n");
+    }
+    
+    int save_ok = 1;
+    double io_start = MPI_Wtime();
+    if (use_mpiio && out_channels < channels) {
+        size_t packed_size = (size_t)mine->rows * mine->cols;
+        unsigned char* packed = (unsigned char*)malloc(packed_size ? packed_size : 1);
+        copy_gray(local_data, bands.pitch, channels, 0, packed, mine->cols,
+                  mine->rows, mine->cols, thread_count);
+        save_ok = write_block_mpiio(output_file, width, height, 1,
+                                    mine, packed, mine->cols, rank);
+        free(packed);
+    } else if (use_mpiio) {
+        save_ok = write_block_mpiio(output_file, width, height, channels,
+                                    mine, local_data, bands.pitch, rank);
+    } else if (rank == 0) {
+        if (out_channels < channels) {
+            Image* gray = use_mmap ? create_image_mmap(output_file, width, height, 1)
+                                   : create_image(width, height, 1);
+            save_ok = (gray != NULL);
+            if (gray) {
+                copy_gray(result_image->data, (size_t)width * channels, channels, 0,
+                          gray->data, width, height, width, thread_count);
+                if (!gray->map) save_ok = save_image(output_file, gray);
+                free_image(gray);
+            }
+        } else if (!result_image->map) {
+            // A mapped result is already in the output file
+            save_ok = save_image(output_file, result_image);
+        }
+        if (result_image != full_image) free_image(result_image);
         free_image(full_image);
     }
+    save_time = MPI_Wtime() - io_start;
+    
+    if (rank == 0) {
+        if (!save_ok) fprintf(stderr, "Error: Could not write %s\n", output_file);
+        printf("I/O time: %.6f seconds (load %.6f, save %.6f, %s)\n",
+               load_time + save_time, load_time, save_time, io_mode);
+        printf("Done!\n\n");
+    }
+    
+    if (want_metrics) {
+        rm.phase[PHASE_LOAD] = load_time;
+        rm.phase[PHASE_SAVE] = save_time;
+        MetricsRun run = {
+            .input = input_file, .filter = filter_type, .io = io_mode,
+            .width = width, .height = height, .channels = channels,
+            .grid_rows = grid_rows, .grid_cols = grid_cols,
+            .thread_count = thread_count, .stage_count = stage_count,
+            .processing = end_time - start_time
+        };
+        if (!metrics_report(&metrics, &rm, &run, blocks, rank, size)) save_ok = 0;
+    }
     
-    free(local_data);
+    band_buffers_free(&bands);
+    process_grid_free(&grid);
+    free(blocks);
+    free(row_starts);
+    free(col_starts);
     MPI_Finalize();
-    return 0;
+    return save_ok ? 0 : 1;
 }
 
 // ============================================
 // FILTER IMPLEMENTATIONS
 // ============================================
+//
+// Per-pixel bodies are written once as *_channels functions that are
+// always inlined; each filter switches on the channel count once per
+// row (CHANNEL_CASES), so the 1-, 3- and 4-channel copies see a constant
+// pixel stride and no per-pixel channel branches. Other counts keep the
+// runtime stride. The 3x3 taps are spelled out.
+#define SPECIALIZED static inline __attribute__((always_inline))
+#define CHANNEL_CASES(call) \
+    switch (channels) { \
+        case 1: call(1); break; \
+        case 3: call(3); break; \
+        case 4: call(4); break; \
+        default: call(channels); break; \
+    }
+
+// Grayscale weights in Q15 (0.299, 0.587, 0.114), the same as the OpenMP
+// build's, so both give identical gray levels
+#define GRAY_WR 9798
+#define GRAY_WG 19235
+#define GRAY_WB 3735
+#define GRAY_SHIFT 15
+
+SPECIALIZED void grayscale_row_channels(unsigned char* row, int width, int channels) {
+    for (int j = 0; j < width; j++) {
+        int idx = j * channels;
+        
+        unsigned char r = row[idx];
+        unsigned char g = (channels > 1) ? row[idx + 1] : r;
+        unsigned char b = (channels > 2) ? row[idx + 2] : r;
+        
+        unsigned char gray = (unsigned char)((GRAY_WR * r + GRAY_WG * g + GRAY_WB * b) >> GRAY_SHIFT);
+        
+        row[idx] = gray;
+        if (channels > 1) row[idx + 1] = gray;
+        if (channels > 2) row[idx + 2] = gray;
+    }
+}
 
 void grayscale_filter_mpi(unsigned char* local_data, int local_height, 
-                          int width, int channels) {
+                          int width, int channels, int thread_count) {
+#pragma omp parallel for num_threads(thread_count) schedule(static)
     for (int i = 0; i < local_height; i++) {
-        for (int j = 0; j < width; j++) {
-            int idx = (i * width + j) * channels;
-            
-            unsigned char r = local_data[idx];
-            unsigned char g = (channels > 1) ? local_data[idx + 1] : r;
-            unsigned char b = (channels > 2) ? local_data[idx + 2] : r;
-            
-            unsigned char gray = (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
-            
-            local_data[idx] = gray;
-            if (channels > 1) local_data[idx + 1] = gray;
-            if (channels > 2) local_data[idx + 2] = gray;
-        }
+        unsigned char* row = local_data + (size_t)i * width * channels;
+#define GRAYSCALE_ROW(ch) grayscale_row_channels(row, width, ch)
+        CHANNEL_CASES(GRAYSCALE_ROW)
+#undef GRAYSCALE_ROW
     }
 }
 
-void gaussian_blur_filter_mpi(unsigned char* local_data, unsigned char* halo_top,
-                              unsigned char* halo_bottom, int local_height, 
-                              int width, int channels, int rank, int size) {
-    float kernel[3][3] = {
-        {1.0/16, 2.0/16, 1.0/16},
-        {2.0/16, 4.0/16, 2.0/16},
-        {1.0/16, 2.0/16, 1.0/16}
-    };
+// First and last row and column of the entire image are left to the 3x3
+// stencils' border rule (blur copies them, edge zeroes them); columns
+// [*j_begin, *j_end) get the kernel
+static void stencil_cols_3x3(const StencilBand* band, int col_begin, int col_end,
+                             int* j_begin, int* j_end) {
+    *j_begin = (band->left_edge && col_begin == 0) ? 1 : col_begin;
+    *j_end = (band->right_edge && col_end == band->width) ? band->width - 1 : col_end;
+}
+
+static void copy_border_cols(const StencilBand* band, const unsigned char* mid,
+                             unsigned char* o, int col_begin, int col_end,
+                             int j_begin, int j_end) {
+    int channels = band->channels;
+    if (j_begin > col_begin) memcpy(o, mid, channels);
+    if (j_end < col_end) {
+        memcpy(o + (band->width - 1) * channels, mid + (band->width - 1) * channels, channels);
+    }
+}
+
+// Columns [j_begin, j_end) of one row; [1 2 1] x [1 2 1] / 16 is exact
+// in integers and every byte's neighbours are +-channels bytes away
+SPECIALIZED void blur_cols_channels(const unsigned char* mid, size_t pitch, unsigned char* o,
+                                    int j_begin, int j_end, int channels) {
+    const unsigned char* up = mid - pitch;
+    const unsigned char* down = mid + pitch;
+    for (int k = j_begin * channels; k < j_end * channels; k++) {
+        int sum = up[k - channels] + 2 * up[k] + up[k + channels]
+                + 2 * (mid[k - channels] + 2 * mid[k] + mid[k + channels])
+                + down[k - channels] + 2 * down[k] + down[k + channels];
+        o[k] = (unsigned char)(sum >> 4);
+    }
+}
+
+int gaussian_blur_rows_mpi(const StencilBand* band, unsigned char* out,
+                           int row_begin, int row_end, int col_begin, int col_end) {
+    int channels = band->channels;
+    size_t pitch = band->pitch;
+    int j_begin, j_end;
     
-    // Need temporary buffer for output
-    unsigned char* temp = (unsigned char*)malloc(local_height * width * channels);
-    memcpy(temp, local_data, local_height * width * channels);
+    if (col_end <= col_begin) return 1;
+    stencil_cols_3x3(band, col_begin, col_end, &j_begin, &j_end);
     
-    // Process interior and border rows
-    for (int i = 0; i < local_height; i++) {
-        int start_j = (i == 0 || i == local_height - 1) ? 1 : 1;
-        int end_j = width - 1;
+#pragma omp parallel for num_threads(band->thread_count) schedule(static)
+    for (int i = row_begin; i < row_end; i++) {
+        const unsigned char* mid = band->src + (ptrdiff_t)i * pitch;
+        unsigned char* o = out + (size_t)i * pitch;
         
-        // Skip first and last row if at boundaries of entire image
-        if ((rank == 0 && i == 0) || (rank == size - 1 && i == local_height - 1)) {
+        if ((band->first_band && i == 0) ||
+            (band->last_band && i == band->local_height - 1)) {
+            memcpy(o + col_begin * channels, mid + col_begin * channels,
+                   (size_t)(col_end - col_begin) * channels);
             continue;
         }
+        copy_border_cols(band, mid, o, col_begin, col_end, j_begin, j_end);
+#define BLUR_COLS(ch) blur_cols_channels(mid, pitch, o, j_begin, j_end, ch)
+        CHANNEL_CASES(BLUR_COLS)
+#undef BLUR_COLS
+    }
+    return 1;
+}
+
+// Sobel of channel 0 for columns [j_begin, j_end) of one row, written to
+// every channel
+SPECIALIZED void sobel_cols_channels(const unsigned char* mid, size_t pitch, unsigned char* o,
+                                     int j_begin, int j_end, int channels, int norm, int level) {
+    int level_sq = level * level;
+    for (int j = j_begin; j < j_end; j++) {
+        const unsigned char* m = mid + j * channels;
+        const unsigned char* u = m - pitch;
+        const unsigned char* d = m + pitch;
         
-        for (int j = start_j; j < end_j; j++) {
-            for (int c = 0; c < channels; c++) {
-                float sum = 0.0;
-                
-                for (int di = -1; di <= 1; di++) {
-                    for (int dj = -1; dj <= 1; dj++) {
-                        int ni = i + di;
-                        int nj = j + dj;
-                        
-                        unsigned char pixel_val;
-                        
-                        // Get pixel from appropriate location
-                        if (ni < 0) {
-                            // Use halo_top
-                            pixel_val = halo_top[nj * channels + c];
-                        } else if (ni >= local_height) {
-                            // Use halo_bottom
-                            pixel_val = halo_bottom[nj * channels + c];
-                        } else {
-                            // Use local_data
-                            pixel_val = temp[(ni * width + nj) * channels + c];
-                        }
-                        
-                        sum += pixel_val * kernel[di + 1][dj + 1];
-                    }
-                }
-                
-                int out_idx = (i * width + j) * channels + c;
-                local_data[out_idx] = (unsigned char)sum;
-            }
+        // Gradient of the first channel (or grayscale)
+        int gx = (u[channels] - u[-channels]) + 2 * (m[channels] - m[-channels])
+               + (d[channels] - d[-channels]);
+        int gy = (d[-channels] + 2 * d[0] + d[channels])
+               - (u[-channels] + 2 * u[0] + u[channels]);
+        
+        unsigned char edge_value;
+        if (norm == EDGE_L1) {
+            int magnitude = abs(gx) + abs(gy);
+            edge_value = level ? (magnitude >= level ? 255 : 0)
+                               : (unsigned char)(magnitude > 255 ? 255 : magnitude);
+        } else if (level) {
+            edge_value = (gx * gx + gy * gy >= level_sq) ? 255 : 0;
+        } else {
+            // Calculate magnitude
+            float magnitude = sqrt((float)(gx * gx + gy * gy));
+            if (magnitude > 255.0) magnitude = 255.0;
+            edge_value = (unsigned char)magnitude;
+        }
+        
+        // Set all channels to the edge value
+        for (int c = 0; c < channels; c++) {
+            o[j * channels + c] = edge_value;
         }
     }
-    
-    free(temp);
 }
 
-void sobel_edge_filter_mpi(unsigned char* local_data, unsigned char* halo_top,
-                           unsigned char* halo_bottom, int local_height,
-                           int width, int channels, int rank, int size) {
-    // Sobel kernels for edge detection
-    int Gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
-    int Gy[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
+// band->params is the FilterStage (norm and mask level). The first and
+// last row and column of the image are zero, as in the OpenMP build, so
+// an edge result has equal channels everywhere.
+int sobel_edge_rows_mpi(const StencilBand* band, unsigned char* out,
+                        int row_begin, int row_end, int col_begin, int col_end) {
+    const FilterStage* st = (const FilterStage*)band->params;
+    int norm = st->norm, level = st->param;
+    int channels = band->channels;
+    size_t pitch = band->pitch;
+    int j_begin, j_end;
 
-    // Need temporary buffer for output
-    unsigned char* temp = (unsigned char*)malloc(local_height * width * channels);
-    memcpy(temp, local_data, local_height * width * channels);
+    if (col_end <= col_begin) return 1;
+    stencil_cols_3x3(band, col_begin, col_end, &j_begin, &j_end);
 
-    // Process interior and border rows
-    for (int i = 0; i < local_height; i++) {
-        int start_j = 1;
-        int end_j = width - 1;
+#pragma omp parallel for num_threads(band->thread_count) schedule(static)
+    for (int i = row_begin; i < row_end; i++) {
+        const unsigned char* mid = band->src + (ptrdiff_t)i * pitch;
+        unsigned char* o = out + (size_t)i * pitch;
 
-        // Skip first and last row if at boundaries of entire image
-        if ((rank == 0 && i == 0) || (rank == size - 1 && i == local_height - 1)) {
+        if ((band->first_band && i == 0) ||
+            (band->last_band && i == band->local_height - 1)) {
+            memset(o + col_begin * channels, 0, (size_t)(col_end - col_begin) * channels);
             continue;
         }
-
-        for (int j = start_j; j < end_j; j++) {
-            float sum_x = 0.0, sum_y = 0.0;
-
-            // Calculate gradient using first channel (or grayscale)
-            for (int di = -1; di <= 1; di++) {
-                for (int dj = -1; dj <= 1; dj++) {
-                    int ni = i + di;
-                    int nj = j + dj;
-
-                    unsigned char pixel_val;
-
-                    // Get pixel from appropriate location
-                    if (ni < 0) {
-                        // Use halo_top
-                        pixel_val = halo_top[nj * channels];
-                    } else if (ni >= local_height) {
-                        // Use halo_bottom
-                        pixel_val = halo_bottom[nj * channels];
-                    } else {
-                        // Use local_data
-                        pixel_val = temp[(ni * width + nj) * channels];
-                    }
-
-                    sum_x += pixel_val * Gx[di + 1][dj + 1];
-                    sum_y += pixel_val * Gy[di + 1][dj + 1];
-                }
-            }
-
-            // Calculate magnitude
-            float magnitude = sqrt(sum_x * sum_x + sum_y * sum_y);
-            if (magnitude > 255.0) magnitude = 255.0;
-
-            unsigned char edge_value = (unsigned char)magnitude;
-
-            // Set all channels to the edge value
-            int out_idx = (i * width + j) * channels;
-            for (int c = 0; c < channels; c++) {
-                local_data[out_idx + c] = edge_value;
-            }
-        }
+        if (j_begin > col_begin) memset(o, 0, channels);
+        if (j_end < col_end) memset(o + (band->width - 1) * channels, 0, channels);
+#define SOBEL_COLS(ch) sobel_cols_channels(mid, pitch, o, j_begin, j_end, ch, norm, level)
+        CHANNEL_CASES(SOBEL_COLS)
+#undef SOBEL_COLS
     }
-
-    free(temp);
+    return 1;
 }
 
 void brightness_filter_mpi(unsigned char* local_data, int local_height,
-                           int width, int channels, int brightness) {
+                           int width, int channels, int brightness, int thread_count) {
     int local_size = local_height * width * channels;
     
+#pragma omp parallel for num_threads(thread_count) schedule(static)
     for (int i = 0; i < local_size; i++) {
         int new_val = local_data[i] + brightness;
         if (new_val > 255) new_val = 255;
@@ -419,50 +1079,2507 @@ void brightness_filter_mpi(unsigned char* local_data, int local_height,
     }
 }
 
+void lut_filter_mpi(unsigned char* local_data, int local_height,
+                    int width, int channels, const unsigned char* table, int thread_count) {
+    int local_size = local_height * width * channels;
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < local_size; i++) {
+        local_data[i] = table[local_data[i]];
+    }
+}
+
 // ============================================
-// IMAGE I/O (PPM Format)
+// SEPARABLE GAUSSIAN BLUR (arbitrary sigma)
 // ============================================
+//
+// Same integer kernels as the OpenMP build: Q14 weights with a 16-bit
+// intermediate, or three running-sum box passes above GAUSS_BOX_SIGMA.
+// Pixels outside the buffer are clamped to the nearest edge pixel.
 
-Image* load_image(const char* filename) {
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) return NULL;
+static inline int clamp_index(int i, int n) {
+    return (i < 0) ? 0 : (i >= n) ? n - 1 : i;
+}
+
+void gauss_kernel_init(GaussKernel* k, float sigma) {
+    k->sigma = sigma;
+    k->use_box = (sigma > GAUSS_BOX_SIGMA);
     
-    char format[3];
-    int width, height, max_val;
+    if (k->use_box) {
+        // Three box widths whose variances add up to sigma^2
+        double w_ideal = sqrt(12.0 * sigma * sigma / 3.0 + 1.0);
+        int wl = (int)floor(w_ideal);
+        if (wl % 2 == 0) wl--;
+        int wu = wl + 2;
+        double m_ideal = (12.0 * sigma * sigma - 3.0 * wl * wl - 12.0 * wl - 9.0)
+                       / (-4.0 * wl - 4.0);
+        int m = (int)floor(m_ideal + 0.5);
+        
+        k->radius = 0;
+        for (int i = 0; i < 3; i++) {
+            k->box_radius[i] = ((i < m) ? wl : wu) / 2;
+            k->radius += k->box_radius[i];
+        }
+        return;
+    }
     
-    fscanf(fp, "%2s\n%d %d\n%d\n", format, &width, &height, &max_val);
+    int r = (int)ceil(3.0 * sigma);
+    if (r < 1) r = 1;
+    if (r > GAUSS_MAX_RADIUS) r = GAUSS_MAX_RADIUS;
+    k->radius = r;
     
-    if (strcmp(format, "P6") != 0) {
-        fclose(fp);
-        return NULL;
+    double w[2 * GAUSS_MAX_RADIUS + 1];
+    double total = 0.0;
+    for (int t = -r; t <= r; t++) {
+        w[t + r] = exp(-(double)(t * t) / (2.0 * sigma * sigma));
+        total += w[t + r];
     }
     
-    Image* img = create_image(width, height, 3);
-    fread(img->data, 1, width * height * 3, fp);
-    fclose(fp);
-    
-    return img;
+    int sum = 0;
+    for (int t = 0; t <= 2 * r; t++) {
+        k->weights[t] = (int)floor(w[t] / total * (1 << GAUSS_SHIFT) + 0.5);
+        sum += k->weights[t];
+    }
+    k->weights[r] += (1 << GAUSS_SHIFT) - sum;   /* weights sum to exactly 1.0 */
 }
 
-void save_image(const char* filename, Image* img) {
-    FILE* fp = fopen(filename, "wb");
-    fprintf(fp, "P6\n%d %d\n255\n", img->width, img->height);
-    fwrite(img->data, 1, img->width * img->height * img->channels, fp);
-    fclose(fp);
+SPECIALIZED void gauss_row_h_fixed(const unsigned char* in, unsigned short* out,
+                                   int width, int channels, const int* w, int r) {
+    for (int x = 0; x < width; x++) {
+        int interior = (x >= r && x + r < width);
+        for (int c = 0; c < channels; c++) {
+            int acc = 0;
+            if (interior) {
+                const unsigned char* p = in + (x - r) * channels + c;
+                for (int t = 0; t <= 2 * r; t++) {
+                    acc += w[t] * p[t * channels];
+                }
+            } else {
+                for (int t = 0; t <= 2 * r; t++) {
+                    acc += w[t] * in[clamp_index(x + t - r, width) * channels + c];
+                }
+            }
+            out[x * channels + c] = (unsigned short)((acc + 32) >> 6);
+        }
+    }
 }
 
-Image* create_image(int width, int height, int channels) {
-    Image* img = (Image*)malloc(sizeof(Image));
-    img->width = width;
+// Radii 1-3 (sigma up to 1) also get their taps unrolled
+static void gauss_row_h(const unsigned char* in, unsigned short* out,
+                        int width, int channels, const GaussKernel* k) {
+    const int* w = k->weights;
+#define GAUSS_ROW(ch) \
+    switch (k->radius) { \
+        case 1: gauss_row_h_fixed(in, out, width, ch, w, 1); break; \
+        case 2: gauss_row_h_fixed(in, out, width, ch, w, 2); break; \
+        case 3: gauss_row_h_fixed(in, out, width, ch, w, 3); break; \
+        default: gauss_row_h_fixed(in, out, width, ch, w, k->radius); break; \
+    }
+    CHANNEL_CASES(GAUSS_ROW)
+#undef GAUSS_ROW
+}
+
+// Running-sum box of radius r along one row
+static void box_row_h(const unsigned char* in, unsigned char* out,
+                      int width, int channels, int r) {
+    unsigned int inv = ((1u << 23) + (2 * r + 1) / 2) / (2 * r + 1);
+    
+    for (int c = 0; c < channels; c++) {
+        unsigned int sum = 0;
+        for (int t = -r; t <= r; t++) {
+            sum += in[clamp_index(t, width) * channels + c];
+        }
+        for (int x = 0; x < width; x++) {
+            unsigned int v = (sum * inv + (1u << 22)) >> 23;
+            out[x * channels + c] = (unsigned char)(v > 255 ? 255 : v);
+            sum += in[clamp_index(x + r + 1, width) * channels + c];
+            sum -= in[clamp_index(x - r, width) * channels + c];
+        }
+    }
+}
+
+// Blur a packed width x height buffer in place
+// Returns 0 (data untouched) if the intermediate plane or the rows of
+// vertical sums cannot be allocated
+static int gauss_blur_buffer(unsigned char* data, int width, int height,
+                             int channels, const GaussKernel* k, int thread_count) {
+    size_t row_size = (size_t)width * channels;
+    size_t plane = row_size * height;
+    
+    if (!k->use_box) {
+        unsigned short* tmp = (unsigned short*)malloc(plane * sizeof(unsigned short));
+        int* accs = (int*)malloc((size_t)thread_count * row_size * sizeof(int));
+        if (!tmp || !accs) {
+            free(tmp);
+            free(accs);
+            return 0;
+        }
+        int r = k->radius;
+        
+#pragma omp parallel num_threads(thread_count)
+        {
+            int tid = 0;
+#ifdef _OPENMP
+            tid = omp_get_thread_num();
+#endif
+#pragma omp for schedule(static)
+            for (int y = 0; y < height; y++) {
+                gauss_row_h(data + y * row_size, tmp + y * row_size, width, channels, k);
+            }
+            
+            int* acc = accs + (size_t)tid * row_size;
+#pragma omp for schedule(static)
+            for (int y = 0; y < height; y++) {
+                memset(acc, 0, row_size * sizeof(int));
+                for (int t = 0; t <= 2 * r; t++) {
+                    const unsigned short* in = tmp + clamp_index(y + t - r, height) * row_size;
+                    int w = k->weights[t];
+                    for (size_t i = 0; i < row_size; i++) {
+                        acc[i] += w * in[i];
+                    }
+                }
+                unsigned char* out = data + y * row_size;
+                for (size_t i = 0; i < row_size; i++) {
+                    out[i] = (unsigned char)((acc[i] + (1 << 21)) >> 22);
+                }
+            }
+        }
+        
+        free(accs);
+        free(tmp);
+        return 1;
+    }
+    
+    unsigned char* tmp = (unsigned char*)malloc(plane);
+    unsigned int* colsum = (unsigned int*)malloc(row_size * sizeof(unsigned int));
+    if (!tmp || !colsum) {
+        free(tmp);
+        free(colsum);
+        return 0;
+    }
+    int col_blocks = (int)((row_size + GAUSS_COL_BLOCK - 1) / GAUSS_COL_BLOCK);
+    
+    for (int pass = 0; pass < 3; pass++) {
+        int r = k->box_radius[pass];
+        unsigned int inv = ((1u << 23) + (2 * r + 1) / 2) / (2 * r + 1);
+        
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+        for (int y = 0; y < height; y++) {
+            box_row_h(data + y * row_size, tmp + y * row_size, width, channels, r);
+        }
+        
+        // Vertical running sum; threads own column blocks since each
+        // column is a sequential recurrence down the rows
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+        for (int b = 0; b < col_blocks; b++) {
+            size_t i0 = (size_t)b * GAUSS_COL_BLOCK;
+            size_t i1 = (i0 + GAUSS_COL_BLOCK < row_size) ? i0 + GAUSS_COL_BLOCK : row_size;
+            
+            memset(colsum + i0, 0, (i1 - i0) * sizeof(unsigned int));
+            for (int t = -r; t <= r; t++) {
+                const unsigned char* row = tmp + clamp_index(t, height) * row_size;
+                for (size_t i = i0; i < i1; i++) colsum[i] += row[i];
+            }
+            for (int y = 0; y < height; y++) {
+                unsigned char* out = data + y * row_size;
+                const unsigned char* add = tmp + clamp_index(y + r + 1, height) * row_size;
+                const unsigned char* sub = tmp + clamp_index(y - r, height) * row_size;
+                for (size_t i = i0; i < i1; i++) {
+                    unsigned int v = (colsum[i] * inv + (1u << 22)) >> 23;
+                    out[i] = (unsigned char)(v > 255 ? 255 : v);
+                    colsum[i] += add[i];
+                    colsum[i] -= sub[i];
+                }
+            }
+        }
+    }
+    
+    free(colsum);
+    free(tmp);
+    return 1;
+}
+
+// Rows [row_begin, row_end) x columns [col_begin, col_end): blur them plus
+// k->radius pixels of context on each side as one packed buffer. Context
+// is cut at the image edge, where the buffer edge clamps exactly like the
+// image edge; elsewhere the clamped margin only affects pixels that are
+// dropped.
+int gaussian_separable_rows_mpi(const StencilBand* band, unsigned char* out,
+                                int row_begin, int row_end, int col_begin, int col_end) {
+    const GaussKernel* k = (const GaussKernel*)band->params;
+    int channels = band->channels;
+    int lo = band->first_band ? 0 : -band->radius;
+    int hi = band->last_band ? band->local_height : band->local_height + band->radius;
+    int left = band->left_edge ? 0 : -band->radius;
+    int right = band->right_edge ? band->width : band->width + band->radius;
+    int y0 = (row_begin - k->radius > lo) ? row_begin - k->radius : lo;
+    int y1 = (row_end + k->radius < hi) ? row_end + k->radius : hi;
+    int x0 = (col_begin - k->radius > left) ? col_begin - k->radius : left;
+    int x1 = (col_end + k->radius < right) ? col_end + k->radius : right;
+    
+    if (row_end <= row_begin || col_end <= col_begin) return 1;
+    
+    size_t ext_row = (size_t)(x1 - x0) * channels;
+    unsigned char* ext = (unsigned char*)malloc((size_t)(y1 - y0) * ext_row);
+    if (ext) {
+        for (int y = y0; y < y1; y++) {
+            memcpy(ext + (size_t)(y - y0) * ext_row,
+                   band->src + (ptrdiff_t)y * band->pitch + x0 * channels, ext_row);
+        }
+    }
+    if (!ext || !gauss_blur_buffer(ext, x1 - x0, y1 - y0, channels, k, band->thread_count)) {
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        fprintf(stderr, "Error: Rank %d could not allocate the Gaussian blur buffers "
+                "for %dx%d pixels\n", rank, x1 - x0, y1 - y0);
+        free(ext);
+        return 0;
+    }
+    
+    size_t span = (size_t)(col_end - col_begin) * channels;
+    for (int y = row_begin; y < row_end; y++) {
+        memcpy(out + (size_t)y * band->pitch + col_begin * channels,
+               ext + (size_t)(y - y0) * ext_row + (size_t)(col_begin - x0) * channels, span);
+    }
+    free(ext);
+    return 1;
+}
+
+// ============================================
+// HALO EXCHANGE WITH OVERLAPPED COMPUTE
+// ============================================
+//
+// Every stencil filter goes through stencil_filter_mpi: it posts the
+// halo exchange, computes the pixels that only need local data while the
+// messages are in flight, and finishes the `radius`-wide frame along each
+// block edge that has a neighbour after MPI_Waitall. A new stencil only
+// supplies a row function.
+//
+// On a 2D grid the halo goes to up to eight neighbours: rows up and
+// down, columns left and right (strided, as an MPI_Type_vector over the
+// block rows) and radius x radius corners diagonally, so a rank sends
+// O(block perimeter) bytes instead of O(image width).
+
+void halo_exchange_begin(HaloExchange* hx, const BandBuffers* bands, unsigned char* rows,
+                         int radius, const ProcessGrid* grid) {
+    double t0 = MPI_Wtime();
+    int local_height = bands->local_height;
+    int width = bands->width;
+    int channels = bands->channels;
+    ptrdiff_t pitch = (ptrdiff_t)bands->pitch;
+    ptrdiff_t down = (ptrdiff_t)local_height * pitch;   /* first ghost row below */
+    ptrdiff_t right = (ptrdiff_t)width * channels;      /* first ghost column right */
+    ptrdiff_t r_rows = radius * pitch;
+    ptrdiff_t r_cols = (ptrdiff_t)radius * channels;
+    hx->count = 0;
+    
+    MPI_Datatype row_halo, col_halo, corner_halo;
+    MPI_Type_vector(radius, width * channels, (int)pitch, MPI_UNSIGNED_CHAR, &row_halo);
+    MPI_Type_vector(local_height, radius * channels, (int)pitch, MPI_UNSIGNED_CHAR, &col_halo);
+    MPI_Type_vector(radius, radius * channels, (int)pitch, MPI_UNSIGNED_CHAR, &corner_halo);
+    MPI_Type_commit(&row_halo);
+    MPI_Type_commit(&col_halo);
+    MPI_Type_commit(&corner_halo);
+    
+    // Per direction: the owned cells sent that way and the ghost cells
+    // filled from that neighbour
+    struct {
+        ptrdiff_t send, recv;
+        MPI_Datatype type;
+    } halo[NB_COUNT] = {
+        [NB_UP]         = {0, -r_rows, row_halo},
+        [NB_DOWN]       = {down - r_rows, down, row_halo},
+        [NB_LEFT]       = {0, -r_cols, col_halo},
+        [NB_RIGHT]      = {right - r_cols, right, col_halo},
+        [NB_UP_LEFT]    = {0, -r_rows - r_cols, corner_halo},
+        [NB_DOWN_RIGHT] = {down - r_rows + right - r_cols, down + right, corner_halo},
+        [NB_UP_RIGHT]   = {right - r_cols, -r_rows + right, corner_halo},
+        [NB_DOWN_LEFT]  = {down - r_rows, down - r_cols, corner_halo},
+    };
+    
+    // Tags name the direction of travel, so a message sent towards d
+    // arrives from the receiver's direction d ^ 1
+    for (int d = 0; d < NB_COUNT; d++) {
+        int peer = grid->neighbors[d];
+        if (peer == MPI_PROC_NULL) continue;
+        MPI_Isend(rows + halo[d].send, 1, halo[d].type, peer, d,
+                  grid->comm, &hx->requests[hx->count++]);
+        MPI_Irecv(rows + halo[d].recv, 1, halo[d].type, peer, d ^ 1,
+                  grid->comm, &hx->requests[hx->count++]);
+    }
+    
+    // Pending requests keep their own reference to the types
+    MPI_Type_free(&row_halo);
+    MPI_Type_free(&col_halo);
+    MPI_Type_free(&corner_halo);
+    halo_seconds += MPI_Wtime() - t0;
+}
+
+void halo_exchange_end(HaloExchange* hx) {
+    double t0 = MPI_Wtime();
+    MPI_Waitall(hx->count, hx->requests, MPI_STATUSES_IGNORE);
+    halo_seconds += MPI_Wtime() - t0;
+}
+
+int stencil_filter_mpi(StencilRowsFn rows_fn, int radius, const void* params,
+                       BandBuffers* bands, const ProcessGrid* grid, int thread_count) {
+    int local_height = bands->local_height;
+    int width = bands->width;
+    
+    // The current rows are only read (and sent) while the output goes to
+    // the other buffer, so no copy is needed
+    unsigned char* src = band_buffer_rows(bands, bands->cur);
+    unsigned char* dst = band_buffer_rows(bands, 1 - bands->cur);
+    
+    HaloExchange hx;
+    halo_exchange_begin(&hx, bands, src, radius, grid);
+    
+    StencilBand band;
+    band.src = src;
+    band.pitch = bands->pitch;
+    band.radius = radius;
+    band.local_height = local_height;
+    band.width = width;
+    band.channels = bands->channels;
+    band.first_band = (grid->neighbors[NB_UP] == MPI_PROC_NULL);
+    band.last_band = (grid->neighbors[NB_DOWN] == MPI_PROC_NULL);
+    band.left_edge = (grid->neighbors[NB_LEFT] == MPI_PROC_NULL);
+    band.right_edge = (grid->neighbors[NB_RIGHT] == MPI_PROC_NULL);
+    band.params = params;
+    band.thread_count = thread_count;
+    
+    // Interior pixels need no halo; only edges with a neighbour wait
+    int top = band.first_band ? 0 : radius;
+    int bottom = band.last_band ? 0 : radius;
+    int left = band.left_edge ? 0 : radius;
+    int right = band.right_edge ? 0 : radius;
+    int top_end = (top < local_height) ? top : local_height;
+    int bottom_begin = (local_height - bottom > top_end) ? local_height - bottom : top_end;
+    int left_end = (left < width) ? left : width;
+    int right_begin = (width - right > left_end) ? width - right : left_end;
+    int ok = 1;
+    if (bottom_begin > top_end && right_begin > left_end) {
+        ok = rows_fn(&band, dst, top_end, bottom_begin, left_end, right_begin);
+    }
+    
+    halo_exchange_end(&hx);
+    
+    ok = ok && rows_fn(&band, dst, 0, top_end, 0, width);
+    ok = ok && rows_fn(&band, dst, bottom_begin, local_height, 0, width);
+    ok = ok && rows_fn(&band, dst, top_end, bottom_begin, 0, left_end);
+    ok = ok && rows_fn(&band, dst, top_end, bottom_begin, right_begin, width);
+    
+    bands->cur = 1 - bands->cur;
+    return ok;
+}
+
+void band_buffers_init(BandBuffers* b, int local_height, int width, int channels,
+                       int ghost, int ghost_cols) {
+    b->pitch = (size_t)(width + 2 * ghost_cols) * channels;
+    size_t bytes = (size_t)(local_height + 2 * ghost) * b->pitch;
+    b->buf[0] = (unsigned char*)malloc(bytes > 0 ? bytes : 1);
+    b->buf[1] = (unsigned char*)malloc(bytes > 0 ? bytes : 1);
+    b->cur = 0;
+    b->ghost = ghost;
+    b->ghost_cols = ghost_cols;
+    b->local_height = local_height;
+    b->width = width;
+    b->channels = channels;
+}
+
+void band_buffers_free(BandBuffers* b) {
+    free(b->buf[0]);
+    free(b->buf[1]);
+}
+
+// ============================================
+// INTEGRAL IMAGE (box:R, thresh:R[:C])
+// ============================================
+//
+// Same filters as the OpenMP build: window sums come from a summed-area
+// table, four lookups per channel whatever R is. Each rank builds the
+// entries of the global table for its own block. Row prefix sums are
+// offset by the row totals of the blocks to the left, and column prefix
+// sums by the column totals of the blocks above; both offsets are
+// exclusive scans over the grid row and grid column (MPI_Exscan), so
+// they cost one message per scan step instead of a halo of pixels. A
+// window near the block edge then reads R table entries from its
+// neighbours, which arrive in a halo exchange of table entries.
+//
+// The block's table is (local_height + 1) x (width + 1) entries per
+// channel; entry (i, j) covers global rows above row_start + i and
+// columns left of col_start + j. It sits inside a frame of R ghost
+// entries on every side.
+
+typedef struct {
+    unsigned int* data;     /* frame included */
+    unsigned int* core;     /* entry (0, 0) */
+    size_t pitch;           /* entries per row, frame included */
+} BlockTable;
+
+// MPI_Exscan leaves the first rank's result undefined
+static void exscan_carry(const unsigned int* totals, unsigned int* carry, int count,
+                         MPI_Comm comm) {
+    int rank;
+    double t0 = MPI_Wtime();
+    MPI_Comm_rank(comm, &rank);
+    MPI_Exscan(totals, carry, count, MPI_UNSIGNED, MPI_SUM, comm);
+    if (rank == 0) memset(carry, 0, (size_t)count * sizeof(unsigned int));
+    halo_seconds += MPI_Wtime() - t0;
+}
+
+// Collective over the grid; returns 0 on every rank (nothing allocated)
+// if any rank could not allocate its table
+static int block_table_build(BlockTable* t, const unsigned char* src, size_t src_pitch,
+                             int local_height, int width, int channels, int radius,
+                             const ProcessGrid* grid, int thread_count) {
+    int row_entries = (width + 1) * channels;
+    t->pitch = (size_t)(width + 1 + 2 * radius) * channels;
+    size_t table_size = (size_t)(local_height + 1 + 2 * radius) * t->pitch;
+    t->data = (unsigned int*)calloc(table_size, sizeof(unsigned int));
+    
+    // Scratch for the two scans: row totals and their carry, then the
+    // column carry
+    size_t scratch = 2 * (size_t)local_height * channels;
+    if (scratch < (size_t)row_entries) scratch = row_entries;
+    unsigned int* totals = (unsigned int*)malloc(scratch * sizeof(unsigned int));
+    
+    int ok = t->data && totals;
+    if (!ok) {
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        fprintf(stderr, "Error: Rank %d could not allocate the integral table (%zu bytes)\n",
+                rank, (table_size + scratch) * sizeof(unsigned int));
+    }
+    if (!grid_all_ok(ok, grid)) {
+        free(t->data);
+        free(totals);
+        t->data = NULL;
+        return 0;
+    }
+    t->core = t->data + (size_t)radius * t->pitch + (size_t)radius * channels;
+    
+    // Row prefix sums into table rows 1..local_height
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < local_height; i++) {
+        const unsigned char* in = src + (size_t)i * src_pitch;
+        unsigned int* s = t->core + (size_t)(i + 1) * t->pitch;
+        for (int k = 0; k < width * channels; k++) s[k + channels] = s[k] + in[k];
+    }
+    
+    // Plus the row totals of the blocks to the left
+    unsigned int* carry = totals + (size_t)local_height * channels;
+    for (int i = 0; i < local_height; i++) {
+        memcpy(totals + (size_t)i * channels,
+               t->core + (size_t)(i + 1) * t->pitch + (size_t)width * channels,
+               channels * sizeof(unsigned int));
+    }
+    exscan_carry(totals, carry, local_height * channels, grid->row_comm);
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < local_height; i++) {
+        unsigned int* s = t->core + (size_t)(i + 1) * t->pitch;
+        const unsigned int* left = carry + (size_t)i * channels;
+        for (int k = 0; k < row_entries; k++) s[k] += left[k % channels];
+    }
+    
+    // Column prefix sums; threads own column blocks since each column is
+    // a recurrence down the rows
+    int col_blocks = (row_entries + SAT_COL_BLOCK - 1) / SAT_COL_BLOCK;
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int b = 0; b < col_blocks; b++) {
+        int k0 = b * SAT_COL_BLOCK;
+        int k1 = (k0 + SAT_COL_BLOCK < row_entries) ? k0 + SAT_COL_BLOCK : row_entries;
+        for (int i = 2; i <= local_height; i++) {
+            unsigned int* s = t->core + (size_t)i * t->pitch;
+            const unsigned int* above = s - t->pitch;
+            for (int k = k0; k < k1; k++) s[k] += above[k];
+        }
+    }
+    
+    // Plus the column totals of the blocks above, row 0 included
+    carry = totals;
+    exscan_carry(t->core + (size_t)local_height * t->pitch, carry, row_entries,
+                 grid->col_comm);
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i <= local_height; i++) {
+        unsigned int* s = t->core + (size_t)i * t->pitch;
+        for (int k = 0; k < row_entries; k++) s[k] += carry[k];
+    }
+    
+    free(totals);
+    return 1;
+}
+
+// The neighbours' entries R deep around the table. Row 0 / column 0 and
+// the last row / column are shared with the neighbour, so the exchanged
+// rows start one in from the edge.
+static void block_table_exchange(BlockTable* t, int local_height, int width, int channels,
+                                 int radius, const ProcessGrid* grid) {
+    double t0 = MPI_Wtime();
+    ptrdiff_t pitch = (ptrdiff_t)t->pitch;
+    ptrdiff_t c = channels;
+    ptrdiff_t r = radius;
+    ptrdiff_t up_send = pitch, down_send = (local_height - r) * pitch;
+    ptrdiff_t up_recv = -r * pitch, down_recv = (local_height + 1) * pitch;
+    ptrdiff_t left_send = c, right_send = (width - r) * c;
+    ptrdiff_t left_recv = -r * c, right_recv = (width + 1) * c;
+    
+    MPI_Datatype row_halo, col_halo, corner_halo;
+    MPI_Type_vector(radius, (width + 1) * channels, (int)pitch, MPI_UNSIGNED, &row_halo);
+    MPI_Type_vector(local_height + 1, radius * channels, (int)pitch, MPI_UNSIGNED, &col_halo);
+    MPI_Type_vector(radius, radius * channels, (int)pitch, MPI_UNSIGNED, &corner_halo);
+    MPI_Type_commit(&row_halo);
+    MPI_Type_commit(&col_halo);
+    MPI_Type_commit(&corner_halo);
+    
+    struct {
+        ptrdiff_t send, recv;
+        MPI_Datatype type;
+    } halo[NB_COUNT] = {
+        [NB_UP]         = {up_send, up_recv, row_halo},
+        [NB_DOWN]       = {down_send, down_recv, row_halo},
+        [NB_LEFT]       = {left_send, left_recv, col_halo},
+        [NB_RIGHT]      = {right_send, right_recv, col_halo},
+        [NB_UP_LEFT]    = {up_send + left_send, up_recv + left_recv, corner_halo},
+        [NB_DOWN_RIGHT] = {down_send + right_send, down_recv + right_recv, corner_halo},
+        [NB_UP_RIGHT]   = {up_send + right_send, up_recv + right_recv, corner_halo},
+        [NB_DOWN_LEFT]  = {down_send + left_send, down_recv + left_recv, corner_halo},
+    };
+    
+    MPI_Request requests[2 * NB_COUNT];
+    int count = 0;
+    for (int d = 0; d < NB_COUNT; d++) {
+        int peer = grid->neighbors[d];
+        if (peer == MPI_PROC_NULL) continue;
+        MPI_Isend(t->core + halo[d].send, 1, halo[d].type, peer, d,
+                  grid->comm, &requests[count++]);
+        MPI_Irecv(t->core + halo[d].recv, 1, halo[d].type, peer, d ^ 1,
+                  grid->comm, &requests[count++]);
+    }
+    MPI_Waitall(count, requests, MPI_STATUSES_IGNORE);
+    
+    MPI_Type_free(&row_halo);
+    MPI_Type_free(&col_halo);
+    MPI_Type_free(&corner_halo);
+    halo_seconds += MPI_Wtime() - t0;
+}
+
+int integral_filter_mpi(const FilterStage* st, BandBuffers* bands, const ProcessGrid* grid,
+                        int thread_count) {
+    int local_height = bands->local_height;
+    int width = bands->width;
+    int channels = bands->channels;
+    int r = st->radius;
+    const unsigned char* src = band_buffer_rows(bands, bands->cur);
+    unsigned char* dst = band_buffer_rows(bands, 1 - bands->cur);
+    
+    BlockTable t;
+    if (!block_table_build(&t, src, bands->pitch, local_height, width, channels, r,
+                           grid, thread_count)) {
+        return 0;
+    }
+    block_table_exchange(&t, local_height, width, channels, r, grid);
+    
+    // Windows are cut at the image edge only; elsewhere they reach into
+    // the neighbours' entries
+    int top = (grid->neighbors[NB_UP] == MPI_PROC_NULL) ? 0 : -r;
+    int bottom = (grid->neighbors[NB_DOWN] == MPI_PROC_NULL) ? local_height : local_height + r;
+    int left = (grid->neighbors[NB_LEFT] == MPI_PROC_NULL) ? 0 : -r;
+    int right = (grid->neighbors[NB_RIGHT] == MPI_PROC_NULL) ? width : width + r;
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < local_height; i++) {
+        int i0 = (i - r > top) ? i - r : top;
+        int i1 = (i + r + 1 < bottom) ? i + r + 1 : bottom;
+        const unsigned int* above = t.core + (ptrdiff_t)i0 * (ptrdiff_t)t.pitch;
+        const unsigned int* below = t.core + (ptrdiff_t)i1 * (ptrdiff_t)t.pitch;
+        const unsigned char* in = src + (size_t)i * bands->pitch;
+        unsigned char* out = dst + (size_t)i * bands->pitch;
+        
+        for (int j = 0; j < width; j++) {
+            int j0 = (j - r > left) ? j - r : left;
+            int j1 = (j + r + 1 < right) ? j + r + 1 : right;
+            unsigned int area = (unsigned int)((i1 - i0) * (j1 - j0));
+            ptrdiff_t a = (ptrdiff_t)j0 * channels;
+            ptrdiff_t b = (ptrdiff_t)j1 * channels;
+            
+            for (int c = 0; c < channels; c++) {
+                unsigned int sum = below[b + c] - below[a + c] - above[b + c] + above[a + c];
+                unsigned int mean = (sum + area / 2) / area;
+                int k = j * channels + c;
+                if (st->type == FILTER_BOX) {
+                    out[k] = (unsigned char)mean;
+                } else {
+                    out[k] = ((int)in[k] + st->offset > (int)mean) ? 255 : 0;
+                }
+            }
+        }
+    }
+    
+    free(t.data);
+    bands->cur = 1 - bands->cur;
+    return 1;
+}
+
+// ============================================
+// HISTOGRAMS AND TONE CURVES (equalize, autolevels, stretch)
+// ============================================
+//
+// Same tables as the OpenMP build. Each thread counts its rows of the
+// block into private histograms that are summed bin by bin without
+// atomics; MPI_Allreduce then adds the blocks of all ranks, so every
+// rank builds the identical table and applies it to its own pixels.
+// Channels are treated separately.
+
+// Returns 0 if the private histograms cannot be allocated
+static int histogram_block(const unsigned char* src, size_t pitch, int local_height,
+                           int width, int channels, unsigned long long* hist,
+                           int thread_count) {
+    int bins = channels * HIST_BINS;
+    size_t copies = (size_t)thread_count * HIST_COPIES;
+    unsigned int* partial = (unsigned int*)calloc(copies * bins, sizeof(unsigned int));
+    if (!partial) return 0;
+    
+#pragma omp parallel num_threads(thread_count)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        // Neighbouring pixels usually share a bin; alternating copies
+        // keeps the increments independent
+        unsigned int* mine = partial + (size_t)tid * HIST_COPIES * bins;
+        
+#pragma omp for schedule(static)
+        for (int i = 0; i < local_height; i++) {
+            const unsigned char* row = src + (size_t)i * pitch;
+            for (int j = 0; j < width; j++) {
+                unsigned int* h = mine + (j % HIST_COPIES) * bins;
+                for (int c = 0; c < channels; c++) {
+                    h[c * HIST_BINS + row[j * channels + c]]++;
+                }
+            }
+        }
+        
+#pragma omp for schedule(static)
+        for (int b = 0; b < bins; b++) {
+            unsigned long long total = 0;
+            for (size_t t = 0; t < copies; t++) total += partial[t * bins + b];
+            hist[b] = total;
+        }
+    }
+    
+    free(partial);
+    return 1;
+}
+
+// Linear map of [lo, hi] onto [0, 255], rounded
+static void stretch_lut(int lo, int hi, unsigned char* lut) {
+    for (int v = 0; v < HIST_BINS; v++) {
+        if (hi <= lo) {
+            lut[v] = (unsigned char)v;  /* flat channel: leave it alone */
+        } else if (v <= lo) {
+            lut[v] = 0;
+        } else if (v >= hi) {
+            lut[v] = 255;
+        } else {
+            lut[v] = (unsigned char)(((v - lo) * 510 + (hi - lo)) / (2 * (hi - lo)));
+        }
+    }
+}
+
+static void tone_lut_build(const FilterStage* st, const unsigned long long* hist, int channels,
+                           unsigned char* lut) {
+    for (int c = 0; c < channels; c++) {
+        const unsigned long long* h = hist + c * HIST_BINS;
+        unsigned char* out = lut + c * HIST_BINS;
+        unsigned long long total = 0;
+        for (int v = 0; v < HIST_BINS; v++) total += h[v];
+        
+        if (st->type == FILTER_EQUALIZE) {
+            // CDF scaled so the first occupied level maps to 0
+            unsigned long long cdf = 0, cdf_min = 0;
+            for (int v = 0; v < HIST_BINS && cdf_min == 0; v++) cdf_min = h[v];
+            unsigned long long range = total - cdf_min;
+            for (int v = 0; v < HIST_BINS; v++) {
+                cdf += h[v];
+                out[v] = (range == 0) ? (unsigned char)v
+                       : (unsigned char)(((cdf - cdf_min) * 255 + range / 2) / range);
+            }
+            continue;
+        }
+        
+        // autolevels is a stretch between the lowest and highest level used
+        double low = (st->type == FILTER_STRETCH) ? st->clip[0] : 0.0;
+        double high = (st->type == FILTER_STRETCH) ? st->clip[1] : 100.0;
+        double low_count = total * low / 100.0;
+        double high_count = total * high / 100.0;
+        unsigned long long cdf = 0;
+        int lo = -1, hi = HIST_BINS - 1;
+        for (int v = 0; v < HIST_BINS; v++) {
+            cdf += h[v];
+            if (lo < 0 && cdf > low_count) lo = v;
+            if (cdf >= high_count && cdf > 0) {
+                hi = v;
+                break;
+            }
+        }
+        stretch_lut(lo < 0 ? 0 : lo, hi, out);
+    }
+}
+
+int tone_filter_mpi(const FilterStage* st, BandBuffers* bands, const ProcessGrid* grid,
+                    int thread_count) {
+    int local_height = bands->local_height;
+    int width = bands->width;
+    int channels = bands->channels;
+    int bins = channels * HIST_BINS;
+    unsigned char* rows = band_buffer_rows(bands, bands->cur);
+    
+    unsigned long long* hist = (unsigned long long*)calloc(bins, sizeof(unsigned long long));
+    unsigned char* lut = (unsigned char*)malloc(bins);
+    int ok = hist && lut &&
+             histogram_block(rows, bands->pitch, local_height, width, channels, hist,
+                             thread_count);
+    if (!ok) {
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        fprintf(stderr, "Error: Rank %d could not allocate the histograms\n", rank);
+    }
+    // Every rank has to agree before the sum, or the ones that can go on
+    // would wait in it forever
+    if (!grid_all_ok(ok, grid)) {
+        free(lut);
+        free(hist);
+        return 0;
+    }
+    double t0 = MPI_Wtime();
+    MPI_Allreduce(MPI_IN_PLACE, hist, bins, MPI_UNSIGNED_LONG_LONG, MPI_SUM, grid->comm);
+    halo_seconds += MPI_Wtime() - t0;
+    
+    tone_lut_build(st, hist, channels, lut);
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < local_height; i++) {
+        unsigned char* row = rows + (size_t)i * bands->pitch;
+        for (int j = 0; j < width; j++) {
+            for (int c = 0; c < channels; c++) {
+                row[j * channels + c] = lut[c * HIST_BINS + row[j * channels + c]];
+            }
+        }
+    }
+    
+    free(lut);
+    free(hist);
+    return 1;
+}
+
+// ============================================
+// FILTER CHAIN
+// ============================================
+
+// "R" or, when offset is given, "R:C"
+static int parse_window_arg(const char* arg, int* radius, int* offset) {
+    char* end;
+    long r = strtol(arg, &end, 10);
+    if (end == arg || r < 1 || r > SAT_MAX_RADIUS) return 0;
+    *radius = (int)r;
+    if (*end == '\0') return 1;
+    if (*end != ':' || !offset) return 0;
+    
+    const char* c_arg = end + 1;
+    long c = strtol(c_arg, &end, 10);
+    if (end == c_arg || *end != '\0' || c < -255 || c > 255) return 0;
+    *offset = (int)c;
+    return 1;
+}
+
+// A run of per-channel point ops (brighten, contrast, gamma, invert,
+// threshold) composes into one 256-entry table, applied in one sweep of
+// the band. A lone brighten keeps its add-and-clamp loop.
+static int is_channel_op(FilterType type) {
+    return type == FILTER_BRIGHTEN || type == FILTER_CONTRAST || type == FILTER_GAMMA ||
+           type == FILTER_INVERT || type == FILTER_THRESHOLD;
+}
+
+static void channel_op_table(const FilterStage* st, unsigned char* table) {
+    for (int v = 0; v < 256; v++) {
+        float f;
+        switch (st->type) {
+        case FILTER_BRIGHTEN: f = (float)(v + st->param); break;
+        case FILTER_CONTRAST: f = (v - 127.5f) * st->amount + 127.5f; break;
+        case FILTER_GAMMA:    f = 255.0f * powf(v / 255.0f, 1.0f / st->amount); break;
+        case FILTER_INVERT:   f = (float)(255 - v); break;
+        default:              f = (v >= st->param) ? 255.0f : 0.0f; break;
+        }
+        f = floorf(f + 0.5f);
+        table[v] = (unsigned char)(f < 0.0f ? 0 : f > 255.0f ? 255 : (int)f);
+    }
+}
+
+static int compile_point_ops(FilterStage* stages, int stage_count) {
+    int count = 0;
+    
+    for (int s = 0; s < stage_count; ) {
+        int end = s;
+        while (end < stage_count && is_channel_op(stages[end].type)) end++;
+        if (end == s || (end == s + 1 && stages[s].type == FILTER_BRIGHTEN)) {
+            stages[count++] = stages[s++];
+            continue;
+        }
+        
+        FilterStage merged = {.type = FILTER_LUT};
+        for (int v = 0; v < 256; v++) merged.table[v] = (unsigned char)v;
+        for (; s < end; s++) {
+            unsigned char op[256];
+            channel_op_table(&stages[s], op);
+            for (int v = 0; v < 256; v++) merged.table[v] = op[merged.table[v]];
+        }
+        stages[count++] = merged;
+    }
+    return count;
+}
+
+// "name" or "name:N" with lo <= N <= hi; a missing N keeps *value
+static int parse_int_arg(const char* tok, size_t name_len, int lo, int hi, int* value) {
+    if (tok[name_len] == '\0') return 1;
+    if (tok[name_len] != ':') return 0;
+    
+    const char* arg = tok + name_len + 1;
+    char* end;
+    long v = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || v < lo || v > hi) return 0;
+    *value = (int)v;
+    return 1;
+}
+
+// "edge[:l1|:l2]" or "edgemask[:T[:l1|:l2]]"
+static int parse_edge_arg(const char* tok, size_t name_len, int mask, FilterStage* st) {
+    st->norm = EDGE_L2;
+    st->param = mask ? THRESHOLD_DEFAULT : 0;
+    if (tok[name_len] == '\0') return 1;
+    if (tok[name_len] != ':') return 0;
+    
+    const char* norm = tok + name_len + 1;
+    if (mask) {
+        char* end;
+        long level = strtol(norm, &end, 10);
+        if (end == norm || level < 1 || level > 255 || (*end != '\0' && *end != ':')) return 0;
+        st->param = (int)level;
+        if (*end == '\0') return 1;
+        norm = end + 1;
+    }
+    if (strcmp(norm, "l1") == 0) st->norm = EDGE_L1;
+    else if (strcmp(norm, "l2") != 0) return 0;
+    return 1;
+}
+
+// edge followed by a threshold table (0 below a level, 255 from there
+// on) becomes the edge mask of that level
+static int threshold_table_level(const FilterStage* st) {
+    if (st->type != FILTER_LUT) return 0;
+    int level = 1;
+    while (level < 256 && st->table[level] == 0) level++;
+    if (st->table[0] != 0 || level == 256) return 0;
+    for (int v = level; v < 256; v++) {
+        if (st->table[v] != 255) return 0;
+    }
+    return level;
+}
+
+static int fuse_edge_masks(FilterStage* stages, int stage_count) {
+    int count = 0;
+    for (int s = 0; s < stage_count; s++) {
+        stages[count] = stages[s];
+        int level = (s + 1 < stage_count) ? threshold_table_level(&stages[s + 1]) : 0;
+        if (stages[s].type == FILTER_EDGE && stages[s].param == 0 && level > 0) {
+            stages[count].param = level;
+            s++;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Parses "grayscale,blur,gauss:2,edge"; rank 0 reports errors
+int parse_pipeline(const char* spec, FilterStage* stages, int max_stages, int rank) {
+    char buf[256];
+    strncpy(buf, spec, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    
+    int count = 0;
+    for (char* tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        if (count == max_stages) {
+            if (rank == 0) fprintf(stderr, "Error: At most %d filters per pipeline\n", max_stages);
+            return -1;
+        }
+        
+        FilterStage* st = &stages[count];
+        st->radius = 0;
+        st->offset = 0;
+        st->param = 0;
+        st->norm = EDGE_L2;
+        st->amount = 0.0f;
+        st->clip[0] = STRETCH_DEFAULT_LOW;
+        st->clip[1] = STRETCH_DEFAULT_HIGH;
+        if (strcmp(tok, "grayscale") == 0) {
+            st->type = FILTER_GRAYSCALE;
+        } else if (strcmp(tok, "blur") == 0) {
+            st->type = FILTER_BLUR;
+            st->radius = 1;
+        } else if (strncmp(tok, "edge", 4) == 0 &&
+                   (tok[4] == '\0' || tok[4] == ':' || strncmp(tok + 4, "mask", 4) == 0)) {
+            int mask = strncmp(tok + 4, "mask", 4) == 0;
+            st->type = FILTER_EDGE;
+            st->radius = 1;
+            if (!parse_edge_arg(tok, mask ? 8 : 4, mask, st)) {
+                if (rank == 0) {
+                    fprintf(stderr, "Error: edge takes l1 or l2 (e.g. edge:l1), edgemask a level "
+                            "from 1 to 255 and optionally the norm (e.g. edgemask:60:l1)\n");
+                }
+                return -1;
+            }
+        } else if (strncmp(tok, "brighten", 8) == 0 && (tok[8] == '\0' || tok[8] == ':')) {
+            st->type = FILTER_BRIGHTEN;
+            st->param = BRIGHTEN_DEFAULT;
+            if (!parse_int_arg(tok, 8, -255, 255, &st->param)) {
+                if (rank == 0) {
+                    fprintf(stderr, "Error: brighten needs an offset from -255 to 255 "
+                            "(e.g. brighten:-30)\n");
+                }
+                return -1;
+            }
+        } else if (strncmp(tok, "contrast", 8) == 0 && (tok[8] == '\0' || tok[8] == ':')) {
+            st->type = FILTER_CONTRAST;
+            st->amount = (tok[8] == ':') ? (float)atof(tok + 9) : CONTRAST_DEFAULT;
+            if (!(st->amount >= 0.0f) || (tok[8] == ':' && tok[9] == '\0')) {
+                if (rank == 0) fprintf(stderr, "Error: contrast needs a gain >= 0 (e.g. contrast:1.2)\n");
+                return -1;
+            }
+        } else if (strncmp(tok, "gamma", 5) == 0 && (tok[5] == '\0' || tok[5] == ':')) {
+            st->type = FILTER_GAMMA;
+            st->amount = (tok[5] == ':') ? (float)atof(tok + 6) : GAMMA_DEFAULT;
+            if (!(st->amount > 0.0f)) {
+                if (rank == 0) fprintf(stderr, "Error: gamma needs a positive exponent (e.g. gamma:2.2)\n");
+                return -1;
+            }
+        } else if (strcmp(tok, "invert") == 0) {
+            st->type = FILTER_INVERT;
+        } else if (strncmp(tok, "threshold", 9) == 0 && (tok[9] == '\0' || tok[9] == ':')) {
+            st->type = FILTER_THRESHOLD;
+            st->param = THRESHOLD_DEFAULT;
+            if (!parse_int_arg(tok, 9, 0, 255, &st->param)) {
+                if (rank == 0) {
+                    fprintf(stderr, "Error: threshold needs a level from 0 to 255 "
+                            "(e.g. threshold:100)\n");
+                }
+                return -1;
+            }
+        } else if (strncmp(tok, "gauss", 5) == 0 && (tok[5] == '\0' || tok[5] == ':')) {
+            float sigma = (tok[5] == ':') ? (float)atof(tok + 6) : 1.0f;
+            if (!(sigma > 0.0f)) {
+                if (rank == 0) fprintf(stderr, "Error: gauss needs a positive sigma (e.g. gauss:2.5)\n");
+                return -1;
+            }
+            st->type = FILTER_GAUSS;
+            gauss_kernel_init(&st->kernel, sigma);
+            st->radius = st->kernel.radius;
+        } else if (strncmp(tok, "box", 3) == 0 && (tok[3] == '\0' || tok[3] == ':')) {
+            st->type = FILTER_BOX;
+            st->radius = BOX_DEFAULT_RADIUS;
+            if (tok[3] == ':' && !parse_window_arg(tok + 4, &st->radius, NULL)) {
+                if (rank == 0) {
+                    fprintf(stderr, "Error: box needs a radius from 1 to %d (e.g. box:8)\n",
+                            SAT_MAX_RADIUS);
+                }
+                return -1;
+            }
+        } else if (strncmp(tok, "thresh", 6) == 0 && (tok[6] == '\0' || tok[6] == ':')) {
+            st->type = FILTER_THRESH;
+            st->radius = THRESH_DEFAULT_RADIUS;
+            st->offset = THRESH_DEFAULT_OFFSET;
+            if (tok[6] == ':' && !parse_window_arg(tok + 7, &st->radius, &st->offset)) {
+                if (rank == 0) {
+                    fprintf(stderr, "Error: thresh needs a radius from 1 to %d and an optional "
+                            "offset (e.g. thresh:15:10)\n", SAT_MAX_RADIUS);
+                }
+                return -1;
+            }
+        } else if (strcmp(tok, "equalize") == 0) {
+            st->type = FILTER_EQUALIZE;
+        } else if (strcmp(tok, "autolevels") == 0) {
+            st->type = FILTER_AUTOLEVELS;
+        } else if (strncmp(tok, "stretch", 7) == 0 && (tok[7] == '\0' || tok[7] == ':')) {
+            st->type = FILTER_STRETCH;
+            if (tok[7] == ':' &&
+                (sscanf(tok + 8, "%f:%f", &st->clip[0], &st->clip[1]) != 2 ||
+                 !(st->clip[0] >= 0.0f && st->clip[0] < st->clip[1] && st->clip[1] <= 100.0f))) {
+                if (rank == 0) {
+                    fprintf(stderr, "Error: stretch needs percentiles LOW:HIGH with "
+                            "0 <= LOW < HIGH <= 100 (e.g. stretch:1:99)\n");
+                }
+                return -1;
+            }
+        } else {
+            if (rank == 0) fprintf(stderr, "Error: Unknown filter '%s'\n", tok);
+            return -1;
+        }
+        count++;
+    }
+    
+    if (count == 0 && rank == 0) fprintf(stderr, "Error: No filter given\n");
+    return fuse_edge_masks(stages, compile_point_ops(stages, count));
+}
+
+// Every later stage treats the channels alike, so from here on they
+// stay equal (edge zeroes the border pixels)
+int pipeline_gray_stage(const FilterStage* stages, int stage_count) {
+    for (int s = 0; s < stage_count; s++) {
+        if (stages[s].type == FILTER_GRAYSCALE || stages[s].type == FILTER_EDGE) return s;
+    }
+    return -1;
+}
+
+int output_is_pgm(const char* path) {
+    size_t n = strlen(path);
+    return n > 4 && strcmp(path + n - 4, ".pgm") == 0;
+}
+
+// verbose: log each stage (rank 0 only, off for calibration runs)
+int apply_pipeline_mpi(const FilterStage* stages, int stage_count, BandBuffers* bands,
+                       const ProcessGrid* grid, int thread_count, int verbose) {
+    int local_height = bands->local_height;
+    int channels = bands->channels;
+    // Point filters run over whole buffer rows; the ghost columns they
+    // also touch are refilled before any stencil reads them
+    int row_pixels = bands->width + 2 * bands->ghost_cols;
+    
+    for (int s = 0; s < stage_count; s++) {
+        const FilterStage* st = &stages[s];
+        unsigned char* rows = band_buffer_rows(bands, bands->cur)
+                            - (size_t)bands->ghost_cols * channels;
+        
+        switch (st->type) {
+        case FILTER_GRAYSCALE:
+            if (verbose) printf("Applying grayscale filter...\n");
+            grayscale_filter_mpi(rows, local_height, row_pixels, channels, thread_count);
+            break;
+            
+        case FILTER_BLUR:
+            if (verbose) printf("Applying Gaussian blur filter...\n");
+            stencil_filter_mpi(gaussian_blur_rows_mpi, 1, NULL, bands,
+                               grid, thread_count);
+            break;
+            
+        case FILTER_EDGE:
+            if (verbose) printf("Applying Sobel edge detection filter...\n");
+            stencil_filter_mpi(sobel_edge_rows_mpi, 1, st, bands,
+                               grid, thread_count);
+            break;
+            
+        case FILTER_GAUSS:
+            if (verbose) {
+                printf("Applying separable Gaussian blur (sigma=%.2f, halo %d rows)...\n",
+                       st->kernel.sigma, st->radius);
+            }
+            if (!grid_all_ok(stencil_filter_mpi(gaussian_separable_rows_mpi, st->radius,
+                                                &st->kernel, bands, grid, thread_count),
+                             grid)) {
+                return 0;
+            }
+            break;
+            
+        case FILTER_BOX:
+            if (verbose) printf("Applying box blur (radius %d, integral image)...\n", st->radius);
+            if (!integral_filter_mpi(st, bands, grid, thread_count)) return 0;
+            break;
+            
+        case FILTER_THRESH:
+            if (verbose) {
+                printf("Applying adaptive threshold (radius %d, offset %d, integral image)...\n",
+                       st->radius, st->offset);
+            }
+            if (!integral_filter_mpi(st, bands, grid, thread_count)) return 0;
+            break;
+            
+        case FILTER_EQUALIZE:
+        case FILTER_AUTOLEVELS:
+        case FILTER_STRETCH:
+            if (verbose) {
+                printf("Applying %s (histogram over all ranks)...\n",
+                       st->type == FILTER_EQUALIZE ? "histogram equalization"
+                       : st->type == FILTER_AUTOLEVELS ? "auto-levels" : "percentile stretch");
+            }
+            if (!tone_filter_mpi(st, bands, grid, thread_count)) return 0;
+            break;
+            
+        case FILTER_BRIGHTEN:
+            if (verbose) printf("Applying brightness adjustment (%+d)...\n", st->param);
+            brightness_filter_mpi(rows, local_height, row_pixels, channels, st->param,
+                                  thread_count);
+            break;
+            
+        case FILTER_LUT:
+            if (verbose) printf("Applying point operations (one lookup table)...\n");
+            lut_filter_mpi(rows, local_height, row_pixels, channels, st->table, thread_count);
+            break;
+            
+        case FILTER_CONTRAST:   /* parse_pipeline folds these into FILTER_LUT */
+        case FILTER_GAMMA:
+        case FILTER_INVERT:
+        case FILTER_THRESHOLD:
+            break;
+        }
+    }
+    return 1;
+}
+
+// ============================================
+// DECOMPOSITION (row bands, 2D process grid)
+// ============================================
+
+// weights == NULL: equal bands with the remainder going to the low ranks.
+// Otherwise every rank gets min_rows and the rest is split in proportion
+// to its weight (height >= size * min_rows is the caller's job).
+void decompose_rows(int height, int size, const double* weights, int min_rows,
+                    int* row_starts) {
+    if (!weights) {
+        int rows_per_process = height / size;
+        int remainder = height % size;
+        for (int r = 0; r <= size; r++) {
+            row_starts[r] = r * rows_per_process + ((r < remainder) ? r : remainder);
+        }
+        return;
+    }
+    
+    double total = 0.0;
+    for (int r = 0; r < size; r++) total += (weights[r] > 0) ? weights[r] : 0;
+    
+    int spare = height - size * min_rows;
+    double cumulative = 0.0;
+    row_starts[0] = 0;
+    for (int r = 1; r <= size; r++) {
+        cumulative += (weights[r - 1] > 0) ? weights[r - 1] : 0;
+        double share = (total > 0) ? cumulative / total : (double)r / size;
+        row_starts[r] = r * min_rows + (int)(spare * share + 0.5);
+    }
+    row_starts[size] = height;
+}
+
+// Rows per second this rank achieves on the chain, measured on a
+// synthetic band after one warm-up run
+double calibrate_throughput(const FilterStage* stages, int stage_count, int width,
+                            int channels, int thread_count) {
+    int ghost = 0;
+    for (int s = 0; s < stage_count; s++) {
+        if (stages[s].radius > ghost) ghost = stages[s].radius;
+    }
+    
+    BandBuffers bands;
+    band_buffers_init(&bands, CALIBRATION_ROWS, width, channels, ghost, 0);
+    
+    ProcessGrid solo;
+    process_grid_solo(&solo);
+    
+    double elapsed = 0.0;
+    for (int run = 0; run < 2; run++) {
+        unsigned char* rows = band_buffer_rows(&bands, bands.cur);
+        for (size_t i = 0; i < (size_t)CALIBRATION_ROWS * width * channels; i++) {
+            rows[i] = (unsigned char)(i * 31 + (i >> 7));
+        }
+        
+        double t = MPI_Wtime();
+        int ok = apply_pipeline_mpi(stages, stage_count, &bands, &solo, thread_count, 0);
+        elapsed = ok ? MPI_Wtime() - t : 0.0;
+    }
+    
+    // A failed run leaves the default weight; the real run reports it
+    band_buffers_free(&bands);
+    return (elapsed > 0) ? CALIBRATION_ROWS / elapsed : 1.0;
+}
+
+int read_balance_hints(const char* path, double* weights, int size) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return 0;
+    
+    int n = 0;
+    while (n < size && fscanf(fp, "%lf", &weights[n]) == 1 && weights[n] > 0) n++;
+    fclose(fp);
+    return n == size;
+}
+
+// Non-periodic grid with rank order kept (rank 0 stays the I/O root);
+// neighbours off the image are MPI_PROC_NULL
+void process_grid_init(ProcessGrid* g, MPI_Comm parent, int grid_rows, int grid_cols) {
+    int periods[2] = {0, 0};
+    g->dims[0] = grid_rows;
+    g->dims[1] = grid_cols;
+    MPI_Cart_create(parent, 2, g->dims, periods, 0, &g->comm);
+    
+    int rank;
+    MPI_Comm_rank(g->comm, &rank);
+    MPI_Cart_coords(g->comm, rank, 2, g->coords);
+    MPI_Cart_shift(g->comm, 0, 1, &g->neighbors[NB_UP], &g->neighbors[NB_DOWN]);
+    MPI_Cart_shift(g->comm, 1, 1, &g->neighbors[NB_LEFT], &g->neighbors[NB_RIGHT]);
+    
+    static const int offsets[4][3] = {
+        {NB_UP_LEFT, -1, -1}, {NB_DOWN_RIGHT, 1, 1},
+        {NB_UP_RIGHT, -1, 1}, {NB_DOWN_LEFT, 1, -1}
+    };
+    for (int i = 0; i < 4; i++) {
+        int c[2] = {g->coords[0] + offsets[i][1], g->coords[1] + offsets[i][2]};
+        g->neighbors[offsets[i][0]] = MPI_PROC_NULL;
+        if (c[0] >= 0 && c[0] < grid_rows && c[1] >= 0 && c[1] < grid_cols) {
+            MPI_Cart_rank(g->comm, c, &g->neighbors[offsets[i][0]]);
+        }
+    }
+    
+    int keep_cols[2] = {0, 1};
+    int keep_rows[2] = {1, 0};
+    MPI_Cart_sub(g->comm, keep_cols, &g->row_comm);
+    MPI_Cart_sub(g->comm, keep_rows, &g->col_comm);
+}
+
+// A rank working alone on a whole image: no neighbours, no halo exchange
+void process_grid_solo(ProcessGrid* g) {
+    g->comm = MPI_COMM_SELF;
+    g->row_comm = MPI_COMM_SELF;
+    g->col_comm = MPI_COMM_SELF;
+    g->dims[0] = g->dims[1] = 1;
+    g->coords[0] = g->coords[1] = 0;
+    for (int d = 0; d < NB_COUNT; d++) g->neighbors[d] = MPI_PROC_NULL;
+}
+
+void process_grid_free(ProcessGrid* g) {
+    MPI_Comm_free(&g->row_comm);
+    MPI_Comm_free(&g->col_comm);
+    MPI_Comm_free(&g->comm);
+}
+
+// Timed with the halo traffic like the other grid-wide reductions
+int grid_all_ok(int ok, const ProcessGrid* g) {
+    int all_ok;
+    double t0 = MPI_Wtime();
+    MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, g->comm);
+    halo_seconds += MPI_Wtime() - t0;
+    return all_ok;
+}
+
+// --grid auto: the factorisation of size with the least halo traffic per
+// rank (block width per row halo plus block height per column halo);
+// ties go to fewer grid columns, so square images on 2 or 4 ranks keep
+// row bands
+void choose_grid(int width, int height, int size, int* grid_rows, int* grid_cols) {
+    double best = -1.0;
+    for (int cols = 1; cols <= size; cols++) {
+        if (size % cols != 0) continue;
+        int rows = size / cols;
+        double cost = ((rows > 1) ? (double)width / cols : 0.0) +
+                      ((cols > 1) ? (double)height / rows : 0.0);
+        if (best < 0 || cost < best) {
+            best = cost;
+            *grid_rows = rows;
+            *grid_cols = cols;
+        }
+    }
+}
+
+// ============================================
+// BATCH MODE (--batch)
+// ============================================
+//
+// Small frames are not worth decomposing: MPI_Init and the thread team
+// are paid once for the whole list and every image is filtered whole by
+// one rank. Rank 0 is the master of a work queue: a worker reports its
+// last result and gets the next path back, so ranks that drew large
+// images simply take fewer of them. On one process rank 0 works alone.
+
+#define BATCH_TAG_READY 10
+#define BATCH_TAG_JOB   11
+#define BATCH_TAG_STOP  12
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int has_pnm_suffix(const char* name) {
+    size_t n = strlen(name);
+    return n > 4 && (strcmp(name + n - 4, ".ppm") == 0 || strcmp(name + n - 4, ".pgm") == 0 ||
+                     strcmp(name + n - 4, ".pam") == 0);
+}
+
+// A directory gives its .ppm, .pgm and .pam files in name order;
+// anything else is read as a manifest with one path per line (blank
+// lines and # comments skipped). Returns the count, or -1 if `source`
+// cannot be read.
+static int collect_batch_inputs(const char* source, char*** paths_out) {
+    int count = 0, capacity = 64;
+    char** paths = (char**)malloc(capacity * sizeof(char*));
+    char line[4096];
+    
+    DIR* dir = opendir(source);
+    FILE* fp = dir ? NULL : fopen(source, "r");
+    if (!dir && !fp) {
+        free(paths);
+        return -1;
+    }
+    
+    for (;;) {
+        const char* name;
+        if (dir) {
+            struct dirent* entry = readdir(dir);
+            if (!entry) break;
+            if (!has_pnm_suffix(entry->d_name)) continue;
+            snprintf(line, sizeof(line), "%s/%s", source, entry->d_name);
+            name = line;
+        } else {
+            if (!fgets(line, sizeof(line), fp)) break;
+            line[strcspn(line, "\r\n")] = '\0';
+            name = line;
+            while (isspace((unsigned char)*name)) name++;
+            if (*name == '\0' || *name == '#') continue;
+        }
+        
+        if (count == capacity) {
+            capacity *= 2;
+            paths = (char**)realloc(paths, capacity * sizeof(char*));
+        }
+        paths[count++] = strdup(name);
+    }
+    
+    if (dir) {
+        closedir(dir);
+        qsort(paths, count, sizeof(char*), compare_paths);
+    } else {
+        fclose(fp);
+    }
+    *paths_out = paths;
+    return count;
+}
+
+// Load, filter and save one whole image on this rank. Returns its pixel
+// count, or -1 on failure.
+static long long batch_process_one(const char* input_file, const char* out_dir,
+                                   const FilterStage* stages, int stage_count,
+                                   int use_mmap, int thread_count) {
+    char output_file[4096];
+    const char* base = strrchr(input_file, '/');
+    snprintf(output_file, sizeof(output_file), "%s/%s", out_dir, base ? base + 1 : input_file);
+    
+    Image* img = use_mmap ? load_image_mmap(input_file) : load_image(input_file);
+    if (!img) return -1;
+    
+    int ghost = 0;
+    for (int s = 0; s < stage_count; s++) {
+        if (stages[s].radius > ghost) ghost = stages[s].radius;
+    }
+    size_t bytes = (size_t)img->width * img->height * img->channels;
+    
+    BandBuffers bands;
+    band_buffers_init(&bands, img->height, img->width, img->channels, ghost, 0);
+    memcpy(band_buffer_rows(&bands, bands.cur), img->data, bytes);
+    
+    ProcessGrid solo;
+    process_grid_solo(&solo);
+    int filtered = apply_pipeline_mpi(stages, stage_count, &bands, &solo, thread_count, 0);
+    
+    Image* result = !filtered ? NULL : use_mmap
+        ? create_image_mmap(output_file, img->width, img->height, img->channels)
+        : img;
+    int ok = (result != NULL);
+    if (ok) {
+        memcpy(result->data, band_buffer_rows(&bands, bands.cur), bytes);
+        if (!result->map) ok = save_image(output_file, result);
+    }
+    long long pixels = (long long)img->width * img->height;
+    
+    band_buffers_free(&bands);
+    if (result && result != img) free_image(result);
+    free_image(img);
+    return ok ? pixels : -1;
+}
+
+int run_batch_mpi(const char* source, const char* out_dir, const FilterStage* stages,
+                  int stage_count, int use_mmap, int thread_count, int rank, int size) {
+    char** paths = NULL;
+    int count = 0;
+    
+    if (rank == 0) {
+        count = collect_batch_inputs(source, &paths);
+        if (count < 0) {
+            fprintf(stderr, "Error: Could not read batch list %s\n", source);
+        } else if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Could not create output directory %s\n", out_dir);
+            for (int i = 0; i < count; i++) free(paths[i]);
+            free(paths);
+            count = -1;
+        }
+    }
+    MPI_Bcast(&count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (count < 0) return 1;
+    
+    MPI_Barrier(MPI_COMM_WORLD);
+    double start = MPI_Wtime();
+    int images = 0;             /* processed by this rank */
+    long long pixels = 0;
+    int failed = 0;
+    
+    if (size == 1) {
+        for (int i = 0; i < count; i++) {
+            long long n = batch_process_one(paths[i], out_dir, stages, stage_count,
+                                            use_mmap, thread_count);
+            if (n < 0) {
+                fprintf(stderr, "Error: Could not process %s\n", paths[i]);
+                failed++;
+            } else {
+                images++;
+                pixels += n;
+            }
+        }
+    } else if (rank == 0) {
+        // A report is the pixel count of the worker's last image (-1:
+        // failed); assigned[] says which image that was (-1: none yet)
+        int* assigned = (int*)malloc(size * sizeof(int));
+        for (int r = 0; r < size; r++) assigned[r] = -1;
+        int next = 0, active = size - 1;
+        while (active > 0) {
+            long long result;
+            MPI_Status status;
+            MPI_Recv(&result, 1, MPI_LONG_LONG, MPI_ANY_SOURCE, BATCH_TAG_READY,
+                     MPI_COMM_WORLD, &status);
+            int worker = status.MPI_SOURCE;
+            if (assigned[worker] >= 0 && result < 0) {
+                fprintf(stderr, "Error: Could not process %s\n", paths[assigned[worker]]);
+                failed++;
+            } else if (assigned[worker] >= 0) {
+                pixels += result;
+            }
+            
+            if (next < count) {
+                MPI_Send(paths[next], (int)strlen(paths[next]) + 1, MPI_CHAR,
+                         worker, BATCH_TAG_JOB, MPI_COMM_WORLD);
+                assigned[worker] = next++;
+            } else {
+                MPI_Send(NULL, 0, MPI_CHAR, worker, BATCH_TAG_STOP, MPI_COMM_WORLD);
+                active--;
+            }
+        }
+        free(assigned);
+    } else {
+        long long result = 0;
+        for (;;) {
+            MPI_Send(&result, 1, MPI_LONG_LONG, 0, BATCH_TAG_READY, MPI_COMM_WORLD);
+            
+            MPI_Status status;
+            MPI_Probe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+            if (status.MPI_TAG == BATCH_TAG_STOP) {
+                MPI_Recv(NULL, 0, MPI_CHAR, 0, BATCH_TAG_STOP, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                break;
+            }
+            int length;
+            MPI_Get_count(&status, MPI_CHAR, &length);
+            char* path = (char*)malloc(length);
+            MPI_Recv(path, length, MPI_CHAR, 0, BATCH_TAG_JOB, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            
+            result = batch_process_one(path, out_dir, stages, stage_count,
+                                       use_mmap, thread_count);
+            if (result >= 0) images++;
+            free(path);
+        }
+    }
+    double elapsed = MPI_Wtime() - start;
+    
+    int* per_rank = (rank == 0) ? (int*)malloc(size * sizeof(int)) : NULL;
+    MPI_Gather(&images, 1, MPI_INT, per_rank, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    
+    if (rank == 0) {
+        int done = count - failed;
+        printf("Batch: %d images, %s\n", count,
+               (size == 1) ? "rank 0 alone" : "rank 0 dispatching to the other ranks");
+        for (int r = (size == 1) ? 0 : 1; r < size; r++) {
+            printf("  rank %d: %d images\n", r, per_rank[r]);
+        }
+        printf("\nBatch time: %.6f seconds (I/O included)\n", elapsed);
+        printf("Processed %d of %d images, %.1f MP", done, count, pixels / 1e6);
+        if (elapsed > 0) {
+            printf(": %.1f images/sec, %.1f MP/s", done / elapsed, pixels / 1e6 / elapsed);
+        }
+        printf("\nDone!\n\n");
+        
+        for (int i = 0; i < count; i++) free(paths[i]);
+        free(paths);
+        free(per_rank);
+    }
+    return (failed > 0) ? 1 : 0;
+}
+
+// ============================================
+// BENCHMARK MODE (--bench)
+// ============================================
+//
+// Strong scaling inside one mpirun: for 1, 2, 4, ... up to all ranks the
+// first k ranks split off a communicator, decompose the image over it
+// and run the chain `warmup` untimed and `reps` timed times. A
+// repetition's time is the slowest member's, from a barrier to the end
+// of apply_pipeline_mpi; the block is refilled before each run, outside
+// the timed region. There is no scatter, gather or file I/O to measure:
+// a synthetic image is generated per block from global coordinates, and
+// a file is loaded whole by every rank once. Speedup and efficiency are
+// relative to the median on one rank.
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Index of the q-quantile in n sorted samples
+static int nearest_rank(int n, double q) {
+    int rank = (int)ceil(q * n);
+    return rank < 1 ? 0 : rank - 1;
+}
+
+// The block's pixels from img, or the OpenMP build's synthetic pattern
+// (gradients, a checkerboard and hashed noise) when img is NULL
+static void bench_fill_block(unsigned char* buf, size_t pitch, const Block* blk, int width,
+                             int height, int channels, const Image* img, int thread_count) {
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < blk->rows; i++) {
+        int y = blk->row_start + i;
+        unsigned char* row = buf + (size_t)i * pitch;
+        if (img) {
+            memcpy(row, img->data + ((size_t)y * width + blk->col_start) * channels,
+                   (size_t)blk->cols * channels);
+            continue;
+        }
+        for (int j = 0; j < blk->cols; j++) {
+            int x = blk->col_start + j;
+            unsigned int h = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u;
+            h = (h ^ (h >> 13)) * 0x5bd1e995u;
+            int check = (((x >> 5) ^ (y >> 5)) & 1) ? 48 : 0;
+            row[3 * j + 0] = (unsigned char)((x * 255) / (width > 1 ? width - 1 : 1));
+            row[3 * j + 1] = (unsigned char)((y * 255) / (height > 1 ? height - 1 : 1));
+            row[3 * j + 2] = (unsigned char)(((h >> 24) & 0x7f) + check + 40);
+        }
+    }
+}
+
+// Rank sweep over one image; img is NULL for the synthetic pattern.
+// Returns 0 (on every rank) if the chain failed at any rank count.
+static int bench_image_mpi(const Image* img, int width, int height, int channels,
+                            const char* label, const FilterStage* stages, int stage_count,
+                            int ghost, int use_grid, int thread_count, int warmup, int reps,
+                            int rank, int size) {
+    double* samples = (double*)malloc(reps * sizeof(double));
+    double megapixels = (double)width * height / 1e6;
+    double base_median = 0.0;
+    int failed = 0;
+    if (rank == 0) {
+        printf("%s: %dx%d, %d channels\n", label, width, height, channels);
+        printf("%6s %7s %12s %12s %12s %10s %9s %11s\n", "ranks", "grid", "min ms",
+               "median ms", "p95 ms", "MP/s", "speedup", "efficiency");
+    }
+    
+    for (int k = 1; ; k = (2 * k < size) ? 2 * k : size) {
+        MPI_Comm sub;
+        MPI_Comm_split(MPI_COMM_WORLD, (rank < k) ? 0 : MPI_UNDEFINED, rank, &sub);
+        
+        int grid_rows = k, grid_cols = 1;
+        if (use_grid) choose_grid(width, height, k, &grid_rows, &grid_cols);
+        int fits = (grid_rows == 1 || height / grid_rows >= ghost) &&
+                   (grid_cols == 1 || width / grid_cols >= ghost);
+        
+        if (sub != MPI_COMM_NULL && fits) {
+            int* row_starts = (int*)malloc((grid_rows + 1) * sizeof(int));
+            int* col_starts = (int*)malloc((grid_cols + 1) * sizeof(int));
+            decompose_rows(height, grid_rows, NULL, 0, row_starts);
+            decompose_rows(width, grid_cols, NULL, 0, col_starts);
+            int gr = rank / grid_cols, gc = rank % grid_cols;
+            Block mine = {row_starts[gr], row_starts[gr + 1] - row_starts[gr],
+                          col_starts[gc], col_starts[gc + 1] - col_starts[gc]};
+            
+            ProcessGrid grid;
+            process_grid_init(&grid, sub, grid_rows, grid_cols);
+            BandBuffers bands;
+            band_buffers_init(&bands, mine.rows, mine.cols, channels, ghost,
+                              (grid_cols > 1) ? ghost : 0);
+            
+            int run_ok = 1;
+            for (int run = 0; run < warmup + reps && run_ok; run++) {
+                bench_fill_block(band_buffer_rows(&bands, bands.cur), bands.pitch, &mine,
+                                 width, height, channels, img, thread_count);
+                MPI_Barrier(sub);
+                double start = MPI_Wtime();
+                run_ok = apply_pipeline_mpi(stages, stage_count, &bands, &grid,
+                                            thread_count, 0);
+                double elapsed = MPI_Wtime() - start;
+                MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, sub);
+                if (run >= warmup) samples[run - warmup] = elapsed;
+            }
+            
+            band_buffers_free(&bands);
+            process_grid_free(&grid);
+            free(row_starts);
+            free(col_starts);
+            
+            if (!run_ok) {
+                failed = 1;
+                if (rank == 0) {
+                    printf("%6d %4dx%-2d  failed: the chain could not allocate its buffers\n",
+                           k, grid_rows, grid_cols);
+                }
+            } else if (rank == 0) {
+                qsort(samples, reps, sizeof(double), compare_doubles);
+                double median = samples[nearest_rank(reps, 0.50)];
+                if (k == 1) base_median = median;
+                double speedup = median > 0 ? base_median / median : 0.0;
+                char dims[16];
+                snprintf(dims, sizeof(dims), "%dx%d", grid_rows, grid_cols);
+                printf("%6d %7s %12.3f %12.3f %12.3f %10.1f %8.2fx %10.1f%%\n", k, dims,
+                       samples[0] * 1e3, median * 1e3, samples[nearest_rank(reps, 0.95)] * 1e3,
+                       median > 0 ? megapixels / median : 0.0, speedup, 100.0 * speedup / k);
+            }
+        } else if (rank == 0 && !fits) {
+            printf("%6d %4dx%-2d  skipped: blocks thinner than the %d-pixel halo\n",
+                   k, grid_rows, grid_cols, ghost);
+        }
+        if (sub != MPI_COMM_NULL) MPI_Comm_free(&sub);
+        MPI_Barrier(MPI_COMM_WORLD);
+        if (k == size) break;
+    }
+    if (rank == 0) printf("\n");
+    free(samples);
+    MPI_Allreduce(MPI_IN_PLACE, &failed, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+    return !failed;
+}
+
+int run_bench_mpi(const char* source, const FilterStage* stages, int stage_count, int ghost,
+                  int use_grid, int thread_count, int warmup, int reps, int rank, int size) {
+    if (strncmp(source, "synthetic", 9) != 0) {
+        Image* img = load_image(source);
+        int ok = img != NULL, all_ok;
+        MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+        if (!all_ok) {
+            if (rank == 0) fprintf(stderr, "Error: Could not load image %s\n", source);
+            free_image(img);
+            return 1;
+        }
+        int bench_ok = bench_image_mpi(img, img->width, img->height, img->channels, source,
+                                       stages, stage_count, ghost, use_grid, thread_count,
+                                       warmup, reps, rank, size);
+        free_image(img);
+        return bench_ok ? 0 : 1;
+    }
+    
+    if (source[9] != '\0' && source[9] != ':') {
+        if (rank == 0) fprintf(stderr, "Error: Unknown bench source '%s'\n", source);
+        return 1;
+    }
+    const char* sizes = source[9] == ':' ? source + 10 : BENCH_SIZES;
+    int bench_ok = 1;
+    for (const char* p = sizes; *p; ) {
+        int width = 0, height = 0, used = 0;
+        if (sscanf(p, "%dx%d%n", &width, &height, &used) != 2 || width < 1 || height < 1) {
+            if (rank == 0) fprintf(stderr, "Error: Invalid bench size list '%s'\n", sizes);
+            return 1;
+        }
+        p += used;
+        if (*p == ',') p++;
+        
+        char label[64];
+        snprintf(label, sizeof(label), "synthetic %dx%d", width, height);
+        if (!bench_image_mpi(NULL, width, height, 3, label, stages, stage_count, ghost,
+                             use_grid, thread_count, warmup, reps, rank, size)) {
+            bench_ok = 0;
+        }
+    }
+    return bench_ok ? 0 : 1;
+}
+
+// ============================================
+// IMAGE I/O (Netpbm: PGM, PPM, PAM)
+// ============================================
+
+// Netpbm headers: P5 <w> <h> <max> (gray), P6 <w> <h> <max> (RGB) and P7
+// (PAM: WIDTH/HEIGHT/DEPTH/MAXVAL/TUPLTYPE lines up to ENDHDR), with
+// '#' comments between the tokens. P5/P6 data starts after the single
+// whitespace byte that ends max_val, P7 data after the ENDHDR line.
+#define PNM_HEADER_MAX 4096
+
+static int header_token(const unsigned char* p, size_t n, size_t* pos, char* tok, size_t size) {
+    for (;;) {
+        while (*pos < n && isspace(p[*pos])) (*pos)++;
+        if (*pos < n && p[*pos] == '#') {
+            while (*pos < n && p[*pos] != '\n') (*pos)++;
+            continue;
+        }
+        break;
+    }
+    size_t len = 0;
+    while (*pos < n && !isspace(p[*pos]) && len + 1 < size) tok[len++] = (char)p[(*pos)++];
+    tok[len] = '\0';
+    return len > 0 && (*pos >= n || isspace(p[*pos]));
+}
+
+static int header_int(const unsigned char* p, size_t n, size_t* pos, int* value) {
+    char tok[16];
+    if (!header_token(p, n, pos, tok, sizeof(tok))) return 0;
+    char* end;
+    long v = strtol(tok, &end, 10);
+    if (*end != '\0' || !isdigit((unsigned char)tok[0]) || v > INT_MAX) return 0;
+    *value = (int)v;
+    return 1;
+}
+
+// Returns the offset of the first pixel byte, or 0 if p does not start
+// with a supported header: 1, 3 or 4 channels of 1..65535
+static size_t parse_pnm_header(const unsigned char* p, size_t n, PnmInfo* info) {
+    char tok[16];
+    size_t pos = 0;
+    if (!header_token(p, n, &pos, tok, sizeof(tok))) return 0;
+    
+    if (strcmp(tok, "P5") == 0 || strcmp(tok, "P6") == 0) {
+        info->channels = (tok[1] == '5') ? 1 : 3;
+        if (!header_int(p, n, &pos, &info->width) ||
+            !header_int(p, n, &pos, &info->height) ||
+            !header_int(p, n, &pos, &info->max_val) || pos >= n) {
+            return 0;
+        }
+        pos++;
+    } else if (strcmp(tok, "P7") == 0) {
+        info->width = info->height = info->channels = info->max_val = 0;
+        for (;;) {
+            if (!header_token(p, n, &pos, tok, sizeof(tok))) return 0;
+            if (strcmp(tok, "ENDHDR") == 0) break;
+            int ok = 1;
+            if (strcmp(tok, "WIDTH") == 0) ok = header_int(p, n, &pos, &info->width);
+            else if (strcmp(tok, "HEIGHT") == 0) ok = header_int(p, n, &pos, &info->height);
+            else if (strcmp(tok, "DEPTH") == 0) ok = header_int(p, n, &pos, &info->channels);
+            else if (strcmp(tok, "MAXVAL") == 0) ok = header_int(p, n, &pos, &info->max_val);
+            else if (strcmp(tok, "TUPLTYPE") == 0) {
+                while (pos < n && p[pos] != '\n') pos++;
+            } else {
+                ok = 0;
+            }
+            if (!ok) return 0;
+        }
+        while (pos < n && p[pos] != '\n') pos++;
+        if (pos >= n) return 0;
+        pos++;
+    } else {
+        return 0;
+    }
+    
+    if (info->width <= 0 || info->height <= 0 || info->max_val < 1 || info->max_val > 65535 ||
+        (info->channels != 1 && info->channels != 3 && info->channels != 4)) {
+        return 0;
+    }
+    return pos;
+}
+
+// P5 for gray, P6 for RGB, P7 RGB_ALPHA for RGBA
+int format_pnm_header(char* buf, size_t size, int width, int height, int channels) {
+    if (channels == 4) {
+        return snprintf(buf, size, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\n"
+                        "TUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+    }
+    return snprintf(buf, size, "P%c\n%d %d\n255\n", (channels == 1) ? '5' : '6',
+                    width, height);
+}
+
+static FILE* open_pnm_input(const char* filename, PnmInfo* info) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    
+    unsigned char header[PNM_HEADER_MAX];
+    size_t n = fread(header, 1, sizeof(header), fp);
+    size_t offset = parse_pnm_header(header, n, info);
+    if (offset == 0 || fseek(fp, (long)offset, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+static int read_pnm_rows(FILE* fp, const PnmInfo* info, unsigned char* dst, size_t rows) {
+    size_t row_size = (size_t)info->width * info->channels;
+    if (info->max_val <= 255) {
+        return fread(dst, row_size, rows, fp) == rows;
+    }
+    
+    // Big-endian 16-bit samples, rescaled to 0..255 a block of rows at a time
+    size_t block = (rows < 64) ? rows : 64;
+    unsigned char* wide = (unsigned char*)malloc(block * row_size * 2);
+    if (!wide) return 0;
+    unsigned int max_val = (unsigned int)info->max_val;
+    int ok = 1;
+    for (size_t y = 0; y < rows && ok; y += block) {
+        size_t n = (rows - y < block) ? rows - y : block;
+        ok = fread(wide, row_size * 2, n, fp) == n;
+        unsigned char* out = dst + y * row_size;
+        for (size_t i = 0; ok && i < n * row_size; i++) {
+            unsigned int v = ((unsigned int)wide[2 * i] << 8) | wide[2 * i + 1];
+            if (v > max_val) v = max_val;
+            out[i] = (unsigned char)((v * 255 + max_val / 2) / max_val);
+        }
+    }
+    free(wide);
+    return ok;
+}
+
+Image* load_image(const char* filename) {
+    PnmInfo info;
+    FILE* fp = open_pnm_input(filename, &info);
+    if (!fp) return NULL;
+    
+    Image* img = create_image(info.width, info.height, info.channels);
+    if (!read_pnm_rows(fp, &info, img->data, (size_t)info.height)) {
+        free_image(img);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    
+    return img;
+}
+
+int save_image(const char* filename, Image* img) {
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) return 0;
+    char header[128];
+    format_pnm_header(header, sizeof(header), img->width, img->height, img->channels);
+    fputs(header, fp);
+    size_t expected = (size_t)img->width * img->height * img->channels;
+    size_t written = fwrite(img->data, 1, expected, fp);
+    return (fclose(fp) == 0 && written == expected);
+}
+
+Image* create_image(int width, int height, int channels) {
+    Image* img = (Image*)malloc(sizeof(Image));
+    img->width = width;
     img->height = height;
     img->channels = channels;
+    img->map = NULL;
+    img->map_size = 0;
     img->data = (unsigned char*)calloc(width * height * channels, sizeof(unsigned char));
     return img;
 }
 
 void free_image(Image* img) {
     if (img) {
-        free(img->data);
+        if (img->map) {
+            munmap(img->map, img->map_size);
+        } else {
+            free(img->data);
+        }
         free(img);
     }
-}
\ No newline at end of file
+}
+
+// rows x cols pixels of channels-byte pixels, src_pitch bytes apart, to
+// one byte per pixel dst_pitch apart
+void copy_gray(const unsigned char* src, size_t src_pitch, int channels, int luma,
+               unsigned char* dst, size_t dst_pitch, int rows, int cols,
+               int thread_count) {
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < rows; i++) {
+        const unsigned char* in = src + (size_t)i * src_pitch;
+        unsigned char* out = dst + (size_t)i * dst_pitch;
+        if (luma && channels >= 3) {
+            for (int j = 0; j < cols; j++) {
+                const unsigned char* p = in + (size_t)j * channels;
+                out[j] = (unsigned char)((GRAY_WR * p[0] + GRAY_WG * p[1] + GRAY_WB * p[2])
+                                         >> GRAY_SHIFT);
+            }
+        } else {
+            for (int j = 0; j < cols; j++) out[j] = in[(size_t)j * channels];
+        }
+    }
+}
+
+// ============================================
+// MEMORY-MAPPED I/O (--io mmap)
+// ============================================
+//
+// The input payload is used in place after the header, so there is no
+// zeroed buffer and no kernel-to-user copy; the filter threads take the
+// page faults as they first touch their rows. The output file is created
+// at its final size and mapped shared, filters write straight into the
+// page cache and saving is just the unmap.
+
+Image* load_image_mmap(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 3) {
+        close(fd);
+        return NULL;
+    }
+    
+    size_t size = (size_t)st.st_size;
+    unsigned char* map = (unsigned char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    
+    /* Same header rules as load_image. 16-bit samples cannot be used in
+       place; those files are read and rescaled instead */
+    PnmInfo info;
+    size_t pos = parse_pnm_header(map, size < PNM_HEADER_MAX ? size : PNM_HEADER_MAX, &info);
+    if (pos == 0 || info.max_val > 255) {
+        munmap(map, size);
+        return pos ? load_image(filename) : NULL;
+    }
+    int width = info.width, height = info.height, channels = info.channels;
+    
+    size_t expected = (size_t)width * (size_t)height * channels;
+    if (size - pos < expected) {
+        munmap(map, size);
+        return NULL;
+    }
+    
+    // Start readahead now so disk reads overlap with the first rows' work
+    madvise(map, size, MADV_WILLNEED);
+    
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) {
+        munmap(map, size);
+        return NULL;
+    }
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->data = map + pos;
+    img->map = map;
+    img->map_size = size;
+    return img;
+}
+
+Image* create_image_mmap(const char* filename, int width, int height, int channels) {
+    char header[128];
+    int header_len = format_pnm_header(header, sizeof(header), width, height, channels);
+    size_t size = (size_t)header_len + (size_t)width * height * channels;
+    
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+    
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    unsigned char* map = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    memcpy(map, header, header_len);
+    
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) {
+        munmap(map, size);
+        return NULL;
+    }
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->data = map + header_len;
+    img->map = map;
+    img->map_size = size;
+    return img;
+}
+
+// ============================================
+// PARALLEL FILE I/O (MPI-IO, default --io mpiio)
+// ============================================
+//
+// Rank 0 only parses the header. Every rank then reads its own block
+// straight from the file and writes its result block into the output with
+// collective calls, so no rank ever holds more than its block. The file
+// view is a subarray of the pixel payload; in memory the block rows sit
+// `pitch` bytes apart, between the ghost cells.
+
+int read_pnm_header_all(const char* filename, PnmInfo* info, MPI_Offset* data_offset,
+                        int rank) {
+    long long header[5] = {0, 0, 0, 0, 0};  /* width, height, channels, max_val, offset */
+    
+    if (rank == 0) {
+        PnmInfo mine;
+        FILE* fp = open_pnm_input(filename, &mine);
+        if (fp) {
+            header[0] = mine.width;
+            header[1] = mine.height;
+            header[2] = mine.channels;
+            header[3] = mine.max_val;
+            header[4] = ftell(fp);
+            fclose(fp);
+        }
+    }
+    
+    MPI_Bcast(header, 5, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    info->width = (int)header[0];
+    info->height = (int)header[1];
+    info->channels = (int)header[2];
+    info->max_val = (int)header[3];
+    *data_offset = (MPI_Offset)header[4];
+    return header[0] > 0;
+}
+
+// File view and buffer layout of one block; 0 for an empty block, which
+// still takes part in the collective calls with a zero count
+static int block_types(int width, int height, int channels, const Block* blk, size_t pitch,
+                       MPI_Datatype* filetype, MPI_Datatype* memtype) {
+    if (blk->rows <= 0 || blk->cols <= 0) return 0;
+    
+    int sizes[2] = {height, width * channels};
+    int subsizes[2] = {blk->rows, blk->cols * channels};
+    int starts[2] = {blk->row_start, blk->col_start * channels};
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+                             MPI_UNSIGNED_CHAR, filetype);
+    MPI_Type_vector(blk->rows, blk->cols * channels, (int)pitch, MPI_UNSIGNED_CHAR, memtype);
+    MPI_Type_commit(filetype);
+    MPI_Type_commit(memtype);
+    return 1;
+}
+
+int read_block_mpiio(const char* filename, MPI_Offset data_offset, int width, int height,
+                     int channels, const Block* blk, unsigned char* buf, size_t pitch) {
+    MPI_File fh;
+    if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_RDONLY,
+                      MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        return 0;
+    }
+    
+    MPI_Datatype filetype = MPI_UNSIGNED_CHAR, memtype = MPI_UNSIGNED_CHAR;
+    int typed = block_types(width, height, channels, blk, pitch, &filetype, &memtype);
+    // A truncated file must fail on every rank, not only on the last band;
+    // element counts of a strided read do not show the short rows reliably
+    MPI_Offset file_size = 0;
+    int rc = MPI_File_get_size(fh, &file_size);
+    int complete = (rc == MPI_SUCCESS &&
+                    file_size >= data_offset + (MPI_Offset)height * width * channels);
+    if (rc == MPI_SUCCESS) {
+        rc = MPI_File_set_view(fh, data_offset, MPI_UNSIGNED_CHAR, filetype,
+                               "native", MPI_INFO_NULL);
+    }
+    if (rc == MPI_SUCCESS) rc = MPI_File_read_all(fh, buf, typed, memtype, MPI_STATUS_IGNORE);
+    MPI_File_close(&fh);
+    if (typed) {
+        MPI_Type_free(&filetype);
+        MPI_Type_free(&memtype);
+    }
+    
+    int ok = (rc == MPI_SUCCESS && complete), all_ok;
+    MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    return all_ok;
+}
+
+int write_block_mpiio(const char* filename, int width, int height, int channels,
+                      const Block* blk, const unsigned char* buf, size_t pitch, int rank) {
+    char header[128];
+    int header_len = format_pnm_header(header, sizeof(header), width, height, channels);
+    MPI_Offset row_size = (MPI_Offset)width * channels;
+    
+    MPI_File fh;
+    if (MPI_File_open(MPI_COMM_WORLD, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                      MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+        return 0;
+    }
+    
+    // Drop any longer previous contents
+    int ok = MPI_File_set_size(fh, header_len + height * row_size) == MPI_SUCCESS;
+    if (rank == 0 && ok) {
+        ok = MPI_File_write_at(fh, 0, header, header_len, MPI_CHAR,
+                               MPI_STATUS_IGNORE) == MPI_SUCCESS;
+    }
+    
+    MPI_Datatype filetype = MPI_UNSIGNED_CHAR, memtype = MPI_UNSIGNED_CHAR;
+    int typed = block_types(width, height, channels, blk, pitch, &filetype, &memtype);
+    int rc = MPI_File_set_view(fh, header_len, MPI_UNSIGNED_CHAR, filetype,
+                               "native", MPI_INFO_NULL);
+    if (rc == MPI_SUCCESS) {
+        rc = MPI_File_write_all(fh, (void*)buf, typed, memtype, MPI_STATUS_IGNORE);
+    }
+    ok = ok && rc == MPI_SUCCESS;
+    MPI_File_close(&fh);
+    if (typed) {
+        MPI_Type_free(&filetype);
+        MPI_Type_free(&memtype);
+    }
+    
+    int all_ok;
+    MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    return all_ok;
+}
+
+// ============================================
+// ROOT DISTRIBUTION (--io stdio|mmap)
+// ============================================
+//
+// Rank 0 holds the whole image. Full-width bands are contiguous on both
+// sides and go through MPI_Scatterv/MPI_Gatherv; 2D blocks are strided
+// and go point to point as subarray types.
+
+static int blocks_are_bands(const Block* blocks, int width, int size, size_t pitch,
+                            int channels) {
+    for (int r = 0; r < size; r++) {
+        if (blocks[r].cols != width) return 0;
+    }
+    return pitch == (size_t)width * channels;
+}
+
+void scatter_blocks(const unsigned char* image, int width, int height, int channels,
+                    const Block* blocks, unsigned char* buf, size_t pitch, int rank, int size) {
+    const Block* mine = &blocks[rank];
+    size_t row_size = (size_t)width * channels;
+    
+    if (blocks_are_bands(blocks, width, size, pitch, channels)) {
+        int* counts = (int*)malloc(size * sizeof(int));
+        int* displs = (int*)malloc(size * sizeof(int));
+        for (int r = 0; r < size; r++) {
+            counts[r] = (int)(blocks[r].rows * row_size);
+            displs[r] = (int)(blocks[r].row_start * row_size);
+        }
+        MPI_Scatterv(image, counts, displs, MPI_UNSIGNED_CHAR, buf, counts[rank],
+                     MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        free(counts);
+        free(displs);
+        return;
+    }
+    
+    MPI_Request* requests = (MPI_Request*)malloc(size * sizeof(MPI_Request));
+    int pending = 0;
+    if (rank == 0) {
+        for (int r = 0; r < size; r++) {
+            MPI_Datatype filetype, memtype;
+            if (!block_types(width, height, channels, &blocks[r], pitch, &filetype, &memtype)) {
+                continue;
+            }
+            MPI_Isend(image, 1, filetype, r, 0, MPI_COMM_WORLD, &requests[pending++]);
+            MPI_Type_free(&filetype);
+            MPI_Type_free(&memtype);
+        }
+    }
+    
+    MPI_Datatype filetype, memtype;
+    if (block_types(width, height, channels, mine, pitch, &filetype, &memtype)) {
+        MPI_Recv(buf, 1, memtype, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Type_free(&filetype);
+        MPI_Type_free(&memtype);
+    }
+    MPI_Waitall(pending, requests, MPI_STATUSES_IGNORE);
+    free(requests);
+}
+
+void gather_blocks(unsigned char* image, int width, int height, int channels,
+                   const Block* blocks, const unsigned char* buf, size_t pitch, int rank, int size) {
+    const Block* mine = &blocks[rank];
+    size_t row_size = (size_t)width * channels;
+    
+    if (blocks_are_bands(blocks, width, size, pitch, channels)) {
+        int* counts = (int*)malloc(size * sizeof(int));
+        int* displs = (int*)malloc(size * sizeof(int));
+        for (int r = 0; r < size; r++) {
+            counts[r] = (int)(blocks[r].rows * row_size);
+            displs[r] = (int)(blocks[r].row_start * row_size);
+        }
+        MPI_Gatherv(buf, counts[rank], MPI_UNSIGNED_CHAR, image, counts, displs,
+                    MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+        free(counts);
+        free(displs);
+        return;
+    }
+    
+    MPI_Request* requests = (MPI_Request*)malloc(size * sizeof(MPI_Request));
+    int pending = 0;
+    if (rank == 0) {
+        for (int r = 0; r < size; r++) {
+            MPI_Datatype filetype, memtype;
+            if (!block_types(width, height, channels, &blocks[r], pitch, &filetype, &memtype)) {
+                continue;
+            }
+            MPI_Irecv(image, 1, filetype, r, 1, MPI_COMM_WORLD, &requests[pending++]);
+            MPI_Type_free(&filetype);
+            MPI_Type_free(&memtype);
+        }
+    }
+    
+    MPI_Datatype filetype, memtype;
+    if (block_types(width, height, channels, mine, pitch, &filetype, &memtype)) {
+        MPI_Send((void*)buf, 1, memtype, 0, 1, MPI_COMM_WORLD);
+        MPI_Type_free(&filetype);
+        MPI_Type_free(&memtype);
+    }
+    MPI_Waitall(pending, requests, MPI_STATUSES_IGNORE);
+    free(requests);
+}
+
+// ============================================
+// METRICS (--metrics json|csv[:FILE])
+// ============================================
+//
+// Every rank times its own phases: load (its MPI-IO band, or rank 0's
+// read), scatter, halo (exchanges plus the grid-wide scans and
+// reductions of the integral and tone filters), compute (filter time
+// without halo), gather and save. Around the filters each thread also
+// reads its CPU time and, where the kernel allows perf events, its
+// user-space cycles, instructions and cache misses; the probes are
+// parallel regions of the filters' size whose worker threads the OpenMP
+// runtime keeps in between. Rank 0 gathers all records. The top-level
+// phases are the slowest rank's, so they add up to the critical path.
+
+typedef struct {
+    double cpu;
+    int fd[METRIC_EVENTS];
+} ThreadProbe;
+
+static ThreadProbe* probes = NULL;
+
+#ifdef __linux__
+static int perf_counter_open(unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static double thread_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int parse_metrics(const char* spec, MetricsSpec* m) {
+    const char* colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    
+    if (len == 4 && strncmp(spec, "json", 4) == 0) m->format = METRICS_JSON;
+    else if (len == 3 && strncmp(spec, "csv", 3) == 0) m->format = METRICS_CSV;
+    else return 0;
+    m->path = (colon && colon[1]) ? colon + 1 : NULL;
+    return 1;
+}
+
+void metrics_probe_begin(int thread_count) {
+    probes = (ThreadProbe*)calloc(thread_count, sizeof(ThreadProbe));
+    
+#pragma omp parallel num_threads(thread_count)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        ThreadProbe* p = &probes[tid];
+        for (int e = 0; e < METRIC_EVENTS; e++) p->fd[e] = -1;
+#ifdef __linux__
+        static const unsigned long long events[METRIC_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+        };
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            p->fd[e] = perf_counter_open(events[e]);
+            if (p->fd[e] >= 0) {
+                ioctl(p->fd[e], PERF_EVENT_IOC_RESET, 0);
+                ioctl(p->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+        p->cpu = thread_cpu_time();
+    }
+}
+
+void metrics_probe_end(RankMetrics* rm, int thread_count) {
+#pragma omp parallel num_threads(thread_count)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        ThreadProbe* p = &probes[tid];
+        p->cpu = thread_cpu_time() - p->cpu;
+#ifdef __linux__
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            if (p->fd[e] >= 0) ioctl(p->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+        }
+#endif
+    }
+    
+    rm->cpu = 0.0;
+    for (int e = 0; e < METRIC_EVENTS; e++) rm->events[e] = 0;
+    for (int t = 0; t < thread_count; t++) {
+        rm->cpu += probes[t].cpu;
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            long long value = -1;
+            int fd = probes[t].fd[e];
+            if (fd >= 0) {
+                if (read(fd, &value, sizeof(value)) != (ssize_t)sizeof(value)) value = -1;
+                close(fd);
+            }
+            if (value < 0 || rm->events[e] < 0) rm->events[e] = -1;
+            else rm->events[e] += value;
+        }
+    }
+    
+    free(probes);
+    probes = NULL;
+}
+
+static void json_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') fprintf(fp, "\\%c", ch);
+        else if (ch < 0x20) fprintf(fp, "\\u%04x", ch);
+        else fputc(ch, fp);
+    }
+    fputc('"', fp);
+}
+
+static void json_count(FILE* fp, long long value) {
+    if (value < 0) fprintf(fp, "null");
+    else fprintf(fp, "%lld", value);
+}
+
+static void csv_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"') fputc('"', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void csv_count(FILE* fp, long long value) {
+    if (value >= 0) fprintf(fp, "%lld", value);
+}
+
+static const char* const phase_names[PHASE_COUNT] = {
+    "load", "scatter", "halo", "compute", "gather", "save"
+};
+
+int metrics_report(const MetricsSpec* m, const RankMetrics* mine, const MetricsRun* run,
+                   const Block* blocks, int rank, int size) {
+    RankMetrics* all = (rank == 0) ? (RankMetrics*)malloc(size * sizeof(RankMetrics)) : NULL;
+    MPI_Gather(mine, (int)sizeof(RankMetrics), MPI_BYTE, all, (int)sizeof(RankMetrics),
+               MPI_BYTE, 0, MPI_COMM_WORLD);
+    if (rank != 0) return 1;
+    
+    FILE* fp = stderr;
+    int new_file = 1;
+    if (m->path) {
+        struct stat st;
+        new_file = (stat(m->path, &st) != 0 || st.st_size == 0);
+        fp = fopen(m->path, m->format == METRICS_CSV ? "a" : "w");
+        if (!fp) {
+            fprintf(stderr, "Error: Could not write metrics to %s\n", m->path);
+            free(all);
+            return 0;
+        }
+    }
+    
+    double worst[PHASE_COUNT] = {0};
+    double compute_min = 0.0, compute_max = 0.0;
+    long long totals[METRIC_EVENTS] = {0};
+    for (int r = 0; r < size; r++) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            if (all[r].phase[p] > worst[p]) worst[p] = all[r].phase[p];
+        }
+        double compute = all[r].phase[PHASE_COMPUTE];
+        if (r == 0 || compute < compute_min) compute_min = compute;
+        if (r == 0 || compute > compute_max) compute_max = compute;
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            if (all[r].events[e] < 0 || totals[e] < 0) totals[e] = -1;
+            else totals[e] += all[r].events[e];
+        }
+    }
+    
+    // Modelled traffic: every stage reads and writes each pixel once
+    // (halo and table messages not included)
+    size_t bytes_moved = 2 * (size_t)run->width * run->height * run->channels * run->stage_count;
+    double pixels = (double)run->width * run->height;
+    double mpix_per_s = (run->processing > 0) ? pixels / run->processing / 1e6 : 0.0;
+    double gb_per_s = (run->processing > 0) ? bytes_moved / run->processing / 1e9 : 0.0;
+    
+    if (m->format == METRICS_JSON) {
+        fprintf(fp, "{\"backend\": \"mpi\", \"input\": ");
+        json_string(fp, run->input);
+        fprintf(fp, ", \"filter\": ");
+        json_string(fp, run->filter);
+        fprintf(fp, ", \"width\": %d, \"height\": %d, \"channels\": %d, \"processes\": %d, "
+                "\"grid\": \"%dx%d\", \"threads_per_rank\": %d, \"io\": \"%s\"",
+                run->width, run->height, run->channels, size, run->grid_rows, run->grid_cols,
+                run->thread_count, run->io);
+        fprintf(fp, ", \"phases\": {");
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(fp, "%s\"%s\": %.6f", p ? ", " : "", phase_names[p], worst[p]);
+        }
+        fprintf(fp, ", \"processing\": %.6f}", run->processing);
+        fprintf(fp, ", \"megapixels_per_s\": %.3f, \"bytes_moved\": %zu, \"gb_per_s\": %.3f",
+                mpix_per_s, bytes_moved, gb_per_s);
+        fprintf(fp, ", \"compute_imbalance\": %.3f",
+                (compute_min > 0) ? compute_max / compute_min : 0.0);
+        fprintf(fp, ", \"cycles\": ");
+        json_count(fp, totals[0]);
+        fprintf(fp, ", \"instructions\": ");
+        json_count(fp, totals[1]);
+        fprintf(fp, ", \"cache_misses\": ");
+        json_count(fp, totals[2]);
+        fprintf(fp, ", \"per_rank\": [");
+        for (int r = 0; r < size; r++) {
+            const RankMetrics* rm = &all[r];
+            fprintf(fp, "%s{\"rank\": %d, \"block\": [%d, %d, %d, %d]", r ? ", " : "", r,
+                    blocks[r].col_start, blocks[r].row_start, blocks[r].cols, blocks[r].rows);
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                fprintf(fp, ", \"%s\": %.6f", phase_names[p], rm->phase[p]);
+            }
+            fprintf(fp, ", \"cpu_s\": %.6f, \"cycles\": ", rm->cpu);
+            json_count(fp, rm->events[0]);
+            fprintf(fp, ", \"instructions\": ");
+            json_count(fp, rm->events[1]);
+            fprintf(fp, ", \"ipc\": ");
+            if (rm->events[0] > 0 && rm->events[1] >= 0) {
+                fprintf(fp, "%.3f", (double)rm->events[1] / rm->events[0]);
+            } else {
+                fprintf(fp, "null");
+            }
+            fprintf(fp, ", \"cache_misses\": ");
+            json_count(fp, rm->events[2]);
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "]}\n");
+    } else {
+        if (new_file) {
+            fprintf(fp, "backend,input,filter,width,height,channels,processes,grid,"
+                    "threads_per_rank,io,load_s,scatter_s,halo_s,compute_s,gather_s,save_s,"
+                    "processing_s,megapixels_per_s,bytes_moved,gb_per_s,rank_compute_min_s,"
+                    "rank_compute_max_s,cycles,instructions,ipc,cache_misses\n");
+        }
+        fprintf(fp, "mpi,");
+        csv_string(fp, run->input);
+        fputc(',', fp);
+        csv_string(fp, run->filter);
+        fprintf(fp, ",%d,%d,%d,%d,%dx%d,%d,%s", run->width, run->height, run->channels, size,
+                run->grid_rows, run->grid_cols, run->thread_count, run->io);
+        for (int p = 0; p < PHASE_COUNT; p++) fprintf(fp, ",%.6f", worst[p]);
+        fprintf(fp, ",%.6f,%.3f,%zu,%.3f,%.6f,%.6f,", run->processing, mpix_per_s, bytes_moved,
+                gb_per_s, compute_min, compute_max);
+        csv_count(fp, totals[0]);
+        fputc(',', fp);
+        csv_count(fp, totals[1]);
+        fputc(',', fp);
+        if (totals[0] > 0 && totals[1] >= 0) fprintf(fp, "%.3f", (double)totals[1] / totals[0]);
+        fputc(',', fp);
+        csv_count(fp, totals[2]);
+        fputc('\n', fp);
+    }
+    
+    if (fp != stderr) fclose(fp);
+    else fflush(fp);
+    free(all);
+    return 1;
+}
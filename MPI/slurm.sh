@@ -2,6 +2,7 @@
 #SBATCH --job-name=image_mpi
 #SBATCH --nodes=4
 #SBATCH --ntasks=16
+#SBATCH --exclusive
 #SBATCH --time=00:30:00
 #SBATCH --output=mpi_results_%j.txt
 
@@ -44,6 +45,29 @@ for nprocs in 1 2 4 8 16; do
         output_bright_${nprocs}p.ppm brighten
 done
 
+# Hybrid MPI+OpenMP sweep: the same cores split between ranks and
+# threads, from one rank per node up to one rank per core
+make hybrid
+CORES_PER_NODE=${SLURM_CPUS_ON_NODE:-32}
+for ranks_per_node in 1 2 4 8 16 32; do
+    threads=$((CORES_PER_NODE / ranks_per_node))
+    [ $threads -lt 1 ] && continue
+    ranks=$((ranks_per_node * SLURM_JOB_NUM_NODES))
+    
+    echo ""
+    echo "=== Hybrid: $ranks ranks x $threads threads ==="
+    export OMP_NUM_THREADS=$threads
+    export OMP_PLACES=cores
+    export OMP_PROC_BIND=close
+    
+    for filter in blur edge gauss:3; do
+        echo "Filter: $filter"
+        srun --ntasks=$ranks --ntasks-per-node=$ranks_per_node --cpus-per-task=$threads \
+            ./image_proc_hybrid.exe test_gradient_large.ppm \
+            output_hybrid_${ranks}x${threads}.ppm $filter --threads $threads
+    done
+done
+
 echo ""
 echo "=========================================="
 echo "Benchmark Complete!"
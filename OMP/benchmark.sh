@@ -28,6 +28,9 @@ fi
 
 # Results file
 results_file="results/benchmark_results.txt"
+# One CSV row per run (--metrics), for spreadsheets and plotting
+metrics_file="results/benchmark_results.csv"
+rm -f "$metrics_file"
 echo "Benchmark Results - $(date)" > $results_file
 echo "======================================" >> $results_file
 
@@ -58,7 +61,7 @@ for size_name in "${!images[@]}"; do
             echo -n "    $t threads... "
             
             # Run and capture output
-            output=$(./image_proc.exe "$input_file" "$output_file" "$filter" "$t" 2>&1)
+            output=$(./image_proc.exe "$input_file" "$output_file" "$filter" "$t" --metrics "csv:$metrics_file" 2>&1)
             
             # Extract timing
             time=$(echo "$output" | grep "Processing time" | awk '{print $3}')
@@ -79,6 +82,7 @@ echo ""
 echo "======================================"
 echo "Benchmark complete!"
 echo "Results saved to: $results_file"
+echo "Per-run metrics (CSV): $metrics_file"
 echo "Output images saved to: results/"
 echo "======================================"
 
@@ -2,61 +2,713 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
+// Only the decoders this program reads; Netpbm has its own loader
+#define STBI_ONLY_PNG
+#define STBI_ONLY_JPEG
+#define STBI_ONLY_BMP
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image.h"
+#include "stb_image_write.h"
 
 typedef struct {
     unsigned char *data;
     int width;
     int height;
     int channels;
+    int planar;     /* 0: interleaved RGBRGB..., 1: one plane per channel */
+    size_t pitch;   /* bytes between rows (rows of one plane when planar) */
+    unsigned char *map;     /* non-NULL: data points into this mmap'd file */
+    size_t map_size;
 } Image;
 
+// Netpbm inputs: P5 (1 channel), P6 (3) or P7 PAM with DEPTH 1, 3 or 4.
+// Samples wider than 8 bits (max_val > 255) are rescaled to 8 bits as
+// they are read; outputs are written as P5, P6 or P7 RGB_ALPHA by
+// channel count.
+typedef struct {
+    int width;
+    int height;
+    int channels;
+    int max_val;
+} PnmInfo;
+
 // Function prototypes
 Image* load_image(const char* filename);
-void save_image(const char* filename, Image* img);
+// Opens a P5/P6/P7 file and leaves it positioned at the pixel data
+FILE* open_pnm_input(const char* filename, PnmInfo* info);
+// Reads `rows` rows as 8-bit samples; returns 1 on success
+int read_pnm_rows(FILE* fp, const PnmInfo* info, unsigned char* dst, size_t rows);
+// Header of a 1-, 3- or 4-channel output; returns its length
+int format_pnm_header(char* buf, size_t size, int width, int height, int channels);
+// Returns 1 on success; the format follows the extension (output_format)
+int save_image(const char* filename, Image* img);
+
+// PNG, JPEG and BMP go through stb_image and stb_image_write. Inputs
+// are recognised by their contents (load_image tries Netpbm first),
+// outputs by the extension; anything else is written as Netpbm. The
+// decoders return 8-bit samples; gray+alpha comes out as RGBA. A .pbm
+// output is P4, one bit per pixel (black below 128), for edge masks;
+// PBM is not read.
+typedef enum { FORMAT_PNM, FORMAT_PNG, FORMAT_JPEG, FORMAT_BMP, FORMAT_PBM } ImageFormat;
+#define JPEG_QUALITY 90
+ImageFormat output_format(const char* path);
+// Size and channel count without decoding; returns 0 if unreadable
+int probe_image(const char* filename, PnmInfo* info, int* compressed);
+Image* load_image_stb(const char* filename);
+int save_image_stb(const char* filename, const Image* img, ImageFormat format);
+Image* load_image_mmap(const char* filename);
+// Mapped without readahead: only the pages the filters touch (or that
+// prefetch_region asks for) are read from disk
+Image* load_image_lazy(const char* filename);
+Image* create_image_mmap(const char* filename, int width, int height, int channels);
 void free_image(Image* img);
 Image* create_image(int width, int height, int channels);
+Image* create_planar_image(int width, int height, int channels);
+Image* image_to_planar(const Image* img, int thread_count);
+// Writes into dst when given (e.g. a mapped output file), else allocates
+Image* image_to_interleaved(const Image* img, Image* dst, int thread_count);
+
+// Sobel output: the magnitude sqrt(gx^2 + gy^2) or its integer
+// approximation |gx| + |gy|, clamped to 255. With a mask level the result
+// is 255 where that magnitude reaches the level and 0 elsewhere, which
+// needs no sqrt for either norm ("edgemask:T", or "edge,threshold:T"
+// fused at parse time).
+typedef enum { EDGE_L2, EDGE_L1 } EdgeNorm;
 
 void grayscale_filter(Image* input, Image* output, int thread_count);
 void gaussian_blur_filter(Image* input, Image* output, int thread_count);
-void sobel_edge_filter(Image* input, Image* output, int thread_count);
+void sobel_edge_filter(Image* input, Image* output, EdgeNorm norm, int level, int thread_count);
 void brightness_filter(Image* input, Image* output, int brightness, int thread_count);
+// Returns 0 (after an error message) if its buffers cannot be allocated
+int separable_gaussian_filter(Image* input, Image* output, float sigma, int thread_count);
+const char* select_kernels(const char* request);
+
+// Separable Gaussian: Q14 weights up to GAUSS_MAX_RADIUS taps each side,
+// three running-sum box passes above GAUSS_BOX_SIGMA
+#define GAUSS_SHIFT 14
+#define GAUSS_MAX_RADIUS 30
+#define GAUSS_BOX_SIGMA 10.0f
+
+typedef struct {
+    float sigma;
+    int radius;         /* rows/columns of context needed on each side */
+    int use_box;
+    int box_radius[3];
+    int weights[2 * GAUSS_MAX_RADIUS + 1];
+} GaussKernel;
+
+// Multi-stage pipeline ("grayscale,blur,edge")
+#define MAX_STAGES 16
+
+typedef enum {
+    FILTER_GRAYSCALE,
+    FILTER_BLUR,
+    FILTER_EDGE,
+    FILTER_BRIGHTEN,
+    FILTER_GAUSS,
+    FILTER_BOX,
+    FILTER_THRESH,
+    FILTER_EQUALIZE,
+    FILTER_AUTOLEVELS,
+    FILTER_STRETCH,
+    FILTER_CONTRAST,
+    FILTER_GAMMA,
+    FILTER_INVERT,
+    FILTER_THRESHOLD,
+    FILTER_LUT      /* internal: a tone stage once its table is known, or a
+                       run of per-channel point ops folded into one table */
+} FilterType;
+
+typedef struct {
+    FilterType type;
+    int param;      /* brightness offset for FILTER_BRIGHTEN, level for
+                       FILTER_THRESHOLD, window radius for FILTER_BOX and
+                       FILTER_THRESH, mask level for FILTER_EDGE (0 for the
+                       magnitude), unused otherwise */
+    EdgeNorm norm;  /* FILTER_EDGE only */
+    int offset;     /* FILTER_THRESH: pixels above local mean - offset turn white */
+    float sigma;    /* FILTER_GAUSS only */
+    float amount;   /* FILTER_CONTRAST gain, FILTER_GAMMA exponent */
+    float clip[2];  /* FILTER_STRETCH: low and high percentiles kept */
+    const unsigned char* lut;   /* FILTER_LUT: HIST_BINS entries per channel,
+                                   or NULL to use `table` for every channel */
+    unsigned char table[256];   /* FILTER_LUT from point ops */
+} FilterStage;
+
+// Per-channel point ops (brighten, contrast, gamma, invert, threshold)
+#define BRIGHTEN_DEFAULT 50
+#define CONTRAST_DEFAULT 1.5f
+#define GAMMA_DEFAULT 2.2f
+#define THRESHOLD_DEFAULT 128
+
+// Histograms: HIST_BINS counts per channel, hist[c * HIST_BINS + v]. The
+// tone stages (equalize, autolevels, stretch) need the histogram of their
+// whole input and then become a lookup table applied like any per-pixel
+// stage.
+#define HIST_BINS 256
+#define HIST_COPIES 4       /* private histograms per thread */
+#define MAX_CHANNELS 4
+#define STRETCH_DEFAULT_LOW 1.0f
+#define STRETCH_DEFAULT_HIGH 99.0f
+
+// Returns 0 when the private histograms cannot be allocated
+int histogram_build(const unsigned char* src, int width, int height, int channels,
+                    size_t pitch, unsigned long long* hist, int thread_count);
+// lut receives HIST_BINS entries per channel
+void tone_lut_build(const FilterStage* st, const unsigned long long* hist, int channels,
+                    unsigned char* lut);
+
+// Integral image (summed-area table): entry (x, y) of channel c holds the
+// sum of channel c over all pixels left of x and above y, so row 0 and
+// column 0 are zero. 32-bit entries wrap; any window of up to
+// 2^32 / 255 pixels still comes out exact, hence SAT_MAX_RADIUS.
+#define SAT_MAX_RADIUS 2047
+#define BOX_DEFAULT_RADIUS 5
+#define THRESH_DEFAULT_RADIUS 7
+#define THRESH_DEFAULT_OFFSET 5
+
+typedef struct {
+    unsigned int* sum;  /* (height + 1) rows of pitch entries */
+    int width;
+    int height;
+    int channels;
+    size_t pitch;       /* entries per row: (width + 1) * channels */
+} IntegralImage;
+
+// `points` (may be empty) are applied to each source row as it is read;
+// returns 0 if the table or its row buffers cannot be allocated
+int integral_image_build(IntegralImage* ii, const unsigned char* src, int width, int height,
+                         int channels, size_t src_pitch, const FilterStage* points,
+                         int point_count, int thread_count);
+void integral_image_free(IntegralImage* ii);
+// Both return 0 (after an error message) if the table cannot be allocated
+int box_blur_filter(Image* input, Image* output, int radius, int thread_count);
+int adaptive_threshold_filter(Image* input, Image* output, int radius, int offset,
+                              int thread_count);
+
+// --sched: static/dynamic/guided set the schedule(runtime) row and tile
+// loops; steal turns tiles (and batch images) into OpenMP tasks
+typedef enum {
+    SCHED_STATIC,
+    SCHED_DYNAMIC,
+    SCHED_GUIDED,
+    SCHED_STEAL
+} SchedMode;
+
+#define TASK_TILE_WIDTH 256     /* --sched steal tiles when --tile is not given */
+#define TASK_TILE_HEIGHT 64
+
+typedef struct {
+    int thread_count;
+    int tile_width;     /* tile_width/tile_height > 0 select the tiled engine */
+    int tile_height;
+    SchedMode sched;
+    int device;         /* --device gpu: the chain runs as OpenMP target regions */
+} PipelineOptions;
+
+typedef struct {
+    int y0, y1;     /* rows [y0, y1) */
+    int x0, x1;     /* columns [x0, x1) */
+} Region;
+
+int parse_sched(const char* name, SchedMode* mode);
+
+int parse_pipeline(const char* spec, FilterStage* stages, int max_stages);
+// equalize, autolevels or stretch: the chain needs whole images, not tiles
+int pipeline_has_tone_stage(const FilterStage* stages, int stage_count);
+// Gray results: a .pgm (or 1-bit .pbm) output gets one channel. Its value is channel 0
+// of the multi-channel result, which needs a grayscale or edge stage
+// (pipeline_gray_stage >= 0) unless the input is gray already. A chain
+// that starts with one runs on one channel from the start (gray_input).
+int pipeline_gray_stage(const FilterStage* stages, int stage_count);
+int output_is_pgm(const char* path);
+// luma: the grayscale weights, else channel 0. Writes into dst when
+// given, else allocates.
+Image* image_to_gray(const Image* img, int luma, Image* dst, int thread_count);
+// The input a .pgm output's chain runs on: one channel when the chain
+// starts with grayscale or edge (img is then freed), else img itself
+Image* gray_input(Image* img, const FilterStage* stages, int stage_count, int thread_count);
+// Returns the number of bytes read from and written to image memory
+size_t run_pipeline(Image* input, Image* output, const FilterStage* stages,
+                    int stage_count, const PipelineOptions* opts);
+// Region of interest "WxH+X+Y"; returns 1 on success
+int parse_roi(const char* spec, Region* roi);
+// The chain for roi only, tile by tile, reading roi plus the chain's
+// halo from src; dst is roi-sized. Returns bytes moved.
+size_t run_roi(const Image* src, Image* dst, const Region* roi, const FilterStage* stages,
+               int stage_count, const PipelineOptions* opts);
+// madvise(WILLNEED) the pages of region r of a mapped image
+void prefetch_region(const Image* img, const Region* r);
+// GPU offload: grayscale, brighten and the other folded point ops, blur
+// and edge; data stays on the device for the whole chain and moves in
+// DEVICE_CHUNK_ROWS-row chunks that overlap with the kernels
+#define DEVICE_CHUNK_ROWS 256
+int device_chain_supported(const FilterStage* stages, int stage_count);
+size_t run_device_pipeline(const Image* input, Image* output, const FilterStage* stages,
+                           int stage_count);
+// Filters the file band by band without loading it; returns 0 on success
+int run_streaming(const char* input_file, const char* output_file,
+                  const FilterStage* stages, int stage_count,
+                  const PipelineOptions* opts, int band_rows);
+
+// Batch mode: every image of a manifest or directory into out_dir;
+// returns 0 if all of them succeeded
+#define BATCH_SMALL_PIXELS (1 << 20)   /* below this an image is one thread's task */
+#define BATCH_CODEC_WINDOW 8            /* large compressed images decoded at once */
+#define BATCH_CODEC_BYTES (1LL << 30)   /* decoded pixels a window may hold */
+int run_batch(const char* source, const char* out_dir, const FilterStage* stages,
+              int stage_count, const PipelineOptions* opts, int use_mmap);
+
+// Sequence mode: the frames of a manifest or directory in order into
+// out_dir, recomputing only the tiles whose input (plus halo) changed
+// since the previous frame; returns 0 if all frames succeeded
+int run_sequence(const char* source, const char* out_dir, const FilterStage* stages,
+                 int stage_count, const PipelineOptions* opts, int use_mmap);
+
+// Server mode: jobs from stdin ("-") or a Unix socket until "quit"
+int run_server(const char* source, const PipelineOptions* opts, int use_mmap);
+
+// Bench mode: load or synthesize each image once, then time the chain
+// reps times after warmup runs for 1, 2, 4, ... opts->thread_count threads;
+// with --device gpu each size is also timed offloaded (transfers included)
+// and a host/device crossover table closes the run
+#define BENCH_SIZES "512x512,1024x1024,2048x2048,4096x4096"
+#define BENCH_WARMUP 3
+#define BENCH_REPS 10
+#define BENCH_MAX_SIZES 32
+int run_bench(const char* source, const FilterStage* stages, int stage_count,
+              const PipelineOptions* opts, int planar, int warmup, int reps);
+
+// Compare mode: per-sample difference of two images of the same size and
+// channel count, skipping a frame of `border` pixels; returns 0 if no
+// sample differs by more than tolerance
+int run_compare(const char* file_a, const char* file_b, int tolerance, int border);
+
+// Pixel buffers of all in-memory images; with the pool enabled (batch and
+// server mode) freed buffers are kept for reuse instead of returned.
+// Buffers are not zeroed; rows is the row count the filters split with
+// schedule(static), used for first-touch placement.
+#define POOL_BUCKETS 48             /* bucket b holds buffers of 2^b bytes */
+#define POOL_PER_BUCKET 8
+#define BUFFER_ALIGN 64
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+typedef enum {
+    ALLOC_CALLOC,   /* zeroed calloc, pages placed by whoever touches them first */
+    ALLOC_TOUCH,    /* 64-byte aligned, first-touched in parallel (default) */
+    ALLOC_HUGE      /* ALLOC_TOUCH on 2 MB aligned transparent huge pages */
+} AllocMode;
+int parse_alloc(const char* name, AllocMode* mode);
+void set_alloc_policy(AllocMode mode, int thread_count);
+unsigned char* pixel_buffer_alloc(size_t bytes, int rows);
+void pixel_buffer_release(unsigned char* data, size_t bytes);
+void pixel_pool_enable(int enable);
+
+// --metrics: phase timers, derived rates and a per-thread breakdown of
+// one in-memory run, written as a JSON object or a CSV row
+#define METRIC_EVENTS 3     /* cycles, instructions, cache misses */
+typedef enum { METRICS_JSON, METRICS_CSV } MetricsFormat;
+typedef enum { PHASE_LOAD, PHASE_ALLOC, PHASE_CONVERT, PHASE_COMPUTE, PHASE_SAVE,
+               PHASE_COUNT } Phase;
+typedef struct {
+    double cpu;                         /* CPU seconds in the compute phase */
+    long long events[METRIC_EVENTS];    /* -1: counter not available */
+    int fd[METRIC_EVENTS];
+} ThreadProbe;
+typedef struct {
+    MetricsFormat format;
+    const char* path;           /* NULL: stderr (stdout has the report) */
+    double phase[PHASE_COUNT];  /* seconds */
+    int thread_count;
+    ThreadProbe* threads;
+} Metrics;
+typedef struct {
+    const char* input;
+    const char* filter;
+    int width, height, channels;
+    const char* kernels;
+    const char* layout;
+    const char* io;
+    const char* sched;
+    const char* alloc;
+    size_t bytes_moved;
+} MetricsRun;
+int parse_metrics(const char* spec, Metrics* m);
+void metrics_init(Metrics* m, int thread_count);
+void metrics_free(Metrics* m);
+// Bracket the compute phase; both are parallel regions of thread_count
+void metrics_threads_begin(Metrics* m);
+void metrics_threads_end(Metrics* m);
+int metrics_write(const Metrics* m, const MetricsRun* run);
+
+// Per-stage log lines; off in batch and server mode
+static int log_stages = 1;
 
 void print_usage(const char* prog_name);
 
+static double wall_time(void) {
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 5) {
+    // --compare A B [--tolerance N] [--border B]: diff two result images
+    if (argc >= 4 && strcmp(argv[1], "--compare") == 0) {
+        int tolerance = 0, border = 0;
+        for (int a = 4; a < argc; a++) {
+            if (strcmp(argv[a], "--tolerance") == 0 && a + 1 < argc) {
+                tolerance = atoi(argv[++a]);
+            } else if (strcmp(argv[a], "--border") == 0 && a + 1 < argc) {
+                border = atoi(argv[++a]);
+            } else {
+                fprintf(stderr, "Error: Unknown compare option '%s'\n", argv[a]);
+                return 1;
+            }
+        }
+        if (tolerance < 0 || tolerance > 255 || border < 0) {
+            fprintf(stderr, "Error: --tolerance must be 0..255 and --border non-negative\n");
+            return 1;
+        }
+        return run_compare(argv[2], argv[3], tolerance, border);
+    }
+    // --serve SOURCE <num_threads>: each job names its own files and filters
+    const char* serve_source = (argc >= 3 && strcmp(argv[1], "--serve") == 0) ? argv[2] : NULL;
+    // --bench SOURCE <filter> <max_threads>: in-process timing sweep
+    const char* bench_source = (argc >= 3 && strcmp(argv[1], "--bench") == 0) ? argv[2] : NULL;
+    int first_option = serve_source ? 4 : 5;
+    if (argc < first_option) {
         print_usage(argv[0]);
         return 1;
     }
     
-    const char* input_file = argv[1];
-    const char* output_file = argv[2];
-    const char* filter_type = argv[3];
-    int thread_count = atoi(argv[4]);
+    const char* input_file = (serve_source || bench_source) ? NULL : argv[1];
+    const char* output_file = (serve_source || bench_source) ? NULL : argv[2];
+    const char* filter_type = serve_source ? NULL : argv[3];
+    int thread_count = atoi(argv[first_option - 1]);
     
     if (thread_count < 1) {
         fprintf(stderr, "Error: thread_count must be positive\n");
         return 1;
     }
     
+    PipelineOptions opts;
+    opts.thread_count = thread_count;
+    opts.tile_width = 0;
+    opts.tile_height = 0;
+    opts.device = 0;
+    const char* sched_name = NULL;     /* default: static, dynamic in batch mode */
+    const char* simd_request = "auto";
+    int planar = 0;
+    int use_mmap = 0;
+    int stream_rows = 0;
+    int batch = 0;
+    int sequence = 0;
+    Region roi;
+    int use_roi = 0;
+    const char* alloc_name = "touch";
+    AllocMode alloc_mode = ALLOC_TOUCH;
+    Metrics metrics;
+    int want_metrics = 0;
+    int bench_warmup = BENCH_WARMUP;
+    int bench_reps = BENCH_REPS;
+    
+    for (int a = first_option; a < argc; a++) {
+        if (strcmp(argv[a], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[a], "--sequence") == 0) {
+            sequence = 1;
+        } else if (strcmp(argv[a], "--sched") == 0 && a + 1 < argc) {
+            sched_name = argv[++a];
+            if (!parse_sched(sched_name, &opts.sched)) {
+                fprintf(stderr, "Error: Unknown schedule '%s'\n", sched_name);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--tile") == 0 && a + 1 < argc) {
+            const char* spec = argv[++a];
+            int n = sscanf(spec, "%dx%d", &opts.tile_width, &opts.tile_height);
+            if (n == 1) opts.tile_height = opts.tile_width;
+            if (n < 1 || opts.tile_width < 1 || opts.tile_height < 1) {
+                fprintf(stderr, "Error: Invalid tile size '%s'\n", spec);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--simd") == 0 && a + 1 < argc) {
+            simd_request = argv[++a];
+        } else if (strcmp(argv[a], "--layout") == 0 && a + 1 < argc) {
+            const char* layout = argv[++a];
+            if (strcmp(layout, "planar") == 0) {
+                planar = 1;
+            } else if (strcmp(layout, "interleaved") == 0) {
+                planar = 0;
+            } else {
+                fprintf(stderr, "Error: Unknown layout '%s'\n", layout);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--roi") == 0 && a + 1 < argc) {
+            if (!parse_roi(argv[++a], &roi)) {
+                fprintf(stderr, "Error: Invalid region '%s' (WxH+X+Y)\n", argv[a]);
+                return 1;
+            }
+            use_roi = 1;
+        } else if (strcmp(argv[a], "--stream") == 0 && a + 1 < argc) {
+            stream_rows = atoi(argv[++a]);
+            if (stream_rows < 1) {
+                fprintf(stderr, "Error: Invalid band height '%s'\n", argv[a]);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--io") == 0 && a + 1 < argc) {
+            const char* io = argv[++a];
+            if (strcmp(io, "mmap") == 0) {
+                use_mmap = 1;
+            } else if (strcmp(io, "stdio") == 0) {
+                use_mmap = 0;
+            } else {
+                fprintf(stderr, "Error: Unknown I/O mode '%s'\n", io);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--device") == 0 && a + 1 < argc) {
+            const char* device = argv[++a];
+            if (strcmp(device, "gpu") == 0) {
+                opts.device = 1;
+            } else if (strcmp(device, "host") == 0) {
+                opts.device = 0;
+            } else {
+                fprintf(stderr, "Error: Unknown device '%s'\n", device);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--alloc") == 0 && a + 1 < argc) {
+            alloc_name = argv[++a];
+            if (!parse_alloc(alloc_name, &alloc_mode)) {
+                fprintf(stderr, "Error: Unknown allocator '%s'\n", alloc_name);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--metrics") == 0 && a + 1 < argc) {
+            if (!parse_metrics(argv[++a], &metrics)) {
+                fprintf(stderr, "Error: Unknown metrics format '%s' (json or csv, "
+                        "optionally :FILE)\n", argv[a]);
+                return 1;
+            }
+            want_metrics = 1;
+        } else if (strcmp(argv[a], "--warmup") == 0 && a + 1 < argc && bench_source) {
+            bench_warmup = atoi(argv[++a]);
+            if (bench_warmup < 0) {
+                fprintf(stderr, "Error: Invalid warmup count '%s'\n", argv[a]);
+                return 1;
+            }
+        } else if (strcmp(argv[a], "--reps") == 0 && a + 1 < argc && bench_source) {
+            bench_reps = atoi(argv[++a]);
+            if (bench_reps < 1) {
+                fprintf(stderr, "Error: Invalid repetition count '%s'\n", argv[a]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[a]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (serve_source && (batch || planar || stream_rows > 0)) {
+        fprintf(stderr, "Error: --serve runs the interleaved in-memory pipeline per job\n");
+        return 1;
+    }
+    
+    if (bench_source && (batch || stream_rows > 0 || use_mmap || want_metrics)) {
+        fprintf(stderr, "Error: --bench times the in-memory pipeline; "
+                "not with --batch, --stream, --io mmap or --metrics\n");
+        return 1;
+    }
+    
+    // The output file is truncated before the input has been read
+    if (use_mmap && !serve_source && !bench_source && strcmp(input_file, output_file) == 0) {
+        fprintf(stderr, "Error: --io mmap needs distinct input and output files\n");
+        return 1;
+    }
+    
+    if (stream_rows > 0 && (planar || use_mmap)) {
+        fprintf(stderr, "Error: --stream reads and writes bands with stdio in the interleaved layout\n");
+        return 1;
+    }
+    
+    if (batch && (planar || stream_rows > 0)) {
+        fprintf(stderr, "Error: --batch runs the interleaved in-memory pipeline per image\n");
+        return 1;
+    }
+    
+    if (planar && opts.tile_width > 0) {
+        fprintf(stderr, "Error: --tile needs the interleaved layout\n");
+        return 1;
+    }
+    
+    if (use_roi && (serve_source || bench_source || batch || stream_rows > 0 || planar)) {
+        fprintf(stderr, "Error: --roi runs one interleaved image tile by tile; "
+                "not with --serve, --bench, --batch, --stream or --layout planar\n");
+        return 1;
+    }
+    
+    if (opts.device && (serve_source || batch || stream_rows > 0 || planar ||
+                        opts.tile_width > 0 || use_roi)) {
+        fprintf(stderr, "Error: --device gpu runs one whole interleaved image; not with --serve, "
+                "--batch, --stream, --layout planar, --tile or --roi\n");
+        return 1;
+    }
+    
+    if (sequence && (serve_source || bench_source || batch || stream_rows > 0 || planar ||
+                     use_roi || opts.device || want_metrics)) {
+        fprintf(stderr, "Error: --sequence runs its frames tile by tile in the interleaved layout; "
+                "not with --serve, --bench, --batch, --stream, --layout planar, --roi, "
+                "--device or --metrics\n");
+        return 1;
+    }
+    
+    if (want_metrics && (serve_source || batch || stream_rows > 0)) {
+        fprintf(stderr, "Error: --metrics times the phases of one in-memory image; "
+                "not with --serve, --batch or --stream\n");
+        return 1;
+    }
+    
+    if (!sched_name) {
+        sched_name = batch ? "dynamic" : "static";
+        parse_sched(sched_name, &opts.sched);
+    }
+    if (opts.sched == SCHED_STEAL && planar) {
+        fprintf(stderr, "Error: --sched steal runs tiles of the interleaved layout\n");
+        return 1;
+    }
+    
+    const char* kernel_name = select_kernels(simd_request);
+    if (!kernel_name) {
+        fprintf(stderr, "Error: SIMD kernels '%s' not available on this CPU\n", simd_request);
+        return 1;
+    }
+    
+    set_alloc_policy(alloc_mode, thread_count);
+    
+    if (serve_source) {
+        return run_server(serve_source, &opts, use_mmap);
+    }
+    
+    FilterStage stages[MAX_STAGES];
+    int stage_count = parse_pipeline(filter_type, stages, MAX_STAGES);
+    if (stage_count <= 0) {
+        fprintf(stderr, "Available filters: grayscale, blur, edge[:l1], edgemask:T[:l1], brighten:N,\n");
+        fprintf(stderr, "                   contrast:F, gamma:G, invert, threshold:T, gauss:SIGMA,\n");
+        fprintf(stderr, "                   box:R, thresh:R[:C], equalize, autolevels, stretch:LOW:HIGH\n");
+        fprintf(stderr, "Chain filters with commas, e.g. grayscale,blur,edge\n");
+        return 1;
+    }
+    
+    if (pipeline_has_tone_stage(stages, stage_count) &&
+        (opts.tile_width > 0 || stream_rows > 0 || opts.sched == SCHED_STEAL || use_roi ||
+         sequence)) {
+        fprintf(stderr, "Error: equalize, autolevels and stretch need the whole image; "
+                "they cannot run with --tile, --stream, --sched steal, --roi or --sequence\n");
+        return 1;
+    }
+    
+    if (opts.device && !device_chain_supported(stages, stage_count)) {
+        fprintf(stderr, "Error: --device gpu runs grayscale, blur, edge and the point ops "
+                "brighten, contrast, gamma, invert and threshold only\n");
+        return 1;
+    }
+    
+    if (bench_source) {
+        printf("\n========================================\n");
+        printf("Image Processing with OpenMP: benchmark\n");
+        printf("========================================\n");
+        printf("Source: %s\n", bench_source);
+        printf("Filter: %s\n", filter_type);
+        printf("Threads: 1..%d\n", thread_count);
+        printf("Kernels: %s\n", kernel_name);
+        printf("Layout: %s\n", planar ? "planar" : "interleaved");
+        printf("Sched:  %s\n", sched_name);
+        printf("Alloc:  %s\n", alloc_name);
+        if (opts.device) printf("Device: gpu\n");
+        if (opts.tile_width > 0) {
+            printf("Tile:   %dx%d\n", opts.tile_width, opts.tile_height);
+        }
+        printf("Runs:   %d warmup + %d timed per thread count\n", bench_warmup, bench_reps);
+        printf("========================================\n\n");
+        return run_bench(bench_source, stages, stage_count, &opts, planar,
+                         bench_warmup, bench_reps);
+    }
+    
     printf("\n========================================\n");
     printf("Image Processing with OpenMP\n");
     printf("========================================\n");
-    printf("Input:  %s\n", input_file);
+    printf("Input:  %s%s\n", input_file, batch ? " (batch)" : sequence ? " (sequence)" : "");
     printf("Output: %s\n", output_file);
     printf("Filter: %s\n", filter_type);
     printf("Threads: %d\n", thread_count);
+    printf("Kernels: %s\n", kernel_name);
+    printf("Layout: %s\n", planar ? "planar" : "interleaved");
+    const char* io_name = use_roi ? "mmap (lazy)" : use_mmap ? "mmap" : "stdio";
+    printf("I/O:    %s\n", io_name);
+    printf("Sched:  %s\n", sched_name);
+    printf("Alloc:  %s\n", alloc_name);
+    if (opts.device) printf("Device: gpu\n");
+    if (opts.tile_width > 0) {
+        printf("Tile:   %dx%d\n", opts.tile_width, opts.tile_height);
+    }
+    if (stream_rows > 0) {
+        printf("Stream: %d-row bands\n", stream_rows);
+    }
+    if (use_roi) {
+        printf("ROI:    %dx%d at (%d, %d)\n", roi.x1 - roi.x0, roi.y1 - roi.y0, roi.x0, roi.y0);
+    }
     printf("========================================\n\n");
     
+    if (batch) {
+        int status = run_batch(input_file, output_file, stages, stage_count, &opts, use_mmap);
+        if (status == 0) printf("Done!\n\n");
+        return status;
+    }
+    
+    if (sequence) {
+        int status = run_sequence(input_file, output_file, stages, stage_count, &opts, use_mmap);
+        if (status == 0) printf("Done!\n\n");
+        return status;
+    }
+    
+    if (stream_rows > 0) {
+        int status = run_streaming(input_file, output_file, stages, stage_count,
+                                   &opts, stream_rows);
+        if (status == 0) printf("Done!\n\n");
+        return status;
+    }
+    
     // Load image
     printf("Loading image...\n");
-    Image* input = load_image(input_file);
+    double io_start = wall_time();
+    Image* input = use_roi ? load_image_lazy(input_file)
+                 : use_mmap ? load_image_mmap(input_file) : load_image(input_file);
+    double load_time = wall_time() - io_start;
     if (!input) {
         fprintf(stderr, "Error: Could not load image %s\n", input_file);
         return 1;
@@ -64,241 +716,4794 @@ int main(int argc, char* argv[]) {
     printf("Image loaded: %dx%d, %d channels\n", 
            input->width, input->height, input->channels);
     
-    // Create output image
-    Image* output = create_image(input->width, input->height, input->channels);
+    if (use_roi && (roi.x1 > input->width || roi.y1 > input->height)) {
+        fprintf(stderr, "Error: --roi %dx%d+%d+%d lies outside the %dx%d image\n",
+                roi.x1 - roi.x0, roi.y1 - roi.y0, roi.x0, roi.y0, input->width, input->height);
+        free_image(input);
+        return 1;
+    }
+    int out_width = use_roi ? roi.x1 - roi.x0 : input->width;
+    int out_height = use_roi ? roi.y1 - roi.y0 : input->height;
     
-    // Apply filter and measure time
-    double start_time = 0.0;
-    double end_time = 0.0;
+    // A .pgm output keeps one channel, from the start if the chain allows
+    // (a ROI is collapsed afterwards rather than convert the whole input)
+    double convert_time = 0.0;
+    int out_channels = output_is_pgm(output_file) ? 1 : input->channels;
+    if (out_channels < input->channels && pipeline_gray_stage(stages, stage_count) < 0) {
+        fprintf(stderr, "Error: %s stores one channel but %s keeps %d distinct channels; "
+                "add grayscale or edge\n", output_file, filter_type, input->channels);
+        free_image(input);
+        return 1;
+    }
+    if (out_channels < input->channels && !use_roi) {
+        double convert_start = wall_time();
+        input = gray_input(input, stages, stage_count, thread_count);
+        convert_time = wall_time() - convert_start;
+        if (!input) {
+            fprintf(stderr, "Error: Could not allocate gray image\n");
+            return 1;
+        }
+        if (input->channels == 1) printf("Reduced to 1 channel for %s\n", output_file);
+    }
     
-#ifdef _OPENMP
-    start_time = omp_get_wtime();
-#endif
+    // Convert once; filters then run on padded single-channel planes
+    if (planar) {
+        double convert_start = wall_time();
+        Image* planes = image_to_planar(input, thread_count);
+        convert_time += wall_time() - convert_start;
+        free_image(input);
+        input = planes;
+        if (!input) {
+            fprintf(stderr, "Error: Could not allocate planar image\n");
+            return 1;
+        }
+        printf("Converted to planar layout (pitch %zu bytes)\n", input->pitch);
+    }
     
-    if (strcmp(filter_type, "grayscale") == 0) {
-        grayscale_filter(input, output, thread_count);
-    } else if (strcmp(filter_type, "blur") == 0) {
-        gaussian_blur_filter(input, output, thread_count);
-    } else if (strcmp(filter_type, "edge") == 0) {
-        sobel_edge_filter(input, output, thread_count);
-    } else if (strcmp(filter_type, "brighten") == 0) {
-        brightness_filter(input, output, 50, thread_count);
-    } else {
-        fprintf(stderr, "Error: Unknown filter '%s'\n", filter_type);
-        fprintf(stderr, "Available filters: grayscale, blur, edge, brighten\n");
+    // Create output image; with mmap the interleaved result lives in the
+    // output file itself unless it still has to be encoded
+    io_start = wall_time();
+    Image* result = NULL;
+    if (use_mmap && output_format(output_file) == FORMAT_PNM) {
+        result = create_image_mmap(output_file, out_width, out_height, out_channels);
+        if (!result) {
+            fprintf(stderr, "Error: Could not map output file %s\n", output_file);
+            free_image(input);
+            return 1;
+        }
+    }
+    double create_time = wall_time() - io_start;
+    
+    double alloc_start = wall_time();
+    // A gray result of a multi-channel chain is collapsed after the run
+    Image* direct = (result && result->channels == input->channels) ? result : NULL;
+    Image* output = planar
+        ? create_planar_image(input->width, input->height, input->channels)
+        : (direct ? direct : create_image(out_width, out_height, input->channels));
+    if (!output) {
+        fprintf(stderr, "Error: Could not allocate output image\n");
         free_image(input);
-        free_image(output);
         return 1;
     }
+    double alloc_time = wall_time() - alloc_start;
+    if (!direct) {
+        printf("Output allocated in %.6f seconds (%s)\n", alloc_time, alloc_name);
+    }
     
-#ifdef _OPENMP
-    end_time = omp_get_wtime();
+    // Apply filter and measure time
+    if (want_metrics) {
+        metrics_init(&metrics, thread_count);
+        metrics_threads_begin(&metrics);
+    }
+    
+    double start_time = wall_time();
+    size_t bytes_moved = use_roi
+        ? run_roi(input, output, &roi, stages, stage_count, &opts)
+        : run_pipeline(input, output, stages, stage_count, &opts);
+    double end_time = wall_time();
+    
+    if (want_metrics) metrics_threads_end(&metrics);
+    if (bytes_moved == 0) {
+        // The engine has reported what it could not allocate
+        if (want_metrics) metrics_free(&metrics);
+        if (output != result) free_image(output);
+        free_image(result);
+        free_image(input);
+        return 1;
+    }
     double elapsed = end_time - start_time;
     printf("\nProcessing time: %.6f seconds\n", elapsed);
-#endif
+    if (elapsed > 0) {
+        printf("Memory traffic: %.1f MB, %.2f GB/s\n",
+               bytes_moved / 1e6, bytes_moved / elapsed / 1e9);
+    }
+    
+    int width = output->width, height = output->height, channels = output->channels;
+    if (output->planar) {
+        double convert_start = wall_time();
+        Image* interleaved = image_to_interleaved(output, direct, thread_count);
+        free_image(output);
+        output = interleaved;
+        convert_time += wall_time() - convert_start;
+        if (!output) {
+            fprintf(stderr, "Error: Could not allocate interleaved image\n");
+            if (want_metrics) metrics_free(&metrics);
+            free_image(result);
+            free_image(input);
+            return 1;
+        }
+    }
+    if (output->channels > out_channels) {
+        double convert_start = wall_time();
+        Image* gray = image_to_gray(output, 0, result, thread_count);
+        free_image(output);
+        output = gray;
+        convert_time += wall_time() - convert_start;
+        if (!output) {
+            fprintf(stderr, "Error: Could not allocate gray image\n");
+            if (want_metrics) metrics_free(&metrics);
+            free_image(input);
+            return 1;
+        }
+    }
     
-    // Save output
+    // Save output (a mapped output is already in the file)
     printf("Saving output image...\n");
-    save_image(output_file, output);
+    io_start = wall_time();
+    int saved = output->map || save_image(output_file, output);
+    free_image(output);
+    free_image(input);
+    double save_time = wall_time() - io_start;
+    if (!saved) {
+        fprintf(stderr, "Error: Could not write %s\n", output_file);
+        return 1;
+    }
+    
+    printf("I/O time: %.6f seconds (load %.6f, save %.6f, %s)\n",
+           load_time + create_time + save_time, load_time, create_time + save_time, io_name);
     printf("Done!\n\n");
     
-    free_image(input);
-    free_image(output);
+    int status = 0;
+    if (want_metrics) {
+        metrics.phase[PHASE_LOAD] = load_time;
+        metrics.phase[PHASE_ALLOC] = create_time + alloc_time;
+        metrics.phase[PHASE_CONVERT] = convert_time;
+        metrics.phase[PHASE_COMPUTE] = elapsed;
+        metrics.phase[PHASE_SAVE] = save_time;
+        MetricsRun run = {
+            .input = input_file, .filter = filter_type,
+            .width = width, .height = height, .channels = channels,
+            .kernels = kernel_name, .layout = planar ? "planar" : "interleaved",
+            .io = io_name, .sched = sched_name, .alloc = alloc_name,
+            .bytes_moved = bytes_moved
+        };
+        status = metrics_write(&metrics, &run) ? 0 : 1;
+        metrics_free(&metrics);
+    }
     
-    return 0;
+    return status;
 }
 
 // ============================================
 // FILTER IMPLEMENTATIONS
 // ============================================
 
-void grayscale_filter(Image* input, Image* output, int thread_count) {
-    int width = input->width;
-    int height = input->height;
-    int channels = input->channels;
-    
-    printf("Applying grayscale filter...\n");
-    
-#pragma omp parallel for num_threads(thread_count) schedule(static)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            int idx = (i * width + j) * channels;
-            
-            unsigned char r = input->data[idx];
-            unsigned char g = (channels > 1) ? input->data[idx + 1] : r;
-            unsigned char b = (channels > 2) ? input->data[idx + 2] : r;
-            
-            // Weighted average for human perception
-            unsigned char gray = (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
-            
-            output->data[idx] = gray;
-            if (channels > 1) output->data[idx + 1] = gray;
-            if (channels > 2) output->data[idx + 2] = gray;
-            if (channels > 3) output->data[idx + 3] = input->data[idx + 3]; // Alpha
-        }
+// Scalar row kernels shared by the single-filter entry points and the
+// fused pipeline. The SIMD variants below fall back to these for tails.
+//
+// Each kernel body is written once as a *_channels function that is
+// always inlined; the entry point switches on the channel count once per
+// call (CHANNEL_CASES), so the 1-, 3- and 4-channel copies see a constant
+// pixel stride, lose their per-pixel channel branches and vectorize.
+// Other counts keep the runtime stride. The 3x3 taps are spelled out
+// instead of walked from a kernel table.
+#define SPECIALIZED static inline __attribute__((always_inline))
+#define CHANNEL_CASES(call) \
+    switch (channels) { \
+        case 1: call(1); break; \
+        case 3: call(3); break; \
+        case 4: call(4); break; \
+        default: call(channels); break; \
+    }
+
+// Grayscale weights in Q15 (0.299, 0.587, 0.114); they sum to exactly
+// 1 << 15 so gray inputs map to themselves
+#define GRAY_WR 9798
+#define GRAY_WG 19235
+#define GRAY_WB 3735
+#define GRAY_SHIFT 15
+
+SPECIALIZED void grayscale_row_channels(const unsigned char* in, unsigned char* out,
+                                        int width, int channels) {
+    for (int j = 0; j < width; j++) {
+        int idx = j * channels;
+        
+        unsigned char r = in[idx];
+        unsigned char g = (channels > 1) ? in[idx + 1] : r;
+        unsigned char b = (channels > 2) ? in[idx + 2] : r;
+        
+        // Weighted average for human perception
+        unsigned char gray = (unsigned char)((GRAY_WR * r + GRAY_WG * g + GRAY_WB * b) >> GRAY_SHIFT);
+        
+        out[idx] = gray;
+        if (channels > 1) out[idx + 1] = gray;
+        if (channels > 2) out[idx + 2] = gray;
+        if (channels > 3) out[idx + 3] = in[idx + 3]; // Alpha
     }
 }
 
-void gaussian_blur_filter(Image* input, Image* output, int thread_count) {
-    int width = input->width;
-    int height = input->height;
-    int channels = input->channels;
-    
-    // 3x3 Gaussian kernel
-    float kernel[3][3] = {
-        {1.0/16, 2.0/16, 1.0/16},
-        {2.0/16, 4.0/16, 2.0/16},
-        {1.0/16, 2.0/16, 1.0/16}
-    };
-    
-    printf("Applying Gaussian blur filter...\n");
-    
-#pragma omp parallel for num_threads(thread_count) schedule(static)
-    for (int i = 1; i < height - 1; i++) {
-        for (int j = 1; j < width - 1; j++) {
-            for (int c = 0; c < channels; c++) {
-                float sum = 0.0;
-                
-                // Apply 3x3 kernel
-                for (int di = -1; di <= 1; di++) {
-                    for (int dj = -1; dj <= 1; dj++) {
-                        int idx = ((i + di) * width + (j + dj)) * channels + c;
-                        sum += input->data[idx] * kernel[di + 1][dj + 1];
-                    }
-                }
-                
-                int out_idx = (i * width + j) * channels + c;
-                output->data[out_idx] = (unsigned char)sum;
-            }
-        }
+static void grayscale_row_scalar(const unsigned char* in, unsigned char* out,
+                                 int width, int channels) {
+#define GRAYSCALE_ROW(ch) grayscale_row_channels(in, out, width, ch)
+    CHANNEL_CASES(GRAYSCALE_ROW)
+#undef GRAYSCALE_ROW
+}
+
+// Grayscale from separate R, G, B plane rows into one output plane row
+static void grayscale_planar_row_scalar(const unsigned char* r, const unsigned char* g,
+                                        const unsigned char* b, unsigned char* out,
+                                        int width) {
+    for (int j = 0; j < width; j++) {
+        out[j] = (unsigned char)((GRAY_WR * r[j] + GRAY_WG * g[j] + GRAY_WB * b[j]) >> GRAY_SHIFT);
     }
-    
-    // Copy borders
-    for (int i = 0; i < height; i++) {
-        if (i == 0 || i == height - 1) {
-            for (int j = 0; j < width; j++) {
-                int idx = (i * width + j) * channels;
-                for (int c = 0; c < channels; c++) {
-                    output->data[idx + c] = input->data[idx + c];
-                }
-            }
-        } else {
-            int idx_left = (i * width) * channels;
-            int idx_right = (i * width + width - 1) * channels;
-            for (int c = 0; c < channels; c++) {
-                output->data[idx_left + c] = input->data[idx_left + c];
-                output->data[idx_right + c] = input->data[idx_right + c];
-            }
-        }
+}
+
+static void brightness_row_scalar(const unsigned char* in, unsigned char* out,
+                                  int width, int channels, int brightness) {
+    int row_size = width * channels;
+    for (int k = 0; k < row_size; k++) {
+        int new_val = in[k] + brightness;
+        if (new_val > 255) new_val = 255;
+        if (new_val < 0) new_val = 0;
+        out[k] = (unsigned char)new_val;
     }
 }
 
-void sobel_edge_filter(Image* input, Image* output, int thread_count) {
-    int width = input->width;
-    int height = input->height;
-    int channels = input->channels;
-    
-    // Sobel kernels
-    int Gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
-    int Gy[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
-    
-    printf("Applying Sobel edge detection filter...\n");
-    
-#pragma omp parallel for num_threads(thread_count) schedule(static)
-    for (int i = 1; i < height - 1; i++) {
-        for (int j = 1; j < width - 1; j++) {
-            float sum_x = 0, sum_y = 0;
-            
-            // Calculate gradient for first channel (or grayscale)
-            for (int di = -1; di <= 1; di++) {
-                for (int dj = -1; dj <= 1; dj++) {
-                    int idx = ((i + di) * width + (j + dj)) * channels;
-                    unsigned char pixel = input->data[idx];
-                    
-                    sum_x += pixel * Gx[di + 1][dj + 1];
-                    sum_y += pixel * Gy[di + 1][dj + 1];
-                }
-            }
-            
+// One 256-entry table applied to `count` bytes
+static void lut_span_scalar(const unsigned char* in, unsigned char* out, int count,
+                            const unsigned char* table) {
+    for (int k = 0; k < count; k++) out[k] = table[in[k]];
+}
+
+// 3x3 Gaussian over `count` pixels starting at mid[0]. The pixel to the
+// left of the span and the one to the right must be readable. The
+// [1 2 1] x [1 2 1] / 16 weights are exact in integers; every byte's
+// neighbours are +-channels bytes away, so channels need no inner loop.
+SPECIALIZED void blur_span_channels(const unsigned char* up, const unsigned char* mid,
+                                    const unsigned char* down, unsigned char* out,
+                                    int count, int channels) {
+    for (int k = 0; k < count * channels; k++) {
+        int sum = up[k - channels] + 2 * up[k] + up[k + channels]
+                + 2 * (mid[k - channels] + 2 * mid[k] + mid[k + channels])
+                + down[k - channels] + 2 * down[k] + down[k + channels];
+        out[k] = (unsigned char)(sum >> 4);
+    }
+}
+
+static void blur_span_scalar(const unsigned char* up, const unsigned char* mid,
+                             const unsigned char* down, unsigned char* out,
+                             int count, int channels) {
+#define BLUR_SPAN(ch) blur_span_channels(up, mid, down, out, count, ch)
+    CHANNEL_CASES(BLUR_SPAN)
+#undef BLUR_SPAN
+}
+
+// Sobel of channel 0 over `count` pixels, written to every channel. Same
+// neighbour requirements as blur_span. Gradients are integers; only the
+// exact magnitude takes a sqrt, a mask compares gx^2 + gy^2 with level^2.
+SPECIALIZED void sobel_span_channels(const unsigned char* up, const unsigned char* mid,
+                                     const unsigned char* down, unsigned char* out,
+                                     int count, int channels, int norm, int level) {
+    int level_sq = level * level;
+    for (int j = 0; j < count; j++) {
+        const unsigned char* u = up + j * channels;
+        const unsigned char* m = mid + j * channels;
+        const unsigned char* d = down + j * channels;
+        
+        // Gradient of the first channel (or grayscale)
+        int gx = (u[channels] - u[-channels]) + 2 * (m[channels] - m[-channels])
+               + (d[channels] - d[-channels]);
+        int gy = (d[-channels] + 2 * d[0] + d[channels])
+               - (u[-channels] + 2 * u[0] + u[channels]);
+        
+        unsigned char edge_value;
+        if (norm == EDGE_L1) {
+            int magnitude = abs(gx) + abs(gy);
+            edge_value = level ? (magnitude >= level ? 255 : 0)
+                               : (unsigned char)(magnitude > 255 ? 255 : magnitude);
+        } else if (level) {
+            edge_value = (gx * gx + gy * gy >= level_sq) ? 255 : 0;
+        } else {
             // Magnitude
-            float magnitude = sqrt(sum_x * sum_x + sum_y * sum_y);
+            float magnitude = sqrt((float)(gx * gx + gy * gy));
             if (magnitude > 255) magnitude = 255;
-            
-            int out_idx = (i * width + j) * channels;
-            unsigned char edge_value = (unsigned char)magnitude;
-            
-            for (int c = 0; c < channels; c++) {
-                output->data[out_idx + c] = edge_value;
-            }
+            edge_value = (unsigned char)magnitude;
+        }
+        for (int c = 0; c < channels; c++) {
+            out[j * channels + c] = edge_value;
         }
     }
 }
 
-void brightness_filter(Image* input, Image* output, int brightness, int thread_count) {
-    int width = input->width;
-    int height = input->height;
-    int channels = input->channels;
-    
-    printf("Applying brightness adjustment (+%d)...\n", brightness);
-    
-#pragma omp parallel for num_threads(thread_count) schedule(static)
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            int idx = (i * width + j) * channels;
-            
-            for (int c = 0; c < channels; c++) {
-                int new_val = input->data[idx + c] + brightness;
-                if (new_val > 255) new_val = 255;
-                if (new_val < 0) new_val = 0;
-                output->data[idx + c] = (unsigned char)new_val;
-            }
-        }
-    }
+static void sobel_span_scalar(const unsigned char* up, const unsigned char* mid,
+                              const unsigned char* down, unsigned char* out,
+                              int count, int channels, int norm, int level) {
+#define SOBEL_SPAN(ch) sobel_span_channels(up, mid, down, out, count, ch, norm, level)
+    CHANNEL_CASES(SOBEL_SPAN)
+#undef SOBEL_SPAN
 }
 
 // ============================================
-// IMAGE I/O (PPM Format - No external libs needed)
+// SIMD KERNELS (runtime dispatch)
 // ============================================
+//
+// Vector versions of the row kernels, picked once at startup by
+// select_kernels() (or --simd). All variants produce the same bytes as
+// the scalar code:
+//   brighten  - saturating u8 add/sub
+//   lut       - 256-entry table as 16 pshufb/tbl rows of 16 (see lut_span_sse4)
+//   grayscale - RGB deinterleave + Q15 dot product in 32-bit lanes
+//   blur      - 3x3 [1 2 1] weights accumulated in 16 bits, >> 4
+//               (the float kernel only has exact multiples of 1/16)
+//   edge      - 16-bit gradients, gx^2 + gy^2 in 32 bits, sqrt in float;
+//               |gx| + |gy| in 16 bits and masks by compare, without sqrt
+// Blur works on interleaved bytes directly (neighbours are +-channels
+// bytes away). Grayscale and edge vectorize for 3-channel images and
+// fall back to scalar otherwise.
 
-Image* load_image(const char* filename) {
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) return NULL;
+typedef struct {
+    const char* name;
+    void (*grayscale)(const unsigned char* in, unsigned char* out,
+                      int width, int channels);
+    void (*grayscale_planar)(const unsigned char* r, const unsigned char* g,
+                             const unsigned char* b, unsigned char* out, int width);
+    void (*brightness)(const unsigned char* in, unsigned char* out,
+                       int width, int channels, int brightness);
+    void (*lut)(const unsigned char* in, unsigned char* out, int count,
+                const unsigned char* table);
+    void (*blur)(const unsigned char* up, const unsigned char* mid,
+                 const unsigned char* down, unsigned char* out,
+                 int count, int channels);
+    void (*sobel)(const unsigned char* up, const unsigned char* mid,
+                  const unsigned char* down, unsigned char* out,
+                  int count, int channels, int norm, int level);
+} KernelSet;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// Channel c of 16 RGB pixels (48 bytes at p)
+__attribute__((target("sse4.1")))
+static inline __m128i rgb_channel_sse(const unsigned char* p, int c) {
+    static const signed char masks[3][3][16] = {
+        {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+        {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+        {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}}
+    };
+    __m128i a0 = _mm_loadu_si128((const __m128i*)p);
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i a2 = _mm_loadu_si128((const __m128i*)(p + 32));
+    __m128i r = _mm_shuffle_epi8(a0, _mm_loadu_si128((const __m128i*)masks[c][0]));
+    r = _mm_or_si128(r, _mm_shuffle_epi8(a1, _mm_loadu_si128((const __m128i*)masks[c][1])));
+    return _mm_or_si128(r, _mm_shuffle_epi8(a2, _mm_loadu_si128((const __m128i*)masks[c][2])));
+}
+
+// Write each of 16 bytes three times (48 bytes at p)
+__attribute__((target("sse4.1")))
+static inline void store_rgb_splat_sse(unsigned char* p, __m128i v) {
+    static const signed char masks[3][16] = {
+        {0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5},
+        {5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10},
+        {10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15}
+    };
+    _mm_storeu_si128((__m128i*)p, _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)masks[0])));
+    _mm_storeu_si128((__m128i*)(p + 16), _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)masks[1])));
+    _mm_storeu_si128((__m128i*)(p + 32), _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)masks[2])));
+}
+
+// Channel 0 of 16 pixels: deinterleaved for RGB, a plain load for planes
+__attribute__((target("sse4.1")))
+static inline __m128i load_channel0_sse(const unsigned char* p, int channels) {
+    return (channels == 3) ? rgb_channel_sse(p, 0) : _mm_loadu_si128((const __m128i*)p);
+}
+
+// Q15 luma of 16 pixels given as separate r, g, b byte vectors
+__attribute__((target("sse4.1")))
+static inline __m128i gray_q15_sse(__m128i r, __m128i g, __m128i b) {
+    const __m128i w_rg = _mm_set1_epi32((GRAY_WG << 16) | GRAY_WR);
+    const __m128i w_b = _mm_set1_epi32(GRAY_WB);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i gray16[2];
+    
+    for (int h = 0; h < 2; h++) {
+        __m128i r16 = h ? _mm_unpackhi_epi8(r, zero) : _mm_unpacklo_epi8(r, zero);
+        __m128i g16 = h ? _mm_unpackhi_epi8(g, zero) : _mm_unpacklo_epi8(g, zero);
+        __m128i b16 = h ? _mm_unpackhi_epi8(b, zero) : _mm_unpacklo_epi8(b, zero);
+        __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r16, g16), w_rg),
+                                   _mm_madd_epi16(_mm_unpacklo_epi16(b16, zero), w_b));
+        __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r16, g16), w_rg),
+                                   _mm_madd_epi16(_mm_unpackhi_epi16(b16, zero), w_b));
+        gray16[h] = _mm_packs_epi32(_mm_srli_epi32(lo, GRAY_SHIFT),
+                                    _mm_srli_epi32(hi, GRAY_SHIFT));
+    }
+    
+    return _mm_packus_epi16(gray16[0], gray16[1]);
+}
+
+__attribute__((target("sse4.1")))
+static void grayscale_row_sse4(const unsigned char* in, unsigned char* out,
+                               int width, int channels) {
+    if (channels != 3) {
+        grayscale_row_scalar(in, out, width, channels);
+        return;
+    }
+    
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        const unsigned char* p = in + j * 3;
+        __m128i gray = gray_q15_sse(rgb_channel_sse(p, 0), rgb_channel_sse(p, 1),
+                                    rgb_channel_sse(p, 2));
+        store_rgb_splat_sse(out + j * 3, gray);
+    }
+    
+    if (j < width) grayscale_row_scalar(in + j * 3, out + j * 3, width - j, 3);
+}
+
+__attribute__((target("sse4.1")))
+static void grayscale_planar_row_sse4(const unsigned char* r, const unsigned char* g,
+                                      const unsigned char* b, unsigned char* out,
+                                      int width) {
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        __m128i gray = gray_q15_sse(_mm_loadu_si128((const __m128i*)(r + j)),
+                                    _mm_loadu_si128((const __m128i*)(g + j)),
+                                    _mm_loadu_si128((const __m128i*)(b + j)));
+        _mm_storeu_si128((__m128i*)(out + j), gray);
+    }
+    
+    if (j < width) grayscale_planar_row_scalar(r + j, g + j, b + j, out + j, width - j);
+}
+
+__attribute__((target("sse4.1")))
+static void brightness_row_sse4(const unsigned char* in, unsigned char* out,
+                                int width, int channels, int brightness) {
+    int n = width * channels;
+    int amount = brightness < 0 ? -brightness : brightness;
+    const __m128i delta = _mm_set1_epi8((char)(amount > 255 ? 255 : amount));
+    int k = 0;
+    
+    for (; k + 16 <= n; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + k));
+        v = (brightness >= 0) ? _mm_adds_epu8(v, delta) : _mm_subs_epu8(v, delta);
+        _mm_storeu_si128((__m128i*)(out + k), v);
+    }
+    
+    if (k < n) brightness_row_scalar(in + k, out + k, n - k, 1, brightness);
+}
+
+// pshufb looks up 16 entries, so the table is 16 rows of 16. For row r,
+// (v - 16r) saturating-plus 0x70 keeps bit 7 clear only when v is in that
+// row, and pshufb returns 0 for lanes with bit 7 set; OR-ing the 16 row
+// lookups leaves exactly table[v] in every lane.
+__attribute__((target("sse4.1")))
+static void lut_span_sse4(const unsigned char* in, unsigned char* out, int count,
+                          const unsigned char* table) {
+    __m128i rows[16];
+    for (int r = 0; r < 16; r++) rows[r] = _mm_loadu_si128((const __m128i*)(table + 16 * r));
+    const __m128i step = _mm_set1_epi8(16);
+    const __m128i bias = _mm_set1_epi8(0x70);
+    int k = 0;
+    
+    for (; k + 16 <= count; k += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + k));
+        __m128i acc = _mm_setzero_si128();
+        for (int r = 0; r < 16; r++) {
+            __m128i idx = _mm_adds_epu8(v, bias);
+            acc = _mm_or_si128(acc, _mm_shuffle_epi8(rows[r], idx));
+            v = _mm_sub_epi8(v, step);
+        }
+        _mm_storeu_si128((__m128i*)(out + k), acc);
+    }
+    
+    if (k < count) lut_span_scalar(in + k, out + k, count - k, table);
+}
+
+// Vertical [1 2 1] of 8 bytes at p (16-bit lanes)
+__attribute__((target("sse4.1")))
+static inline __m128i column_121_sse(const unsigned char* up, const unsigned char* mid,
+                                     const unsigned char* down) {
+    __m128i u = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)up));
+    __m128i m = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)mid));
+    __m128i d = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)down));
+    return _mm_add_epi16(_mm_add_epi16(u, d), _mm_slli_epi16(m, 1));
+}
+
+__attribute__((target("sse4.1")))
+static void blur_span_sse4(const unsigned char* up, const unsigned char* mid,
+                           const unsigned char* down, unsigned char* out,
+                           int count, int channels) {
+    int n = count * channels;
+    int c = channels;
+    int k = 0;
+    
+    for (; k + 16 <= n; k += 16) {
+        __m128i res[2];
+        for (int h = 0; h < 2; h++) {
+            int o = k + 8 * h;
+            __m128i l = column_121_sse(up + o - c, mid + o - c, down + o - c);
+            __m128i m = column_121_sse(up + o, mid + o, down + o);
+            __m128i r = column_121_sse(up + o + c, mid + o + c, down + o + c);
+            __m128i sum = _mm_add_epi16(_mm_add_epi16(l, r), _mm_slli_epi16(m, 1));
+            res[h] = _mm_srli_epi16(sum, 4);
+        }
+        _mm_storeu_si128((__m128i*)(out + k), _mm_packus_epi16(res[0], res[1]));
+    }
+    
+    // Finish the tail pixel by pixel (k is not always on a pixel boundary)
+    int j = k / c;
+    if (j < count) {
+        blur_span_scalar(up + j * c, mid + j * c, down + j * c, out + j * c,
+                         count - j, c);
+    }
+}
+
+// Sobel output from 16-bit channel-0 samples (8 pixels), not yet
+// clamped to 255
+__attribute__((target("sse4.1")))
+static inline __m128i sobel_magnitude_sse(__m128i ul, __m128i uc, __m128i ur,
+                                          __m128i ml, __m128i mr,
+                                          __m128i dl, __m128i dc, __m128i dr,
+                                          int norm, int level) {
+    __m128i gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(ur, ul), _mm_sub_epi16(dr, dl)),
+                               _mm_slli_epi16(_mm_sub_epi16(mr, ml), 1));
+    __m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(dl, dr), _mm_slli_epi16(dc, 1)),
+                               _mm_add_epi16(_mm_add_epi16(ul, ur), _mm_slli_epi16(uc, 1)));
+    if (norm == EDGE_L1) {
+        __m128i m = _mm_add_epi16(_mm_abs_epi16(gx), _mm_abs_epi16(gy));
+        if (!level) return m;
+        return _mm_and_si128(_mm_cmpgt_epi16(m, _mm_set1_epi16((short)(level - 1))),
+                             _mm_set1_epi16(255));
+    }
+    __m128i lo = _mm_unpacklo_epi16(gx, gy);
+    __m128i hi = _mm_unpackhi_epi16(gx, gy);
+    __m128i sq_lo = _mm_madd_epi16(lo, lo);
+    __m128i sq_hi = _mm_madd_epi16(hi, hi);
+    if (level) {
+        __m128i t = _mm_set1_epi32(level * level - 1);
+        return _mm_and_si128(_mm_packs_epi32(_mm_cmpgt_epi32(sq_lo, t), _mm_cmpgt_epi32(sq_hi, t)),
+                             _mm_set1_epi16(255));
+    }
+    __m128 mlo = _mm_sqrt_ps(_mm_cvtepi32_ps(sq_lo));
+    __m128 mhi = _mm_sqrt_ps(_mm_cvtepi32_ps(sq_hi));
+    return _mm_packs_epi32(_mm_cvttps_epi32(mlo), _mm_cvttps_epi32(mhi));
+}
+
+__attribute__((target("sse4.1")))
+static void sobel_span_sse4(const unsigned char* up, const unsigned char* mid,
+                            const unsigned char* down, unsigned char* out,
+                            int count, int channels, int norm, int level) {
+    if (channels != 3 && channels != 1) {
+        sobel_span_scalar(up, mid, down, out, count, channels, norm, level);
+        return;
+    }
+    
+    const __m128i zero = _mm_setzero_si128();
+    int c = channels;
+    int j = 0;
+    
+    // The right neighbour of the last pixel (pixel `count`) is readable
+    for (; j + 16 <= count; j += 16) {
+        const unsigned char* rows[3] = {up + j * c, mid + j * c, down + j * c};
+        __m128i v[3][3];
+        for (int r = 0; r < 3; r++) {
+            v[r][0] = load_channel0_sse(rows[r] - c, c);
+            v[r][1] = load_channel0_sse(rows[r], c);
+            v[r][2] = load_channel0_sse(rows[r] + c, c);
+        }
+        
+        __m128i mag[2];
+        for (int h = 0; h < 2; h++) {
+            __m128i w[3][3];
+            for (int r = 0; r < 3; r++) {
+                for (int d = 0; d < 3; d++) {
+                    w[r][d] = h ? _mm_unpackhi_epi8(v[r][d], zero)
+                                : _mm_unpacklo_epi8(v[r][d], zero);
+                }
+            }
+            mag[h] = sobel_magnitude_sse(w[0][0], w[0][1], w[0][2], w[1][0], w[1][2],
+                                         w[2][0], w[2][1], w[2][2], norm, level);
+        }
+        
+        __m128i res = _mm_packus_epi16(mag[0], mag[1]);
+        if (c == 3) store_rgb_splat_sse(out + j * 3, res);
+        else _mm_storeu_si128((__m128i*)(out + j), res);
+    }
+    
+    if (j < count) {
+        sobel_span_scalar(up + j * c, mid + j * c, down + j * c, out + j * c,
+                          count - j, c, norm, level);
+    }
+}
+
+// Q15 luma of 16 pixels, arithmetic in 256-bit lanes
+__attribute__((target("avx2")))
+static inline __m128i gray_q15_avx2(__m128i r, __m128i g, __m128i b) {
+    const __m256i w_rg = _mm256_set1_epi32((GRAY_WG << 16) | GRAY_WR);
+    const __m256i w_b = _mm256_set1_epi32(GRAY_WB);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i r16 = _mm256_cvtepu8_epi16(r);
+    __m256i g16 = _mm256_cvtepu8_epi16(g);
+    __m256i b16 = _mm256_cvtepu8_epi16(b);
+    
+    // unpack/pack both work per 128-bit lane, so pixel order survives
+    __m256i lo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r16, g16), w_rg),
+                                  _mm256_madd_epi16(_mm256_unpacklo_epi16(b16, zero), w_b));
+    __m256i hi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r16, g16), w_rg),
+                                  _mm256_madd_epi16(_mm256_unpackhi_epi16(b16, zero), w_b));
+    __m256i gray16 = _mm256_packs_epi32(_mm256_srli_epi32(lo, GRAY_SHIFT),
+                                        _mm256_srli_epi32(hi, GRAY_SHIFT));
+    return _mm_packus_epi16(_mm256_castsi256_si128(gray16),
+                            _mm256_extracti128_si256(gray16, 1));
+}
+
+__attribute__((target("avx2")))
+static void grayscale_row_avx2(const unsigned char* in, unsigned char* out,
+                               int width, int channels) {
+    if (channels != 3) {
+        grayscale_row_scalar(in, out, width, channels);
+        return;
+    }
+    
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        const unsigned char* p = in + j * 3;
+        __m128i gray = gray_q15_avx2(rgb_channel_sse(p, 0), rgb_channel_sse(p, 1),
+                                     rgb_channel_sse(p, 2));
+        store_rgb_splat_sse(out + j * 3, gray);
+    }
+    
+    if (j < width) grayscale_row_scalar(in + j * 3, out + j * 3, width - j, 3);
+}
+
+__attribute__((target("avx2")))
+static void grayscale_planar_row_avx2(const unsigned char* r, const unsigned char* g,
+                                      const unsigned char* b, unsigned char* out,
+                                      int width) {
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        __m128i gray = gray_q15_avx2(_mm_loadu_si128((const __m128i*)(r + j)),
+                                     _mm_loadu_si128((const __m128i*)(g + j)),
+                                     _mm_loadu_si128((const __m128i*)(b + j)));
+        _mm_storeu_si128((__m128i*)(out + j), gray);
+    }
+    
+    if (j < width) grayscale_planar_row_scalar(r + j, g + j, b + j, out + j, width - j);
+}
+
+__attribute__((target("avx2")))
+static void brightness_row_avx2(const unsigned char* in, unsigned char* out,
+                                int width, int channels, int brightness) {
+    int n = width * channels;
+    int amount = brightness < 0 ? -brightness : brightness;
+    const __m256i delta = _mm256_set1_epi8((char)(amount > 255 ? 255 : amount));
+    int k = 0;
+    
+    for (; k + 32 <= n; k += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + k));
+        v = (brightness >= 0) ? _mm256_adds_epu8(v, delta) : _mm256_subs_epu8(v, delta);
+        _mm256_storeu_si256((__m256i*)(out + k), v);
+    }
+    
+    if (k < n) brightness_row_scalar(in + k, out + k, n - k, 1, brightness);
+}
+
+// Same row scheme as lut_span_sse4 with each row in both 128-bit lanes
+__attribute__((target("avx2")))
+static void lut_span_avx2(const unsigned char* in, unsigned char* out, int count,
+                          const unsigned char* table) {
+    __m256i rows[16];
+    for (int r = 0; r < 16; r++) {
+        rows[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(table + 16 * r)));
+    }
+    const __m256i step = _mm256_set1_epi8(16);
+    const __m256i bias = _mm256_set1_epi8(0x70);
+    int k = 0;
+    
+    for (; k + 32 <= count; k += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + k));
+        __m256i acc = _mm256_setzero_si256();
+        for (int r = 0; r < 16; r++) {
+            __m256i idx = _mm256_adds_epu8(v, bias);
+            acc = _mm256_or_si256(acc, _mm256_shuffle_epi8(rows[r], idx));
+            v = _mm256_sub_epi8(v, step);
+        }
+        _mm256_storeu_si256((__m256i*)(out + k), acc);
+    }
+    
+    if (k < count) lut_span_scalar(in + k, out + k, count - k, table);
+}
+
+// Vertical [1 2 1] of 16 bytes (16-bit lanes)
+__attribute__((target("avx2")))
+static inline __m256i column_121_avx2(const unsigned char* up, const unsigned char* mid,
+                                      const unsigned char* down) {
+    __m256i u = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)up));
+    __m256i m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)mid));
+    __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)down));
+    return _mm256_add_epi16(_mm256_add_epi16(u, d), _mm256_slli_epi16(m, 1));
+}
+
+__attribute__((target("avx2")))
+static void blur_span_avx2(const unsigned char* up, const unsigned char* mid,
+                           const unsigned char* down, unsigned char* out,
+                           int count, int channels) {
+    int n = count * channels;
+    int c = channels;
+    int k = 0;
+    
+    for (; k + 16 <= n; k += 16) {
+        __m256i l = column_121_avx2(up + k - c, mid + k - c, down + k - c);
+        __m256i m = column_121_avx2(up + k, mid + k, down + k);
+        __m256i r = column_121_avx2(up + k + c, mid + k + c, down + k + c);
+        __m256i sum = _mm256_srli_epi16(
+            _mm256_add_epi16(_mm256_add_epi16(l, r), _mm256_slli_epi16(m, 1)), 4);
+        __m128i res = _mm_packus_epi16(_mm256_castsi256_si128(sum),
+                                       _mm256_extracti128_si256(sum, 1));
+        _mm_storeu_si128((__m128i*)(out + k), res);
+    }
+    
+    int j = k / c;
+    if (j < count) {
+        blur_span_scalar(up + j * c, mid + j * c, down + j * c, out + j * c,
+                         count - j, c);
+    }
+}
+
+__attribute__((target("avx2")))
+static void sobel_span_avx2(const unsigned char* up, const unsigned char* mid,
+                            const unsigned char* down, unsigned char* out,
+                            int count, int channels, int norm, int level) {
+    if (channels != 3 && channels != 1) {
+        sobel_span_scalar(up, mid, down, out, count, channels, norm, level);
+        return;
+    }
+    
+    const __m256i mask_byte = _mm256_set1_epi16(255);
+    const __m256i l1_level = _mm256_set1_epi16((short)(level - 1));
+    const __m256i l2_level = _mm256_set1_epi32(level * level - 1);
+    
+    int c = channels;
+    int j = 0;
+    for (; j + 16 <= count; j += 16) {
+        const unsigned char* rows[3] = {up + j * c, mid + j * c, down + j * c};
+        __m256i w[3][3];
+        for (int r = 0; r < 3; r++) {
+            w[r][0] = _mm256_cvtepu8_epi16(load_channel0_sse(rows[r] - c, c));
+            w[r][1] = _mm256_cvtepu8_epi16(load_channel0_sse(rows[r], c));
+            w[r][2] = _mm256_cvtepu8_epi16(load_channel0_sse(rows[r] + c, c));
+        }
+        
+        __m256i gx = _mm256_add_epi16(
+            _mm256_add_epi16(_mm256_sub_epi16(w[0][2], w[0][0]), _mm256_sub_epi16(w[2][2], w[2][0])),
+            _mm256_slli_epi16(_mm256_sub_epi16(w[1][2], w[1][0]), 1));
+        __m256i gy = _mm256_sub_epi16(
+            _mm256_add_epi16(_mm256_add_epi16(w[2][0], w[2][2]), _mm256_slli_epi16(w[2][1], 1)),
+            _mm256_add_epi16(_mm256_add_epi16(w[0][0], w[0][2]), _mm256_slli_epi16(w[0][1], 1)));
+        __m256i mag16;
+        if (norm == EDGE_L1) {
+            mag16 = _mm256_add_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));
+            if (level) mag16 = _mm256_and_si256(_mm256_cmpgt_epi16(mag16, l1_level), mask_byte);
+        } else {
+            // unpack and packs both work per 128-bit lane, so the pixel
+            // order comes back unchanged
+            __m256i lo = _mm256_unpacklo_epi16(gx, gy);
+            __m256i hi = _mm256_unpackhi_epi16(gx, gy);
+            __m256i sq_lo = _mm256_madd_epi16(lo, lo);
+            __m256i sq_hi = _mm256_madd_epi16(hi, hi);
+            if (level) {
+                mag16 = _mm256_and_si256(_mm256_packs_epi32(_mm256_cmpgt_epi32(sq_lo, l2_level),
+                                                            _mm256_cmpgt_epi32(sq_hi, l2_level)),
+                                         mask_byte);
+            } else {
+                __m256 mlo = _mm256_sqrt_ps(_mm256_cvtepi32_ps(sq_lo));
+                __m256 mhi = _mm256_sqrt_ps(_mm256_cvtepi32_ps(sq_hi));
+                mag16 = _mm256_packs_epi32(_mm256_cvttps_epi32(mlo), _mm256_cvttps_epi32(mhi));
+            }
+        }
+        __m128i mag = _mm_packus_epi16(_mm256_castsi256_si128(mag16),
+                                       _mm256_extracti128_si256(mag16, 1));
+        
+        if (c == 3) store_rgb_splat_sse(out + j * 3, mag);
+        else _mm_storeu_si128((__m128i*)(out + j), mag);
+    }
+    
+    if (j < count) {
+        sobel_span_scalar(up + j * c, mid + j * c, down + j * c, out + j * c,
+                          count - j, c, norm, level);
+    }
+}
+#endif /* x86 */
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static inline uint8x16_t gray_q15_neon(uint8x16_t r8, uint8x16_t g8, uint8x16_t b8) {
+    uint16x8_t gray16[2];
+    
+    for (int h = 0; h < 2; h++) {
+        uint16x8_t r = h ? vmovl_high_u8(r8) : vmovl_u8(vget_low_u8(r8));
+        uint16x8_t g = h ? vmovl_high_u8(g8) : vmovl_u8(vget_low_u8(g8));
+        uint16x8_t b = h ? vmovl_high_u8(b8) : vmovl_u8(vget_low_u8(b8));
+        uint32x4_t lo = vmull_n_u16(vget_low_u16(r), GRAY_WR);
+        uint32x4_t hi = vmull_high_n_u16(r, GRAY_WR);
+        lo = vmlal_n_u16(lo, vget_low_u16(g), GRAY_WG);
+        hi = vmlal_high_n_u16(hi, g, GRAY_WG);
+        lo = vmlal_n_u16(lo, vget_low_u16(b), GRAY_WB);
+        hi = vmlal_high_n_u16(hi, b, GRAY_WB);
+        gray16[h] = vcombine_u16(vshrn_n_u32(lo, GRAY_SHIFT), vshrn_n_u32(hi, GRAY_SHIFT));
+    }
+    
+    return vcombine_u8(vqmovn_u16(gray16[0]), vqmovn_u16(gray16[1]));
+}
+
+static void grayscale_row_neon(const unsigned char* in, unsigned char* out,
+                               int width, int channels) {
+    if (channels != 3) {
+        grayscale_row_scalar(in, out, width, channels);
+        return;
+    }
+    
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        uint8x16x3_t px = vld3q_u8(in + j * 3);
+        uint8x16_t gray = gray_q15_neon(px.val[0], px.val[1], px.val[2]);
+        uint8x16x3_t res = {{gray, gray, gray}};
+        vst3q_u8(out + j * 3, res);
+    }
+    
+    if (j < width) grayscale_row_scalar(in + j * 3, out + j * 3, width - j, 3);
+}
+
+static void grayscale_planar_row_neon(const unsigned char* r, const unsigned char* g,
+                                      const unsigned char* b, unsigned char* out,
+                                      int width) {
+    int j = 0;
+    for (; j + 16 <= width; j += 16) {
+        vst1q_u8(out + j, gray_q15_neon(vld1q_u8(r + j), vld1q_u8(g + j), vld1q_u8(b + j)));
+    }
+    
+    if (j < width) grayscale_planar_row_scalar(r + j, g + j, b + j, out + j, width - j);
+}
+
+static void brightness_row_neon(const unsigned char* in, unsigned char* out,
+                                int width, int channels, int brightness) {
+    int n = width * channels;
+    int amount = brightness < 0 ? -brightness : brightness;
+    const uint8x16_t delta = vdupq_n_u8((uint8_t)(amount > 255 ? 255 : amount));
+    int k = 0;
+    
+    for (; k + 16 <= n; k += 16) {
+        uint8x16_t v = vld1q_u8(in + k);
+        v = (brightness >= 0) ? vqaddq_u8(v, delta) : vqsubq_u8(v, delta);
+        vst1q_u8(out + k, v);
+    }
+    
+    if (k < n) brightness_row_scalar(in + k, out + k, n - k, 1, brightness);
+}
+
+// tbl takes four registers (64 entries) at once and returns 0 out of
+// range; tbx leaves those lanes alone, so four lookups cover the table
+static void lut_span_neon(const unsigned char* in, unsigned char* out, int count,
+                          const unsigned char* table) {
+    uint8x16x4_t quarter[4];
+    for (int q = 0; q < 4; q++) quarter[q] = vld1q_u8_x4(table + 64 * q);
+    const uint8x16_t step = vdupq_n_u8(64);
+    int k = 0;
+    
+    for (; k + 16 <= count; k += 16) {
+        uint8x16_t v = vld1q_u8(in + k);
+        uint8x16_t acc = vqtbl4q_u8(quarter[0], v);
+        for (int q = 1; q < 4; q++) {
+            v = vsubq_u8(v, step);
+            acc = vqtbx4q_u8(acc, quarter[q], v);
+        }
+        vst1q_u8(out + k, acc);
+    }
+    
+    if (k < count) lut_span_scalar(in + k, out + k, count - k, table);
+}
+
+static inline uint16x8_t column_121_neon(const unsigned char* up, const unsigned char* mid,
+                                         const unsigned char* down) {
+    return vaddq_u16(vaddl_u8(vld1_u8(up), vld1_u8(down)), vshll_n_u8(vld1_u8(mid), 1));
+}
+
+static void blur_span_neon(const unsigned char* up, const unsigned char* mid,
+                           const unsigned char* down, unsigned char* out,
+                           int count, int channels) {
+    int n = count * channels;
+    int c = channels;
+    int k = 0;
+    
+    for (; k + 8 <= n; k += 8) {
+        uint16x8_t l = column_121_neon(up + k - c, mid + k - c, down + k - c);
+        uint16x8_t m = column_121_neon(up + k, mid + k, down + k);
+        uint16x8_t r = column_121_neon(up + k + c, mid + k + c, down + k + c);
+        uint16x8_t sum = vaddq_u16(vaddq_u16(l, r), vshlq_n_u16(m, 1));
+        vst1_u8(out + k, vshrn_n_u16(sum, 4));
+    }
+    
+    int j = k / c;
+    if (j < count) {
+        blur_span_scalar(up + j * c, mid + j * c, down + j * c, out + j * c,
+                         count - j, c);
+    }
+}
+
+static inline uint32x4_t sobel_sq_neon(int16x4_t gx, int16x4_t gy) {
+    return vreinterpretq_u32_s32(vmlal_s16(vmull_s16(gx, gx), gy, gy));
+}
+
+static void sobel_span_neon(const unsigned char* up, const unsigned char* mid,
+                            const unsigned char* down, unsigned char* out,
+                            int count, int channels, int norm, int level) {
+    if (channels != 3 && channels != 1) {
+        sobel_span_scalar(up, mid, down, out, count, channels, norm, level);
+        return;
+    }
+    
+    int c = channels;
+    int j = 0;
+    for (; j + 8 <= count; j += 8) {
+        const unsigned char* rows[3] = {up + j * c, mid + j * c, down + j * c};
+        int16x8_t w[3][3];
+        for (int r = 0; r < 3; r++) {
+            for (int d = 0; d < 3; d++) {
+                const unsigned char* p = rows[r] + (d - 1) * c;
+                uint8x8_t ch0 = (c == 3) ? vld3_u8(p).val[0] : vld1_u8(p);
+                w[r][d] = vreinterpretq_s16_u16(vmovl_u8(ch0));
+            }
+        }
+        
+        int16x8_t gx = vaddq_s16(vaddq_s16(vsubq_s16(w[0][2], w[0][0]), vsubq_s16(w[2][2], w[2][0])),
+                                 vshlq_n_s16(vsubq_s16(w[1][2], w[1][0]), 1));
+        int16x8_t gy = vsubq_s16(vaddq_s16(vaddq_s16(w[2][0], w[2][2]), vshlq_n_s16(w[2][1], 1)),
+                                 vaddq_s16(vaddq_s16(w[0][0], w[0][2]), vshlq_n_s16(w[0][1], 1)));
+        // Masks are all-ones lanes, which the saturating narrow makes 255
+        uint16x8_t mag16;
+        if (norm == EDGE_L1) {
+            int16x8_t m = vaddq_s16(vabsq_s16(gx), vabsq_s16(gy));
+            mag16 = level ? vcgeq_s16(m, vdupq_n_s16((short)level)) : vreinterpretq_u16_s16(m);
+        } else {
+            uint32x4_t sq_lo = sobel_sq_neon(vget_low_s16(gx), vget_low_s16(gy));
+            uint32x4_t sq_hi = sobel_sq_neon(vget_high_s16(gx), vget_high_s16(gy));
+            if (level) {
+                uint32x4_t t = vdupq_n_u32((uint32_t)(level * level));
+                mag16 = vcombine_u16(vmovn_u32(vcgeq_u32(sq_lo, t)), vmovn_u32(vcgeq_u32(sq_hi, t)));
+            } else {
+                float32x4_t mlo = vsqrtq_f32(vcvtq_f32_u32(sq_lo));
+                float32x4_t mhi = vsqrtq_f32(vcvtq_f32_u32(sq_hi));
+                mag16 = vcombine_u16(vqmovn_u32(vcvtq_u32_f32(mlo)),
+                                     vqmovn_u32(vcvtq_u32_f32(mhi)));
+            }
+        }
+        uint8x8_t mag = vqmovn_u16(mag16);
+        if (c == 3) {
+            uint8x8x3_t res = {{mag, mag, mag}};
+            vst3_u8(out + j * 3, res);
+        } else {
+            vst1_u8(out + j, mag);
+        }
+    }
+    
+    if (j < count) {
+        sobel_span_scalar(up + j * c, mid + j * c, down + j * c, out + j * c,
+                          count - j, c, norm, level);
+    }
+}
+#endif /* NEON */
+
+static const KernelSet kernel_sets[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", grayscale_row_avx2, grayscale_planar_row_avx2, brightness_row_avx2,
+     lut_span_avx2, blur_span_avx2, sobel_span_avx2},
+    {"sse4", grayscale_row_sse4, grayscale_planar_row_sse4, brightness_row_sse4,
+     lut_span_sse4, blur_span_sse4, sobel_span_sse4},
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    {"neon", grayscale_row_neon, grayscale_planar_row_neon, brightness_row_neon,
+     lut_span_neon, blur_span_neon, sobel_span_neon},
+#endif
+    {"scalar", grayscale_row_scalar, grayscale_planar_row_scalar, brightness_row_scalar,
+     lut_span_scalar, blur_span_scalar, sobel_span_scalar}
+};
+
+static const KernelSet* kernels = &kernel_sets[sizeof(kernel_sets) / sizeof(kernel_sets[0]) - 1];
+
+static int kernel_set_supported(const KernelSet* set) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (strcmp(set->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(set->name, "sse4") == 0) return __builtin_cpu_supports("sse4.1");
+#endif
+    (void)set;
+    return 1;
+}
+
+// Pick the kernel set: "auto" takes the widest one this CPU supports.
+// Returns the chosen name, or NULL if `request` is unknown/unsupported.
+const char* select_kernels(const char* request) {
+    int n = (int)(sizeof(kernel_sets) / sizeof(kernel_sets[0]));
+    
+    for (int i = 0; i < n; i++) {
+        const KernelSet* set = &kernel_sets[i];
+        if (strcmp(request, "auto") != 0 && strcmp(request, set->name) != 0) continue;
+        if (!kernel_set_supported(set)) {
+            if (strcmp(request, "auto") == 0) continue;
+            return NULL;
+        }
+        kernels = set;
+        return set->name;
+    }
+    return NULL;
+}
+
+// Dispatching row kernels used by the filters below
+static void grayscale_row(const unsigned char* in, unsigned char* out,
+                          int width, int channels) {
+    kernels->grayscale(in, out, width, channels);
+}
+
+static void grayscale_planar_row(const unsigned char* r, const unsigned char* g,
+                                 const unsigned char* b, unsigned char* out, int width) {
+    kernels->grayscale_planar(r, g, b, out, width);
+}
+
+static void brightness_row(const unsigned char* in, unsigned char* out,
+                           int width, int channels, int brightness) {
+    kernels->brightness(in, out, width, channels, brightness);
+}
+
+static void lut_span(const unsigned char* in, unsigned char* out, int count,
+                     const unsigned char* table) {
+    kernels->lut(in, out, count, table);
+}
+
+static void blur_span(const unsigned char* up, const unsigned char* mid,
+                      const unsigned char* down, unsigned char* out,
+                      int count, int channels) {
+    kernels->blur(up, mid, down, out, count, channels);
+}
+
+static void sobel_span(const unsigned char* up, const unsigned char* mid,
+                       const unsigned char* down, unsigned char* out,
+                       int count, int channels, int norm, int level) {
+    kernels->sobel(up, mid, down, out, count, channels, norm, level);
+}
+
+// Full-row blur: the first and last column are copied from mid.
+static void blur_row(const unsigned char* up, const unsigned char* mid,
+                     const unsigned char* down, unsigned char* out,
+                     int width, int channels) {
+    if (width > 2) {
+        blur_span(up + channels, mid + channels, down + channels,
+                  out + channels, width - 2, channels);
+    }
+    
+    // Copy borders
+    int idx_right = (width - 1) * channels;
+    for (int c = 0; c < channels; c++) {
+        out[c] = mid[c];
+        out[idx_right + c] = mid[idx_right + c];
+    }
+}
+
+// Full-row Sobel: border columns are set to zero.
+static void sobel_row(const unsigned char* up, const unsigned char* mid,
+                      const unsigned char* down, unsigned char* out,
+                      int width, int channels, int norm, int level) {
+    if (width > 2) {
+        sobel_span(up + channels, mid + channels, down + channels,
+                   out + channels, width - 2, channels, norm, level);
+    }
+    
+    int idx_right = (width - 1) * channels;
+    for (int c = 0; c < channels; c++) {
+        out[c] = 0;
+        out[idx_right + c] = 0;
+    }
+}
+
+void grayscale_filter(Image* input, Image* output, int thread_count) {
+    int width = input->width;
+    int height = input->height;
+    int channels = input->channels;
+    size_t row_size = (size_t)width * channels;
+    
+    if (log_stages) printf("Applying grayscale filter...\n");
+    
+#pragma omp parallel for num_threads(thread_count) schedule(runtime)
+    for (int i = 0; i < height; i++) {
+        grayscale_row(input->data + i * row_size, output->data + i * row_size,
+                      width, channels);
+    }
+}
+
+void gaussian_blur_filter(Image* input, Image* output, int thread_count) {
+    int width = input->width;
+    int height = input->height;
+    int channels = input->channels;
+    size_t row_size = (size_t)width * channels;
+    
+    if (log_stages) printf("Applying Gaussian blur filter...\n");
+    
+#pragma omp parallel for num_threads(thread_count) schedule(runtime)
+    for (int i = 0; i < height; i++) {
+        const unsigned char* mid = input->data + i * row_size;
+        unsigned char* out = output->data + i * row_size;
+        if (i == 0 || i == height - 1) {
+            memcpy(out, mid, row_size);
+        } else {
+            blur_row(mid - row_size, mid, mid + row_size, out, width, channels);
+        }
+    }
+}
+
+void sobel_edge_filter(Image* input, Image* output, EdgeNorm norm, int level, int thread_count) {
+    int width = input->width;
+    int height = input->height;
+    int channels = input->channels;
+    size_t row_size = (size_t)width * channels;
+    
+    if (log_stages) printf("Applying Sobel edge detection filter...\n");
+    
+#pragma omp parallel for num_threads(thread_count) schedule(runtime)
+    for (int i = 0; i < height; i++) {
+        const unsigned char* mid = input->data + i * row_size;
+        unsigned char* out = output->data + i * row_size;
+        if (i == 0 || i == height - 1) {
+            memset(out, 0, row_size);
+        } else {
+            sobel_row(mid - row_size, mid, mid + row_size, out, width, channels, norm, level);
+        }
+    }
+}
+
+void brightness_filter(Image* input, Image* output, int brightness, int thread_count) {
+    int width = input->width;
+    int height = input->height;
+    int channels = input->channels;
+    size_t row_size = (size_t)width * channels;
+    
+    if (log_stages) printf("Applying brightness adjustment (+%d)...\n", brightness);
+    
+#pragma omp parallel for num_threads(thread_count) schedule(runtime)
+    for (int i = 0; i < height; i++) {
+        brightness_row(input->data + i * row_size, output->data + i * row_size,
+                       width, channels, brightness);
+    }
+}
+
+// ============================================
+// SEPARABLE GAUSSIAN BLUR (arbitrary sigma)
+// ============================================
+//
+// Horizontal then vertical 1D pass with Q14 integer weights, so the cost
+// per pixel is 2 * (2r + 1) taps instead of (2r + 1)^2. The horizontal
+// pass keeps 8 fractional bits in a 16-bit intermediate. Above
+// GAUSS_BOX_SIGMA the blur is approximated by three running-sum box
+// passes whose cost does not depend on the radius. Pixels outside the
+// buffer are clamped to the nearest edge pixel.
+
+static void apply_point_chain(const FilterStage* stages, int count,
+                              const unsigned char* in, unsigned char* out,
+                              int width, int channels);
+
+static void static_block(int n, int tid, int nthreads, int* first, int* last) {
+    int rows = n / nthreads;
+    int extra = n % nthreads;
+    *first = tid * rows + (tid < extra ? tid : extra);
+    *last = *first + rows + (tid < extra ? 1 : 0);
+}
+
+static inline int clamp_index(int i, int n) {
+    return (i < 0) ? 0 : (i >= n) ? n - 1 : i;
+}
+
+static void gauss_kernel_init(GaussKernel* k, float sigma) {
+    k->sigma = sigma;
+    k->use_box = (sigma > GAUSS_BOX_SIGMA);
+    
+    if (k->use_box) {
+        // Three box widths whose variances add up to sigma^2
+        double w_ideal = sqrt(12.0 * sigma * sigma / 3.0 + 1.0);
+        int wl = (int)floor(w_ideal);
+        if (wl % 2 == 0) wl--;
+        int wu = wl + 2;
+        double m_ideal = (12.0 * sigma * sigma - 3.0 * wl * wl - 12.0 * wl - 9.0)
+                       / (-4.0 * wl - 4.0);
+        int m = (int)floor(m_ideal + 0.5);
+        
+        k->radius = 0;
+        for (int i = 0; i < 3; i++) {
+            k->box_radius[i] = ((i < m) ? wl : wu) / 2;
+            k->radius += k->box_radius[i];
+        }
+        return;
+    }
+    
+    int r = (int)ceil(3.0 * sigma);
+    if (r < 1) r = 1;
+    if (r > GAUSS_MAX_RADIUS) r = GAUSS_MAX_RADIUS;
+    k->radius = r;
+    
+    double w[2 * GAUSS_MAX_RADIUS + 1];
+    double total = 0.0;
+    for (int t = -r; t <= r; t++) {
+        w[t + r] = exp(-(double)(t * t) / (2.0 * sigma * sigma));
+        total += w[t + r];
+    }
+    
+    int sum = 0;
+    for (int t = 0; t <= 2 * r; t++) {
+        k->weights[t] = (int)floor(w[t] / total * (1 << GAUSS_SHIFT) + 0.5);
+        sum += k->weights[t];
+    }
+    k->weights[r] += (1 << GAUSS_SHIFT) - sum;   /* weights sum to exactly 1.0 */
+}
+
+SPECIALIZED void gauss_row_h_fixed(const unsigned char* in, unsigned short* out,
+                                   int width, int channels, const int* w, int r) {
+    for (int x = 0; x < width; x++) {
+        int interior = (x >= r && x + r < width);
+        for (int c = 0; c < channels; c++) {
+            int acc = 0;
+            if (interior) {
+                const unsigned char* p = in + (x - r) * channels + c;
+                for (int t = 0; t <= 2 * r; t++) {
+                    acc += w[t] * p[t * channels];
+                }
+            } else {
+                for (int t = 0; t <= 2 * r; t++) {
+                    acc += w[t] * in[clamp_index(x + t - r, width) * channels + c];
+                }
+            }
+            out[x * channels + c] = (unsigned short)((acc + 32) >> 6);
+        }
+    }
+}
+
+// Radii 1-3 (sigma up to 1) also get their taps unrolled
+static void gauss_row_h(const unsigned char* in, unsigned short* out,
+                        int width, int channels, const GaussKernel* k) {
+    const int* w = k->weights;
+#define GAUSS_ROW(ch) \
+    switch (k->radius) { \
+        case 1: gauss_row_h_fixed(in, out, width, ch, w, 1); break; \
+        case 2: gauss_row_h_fixed(in, out, width, ch, w, 2); break; \
+        case 3: gauss_row_h_fixed(in, out, width, ch, w, 3); break; \
+        default: gauss_row_h_fixed(in, out, width, ch, w, k->radius); break; \
+    }
+    CHANNEL_CASES(GAUSS_ROW)
+#undef GAUSS_ROW
+}
+
+// Running-sum box of radius r along one row
+static void box_row_h(const unsigned char* in, unsigned char* out,
+                      int width, int channels, int r) {
+    unsigned int inv = ((1u << 23) + (2 * r + 1) / 2) / (2 * r + 1);
+    
+    for (int c = 0; c < channels; c++) {
+        unsigned int sum = 0;
+        for (int t = -r; t <= r; t++) {
+            sum += in[clamp_index(t, width) * channels + c];
+        }
+        for (int x = 0; x < width; x++) {
+            unsigned int v = (sum * inv + (1u << 22)) >> 23;
+            out[x * channels + c] = (unsigned char)(v > 255 ? 255 : v);
+            sum += in[clamp_index(x + r + 1, width) * channels + c];
+            sum -= in[clamp_index(x - r, width) * channels + c];
+        }
+    }
+}
+
+// Blur a width x height buffer whose rows are `pitch` bytes apart.
+// `points` (may be empty) are applied to each source row as it is read.
+// src may equal dst. Returns 0 (dst untouched) if the intermediate plane
+// or the per-thread rows cannot be allocated.
+static int gauss_blur_buffer(const unsigned char* src, unsigned char* dst,
+                             int width, int height, int channels, size_t pitch,
+                             const GaussKernel* k,
+                             const FilterStage* points, int point_count,
+                             int thread_count) {
+    size_t row_size = (size_t)width * channels;
+    size_t plane = row_size * height;
+    
+    // The horizontal pass keeps 16 bits per sample for the taps, the box
+    // passes 8; every thread has a transformed source row and a row of
+    // vertical sums
+    size_t sample = k->use_box ? sizeof(unsigned char) : sizeof(unsigned short);
+    size_t sum_size = k->use_box ? sizeof(unsigned int) : sizeof(int);
+    void* tmp = malloc(plane * sample);
+    unsigned char* rowbufs = point_count ? (unsigned char*)malloc(thread_count * row_size)
+                                         : NULL;
+    void* sums = malloc((size_t)thread_count * row_size * sum_size);
+    if (!tmp || (point_count && !rowbufs) || !sums) {
+        fprintf(stderr, "Error: Could not allocate the Gaussian blur buffers (%zu bytes)\n",
+                plane * sample + thread_count * row_size * (sum_size + (point_count ? 1 : 0)));
+        free(tmp);
+        free(rowbufs);
+        free(sums);
+        return 0;
+    }
+    
+    if (!k->use_box) {
+        int r = k->radius;
+        
+#pragma omp parallel num_threads(thread_count) if(thread_count > 1)
+        {
+            int tid = 0;
+#ifdef _OPENMP
+            tid = omp_get_thread_num();
+#endif
+            unsigned short* tmp16 = (unsigned short*)tmp;
+            unsigned char* rowbuf = point_count ? rowbufs + tid * row_size : NULL;
+            int* acc = (int*)sums + tid * row_size;
+            
+#pragma omp for schedule(runtime)
+            for (int y = 0; y < height; y++) {
+                const unsigned char* row = src + y * pitch;
+                if (point_count) {
+                    apply_point_chain(points, point_count, row, rowbuf, width, channels);
+                    row = rowbuf;
+                }
+                gauss_row_h(row, tmp16 + y * row_size, width, channels, k);
+            }
+            
+#pragma omp for schedule(runtime)
+            for (int y = 0; y < height; y++) {
+                memset(acc, 0, row_size * sizeof(int));
+                for (int t = 0; t <= 2 * r; t++) {
+                    const unsigned short* in = tmp16 + clamp_index(y + t - r, height) * row_size;
+                    int w = k->weights[t];
+                    for (size_t i = 0; i < row_size; i++) {
+                        acc[i] += w * in[i];
+                    }
+                }
+                unsigned char* out = dst + y * pitch;
+                for (size_t i = 0; i < row_size; i++) {
+                    out[i] = (unsigned char)((acc[i] + (1 << 21)) >> 22);
+                }
+            }
+        }
+        
+        free(tmp);
+        free(rowbufs);
+        free(sums);
+        return 1;
+    }
+    
+#pragma omp parallel num_threads(thread_count) if(thread_count > 1)
+    {
+        int tid = 0, nthreads = 1;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+        nthreads = omp_get_num_threads();
+#endif
+        int first, last;
+        static_block(height, tid, nthreads, &first, &last);
+        
+        unsigned char* tmp8 = (unsigned char*)tmp;
+        unsigned char* rowbuf = point_count ? rowbufs + tid * row_size : NULL;
+        unsigned int* colsum = (unsigned int*)sums + tid * row_size;
+        
+        for (int pass = 0; pass < 3; pass++) {
+            int r = k->box_radius[pass];
+            const unsigned char* in = (pass == 0) ? src : dst;
+            unsigned int inv = ((1u << 23) + (2 * r + 1) / 2) / (2 * r + 1);
+            
+            for (int y = first; y < last; y++) {
+                const unsigned char* row = in + y * pitch;
+                if (pass == 0 && point_count) {
+                    apply_point_chain(points, point_count, row, rowbuf, width, channels);
+                    row = rowbuf;
+                }
+                box_row_h(row, tmp8 + y * row_size, width, channels, r);
+            }
+#pragma omp barrier
+            
+            // Vertical running sum over this thread's block of rows
+            if (first < last) {
+                memset(colsum, 0, row_size * sizeof(unsigned int));
+                for (int t = -r; t <= r; t++) {
+                    const unsigned char* row = tmp8 + clamp_index(first + t, height) * row_size;
+                    for (size_t i = 0; i < row_size; i++) colsum[i] += row[i];
+                }
+            }
+            for (int y = first; y < last; y++) {
+                unsigned char* out = dst + y * pitch;
+                const unsigned char* add = tmp8 + clamp_index(y + r + 1, height) * row_size;
+                const unsigned char* sub = tmp8 + clamp_index(y - r, height) * row_size;
+                for (size_t i = 0; i < row_size; i++) {
+                    unsigned int v = (colsum[i] * inv + (1u << 22)) >> 23;
+                    out[i] = (unsigned char)(v > 255 ? 255 : v);
+                    colsum[i] += add[i];
+                    colsum[i] -= sub[i];
+                }
+            }
+#pragma omp barrier
+        }
+    }
+    
+    free(tmp);
+    free(rowbufs);
+    free(sums);
+    return 1;
+}
+
+int separable_gaussian_filter(Image* input, Image* output, float sigma, int thread_count) {
+    GaussKernel k;
+    gauss_kernel_init(&k, sigma);
+    
+    if (log_stages && k.use_box) {
+        printf("Applying Gaussian blur (sigma=%.2f, 3-pass box approximation, radii %d/%d/%d)...\n",
+               sigma, k.box_radius[0], k.box_radius[1], k.box_radius[2]);
+    } else if (log_stages) {
+        printf("Applying separable Gaussian blur (sigma=%.2f, radius %d)...\n",
+               sigma, k.radius);
+    }
+    
+    return gauss_blur_buffer(input->data, output->data, input->width, input->height,
+                             input->channels, (size_t)input->width * input->channels,
+                             &k, NULL, 0, thread_count);
+}
+
+// ============================================
+// INTEGRAL IMAGE (box:R, thresh:R[:C])
+// ============================================
+//
+// Box blur and adaptive threshold need the sum over a (2R+1)^2 window
+// around every pixel. With an integral image that is four lookups per
+// channel whatever R is. The table is built as a two-pass parallel
+// scan: each thread takes a static block of rows, computes row prefix
+// sums and the column prefix sums within its block, and then adds the
+// column totals of all blocks above it (an exclusive scan over the
+// blocks - the MPI build does the same across ranks with MPI_Exscan).
+// Windows are cut at the image edge and averaged over the pixels that
+// remain, so a tile or band that carries R pixels of context computes
+// exactly what the whole image does.
+
+int integral_image_build(IntegralImage* ii, const unsigned char* src, int width, int height,
+                         int channels, size_t src_pitch, const FilterStage* points,
+                         int point_count, int thread_count) {
+    size_t row_size = (size_t)width * channels;
+    size_t pitch = (size_t)(width + 1) * channels;
+    
+    ii->width = width;
+    ii->height = height;
+    ii->channels = channels;
+    ii->pitch = pitch;
+    ii->sum = (unsigned int*)malloc((size_t)(height + 1) * pitch * sizeof(unsigned int));
+    unsigned char* rowbufs = point_count ? (unsigned char*)malloc(thread_count * row_size)
+                                         : NULL;
+    unsigned int* carries = (unsigned int*)calloc((size_t)thread_count * pitch,
+                                                  sizeof(unsigned int));
+    if (!ii->sum || (point_count && !rowbufs) || !carries) {
+        free(ii->sum);
+        free(rowbufs);
+        free(carries);
+        ii->sum = NULL;
+        return 0;
+    }
+    memset(ii->sum, 0, pitch * sizeof(unsigned int));
+    
+#pragma omp parallel num_threads(thread_count) if(thread_count > 1)
+    {
+        int tid = 0, nthreads = 1;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+        nthreads = omp_get_num_threads();
+#endif
+        int first, last;
+        static_block(height, tid, nthreads, &first, &last);
+        
+        unsigned char* rowbuf = point_count ? rowbufs + tid * row_size : NULL;
+        unsigned int* carry = carries + (size_t)tid * pitch;
+        
+        // Pass 1: prefix sums along each row, then down the block
+        for (int y = first; y < last; y++) {
+            const unsigned char* in = src + y * src_pitch;
+            if (point_count) {
+                apply_point_chain(points, point_count, in, rowbuf, width, channels);
+                in = rowbuf;
+            }
+            unsigned int* s = ii->sum + (size_t)(y + 1) * pitch;
+            for (int c = 0; c < channels; c++) s[c] = 0;
+            for (size_t i = 0; i < row_size; i++) s[i + channels] = s[i] + in[i];
+            
+            if (y > first) {
+                const unsigned int* above = s - pitch;
+                for (size_t i = 0; i < pitch; i++) s[i] += above[i];
+            }
+        }
+#pragma omp barrier
+        
+        // The last row of every block above holds that block's column totals
+        for (int t = 0; t < tid; t++) {
+            int t_first, t_last;
+            static_block(height, t, nthreads, &t_first, &t_last);
+            if (t_last == t_first) continue;
+            const unsigned int* total = ii->sum + (size_t)t_last * pitch;
+            for (size_t i = 0; i < pitch; i++) carry[i] += total[i];
+        }
+#pragma omp barrier
+        
+        // Pass 2: add the carry from above
+        if (tid > 0) {
+            for (int y = first; y < last; y++) {
+                unsigned int* s = ii->sum + (size_t)(y + 1) * pitch;
+                for (size_t i = 0; i < pitch; i++) s[i] += carry[i];
+            }
+        }
+    }
+    
+    free(carries);
+    free(rowbufs);
+    return 1;
+}
+
+void integral_image_free(IntegralImage* ii) {
+    free(ii->sum);
+    ii->sum = NULL;
+}
+
+// Output row y of a box or threshold stage. `in` is the stage's input
+// row (after any fused point stages); only the threshold reads it.
+static void integral_row(const FilterStage* st, const IntegralImage* ii, int y,
+                         const unsigned char* in, unsigned char* out) {
+    int r = st->param;
+    int width = ii->width;
+    int channels = ii->channels;
+    int y0 = (y - r > 0) ? y - r : 0;
+    int y1 = (y + r + 1 < ii->height) ? y + r + 1 : ii->height;
+    const unsigned int* top = ii->sum + (size_t)y0 * ii->pitch;
+    const unsigned int* bottom = ii->sum + (size_t)y1 * ii->pitch;
+    
+    for (int x = 0; x < width; x++) {
+        int x0 = (x - r > 0) ? x - r : 0;
+        int x1 = (x + r + 1 < width) ? x + r + 1 : width;
+        unsigned int area = (unsigned int)((y1 - y0) * (x1 - x0));
+        size_t a = (size_t)x0 * channels;
+        size_t b = (size_t)x1 * channels;
+        
+        for (int c = 0; c < channels; c++) {
+            unsigned int sum = bottom[b + c] - bottom[a + c] - top[b + c] + top[a + c];
+            unsigned int mean = (sum + area / 2) / area;
+            size_t i = (size_t)x * channels + c;
+            if (st->type == FILTER_BOX) {
+                out[i] = (unsigned char)mean;
+            } else {
+                out[i] = ((int)in[i] + st->offset > (int)mean) ? 255 : 0;
+            }
+        }
+    }
+}
+
+// Box or threshold stage over a width x height buffer whose rows are
+// `pitch` bytes apart. `points` (may be empty) are applied to each source
+// row as it is read. src may equal dst. Returns 0 (dst untouched) if the
+// table cannot be allocated.
+static int integral_filter_buffer(const FilterStage* st, const unsigned char* src,
+                                  unsigned char* dst, int width, int height, int channels,
+                                  size_t pitch, const FilterStage* points, int point_count,
+                                  int thread_count) {
+    // The threshold compares against the transformed source pixel
+    int need_row = (st->type == FILTER_THRESH && point_count > 0);
+    size_t row_size = (size_t)width * channels;
+    
+    IntegralImage ii;
+    unsigned char* rowbufs = need_row ? (unsigned char*)malloc(thread_count * row_size) : NULL;
+    if ((need_row && !rowbufs) ||
+        !integral_image_build(&ii, src, width, height, channels, pitch,
+                              points, point_count, thread_count)) {
+        fprintf(stderr, "Error: Could not allocate the integral image\n");
+        free(rowbufs);
+        return 0;
+    }
+    
+#pragma omp parallel num_threads(thread_count) if(thread_count > 1)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        unsigned char* rowbuf = need_row ? rowbufs + tid * row_size : NULL;
+        
+#pragma omp for schedule(runtime)
+        for (int y = 0; y < height; y++) {
+            const unsigned char* in = src + y * pitch;
+            if (need_row) {
+                apply_point_chain(points, point_count, in, rowbuf, width, channels);
+                in = rowbuf;
+            }
+            integral_row(st, &ii, y, in, dst + y * pitch);
+        }
+    }
+    
+    free(rowbufs);
+    integral_image_free(&ii);
+    return 1;
+}
+
+int box_blur_filter(Image* input, Image* output, int radius, int thread_count) {
+    if (log_stages) printf("Applying box blur (radius %d, integral image)...\n", radius);
+    
+    FilterStage st = {.type = FILTER_BOX, .param = radius};
+    return integral_filter_buffer(&st, input->data, output->data, input->width,
+                                  input->height, input->channels,
+                                  (size_t)input->width * input->channels,
+                                  NULL, 0, thread_count);
+}
+
+int adaptive_threshold_filter(Image* input, Image* output, int radius, int offset,
+                              int thread_count) {
+    if (log_stages) {
+        printf("Applying adaptive threshold (radius %d, offset %d, integral image)...\n",
+               radius, offset);
+    }
+    
+    FilterStage st = {.type = FILTER_THRESH, .param = radius, .offset = offset};
+    return integral_filter_buffer(&st, input->data, output->data, input->width,
+                                  input->height, input->channels,
+                                  (size_t)input->width * input->channels,
+                                  NULL, 0, thread_count);
+}
+
+// ============================================
+// HISTOGRAMS AND TONE CURVES (equalize, autolevels, stretch)
+// ============================================
+//
+// Every thread counts its rows into a private histogram; the private
+// copies are then summed bin by bin, each thread owning a range of bins,
+// so no counter is ever shared. The tone stages turn the histogram into
+// one table per channel and from then on are a per-pixel stage: the
+// table lookup fuses into the next 3x3 or integral stage like grayscale
+// and brighten do, and costs a separate pass only when nothing follows.
+// Channels are treated separately.
+
+int histogram_build(const unsigned char* src, int width, int height, int channels,
+                    size_t pitch, unsigned long long* hist, int thread_count) {
+    int bins = channels * HIST_BINS;
+    size_t copies = (size_t)thread_count * HIST_COPIES;
+    unsigned int* partial = (unsigned int*)calloc(copies * bins, sizeof(unsigned int));
+    if (!partial) {
+        fprintf(stderr, "Error: Could not allocate %zu private histograms\n", copies);
+        return 0;
+    }
+    
+#pragma omp parallel num_threads(thread_count) if(thread_count > 1)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        unsigned int* mine = partial + (size_t)tid * HIST_COPIES * bins;
+        
+        // Neighbouring pixels usually fall into the same bin; counting
+        // them into different copies keeps the increments independent
+#pragma omp for schedule(runtime)
+        for (int y = 0; y < height; y++) {
+            const unsigned char* row = src + y * pitch;
+            if (channels == 3) {
+                for (int x = 0; x < width; x++) {
+                    unsigned int* h = mine + (x % HIST_COPIES) * bins;
+                    h[row[3 * x]]++;
+                    h[HIST_BINS + row[3 * x + 1]]++;
+                    h[2 * HIST_BINS + row[3 * x + 2]]++;
+                }
+            } else {
+                for (int x = 0; x < width; x++) {
+                    unsigned int* h = mine + (x % HIST_COPIES) * bins;
+                    for (int c = 0; c < channels; c++) {
+                        h[c * HIST_BINS + row[x * channels + c]]++;
+                    }
+                }
+            }
+        }
+        
+#pragma omp for schedule(static)
+        for (int b = 0; b < bins; b++) {
+            unsigned long long total = 0;
+            for (size_t t = 0; t < copies; t++) total += partial[t * bins + b];
+            hist[b] = total;
+        }
+    }
+    
+    free(partial);
+    return 1;
+}
+
+// Linear map of [lo, hi] onto [0, 255], rounded
+static void stretch_lut(int lo, int hi, unsigned char* lut) {
+    for (int v = 0; v < HIST_BINS; v++) {
+        if (hi <= lo) {
+            lut[v] = (unsigned char)v;  /* flat channel: leave it alone */
+        } else if (v <= lo) {
+            lut[v] = 0;
+        } else if (v >= hi) {
+            lut[v] = 255;
+        } else {
+            lut[v] = (unsigned char)(((v - lo) * 510 + (hi - lo)) / (2 * (hi - lo)));
+        }
+    }
+}
+
+void tone_lut_build(const FilterStage* st, const unsigned long long* hist, int channels,
+                    unsigned char* lut) {
+    for (int c = 0; c < channels; c++) {
+        const unsigned long long* h = hist + c * HIST_BINS;
+        unsigned char* out = lut + c * HIST_BINS;
+        unsigned long long total = 0;
+        for (int v = 0; v < HIST_BINS; v++) total += h[v];
+        
+        if (st->type == FILTER_EQUALIZE) {
+            // CDF scaled so the first occupied level maps to 0
+            unsigned long long cdf = 0, cdf_min = 0;
+            for (int v = 0; v < HIST_BINS && cdf_min == 0; v++) cdf_min = h[v];
+            unsigned long long range = total - cdf_min;
+            for (int v = 0; v < HIST_BINS; v++) {
+                cdf += h[v];
+                out[v] = (range == 0) ? (unsigned char)v
+                       : (unsigned char)(((cdf - cdf_min) * 255 + range / 2) / range);
+            }
+            continue;
+        }
+        
+        // autolevels is a stretch between the lowest and highest level used
+        double low = (st->type == FILTER_STRETCH) ? st->clip[0] : 0.0;
+        double high = (st->type == FILTER_STRETCH) ? st->clip[1] : 100.0;
+        double low_count = total * low / 100.0;
+        double high_count = total * high / 100.0;
+        unsigned long long cdf = 0;
+        int lo = -1, hi = HIST_BINS - 1;
+        for (int v = 0; v < HIST_BINS; v++) {
+            cdf += h[v];
+            if (lo < 0 && cdf > low_count) lo = v;
+            if (cdf >= high_count && cdf > 0) {
+                hi = v;
+                break;
+            }
+        }
+        stretch_lut(lo < 0 ? 0 : lo, hi, out);
+    }
+}
+
+static void lut_row(const unsigned char* in, unsigned char* out, int width, int channels,
+                    const unsigned char* lut) {
+    if (channels == 3) {
+        const unsigned char* r = lut;
+        const unsigned char* g = lut + HIST_BINS;
+        const unsigned char* b = lut + 2 * HIST_BINS;
+        for (int x = 0; x < width; x++) {
+            out[3 * x] = r[in[3 * x]];
+            out[3 * x + 1] = g[in[3 * x + 1]];
+            out[3 * x + 2] = b[in[3 * x + 2]];
+        }
+        return;
+    }
+    for (int x = 0; x < width; x++) {
+        for (int c = 0; c < channels; c++) {
+            out[x * channels + c] = lut[c * HIST_BINS + in[x * channels + c]];
+        }
+    }
+}
+
+// ============================================
+// PIPELINE (multiple filters, one process)
+// ============================================
+//
+// A pipeline is split into passes. Each pass is a run of zero or more
+// per-pixel stages (grayscale, brighten, lookup tables) optionally
+// followed by one 3x3 stencil stage (blur, edge). The per-pixel stages of
+// a pass are applied on the fly to a 3-row window owned by each thread,
+// so the stencil reads each input pixel from memory once instead of once
+// per filter.
+// Passes ping-pong between the output image and one scratch image.
+
+static const char* stage_name(FilterType type) {
+    switch (type) {
+        case FILTER_GRAYSCALE: return "grayscale";
+        case FILTER_BLUR:      return "blur";
+        case FILTER_EDGE:      return "edge";
+        case FILTER_BRIGHTEN:  return "brighten";
+        case FILTER_GAUSS:     return "gauss";
+        case FILTER_BOX:       return "box";
+        case FILTER_THRESH:    return "thresh";
+        case FILTER_EQUALIZE:  return "equalize";
+        case FILTER_AUTOLEVELS: return "autolevels";
+        case FILTER_STRETCH:   return "stretch";
+        case FILTER_CONTRAST:  return "contrast";
+        case FILTER_GAMMA:     return "gamma";
+        case FILTER_INVERT:    return "invert";
+        case FILTER_THRESHOLD: return "threshold";
+        case FILTER_LUT:       return "lut";
+    }
+    return "?";
+}
+
+static int is_point_stage(FilterType type) {
+    return type == FILTER_GRAYSCALE || type == FILTER_BRIGHTEN || type == FILTER_LUT;
+}
+
+// Stages that need the histogram of their whole input
+static int is_tone_stage(FilterType type) {
+    return type == FILTER_EQUALIZE || type == FILTER_AUTOLEVELS || type == FILTER_STRETCH;
+}
+
+int pipeline_has_tone_stage(const FilterStage* stages, int stage_count) {
+    for (int s = 0; s < stage_count; s++) {
+        if (is_tone_stage(stages[s].type)) return 1;
+    }
+    return 0;
+}
+
+// Every later stage treats the channels alike, so from here on they
+// stay equal (edge leaves the border pixels as they were)
+int pipeline_gray_stage(const FilterStage* stages, int stage_count) {
+    for (int s = 0; s < stage_count; s++) {
+        if (stages[s].type == FILTER_GRAYSCALE || stages[s].type == FILTER_EDGE) return s;
+    }
+    return -1;
+}
+
+int output_is_pgm(const char* path) {
+    size_t n = strlen(path);
+    return n > 4 && (strcmp(path + n - 4, ".pgm") == 0 || output_format(path) == FORMAT_PBM);
+}
+
+// Stages that read a whole-region table rather than a 3x3 window
+static int is_integral_stage(FilterType type) {
+    return type == FILTER_BOX || type == FILTER_THRESH;
+}
+
+// "R" or, when offset is given, "R:C"; missing parts keep their defaults
+static int parse_window_arg(const char* arg, int* radius, int* offset) {
+    if (!arg) return 1;
+    
+    char* end;
+    long r = strtol(arg, &end, 10);
+    if (end == arg || r < 1 || r > SAT_MAX_RADIUS) return 0;
+    *radius = (int)r;
+    if (*end == '\0') return 1;
+    if (*end != ':' || !offset) return 0;
+    
+    const char* c_arg = end + 1;
+    long c = strtol(c_arg, &end, 10);
+    if (end == c_arg || *end != '\0' || c < -255 || c > 255) return 0;
+    *offset = (int)c;
+    return 1;
+}
+
+// ============================================
+// POINT OPERATIONS (lookup tables)
+// ============================================
+//
+// Every op that maps each channel value on its own is a function of one
+// byte, so a run of them composes into a single 256-entry table at parse
+// time and costs one lookup per byte however long the run is. The lookup
+// is the vectorized lut kernel above. A lone brighten keeps its
+// saturating-add kernel, which is cheaper than any lookup.
+
+static int is_channel_op(FilterType type) {
+    return type == FILTER_BRIGHTEN || type == FILTER_CONTRAST || type == FILTER_GAMMA ||
+           type == FILTER_INVERT || type == FILTER_THRESHOLD;
+}
+
+static void channel_op_table(const FilterStage* st, unsigned char* table) {
+    for (int v = 0; v < HIST_BINS; v++) {
+        float f;
+        switch (st->type) {
+        case FILTER_BRIGHTEN: f = (float)(v + st->param); break;
+        case FILTER_CONTRAST: f = (v - 127.5f) * st->amount + 127.5f; break;
+        case FILTER_GAMMA:    f = 255.0f * powf(v / 255.0f, 1.0f / st->amount); break;
+        case FILTER_INVERT:   f = (float)(255 - v); break;
+        default:              f = (v >= st->param) ? 255.0f : 0.0f; break;
+        }
+        f = floorf(f + 0.5f);
+        table[v] = (unsigned char)(f < 0.0f ? 0 : f > 255.0f ? 255 : (int)f);
+    }
+}
+
+// Replace each run of per-channel ops by one FILTER_LUT stage; returns
+// the new stage count
+static int compile_point_ops(FilterStage* stages, int stage_count) {
+    int count = 0;
+    
+    for (int s = 0; s < stage_count; ) {
+        int end = s;
+        while (end < stage_count && is_channel_op(stages[end].type)) end++;
+        if (end == s || (end == s + 1 && stages[s].type == FILTER_BRIGHTEN)) {
+            stages[count++] = stages[s++];
+            continue;
+        }
+        
+        FilterStage merged = {.type = FILTER_LUT};
+        for (int v = 0; v < HIST_BINS; v++) merged.table[v] = (unsigned char)v;
+        for (; s < end; s++) {
+            unsigned char op[HIST_BINS];
+            channel_op_table(&stages[s], op);
+            for (int v = 0; v < HIST_BINS; v++) merged.table[v] = op[merged.table[v]];
+        }
+        stages[count++] = merged;
+    }
+    return count;
+}
+
+// Whole-number argument in [lo, hi]; a missing one keeps *value
+static int parse_int_arg(const char* arg, int lo, int hi, int* value) {
+    if (!arg) return 1;
+    
+    char* end;
+    long v = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || v < lo || v > hi) return 0;
+    *value = (int)v;
+    return 1;
+}
+
+// "l1" or "l2" for edge; "T", "T:l1" or "T:l2" for edgemask
+static int parse_edge_arg(const char* arg, int mask, FilterStage* st) {
+    st->norm = EDGE_L2;
+    st->param = mask ? THRESHOLD_DEFAULT : 0;
+    if (!arg) return 1;
+    
+    const char* norm = arg;
+    if (mask) {
+        char* end;
+        long level = strtol(arg, &end, 10);
+        if (end == arg || level < 1 || level > 255 || (*end != '\0' && *end != ':')) return 0;
+        st->param = (int)level;
+        if (*end == '\0') return 1;
+        norm = end + 1;
+    }
+    if (strcmp(norm, "l1") == 0) st->norm = EDGE_L1;
+    else if (strcmp(norm, "l2") != 0) return 0;
+    return 1;
+}
+
+// A threshold table (0 below some level, 255 from there on) after edge
+// folds into the edge stage as its mask level: comparing gx^2 + gy^2 with
+// level^2 gives the same bytes as thresholding the clamped magnitude.
+static int threshold_table_level(const FilterStage* st) {
+    if (st->type != FILTER_LUT || st->lut) return 0;
+    int level = 1;
+    while (level < 256 && st->table[level] == 0) level++;
+    if (st->table[0] != 0 || level == 256) return 0;
+    for (int v = level; v < 256; v++) {
+        if (st->table[v] != 255) return 0;
+    }
+    return level;
+}
+
+static int fuse_edge_masks(FilterStage* stages, int stage_count) {
+    int count = 0;
+    for (int s = 0; s < stage_count; s++) {
+        stages[count] = stages[s];
+        int level = (s + 1 < stage_count) ? threshold_table_level(&stages[s + 1]) : 0;
+        if (stages[s].type == FILTER_EDGE && stages[s].param == 0 && level > 0) {
+            stages[count].param = level;
+            s++;
+        }
+        count++;
+    }
+    return count;
+}
+
+int parse_pipeline(const char* spec, FilterStage* stages, int max_stages) {
+    int count = 0;
+    const char* p = spec;
+    
+    while (*p) {
+        const char* end = strchr(p, ',');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        char name[32];
+        char* arg = NULL;
+        
+        if (len == 0 || len >= sizeof(name)) {
+            fprintf(stderr, "Error: Invalid filter list '%s'\n", spec);
+            return -1;
+        }
+        if (count == max_stages) {
+            fprintf(stderr, "Error: At most %d filters per pipeline\n", max_stages);
+            return -1;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        
+        // Optional argument: "gauss:2.5"
+        char* colon = strchr(name, ':');
+        if (colon) {
+            *colon = '\0';
+            arg = colon + 1;
+        }
+        
+        FilterStage* st = &stages[count];
+        st->param = 0;
+        st->norm = EDGE_L2;
+        st->offset = 0;
+        st->sigma = 0.0f;
+        st->amount = 0.0f;
+        st->clip[0] = STRETCH_DEFAULT_LOW;
+        st->clip[1] = STRETCH_DEFAULT_HIGH;
+        st->lut = NULL;
+        if (strcmp(name, "grayscale") == 0) {
+            st->type = FILTER_GRAYSCALE;
+        } else if (strcmp(name, "blur") == 0) {
+            st->type = FILTER_BLUR;
+        } else if (strcmp(name, "edge") == 0 || strcmp(name, "edgemask") == 0) {
+            st->type = FILTER_EDGE;
+            if (!parse_edge_arg(arg, name[4] != '\0', st)) {
+                fprintf(stderr, "Error: edge takes l1 or l2 (e.g. edge:l1), edgemask a level "
+                        "from 1 to 255 and optionally the norm (e.g. edgemask:60:l1)\n");
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "brighten") == 0) {
+            st->type = FILTER_BRIGHTEN;
+            st->param = BRIGHTEN_DEFAULT;
+            if (!parse_int_arg(arg, -255, 255, &st->param)) {
+                fprintf(stderr, "Error: brighten needs an offset from -255 to 255 "
+                        "(e.g. brighten:-30)\n");
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "contrast") == 0) {
+            st->type = FILTER_CONTRAST;
+            st->amount = arg ? (float)atof(arg) : CONTRAST_DEFAULT;
+            if (!(st->amount >= 0.0f) || (arg && *arg == '\0')) {
+                fprintf(stderr, "Error: contrast needs a gain >= 0 (e.g. contrast:1.2)\n");
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "gamma") == 0) {
+            st->type = FILTER_GAMMA;
+            st->amount = arg ? (float)atof(arg) : GAMMA_DEFAULT;
+            if (!(st->amount > 0.0f)) {
+                fprintf(stderr, "Error: gamma needs a positive exponent (e.g. gamma:2.2)\n");
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "invert") == 0) {
+            st->type = FILTER_INVERT;
+        } else if (strcmp(name, "threshold") == 0) {
+            st->type = FILTER_THRESHOLD;
+            st->param = THRESHOLD_DEFAULT;
+            if (!parse_int_arg(arg, 0, 255, &st->param)) {
+                fprintf(stderr, "Error: threshold needs a level from 0 to 255 "
+                        "(e.g. threshold:100)\n");
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "gauss") == 0) {
+            st->type = FILTER_GAUSS;
+            st->sigma = arg ? (float)atof(arg) : 1.0f;
+            if (!(st->sigma > 0.0f)) {
+                fprintf(stderr, "Error: gauss needs a positive sigma (e.g. gauss:2.5)\n");
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "box") == 0) {
+            st->type = FILTER_BOX;
+            st->param = BOX_DEFAULT_RADIUS;
+            if (!parse_window_arg(arg, &st->param, NULL)) {
+                fprintf(stderr, "Error: box needs a radius from 1 to %d (e.g. box:8)\n",
+                        SAT_MAX_RADIUS);
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "thresh") == 0) {
+            st->type = FILTER_THRESH;
+            st->param = THRESH_DEFAULT_RADIUS;
+            st->offset = THRESH_DEFAULT_OFFSET;
+            if (!parse_window_arg(arg, &st->param, &st->offset)) {
+                fprintf(stderr, "Error: thresh needs a radius from 1 to %d and an optional "
+                        "offset (e.g. thresh:15:10)\n", SAT_MAX_RADIUS);
+                return -1;
+            }
+            arg = NULL;
+        } else if (strcmp(name, "equalize") == 0) {
+            st->type = FILTER_EQUALIZE;
+        } else if (strcmp(name, "autolevels") == 0) {
+            st->type = FILTER_AUTOLEVELS;
+        } else if (strcmp(name, "stretch") == 0) {
+            st->type = FILTER_STRETCH;
+            if (arg && (sscanf(arg, "%f:%f", &st->clip[0], &st->clip[1]) != 2 ||
+                        !(st->clip[0] >= 0.0f && st->clip[0] < st->clip[1] &&
+                          st->clip[1] <= 100.0f))) {
+                fprintf(stderr, "Error: stretch needs percentiles LOW:HIGH with "
+                        "0 <= LOW < HIGH <= 100 (e.g. stretch:1:99)\n");
+                return -1;
+            }
+            arg = NULL;
+        } else {
+            fprintf(stderr, "Error: Unknown filter '%s'\n", name);
+            return -1;
+        }
+        if (arg) {
+            fprintf(stderr, "Error: Filter '%s' takes no argument\n", name);
+            return -1;
+        }
+        count++;
+        
+        if (!end) break;
+        p = end + 1;
+        if (*p == '\0') {
+            fprintf(stderr, "Error: Invalid filter list '%s'\n", spec);
+            return -1;
+        }
+    }
+    
+    return fuse_edge_masks(stages, compile_point_ops(stages, count));
+}
+
+static void apply_point_row(const FilterStage* st, const unsigned char* in,
+                            unsigned char* out, int width, int channels) {
+    if (st->type == FILTER_GRAYSCALE) {
+        grayscale_row(in, out, width, channels);
+    } else if (st->type == FILTER_LUT) {
+        if (st->lut) lut_row(in, out, width, channels, st->lut);
+        else lut_span(in, out, width * channels, st->table);
+    } else {
+        brightness_row(in, out, width, channels, st->param);
+    }
+}
+
+// Apply a run of per-pixel stages to one row. The first stage reads `in`,
+// later stages run in place on `out`.
+static void apply_point_chain(const FilterStage* stages, int count,
+                              const unsigned char* in, unsigned char* out,
+                              int width, int channels) {
+    for (int s = 0; s < count; s++) {
+        apply_point_row(&stages[s], s == 0 ? in : out, out, width, channels);
+    }
+}
+
+static void apply_stencil_row(const FilterStage* st, const unsigned char* up,
+                              const unsigned char* mid, const unsigned char* down,
+                              unsigned char* out, int width, int channels,
+                              int border_row) {
+    size_t row_size = (size_t)width * channels;
+    
+    if (st->type == FILTER_BLUR) {
+        if (border_row) memcpy(out, mid, row_size);
+        else blur_row(up, mid, down, out, width, channels);
+    } else {
+        if (border_row) memset(out, 0, row_size);
+        else sobel_row(up, mid, down, out, width, channels, st->norm, st->param);
+    }
+}
+
+// One pass: `point_count` per-pixel stages, then `stencil` (may be NULL).
+static int run_fused_pass(const Image* src, Image* dst,
+                          const FilterStage* points, int point_count,
+                          const FilterStage* stencil, int thread_count) {
+    int width = src->width;
+    int height = src->height;
+    int channels = src->channels;
+    size_t row_size = (size_t)width * channels;
+    
+    if (!stencil) {
+#pragma omp parallel for num_threads(thread_count) schedule(runtime)
+        for (int i = 0; i < height; i++) {
+            apply_point_chain(points, point_count, src->data + i * row_size,
+                              dst->data + i * row_size, width, channels);
+        }
+        return 1;
+    }
+    
+    if (stencil->type == FILTER_GAUSS) {
+        GaussKernel k;
+        gauss_kernel_init(&k, stencil->sigma);
+        return gauss_blur_buffer(src->data, dst->data, width, height, channels, row_size,
+                                 &k, points, point_count, thread_count);
+    }
+    
+    if (is_integral_stage(stencil->type)) {
+        return integral_filter_buffer(stencil, src->data, dst->data, width, height, channels,
+                                      row_size, points, point_count, thread_count);
+    }
+    
+    if (point_count == 0) {
+#pragma omp parallel for num_threads(thread_count) schedule(runtime)
+        for (int i = 0; i < height; i++) {
+            const unsigned char* mid = src->data + i * row_size;
+            int border_row = (i == 0 || i == height - 1);
+            apply_stencil_row(stencil, border_row ? mid : mid - row_size, mid,
+                              border_row ? mid : mid + row_size,
+                              dst->data + i * row_size, width, channels, border_row);
+        }
+        return 1;
+    }
+    
+    // Ring of three transformed rows per thread: row y lives in slot y % 3
+    unsigned char* windows = (unsigned char*)malloc((size_t)thread_count * 3 * row_size);
+    if (!windows) {
+        fprintf(stderr, "Error: Could not allocate %d row windows of %zu bytes\n",
+                thread_count, 3 * row_size);
+        return 0;
+    }
+    
+#pragma omp parallel num_threads(thread_count)
+    {
+        int tid = 0, nthreads = 1;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+        nthreads = omp_get_num_threads();
+#endif
+        // Static block of rows per thread, like schedule(static)
+        int first, last;
+        static_block(height, tid, nthreads, &first, &last);
+        
+        unsigned char* window = windows + (size_t)tid * 3 * row_size;
+        int loaded_until = first - 2;   /* highest row held in the window */
+        
+        for (int i = first; i < last; i++) {
+            int lo = (i > 0) ? i - 1 : 0;
+            int hi = (i < height - 1) ? i + 1 : height - 1;
+            
+            for (int y = (loaded_until + 1 > lo) ? loaded_until + 1 : lo; y <= hi; y++) {
+                apply_point_chain(points, point_count, src->data + y * row_size,
+                                  window + (y % 3) * row_size, width, channels);
+            }
+            if (hi > loaded_until) loaded_until = hi;
+            
+            apply_stencil_row(stencil, window + (lo % 3) * row_size,
+                              window + (i % 3) * row_size,
+                              window + (hi % 3) * row_size,
+                              dst->data + i * row_size, width, channels,
+                              i == 0 || i == height - 1);
+        }
+    }
+    
+    free(windows);
+    return 1;
+}
+
+// ============================================
+// PLANAR (SoA) LAYOUT
+// ============================================
+//
+// With --layout planar the image is converted once after loading into
+// one plane per channel, each row padded to a 64-byte aligned pitch, and
+// back once before saving. Every filter then works on contiguous
+// single-channel rows; edge detection reads plane 0 only.
+
+static inline unsigned char* plane_row(const Image* img, int c, int y) {
+    return img->data + ((size_t)c * img->height + y) * img->pitch;
+}
+
+Image* create_planar_image(int width, int height, int channels) {
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) return NULL;
+    
+    // 64-byte rows, but avoid pitches that are multiples of 4 KB so that
+    // vertically adjacent pixels do not alias in the cache
+    size_t pitch = ((size_t)width + 63) & ~(size_t)63;
+    if (pitch % 4096 == 0) pitch += 64;
+    
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->planar = 1;
+    img->pitch = pitch;
+    img->map = NULL;
+    img->map_size = 0;
+    
+    // Plane rows are what the planar stages split between threads
+    img->data = pixel_buffer_alloc(pitch * height * channels, height * channels);
+    if (!img->data) {
+        free(img);
+        return NULL;
+    }
+    return img;
+}
+
+Image* image_to_planar(const Image* img, int thread_count) {
+    int width = img->width;
+    int channels = img->channels;
+    Image* out = create_planar_image(width, img->height, channels);
+    if (!out) return NULL;
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < img->height; i++) {
+        const unsigned char* src = img->data + (size_t)i * width * channels;
+        for (int c = 0; c < channels; c++) {
+            unsigned char* dst = plane_row(out, c, i);
+            for (int j = 0; j < width; j++) {
+                dst[j] = src[j * channels + c];
+            }
+        }
+    }
+    
+    return out;
+}
+
+Image* image_to_interleaved(const Image* img, Image* dst, int thread_count) {
+    int width = img->width;
+    int channels = img->channels;
+    Image* out = dst ? dst : create_image(width, img->height, channels);
+    if (!out) return NULL;
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < img->height; i++) {
+        unsigned char* dst = out->data + (size_t)i * width * channels;
+        for (int c = 0; c < channels; c++) {
+            const unsigned char* src = plane_row(img, c, i);
+            for (int j = 0; j < width; j++) {
+                dst[j * channels + c] = src[j];
+            }
+        }
+    }
+    
+    return out;
+}
+
+Image* image_to_gray(const Image* img, int luma, Image* dst, int thread_count) {
+    int width = img->width;
+    int channels = img->channels;
+    Image* out = dst ? dst : create_image(width, img->height, 1);
+    if (!out) return NULL;
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int i = 0; i < img->height; i++) {
+        const unsigned char* src = img->data + (size_t)i * img->pitch;
+        unsigned char* gray = out->data + (size_t)i * out->pitch;
+        if (luma && channels >= 3) {
+            for (int j = 0; j < width; j++) {
+                const unsigned char* p = src + j * channels;
+                gray[j] = (unsigned char)((GRAY_WR * p[0] + GRAY_WG * p[1] + GRAY_WB * p[2])
+                                          >> GRAY_SHIFT);
+            }
+        } else {
+            for (int j = 0; j < width; j++) gray[j] = src[j * channels];
+        }
+    }
+    
+    return out;
+}
+
+Image* gray_input(Image* img, const FilterStage* stages, int stage_count, int thread_count) {
+    if (img->channels == 1 || stage_count == 0 ||
+        pipeline_gray_stage(stages, stage_count) != 0) {
+        return img;
+    }
+    // grayscale of the luma plane is the luma itself; Sobel reads channel 0
+    Image* gray = image_to_gray(img, stages[0].type == FILTER_GRAYSCALE, NULL, thread_count);
+    free_image(img);
+    return gray;
+}
+
+// One stage on planar images (src != dst). Returns bytes moved.
+static size_t planar_stage(const FilterStage* st, const Image* src, Image* dst,
+                           int thread_count) {
+    int width = src->width;
+    int height = src->height;
+    int channels = src->channels;
+    size_t pitch = src->pitch;
+    size_t plane_bytes = (size_t)width * height;
+    int rows = channels * height;
+    
+    if (log_stages) printf("Applying %s filter (planar)...\n", stage_name(st->type));
+    
+    switch (st->type) {
+    case FILTER_GRAYSCALE:
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+        for (int i = 0; i < height; i++) {
+            const unsigned char* r = plane_row(src, 0, i);
+            const unsigned char* g = (channels > 1) ? plane_row(src, 1, i) : r;
+            const unsigned char* b = (channels > 2) ? plane_row(src, 2, i) : r;
+            unsigned char* gray = plane_row(dst, 0, i);
+            
+            grayscale_planar_row(r, g, b, gray, width);
+            for (int c = 1; c < channels && c < 3; c++) {
+                memcpy(plane_row(dst, c, i), gray, width);
+            }
+            if (channels > 3) memcpy(plane_row(dst, 3, i), plane_row(src, 3, i), width); // Alpha
+        }
+        break;
+        
+    case FILTER_CONTRAST:   /* parse_pipeline folds these into a LUT */
+    case FILTER_GAMMA:
+    case FILTER_INVERT:
+    case FILTER_THRESHOLD:
+        break;
+        
+    case FILTER_BRIGHTEN:
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+        for (int t = 0; t < rows; t++) {
+            brightness_row(plane_row(src, t / height, t % height),
+                           plane_row(dst, t / height, t % height), width, 1, st->param);
+        }
+        break;
+        
+    case FILTER_BLUR:
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+        for (int t = 0; t < rows; t++) {
+            int c = t / height, i = t % height;
+            const unsigned char* mid = plane_row(src, c, i);
+            unsigned char* out = plane_row(dst, c, i);
+            if (i == 0 || i == height - 1) {
+                memcpy(out, mid, width);
+            } else {
+                blur_row(mid - pitch, mid, mid + pitch, out, width, 1);
+            }
+        }
+        break;
+        
+    case FILTER_EDGE:
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+        for (int i = 0; i < height; i++) {
+            const unsigned char* mid = plane_row(src, 0, i);
+            unsigned char* out = plane_row(dst, 0, i);
+            if (i == 0 || i == height - 1) {
+                memset(out, 0, width);
+            } else {
+                sobel_row(mid - pitch, mid, mid + pitch, out, width, 1, st->norm, st->param);
+            }
+            for (int c = 1; c < channels; c++) {
+                memcpy(plane_row(dst, c, i), out, width);
+            }
+        }
+        return plane_bytes * (1 + channels);
+        
+    case FILTER_GAUSS: {
+        GaussKernel k;
+        gauss_kernel_init(&k, st->sigma);
+        for (int c = 0; c < channels; c++) {
+            if (!gauss_blur_buffer(plane_row(src, c, 0), plane_row(dst, c, 0), width, height,
+                                   1, pitch, &k, NULL, 0, thread_count)) {
+                return 0;
+            }
+        }
+        break;
+    }
+        
+    case FILTER_BOX:
+    case FILTER_THRESH:
+        for (int c = 0; c < channels; c++) {
+            if (!integral_filter_buffer(st, plane_row(src, c, 0), plane_row(dst, c, 0), width,
+                                        height, 1, pitch, NULL, 0, thread_count)) {
+                return 0;
+            }
+        }
+        break;
+        
+    case FILTER_EQUALIZE:
+    case FILTER_AUTOLEVELS:
+    case FILTER_STRETCH:
+    case FILTER_LUT: {
+        unsigned long long hist[HIST_BINS];
+        unsigned char lut[HIST_BINS];
+        for (int c = 0; c < channels; c++) {
+            const unsigned char* table = (st->type != FILTER_LUT) ? lut
+                                       : st->lut ? st->lut + c * HIST_BINS : st->table;
+            if (st->type != FILTER_LUT) {
+                if (!histogram_build(plane_row(src, c, 0), width, height, 1, pitch, hist,
+                                     thread_count)) {
+                    return 0;
+                }
+                tone_lut_build(st, hist, 1, lut);
+            }
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+            for (int i = 0; i < height; i++) {
+                lut_span(plane_row(src, c, i), plane_row(dst, c, i), width, table);
+            }
+        }
+        return plane_bytes * channels * (st->type == FILTER_LUT ? 2 : 3);
+    }
+    }
+    
+    return 2 * plane_bytes * channels;
+}
+
+// Planar images run one stage per pass, ping-ponging like run_pipeline
+static size_t run_planar_pipeline(Image* input, Image* output, const FilterStage* stages,
+                                  int stage_count, int thread_count) {
+    Image* scratch = NULL;
+    if (stage_count > 1) {
+        scratch = create_planar_image(input->width, input->height, input->channels);
+        if (!scratch) {
+            fprintf(stderr, "Error: Could not allocate output image\n");
+            return 0;
+        }
+    }
+    
+    size_t bytes = 0;
+    const Image* src = input;
+    for (int s = 0; s < stage_count; s++) {
+        Image* dst = ((stage_count - 1 - s) % 2 == 0) ? output : scratch;
+        size_t moved = planar_stage(&stages[s], src, dst, thread_count);
+        if (moved == 0) {
+            free_image(scratch);
+            return 0;
+        }
+        bytes += moved;
+        src = dst;
+    }
+    
+    free_image(scratch);
+    return bytes;
+}
+
+// ============================================
+// TILED STENCIL ENGINE
+// ============================================
+//
+// The whole pipeline runs one output tile at a time. A thread loads its
+// tile plus a halo of one pixel per stencil stage into a private scratch
+// buffer and runs every stage there, shrinking the valid region by one
+// pixel per stencil, so intermediate results never leave cache. Tiles
+// touching the image edge are not padded; the border rule of each
+// stencil (copy for blur, zero for edge) is applied there instead.
+
+// Border rule for `count` pixels on the image edge
+static void stencil_border_span(const FilterStage* st, const unsigned char* mid,
+                                unsigned char* out, int count, int channels) {
+    size_t n = (size_t)count * channels;
+    if (st->type == FILTER_BLUR) memcpy(out, mid, n);
+    else memset(out, 0, n);
+}
+
+// Apply one stencil stage to the region `out`, reading from `src` which
+// holds region `in` (out must lie inside in, shrunk by one pixel on every
+// side that is not on the image edge).
+static void stencil_region(const FilterStage* st,
+                           const unsigned char* src, const Region* in,
+                           unsigned char* dst, const Region* out,
+                           int width, int height, int channels) {
+    size_t src_pitch = (size_t)(in->x1 - in->x0) * channels;
+    size_t dst_pitch = (size_t)(out->x1 - out->x0) * channels;
+    
+    for (int y = out->y0; y < out->y1; y++) {
+        const unsigned char* mid = src + (size_t)(y - in->y0) * src_pitch
+                                 + (size_t)(out->x0 - in->x0) * channels;
+        unsigned char* o = dst + (size_t)(y - out->y0) * dst_pitch;
+        
+        if (y == 0 || y == height - 1) {
+            stencil_border_span(st, mid, o, out->x1 - out->x0, channels);
+            continue;
+        }
+        
+        int x = out->x0;
+        if (x == 0) {
+            stencil_border_span(st, mid, o, 1, channels);
+            x = 1;
+        }
+        
+        int x_end = (out->x1 < width - 1) ? out->x1 : width - 1;
+        if (x_end > x) {
+            size_t off = (size_t)(x - out->x0) * channels;
+            if (st->type == FILTER_BLUR) {
+                blur_span(mid - src_pitch + off, mid + off, mid + src_pitch + off,
+                          o + off, x_end - x, channels);
+            } else {
+                sobel_span(mid - src_pitch + off, mid + off, mid + src_pitch + off,
+                           o + off, x_end - x, channels, st->norm, st->param);
+            }
+        }
+        
+        if (out->x1 == width && x <= width - 1) {
+            size_t off = (size_t)(width - 1 - out->x0) * channels;
+            stencil_border_span(st, mid + off, o + off, 1, channels);
+        }
+    }
+}
+
+// Context each stage of a chain needs on every side
+typedef struct {
+    const FilterStage* stages;
+    int stage_count;
+    int radius[MAX_STAGES];
+    GaussKernel kernels[MAX_STAGES];
+    int halo;       /* sum of the stage radii */
+} StageChain;
+
+static void stage_chain_init(StageChain* chain, const FilterStage* stages, int stage_count) {
+    chain->stages = stages;
+    chain->stage_count = stage_count;
+    chain->halo = 0;
+    for (int s = 0; s < stage_count; s++) {
+        chain->radius[s] = is_point_stage(stages[s].type) ? 0 : 1;
+        if (stages[s].type == FILTER_GAUSS) {
+            gauss_kernel_init(&chain->kernels[s], stages[s].sigma);
+            chain->radius[s] = chain->kernels[s].radius;
+        } else if (is_integral_stage(stages[s].type)) {
+            chain->radius[s] = stages[s].param;
+        }
+        chain->halo += chain->radius[s];
+    }
+}
+
+// Run the whole chain for one output tile. `src` holds full-width image
+// rows starting at row src_y0 (enough to cover the tile plus halo) and
+// the tile is written into `dst`, which holds region dst_area (rows of
+// its width). *a and *b are scratch buffers of (tile + 2 * halo)^2
+// pixels; they may come back swapped. Returns bytes copied in and out,
+// or 0 if a stage could not allocate its working memory.
+static size_t run_tile(const StageChain* chain, const unsigned char* src, int src_y0,
+                       unsigned char* dst, const Region* dst_area, const Region* tile,
+                       int width, int height, int channels,
+                       unsigned char** a_buf, unsigned char** b_buf) {
+    const FilterStage* stages = chain->stages;
+    int halo = chain->halo;
+    size_t row_size = (size_t)width * channels;
+    unsigned char* a = *a_buf;
+    unsigned char* b = *b_buf;
+    size_t bytes = 0;
+    
+    Region r;
+    r.y0 = (tile->y0 - halo > 0) ? tile->y0 - halo : 0;
+    r.x0 = (tile->x0 - halo > 0) ? tile->x0 - halo : 0;
+    r.y1 = (tile->y1 + halo < height) ? tile->y1 + halo : height;
+    r.x1 = (tile->x1 + halo < width) ? tile->x1 + halo : width;
+    
+    int rw = r.x1 - r.x0;
+    size_t pitch = (size_t)rw * channels;
+    for (int y = r.y0; y < r.y1; y++) {
+        memcpy(a + (size_t)(y - r.y0) * pitch,
+               src + (size_t)(y - src_y0) * row_size + (size_t)r.x0 * channels, pitch);
+    }
+    bytes += (size_t)(r.y1 - r.y0) * pitch;
+    
+    for (int s = 0; s < chain->stage_count; s++) {
+        const FilterStage* st = &stages[s];
+        int radius = chain->radius[s];
+        pitch = (size_t)(r.x1 - r.x0) * channels;
+        
+        if (is_point_stage(st->type)) {
+            for (int y = 0; y < r.y1 - r.y0; y++) {
+                apply_point_row(st, a + y * pitch, a + y * pitch,
+                                r.x1 - r.x0, channels);
+            }
+            continue;
+        }
+        
+        Region o = r;
+        if (o.y0 > 0) o.y0 += radius;
+        if (o.x0 > 0) o.x0 += radius;
+        if (o.y1 < height) o.y1 -= radius;
+        if (o.x1 < width) o.x1 -= radius;
+        
+        if (st->type == FILTER_GAUSS || is_integral_stage(st->type)) {
+            // Filter the whole region (its non-edge sides clamp or cut
+            // the window, which only corrupts the margin dropped below),
+            // then pack the valid part into b.
+            int ok = (st->type == FILTER_GAUSS)
+                ? gauss_blur_buffer(a, a, r.x1 - r.x0, r.y1 - r.y0, channels, pitch,
+                                    &chain->kernels[s], NULL, 0, 1)
+                : integral_filter_buffer(st, a, a, r.x1 - r.x0, r.y1 - r.y0, channels,
+                                         pitch, NULL, 0, 1);
+            if (!ok) {
+                *a_buf = a;
+                *b_buf = b;
+                return 0;
+            }
+            size_t o_pitch = (size_t)(o.x1 - o.x0) * channels;
+            for (int y = o.y0; y < o.y1; y++) {
+                memcpy(b + (size_t)(y - o.y0) * o_pitch,
+                       a + (size_t)(y - r.y0) * pitch + (size_t)(o.x0 - r.x0) * channels,
+                       o_pitch);
+            }
+        } else {
+            stencil_region(st, a, &r, b, &o, width, height, channels);
+        }
+        
+        unsigned char* tmp = a;
+        a = b;
+        b = tmp;
+        r = o;
+    }
+    
+    // r may extend past the tile where the halo was clipped
+    pitch = (size_t)(r.x1 - r.x0) * channels;
+    size_t tile_pitch = (size_t)(tile->x1 - tile->x0) * channels;
+    size_t dst_pitch = (size_t)(dst_area->x1 - dst_area->x0) * channels;
+    for (int y = tile->y0; y < tile->y1; y++) {
+        memcpy(dst + (size_t)(y - dst_area->y0) * dst_pitch
+                   + (size_t)(tile->x0 - dst_area->x0) * channels,
+               a + (size_t)(y - r.y0) * pitch + (size_t)(tile->x0 - r.x0) * channels,
+               tile_pitch);
+    }
+    bytes += (size_t)(tile->y1 - tile->y0) * tile_pitch;
+    
+    *a_buf = a;
+    *b_buf = b;
+    return bytes;
+}
+
+// A tile side: the requested size (or the default when none was given)
+// clamped to the image, since a larger tile only costs scratch memory
+static int tile_extent(int requested, int fallback, int limit) {
+    int extent = (requested > 0) ? requested : fallback;
+    return (extent < limit) ? extent : limit;
+}
+
+static void tile_scratch_free(unsigned char** scratch, int thread_count) {
+    if (!scratch) return;
+    for (int i = 0; i < 2 * thread_count; i++) {
+        free(scratch[i]);
+    }
+    free(scratch);
+}
+
+// Two scratch buffers of `bytes` per thread, [2 * tid] and [2 * tid + 1];
+// NULL (after an error message) if any allocation fails. Untouched until
+// a tile runs, so each thread first-touches its own pair.
+static unsigned char** tile_scratch_alloc(int thread_count, size_t bytes) {
+    unsigned char** scratch = (unsigned char**)calloc(2 * thread_count, sizeof(unsigned char*));
+    int ok = scratch != NULL;
+    for (int i = 0; ok && i < 2 * thread_count; i++) {
+        scratch[i] = (unsigned char*)malloc(bytes);
+        ok = scratch[i] != NULL;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Could not allocate %d tile buffers of %zu bytes\n",
+                2 * thread_count, bytes);
+        tile_scratch_free(scratch, thread_count);
+        return NULL;
+    }
+    return scratch;
+}
+
+// Returns bytes moved, 0 if the tile buffers could not be allocated
+static size_t run_tiled(const Image* src, Image* dst, const FilterStage* stages,
+                        int stage_count, const PipelineOptions* opts) {
+    int width = src->width;
+    int height = src->height;
+    int channels = src->channels;
+    int tile_w = tile_extent(opts->tile_width, width, width);
+    int tile_h = tile_extent(opts->tile_height, height, height);
+    
+    StageChain chain;
+    stage_chain_init(&chain, stages, stage_count);
+    int halo = chain.halo;
+    
+    int tiles_x = (width + tile_w - 1) / tile_w;
+    int tiles_y = (height + tile_h - 1) / tile_h;
+    int tile_count = tiles_x * tiles_y;
+    size_t buf_size = (size_t)(tile_h + 2 * halo) * (tile_w + 2 * halo) * channels;
+    size_t bytes = 0;
+    int failed = 0;
+    Region whole = {0, height, 0, width};
+    unsigned char** scratch = tile_scratch_alloc(opts->thread_count, buf_size);
+    if (!scratch) return 0;
+    
+    if (log_stages) {
+        printf("Tiled execution: %dx%d tiles (%d x %d), halo %d\n",
+               tile_w, tile_h, tiles_x, tiles_y, halo);
+    }
+    
+#pragma omp parallel num_threads(opts->thread_count) reduction(+:bytes, failed)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        
+#pragma omp for schedule(runtime)
+        for (int t = 0; t < tile_count; t++) {
+            Region tile;
+            tile.y0 = (t / tiles_x) * tile_h;
+            tile.x0 = (t % tiles_x) * tile_w;
+            tile.y1 = (tile.y0 + tile_h < height) ? tile.y0 + tile_h : height;
+            tile.x1 = (tile.x0 + tile_w < width) ? tile.x0 + tile_w : width;
+            
+            size_t moved = run_tile(&chain, src->data, 0, dst->data, &whole, &tile,
+                                    width, height, channels,
+                                    &scratch[2 * tid], &scratch[2 * tid + 1]);
+            bytes += moved;
+            failed += (moved == 0);
+        }
+    }
+    
+    tile_scratch_free(scratch, opts->thread_count);
+    return failed ? 0 : bytes;
+}
+
+// --sched steal: every tile is a task instead of a loop iteration, so no
+// thread idles at a loop barrier while tiles are still queued. Idle
+// threads take queued tasks (per-thread deques with stealing in LLVM's
+// libomp, a shared queue in libgomp). Holds two scratch buffers per
+// thread for the tiles that thread happens to run.
+typedef struct {
+    StageChain chain;
+    int tile_w;
+    int tile_h;
+    int thread_count;
+    unsigned char** scratch;
+} TileTasks;
+
+// Tiles are clamped to max_width x max_height, the largest image they
+// will cover; returns 0 if the scratch buffers could not be allocated
+static int tile_tasks_init(TileTasks* tt, const FilterStage* stages, int stage_count,
+                           const PipelineOptions* opts, int channels,
+                           int max_width, int max_height) {
+    stage_chain_init(&tt->chain, stages, stage_count);
+    tt->tile_w = tile_extent(opts->tile_width, TASK_TILE_WIDTH, max_width);
+    tt->tile_h = tile_extent(opts->tile_height, TASK_TILE_HEIGHT, max_height);
+    tt->thread_count = opts->thread_count;
+    
+    int halo = tt->chain.halo;
+    size_t buf_size = (size_t)(tt->tile_h + 2 * halo) * (tt->tile_w + 2 * halo) * channels;
+    tt->scratch = tile_scratch_alloc(tt->thread_count, buf_size);
+    return tt->scratch != NULL;
+}
+
+static void tile_tasks_free(TileTasks* tt) {
+    tile_scratch_free(tt->scratch, tt->thread_count);
+}
+
+// Queue the tiles of one image and wait for them. Must run inside a
+// parallel region (any thread, any task); returns bytes moved, or 0 if
+// any tile failed.
+static size_t run_tile_tasks(const TileTasks* tt, const Image* src, Image* dst) {
+    int width = src->width;
+    int height = src->height;
+    int channels = src->channels;
+    int tiles_x = (width + tt->tile_w - 1) / tt->tile_w;
+    int tiles_y = (height + tt->tile_h - 1) / tt->tile_h;
+    size_t bytes = 0;
+    int failed = 0;
+    Region whole = {0, height, 0, width};
+    
+#pragma omp taskloop grainsize(1) shared(bytes, failed)
+    for (int t = 0; t < tiles_x * tiles_y; t++) {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        Region tile;
+        tile.y0 = (t / tiles_x) * tt->tile_h;
+        tile.x0 = (t % tiles_x) * tt->tile_w;
+        tile.y1 = (tile.y0 + tt->tile_h < height) ? tile.y0 + tt->tile_h : height;
+        tile.x1 = (tile.x0 + tt->tile_w < width) ? tile.x0 + tt->tile_w : width;
+        
+        // The scratch pair belongs to whichever thread runs the tile;
+        // run_tile has no task scheduling points, so it is not shared
+        size_t moved = run_tile(&tt->chain, src->data, 0, dst->data, &whole, &tile,
+                                width, height, channels,
+                                &tt->scratch[2 * tid], &tt->scratch[2 * tid + 1]);
+        if (moved == 0) {
+#pragma omp atomic write
+            failed = 1;
+        }
+#pragma omp atomic
+        bytes += moved;
+    }
+    
+    return failed ? 0 : bytes;
+}
+
+static size_t run_tiled_tasks(const Image* src, Image* dst, const FilterStage* stages,
+                              int stage_count, const PipelineOptions* opts) {
+    TileTasks tt;
+    if (!tile_tasks_init(&tt, stages, stage_count, opts, src->channels,
+                         src->width, src->height)) {
+        return 0;
+    }
+    size_t bytes = 0;
+    
+    if (log_stages) {
+        printf("Task-tiled execution: %dx%d tiles (%d x %d), halo %d\n",
+               tt.tile_w, tt.tile_h, (src->width + tt.tile_w - 1) / tt.tile_w,
+               (src->height + tt.tile_h - 1) / tt.tile_h, tt.chain.halo);
+    }
+    
+#pragma omp parallel num_threads(opts->thread_count)
+#pragma omp single
+    bytes = run_tile_tasks(&tt, src, dst);
+    
+    tile_tasks_free(&tt);
+    return bytes;
+}
+
+// Fused passes over whole images, ping-ponging between output and one
+// scratch image; returns 0 if a buffer could not be allocated
+static size_t run_passes(const Image* input, Image* output, const FilterStage* stages,
+                         int stage_count, int thread_count) {
+    size_t image_bytes = (size_t)input->width * input->height * input->channels;
+    
+    // Group stages into passes
+    int pass_start[MAX_STAGES];
+    int pass_len[MAX_STAGES];
+    int pass_count = 0;
+    for (int s = 0; s < stage_count; ) {
+        pass_start[pass_count] = s;
+        while (s < stage_count && is_point_stage(stages[s].type)) s++;
+        if (s < stage_count) s++;   /* the stencil that closes the pass */
+        pass_len[pass_count] = s - pass_start[pass_count];
+        pass_count++;
+    }
+    
+    if (log_stages) {
+        printf("Applying pipeline:");
+        for (int s = 0; s < stage_count; s++) {
+            printf("%s%s", s ? " -> " : " ", stage_name(stages[s].type));
+        }
+        printf(" (%d fused pass%s)\n", pass_count, pass_count == 1 ? "" : "es");
+    }
+    
+    Image* scratch = NULL;
+    if (pass_count > 1) {
+        scratch = create_image(input->width, input->height, input->channels);
+        if (!scratch) {
+            fprintf(stderr, "Error: Could not allocate output image\n");
+            return 0;
+        }
+    }
+    
+    const Image* src = input;
+    for (int p = 0; p < pass_count; p++) {
+        // Alternate so that the last pass lands in `output`
+        Image* dst = ((pass_count - 1 - p) % 2 == 0) ? output : scratch;
+        const FilterStage* first = &stages[pass_start[p]];
+        const FilterStage* last = first + pass_len[p] - 1;
+        
+        int ok = is_point_stage(last->type)
+            ? run_fused_pass(src, dst, first, pass_len[p], NULL, thread_count)
+            : run_fused_pass(src, dst, first, pass_len[p] - 1, last, thread_count);
+        if (!ok) {
+            free_image(scratch);
+            return 0;
+        }
+        src = dst;
+    }
+    
+    free_image(scratch);
+    return 2 * image_bytes * pass_count;
+}
+
+// The stages up to each tone stage run first; the tone stage takes the
+// histogram of their result and continues as a table lookup, which then
+// fuses into the next pass
+static size_t run_tone_pipeline(const Image* input, Image* output, const FilterStage* stages,
+                                int stage_count, int thread_count) {
+    int width = input->width;
+    int height = input->height;
+    int channels = input->channels;
+    size_t image_bytes = (size_t)width * height * channels;
+    FilterStage work[MAX_STAGES];
+    unsigned char luts[MAX_STAGES][MAX_CHANNELS * HIST_BINS];
+    unsigned long long hist[MAX_CHANNELS * HIST_BINS];
+    Image* held[2] = {NULL, NULL};
+    int next = 0;
+    const Image* src = input;
+    size_t bytes = 0;
+    int start = 0;
+    
+    memcpy(work, stages, stage_count * sizeof(FilterStage));
+    for (int s = 0; s < stage_count; s++) {
+        if (!is_tone_stage(work[s].type)) continue;
+        
+        if (s > start) {
+            if (!held[next]) held[next] = create_image(width, height, channels);
+            size_t moved = held[next]
+                ? run_passes(src, held[next], work + start, s - start, thread_count) : 0;
+            if (moved == 0) {
+                if (!held[next]) fprintf(stderr, "Error: Could not allocate output image\n");
+                free_image(held[0]);
+                free_image(held[1]);
+                return 0;
+            }
+            bytes += moved;
+            src = held[next];
+            next = 1 - next;
+        }
+        
+        if (log_stages) {
+            printf("Applying %s (histogram of %d x %d pixels)...\n",
+                   stage_name(work[s].type), width, height);
+        }
+        if (!histogram_build(src->data, width, height, channels, (size_t)width * channels,
+                             hist, thread_count)) {
+            free_image(held[0]);
+            free_image(held[1]);
+            return 0;
+        }
+        tone_lut_build(&work[s], hist, channels, luts[s]);
+        bytes += image_bytes;
+        
+        work[s].type = FILTER_LUT;
+        work[s].lut = luts[s];
+        start = s;
+    }
+    
+    size_t moved = run_passes(src, output, work + start, stage_count - start, thread_count);
+    free_image(held[0]);
+    free_image(held[1]);
+    return moved ? bytes + moved : 0;
+}
+
+size_t run_pipeline(Image* input, Image* output, const FilterStage* stages,
+                    int stage_count, const PipelineOptions* opts) {
+    int thread_count = opts->thread_count;
+    size_t image_bytes = (size_t)input->width * input->height * input->channels;
+    
+    if (input->planar) {
+        return run_planar_pipeline(input, output, stages, stage_count, thread_count);
+    }
+    
+    if (opts->device) {
+        return run_device_pipeline(input, output, stages, stage_count);
+    }
+    
+    // Tiles never see the whole image, so tone stages always run as
+    // whole-image passes (main rejects --tile and steal with them; server
+    // jobs fall back silently)
+    if (pipeline_has_tone_stage(stages, stage_count)) {
+        return run_tone_pipeline(input, output, stages, stage_count, thread_count);
+    }
+    
+    if (opts->sched == SCHED_STEAL) {
+        return run_tiled_tasks(input, output, stages, stage_count, opts);
+    }
+    
+    if (opts->tile_width > 0 && opts->tile_height > 0) {
+        return run_tiled(input, output, stages, stage_count, opts);
+    }
+    
+    // A single filter keeps its original entry point and log line
+    if (stage_count == 1) {
+        switch (stages[0].type) {
+            case FILTER_GRAYSCALE: grayscale_filter(input, output, thread_count); break;
+            case FILTER_BLUR:      gaussian_blur_filter(input, output, thread_count); break;
+            case FILTER_EDGE:
+                sobel_edge_filter(input, output, stages[0].norm, stages[0].param, thread_count);
+                break;
+            case FILTER_BRIGHTEN:  brightness_filter(input, output, stages[0].param, thread_count); break;
+            case FILTER_GAUSS:
+                if (!separable_gaussian_filter(input, output, stages[0].sigma, thread_count)) {
+                    return 0;
+                }
+                break;
+            case FILTER_BOX:
+                if (!box_blur_filter(input, output, stages[0].param, thread_count)) return 0;
+                break;
+            case FILTER_THRESH:
+                if (!adaptive_threshold_filter(input, output, stages[0].param, stages[0].offset,
+                                               thread_count)) return 0;
+                break;
+            case FILTER_EQUALIZE:       /* tone stages were routed above */
+            case FILTER_AUTOLEVELS:
+            case FILTER_STRETCH:
+            case FILTER_CONTRAST:       /* parse_pipeline folds these into a LUT */
+            case FILTER_GAMMA:
+            case FILTER_INVERT:
+            case FILTER_THRESHOLD:
+            case FILTER_LUT:
+                return run_passes(input, output, stages, stage_count, thread_count);
+        }
+        return 2 * image_bytes;
+    }
+    
+    return run_passes(input, output, stages, stage_count, thread_count);
+}
+
+// ============================================
+// REGION OF INTEREST (--roi WxH+X+Y)
+// ============================================
+//
+// Only the requested window is computed. It is cut into tiles and each
+// tile runs the chain through run_tile, which copies in just the tile
+// plus the chain's halo, so the work is proportional to the window and
+// the result is that window of a full run. The input is mapped without
+// readahead (load_image_lazy) and only the pages under the window plus
+// halo are prefetched; the rest of the file is never read.
+
+int parse_roi(const char* spec, Region* roi) {
+    int w, h, x, y;
+    char tail;
+    if (sscanf(spec, "%dx%d+%d+%d%c", &w, &h, &x, &y, &tail) != 4 ||
+        w < 1 || h < 1 || x < 0 || y < 0 || w > INT_MAX - x || h > INT_MAX - y) {
+        return 0;
+    }
+    roi->x0 = x;
+    roi->y0 = y;
+    roi->x1 = x + w;
+    roi->y1 = y + h;
+    return 1;
+}
+
+// Runs of rows whose spans share or touch pages go out as one call
+void prefetch_region(const Image* img, const Region* r) {
+    if (!img->map) return;
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t run_start = 0, run_end = 0;
+    for (int y = r->y0; y < r->y1; y++) {
+        uintptr_t start = (uintptr_t)(img->data + (size_t)y * img->pitch
+                                      + (size_t)r->x0 * img->channels);
+        uintptr_t end = start + (size_t)(r->x1 - r->x0) * img->channels;
+        start &= ~(page - 1);
+        if (run_end > run_start && start <= run_end) {
+            if (end > run_end) run_end = end;
+            continue;
+        }
+        if (run_end > run_start) madvise((void*)run_start, run_end - run_start, MADV_WILLNEED);
+        run_start = start;
+        run_end = end;
+    }
+    if (run_end > run_start) madvise((void*)run_start, run_end - run_start, MADV_WILLNEED);
+}
+
+size_t run_roi(const Image* src, Image* dst, const Region* roi, const FilterStage* stages,
+               int stage_count, const PipelineOptions* opts) {
+    int width = src->width;
+    int height = src->height;
+    int channels = src->channels;
+    int tile_w = tile_extent(opts->tile_width, TASK_TILE_WIDTH, roi->x1 - roi->x0);
+    int tile_h = tile_extent(opts->tile_height, TASK_TILE_HEIGHT, roi->y1 - roi->y0);
+    
+    StageChain chain;
+    stage_chain_init(&chain, stages, stage_count);
+    int halo = chain.halo;
+    
+    Region need;
+    need.y0 = (roi->y0 - halo > 0) ? roi->y0 - halo : 0;
+    need.x0 = (roi->x0 - halo > 0) ? roi->x0 - halo : 0;
+    need.y1 = (roi->y1 + halo < height) ? roi->y1 + halo : height;
+    need.x1 = (roi->x1 + halo < width) ? roi->x1 + halo : width;
+    prefetch_region(src, &need);
+    
+    int tiles_x = (roi->x1 - roi->x0 + tile_w - 1) / tile_w;
+    int tiles_y = (roi->y1 - roi->y0 + tile_h - 1) / tile_h;
+    int tile_count = tiles_x * tiles_y;
+    size_t buf_size = (size_t)(tile_h + 2 * halo) * (tile_w + 2 * halo) * channels;
+    size_t bytes = 0;
+    int failed = 0;
+    unsigned char** scratch = tile_scratch_alloc(opts->thread_count, buf_size);
+    if (!scratch) return 0;
+    
+    if (log_stages) {
+        printf("ROI %dx%d at (%d, %d): %d x %d tiles of %dx%d, reading %dx%d "
+               "(%.1f%% of the image)\n", roi->x1 - roi->x0, roi->y1 - roi->y0,
+               roi->x0, roi->y0, tiles_x, tiles_y, tile_w, tile_h,
+               need.x1 - need.x0, need.y1 - need.y0,
+               100.0 * (need.x1 - need.x0) * (need.y1 - need.y0) / ((double)width * height));
+    }
+    
+#pragma omp parallel num_threads(opts->thread_count) reduction(+:bytes, failed)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        
+#pragma omp for schedule(runtime)
+        for (int t = 0; t < tile_count; t++) {
+            Region tile;
+            tile.y0 = roi->y0 + (t / tiles_x) * tile_h;
+            tile.x0 = roi->x0 + (t % tiles_x) * tile_w;
+            tile.y1 = (tile.y0 + tile_h < roi->y1) ? tile.y0 + tile_h : roi->y1;
+            tile.x1 = (tile.x0 + tile_w < roi->x1) ? tile.x0 + tile_w : roi->x1;
+            
+            size_t moved = run_tile(&chain, src->data, 0, dst->data, roi, &tile,
+                                    width, height, channels,
+                                    &scratch[2 * tid], &scratch[2 * tid + 1]);
+            bytes += moved;
+            failed += (moved == 0);
+        }
+    }
+    
+    tile_scratch_free(scratch, opts->thread_count);
+    return failed ? 0 : bytes;
+}
+
+// ============================================
+// GPU OFFLOAD (--device gpu)
+// ============================================
+//
+// The chain runs as OpenMP target regions with the image resident in
+// device memory from the first stage to the last: the input and output
+// buffers are associated with device allocations and a third one takes
+// the ping-pong for chains of more than one stage. Uploads, kernels and
+// downloads are issued per chunk of DEVICE_CHUNK_ROWS rows as nowait
+// target tasks whose depend clauses name the chunks they read (a stencil
+// also reads the neighbouring ones) and write, so chunk k+1 uploads
+// while chunk k is filtered and finished chunks download while later
+// ones still compute. The kernels produce the same bytes as the host.
+//
+// The device code needs an offload compiler (make gpu). Without a device
+// the target regions run on the host and the transfers have nothing to
+// copy.
+
+int device_chain_supported(const FilterStage* stages, int stage_count) {
+    for (int s = 0; s < stage_count; s++) {
+        FilterType type = stages[s].type;
+        if (!(type == FILTER_GRAYSCALE || type == FILTER_BRIGHTEN || type == FILTER_BLUR ||
+              type == FILTER_EDGE || (type == FILTER_LUT && !stages[s].lut))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int device_available(int* dev) {
+#ifdef _OPENMP
+    *dev = omp_get_default_device();
+    return omp_get_num_devices() > 0 && *dev != omp_get_initial_device();
+#else
+    *dev = 0;
+    return 0;
+#endif
+}
+
+// Device memory for `size` bytes; with `host` given it is associated so
+// that target update moves between the two. Without a device the host
+// buffer (or a fresh one) is used directly.
+static unsigned char* device_buffer(unsigned char* host, size_t size, int dev, int on_device) {
+#ifdef _OPENMP
+    if (on_device) {
+        unsigned char* p = (unsigned char*)omp_target_alloc(size, dev);
+        if (p && host && omp_target_associate_ptr(host, p, size, 0, dev) != 0) {
+            omp_target_free(p, dev);
+            return NULL;
+        }
+        return p;
+    }
+#endif
+    (void)dev;
+    (void)on_device;
+    return host ? host : (unsigned char*)malloc(size);
+}
+
+static void device_buffer_free(unsigned char* p, unsigned char* host, int dev, int on_device) {
+    if (!p) return;
+#ifdef _OPENMP
+    if (on_device) {
+        if (host) omp_target_disassociate_ptr(host, dev);
+        omp_target_free(p, dev);
+        return;
+    }
+#endif
+    if (!host) free(p);
+}
+
+// One stage over rows [y0, y1) as a deferred target task. Dependences
+// are keyed on the first byte of each chunk a task touches.
+static void device_stage(const FilterStage* st, const unsigned char* src, unsigned char* dst,
+                         int width, int height, int channels, int y0, int y1) {
+    size_t row = (size_t)width * channels;
+    size_t off = (size_t)y0 * row;
+    size_t prev = (y0 > 0) ? off - (size_t)DEVICE_CHUNK_ROWS * row : off;
+    size_t next = (y1 < height) ? (size_t)y1 * row : off;
+    size_t begin = off, end = (size_t)y1 * row;
+    
+    if (st->type == FILTER_GRAYSCALE) {
+#pragma omp target teams distribute parallel for is_device_ptr(src, dst) \
+        depend(in: src[off]) depend(out: dst[off]) nowait
+        for (size_t i = begin; i < end; i += channels) {
+            unsigned char r = src[i];
+            unsigned char g = (channels > 1) ? src[i + 1] : r;
+            unsigned char b = (channels > 2) ? src[i + 2] : r;
+            unsigned char gray = (unsigned char)((GRAY_WR * r + GRAY_WG * g + GRAY_WB * b)
+                                                 >> GRAY_SHIFT);
+            dst[i] = gray;
+            if (channels > 1) dst[i + 1] = gray;
+            if (channels > 2) dst[i + 2] = gray;
+            if (channels > 3) dst[i + 3] = src[i + 3];
+        }
+    } else if (st->type == FILTER_BRIGHTEN) {
+        int brightness = st->param;
+#pragma omp target teams distribute parallel for is_device_ptr(src, dst) \
+        depend(in: src[off]) depend(out: dst[off]) nowait
+        for (size_t i = begin; i < end; i++) {
+            int v = src[i] + brightness;
+            dst[i] = (unsigned char)(v > 255 ? 255 : (v < 0 ? 0 : v));
+        }
+    } else if (st->type == FILTER_LUT) {
+        const unsigned char* table = st->table;
+#pragma omp target teams distribute parallel for is_device_ptr(src, dst) \
+        map(to: table[0:256]) depend(in: src[off]) depend(out: dst[off]) nowait
+        for (size_t i = begin; i < end; i++) dst[i] = table[src[i]];
+    } else if (st->type == FILTER_BLUR) {
+        // Border pixels are copied, as on the host
+#pragma omp target teams distribute parallel for collapse(2) is_device_ptr(src, dst) \
+        depend(in: src[prev], src[off], src[next]) depend(out: dst[off]) nowait
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t i = (size_t)y * row + (size_t)x * channels;
+                int border = (y == 0 || y == height - 1 || x == 0 || x == width - 1);
+                for (int c = 0; c < channels; c++) {
+                    size_t k = i + c;
+                    dst[k] = border ? src[k] : (unsigned char)((
+                        src[k - row - channels] + 2 * src[k - row] + src[k - row + channels]
+                        + 2 * (src[k - channels] + 2 * src[k] + src[k + channels])
+                        + src[k + row - channels] + 2 * src[k + row] + src[k + row + channels])
+                        >> 4);
+                }
+            }
+        }
+    } else {
+        // Sobel of channel 0 into every channel; border pixels are zero,
+        // as on the host
+        int norm = st->norm, level = st->param;
+#pragma omp target teams distribute parallel for collapse(2) is_device_ptr(src, dst) \
+        depend(in: src[prev], src[off], src[next]) depend(out: dst[off]) nowait
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0; x < width; x++) {
+                size_t i = (size_t)y * row + (size_t)x * channels;
+                unsigned char edge = 0;
+                if (y > 0 && y < height - 1 && x > 0 && x < width - 1) {
+                    const unsigned char* u = src + i - row;
+                    const unsigned char* m = src + i;
+                    const unsigned char* d = src + i + row;
+                    int gx = (u[channels] - u[-channels]) + 2 * (m[channels] - m[-channels])
+                           + (d[channels] - d[-channels]);
+                    int gy = (d[-channels] + 2 * d[0] + d[channels])
+                           - (u[-channels] + 2 * u[0] + u[channels]);
+                    int l1 = (gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy);
+                    if (norm == EDGE_L1) {
+                        edge = level ? (l1 >= level ? 255 : 0)
+                                     : (unsigned char)(l1 > 255 ? 255 : l1);
+                    } else if (level) {
+                        edge = (gx * gx + gy * gy >= level * level) ? 255 : 0;
+                    } else {
+                        float magnitude = sqrtf((float)(gx * gx + gy * gy));
+                        edge = (unsigned char)(magnitude > 255 ? 255 : magnitude);
+                    }
+                }
+                for (int c = 0; c < channels; c++) dst[i + c] = edge;
+            }
+        }
+    }
+}
+
+size_t run_device_pipeline(const Image* input, Image* output, const FilterStage* stages,
+                           int stage_count) {
+    int width = input->width;
+    int height = input->height;
+    int channels = input->channels;
+    size_t row = (size_t)width * channels;
+    size_t image_bytes = row * height;
+    int dev;
+    int on_device = device_available(&dev);
+    
+    // The last stage writes d_out; earlier ones alternate so that it does
+    unsigned char* host_in = input->data;
+    unsigned char* host_out = output->data;
+    unsigned char* d_in = device_buffer(host_in, image_bytes, dev, on_device);
+    unsigned char* d_out = device_buffer(host_out, image_bytes, dev, on_device);
+    unsigned char* d_tmp = (stage_count > 1) ? device_buffer(NULL, image_bytes, dev, on_device)
+                                             : NULL;
+    if (!d_in || !d_out || (stage_count > 1 && !d_tmp)) {
+        fprintf(stderr, "Error: Could not allocate %zu bytes of device memory\n", image_bytes);
+        device_buffer_free(d_in, host_in, dev, on_device);
+        device_buffer_free(d_out, host_out, dev, on_device);
+        device_buffer_free(d_tmp, NULL, dev, on_device);
+        return 0;
+    }
+    
+    if (log_stages) {
+        printf("Offloading %d stage%s to %s, %d-row chunks\n", stage_count,
+               stage_count == 1 ? "" : "s", on_device ? "the device" : "the host (no device)",
+               DEVICE_CHUNK_ROWS);
+    }
+    
+    for (int y0 = 0; y0 < height; y0 += DEVICE_CHUNK_ROWS) {
+        int y1 = (y0 + DEVICE_CHUNK_ROWS < height) ? y0 + DEVICE_CHUNK_ROWS : height;
+        size_t off = (size_t)y0 * row, len = (size_t)(y1 - y0) * row;
+#pragma omp target update to(host_in[off:len]) depend(out: d_in[off]) nowait
+    }
+    
+    const unsigned char* src = d_in;
+    for (int s = 0; s < stage_count; s++) {
+        unsigned char* dst = ((stage_count - 1 - s) % 2 == 0) ? d_out : d_tmp;
+        for (int y0 = 0; y0 < height; y0 += DEVICE_CHUNK_ROWS) {
+            int y1 = (y0 + DEVICE_CHUNK_ROWS < height) ? y0 + DEVICE_CHUNK_ROWS : height;
+            device_stage(&stages[s], src, dst, width, height, channels, y0, y1);
+        }
+        src = dst;
+    }
+    
+    for (int y0 = 0; y0 < height; y0 += DEVICE_CHUNK_ROWS) {
+        int y1 = (y0 + DEVICE_CHUNK_ROWS < height) ? y0 + DEVICE_CHUNK_ROWS : height;
+        size_t off = (size_t)y0 * row, len = (size_t)(y1 - y0) * row;
+#pragma omp target update from(host_out[off:len]) depend(in: d_out[off]) nowait
+    }
+#pragma omp taskwait
+    
+    device_buffer_free(d_in, host_in, dev, on_device);
+    device_buffer_free(d_out, host_out, dev, on_device);
+    device_buffer_free(d_tmp, NULL, dev, on_device);
+    return 2 * image_bytes * stage_count;
+}
+
+// ============================================
+// STREAMING BAND PROCESSING (--stream ROWS)
+// ============================================
+//
+// Images larger than memory are filtered in horizontal bands of ROWS
+// output rows without ever holding the whole image. Each input band
+// carries the chain's halo rows on both sides; rows shared with the next
+// band are copied over rather than re-read. Reading band k+1, filtering
+// band k (as tiles of the tiled engine) and writing band k-1 run as
+// concurrent tasks on double buffers, so peak memory is a few bands.
+
+static int band_in_y0(int k, int band_rows, int halo) {
+    int y = k * band_rows - halo;
+    return (y > 0) ? y : 0;
+}
+
+static int band_in_y1(int k, int band_rows, int halo, int height) {
+    int y = (k + 1) * band_rows + halo;
+    return (y < height) ? y : height;
+}
+
+int run_streaming(const char* input_file, const char* output_file,
+                  const FilterStage* stages, int stage_count,
+                  const PipelineOptions* opts, int band_rows) {
+    // Bands are read and written in place; a codec needs the whole image
+    // and PBM packs bits
+    if (output_format(output_file) != FORMAT_PNM) {
+        fprintf(stderr, "Error: --stream writes PGM, PPM or PAM only, not %s\n", output_file);
+        return 1;
+    }
+    PnmInfo info;
+    FILE* in = open_pnm_input(input_file, &info);
+    if (!in) {
+        fprintf(stderr, "Error: Could not load image %s (--stream reads Netpbm only)\n",
+                input_file);
+        return 1;
+    }
+    int width = info.width, height = info.height, channels = info.channels;
+    
+    // A gray result for a .pgm output is collapsed band by band on write
+    int out_channels = output_is_pgm(output_file) ? 1 : channels;
+    if (out_channels < channels && pipeline_gray_stage(stages, stage_count) < 0) {
+        fprintf(stderr, "Error: %s stores one channel but the chain keeps %d distinct "
+                "channels; add grayscale or edge\n", output_file, channels);
+        fclose(in);
+        return 1;
+    }
+    
+    FILE* out = fopen(output_file, "wb");
+    if (!out) {
+        fprintf(stderr, "Error: Could not create %s\n", output_file);
+        fclose(in);
+        return 1;
+    }
+    char header[128];
+    format_pnm_header(header, sizeof(header), width, height, out_channels);
+    fputs(header, out);
+    
+    int thread_count = opts->thread_count;
+    size_t row_size = (size_t)width * channels;
+    
+    StageChain chain;
+    stage_chain_init(&chain, stages, stage_count);
+    int halo = chain.halo;
+    
+    if (band_rows > height) band_rows = height;
+    int band_count = (height + band_rows - 1) / band_rows;
+    
+    // Tiles within a band; by default one full-width strip per thread
+    int tile_w = tile_extent(opts->tile_width, width, width);
+    int tile_h = tile_extent(opts->tile_height, (band_rows + thread_count - 1) / thread_count,
+                             band_rows);
+    int tiles_x = (width + tile_w - 1) / tile_w;
+    size_t scratch_size = (size_t)(tile_h + 2 * halo) * (tile_w + 2 * halo) * channels;
+    
+    size_t in_size = (size_t)(band_rows + 2 * halo) * row_size;
+    size_t out_size = (size_t)band_rows * row_size;
+    unsigned char* in_buf[2];
+    unsigned char* out_buf[2];
+    unsigned char** scratch = tile_scratch_alloc(thread_count, scratch_size);
+    int buffers_ok = scratch != NULL;
+    for (int i = 0; i < 2; i++) {
+        in_buf[i] = (unsigned char*)malloc(in_size);
+        out_buf[i] = (unsigned char*)malloc(out_size);
+        if (!in_buf[i] || !out_buf[i]) buffers_ok = 0;
+    }
+    if (!buffers_ok) {
+        if (scratch) fprintf(stderr, "Error: Could not allocate the band buffers\n");
+        for (int i = 0; i < 2; i++) {
+            free(in_buf[i]);
+            free(out_buf[i]);
+        }
+        tile_scratch_free(scratch, thread_count);
+        fclose(in);
+        fclose(out);
+        return 1;
+    }
+    
+    printf("Streaming: %d bands of %d rows, halo %d, %.1f MB of buffers\n",
+           band_count, band_rows, halo,
+           (2 * in_size + 2 * out_size + 2 * thread_count * scratch_size) / 1e6);
+    
+    double start_time = wall_time();
+    double read_time = 0.0;
+    double write_time = 0.0;
+    int read_ok = 1;
+    int write_ok = 1;
+    int compute_ok = 1;
+    
+    double t0 = wall_time();
+    size_t first_rows = band_in_y1(0, band_rows, halo, height);
+    read_ok = read_pnm_rows(in, &info, in_buf[0], first_rows);
+    read_time += wall_time() - t0;
+    
+#pragma omp parallel num_threads(thread_count)
+#pragma omp single
+    for (int k = 0; k <= band_count && read_ok && compute_ok; k++) {
+        if (k + 1 < band_count) {
+#pragma omp task shared(read_ok, read_time)
+            {
+                // Rows the next band shares with this one are already here
+                double t = wall_time();
+                int prev_y0 = band_in_y0(k, band_rows, halo);
+                int prev_y1 = band_in_y1(k, band_rows, halo, height);
+                int y0 = band_in_y0(k + 1, band_rows, halo);
+                int y1 = band_in_y1(k + 1, band_rows, halo, height);
+                int keep = (prev_y1 > y0) ? prev_y1 - y0 : 0;
+                unsigned char* next = in_buf[(k + 1) % 2];
+                
+                memcpy(next, in_buf[k % 2] + (size_t)(y0 - prev_y0) * row_size,
+                       (size_t)keep * row_size);
+                size_t rows = (size_t)(y1 - y0 - keep);
+                if (!read_pnm_rows(in, &info, next + (size_t)keep * row_size, rows)) {
+                    read_ok = 0;
+                }
+                read_time += wall_time() - t;
+            }
+        }
+        
+        if (k >= 1) {
+#pragma omp task shared(write_ok, write_time)
+            {
+                double t = wall_time();
+                int y0 = (k - 1) * band_rows;
+                size_t rows = (size_t)(((y0 + band_rows < height) ? y0 + band_rows : height) - y0);
+                unsigned char* band = out_buf[(k - 1) % 2];
+                if (out_channels < channels) {
+                    for (size_t i = 0; i < rows * width; i++) band[i] = band[i * channels];
+                }
+                if (fwrite(band, (size_t)width * out_channels, rows, out) != rows) {
+                    write_ok = 0;
+                }
+                write_time += wall_time() - t;
+            }
+        }
+        
+        if (k < band_count) {
+            int out_y0 = k * band_rows;
+            int out_y1 = (out_y0 + band_rows < height) ? out_y0 + band_rows : height;
+            int tiles_y = (out_y1 - out_y0 + tile_h - 1) / tile_h;
+            const unsigned char* src = in_buf[k % 2];
+            unsigned char* dst = out_buf[k % 2];
+            int src_y0 = band_in_y0(k, band_rows, halo);
+            Region area = {out_y0, out_y1, 0, width};
+            
+#pragma omp taskloop grainsize(1) shared(compute_ok)
+            for (int t = 0; t < tiles_x * tiles_y; t++) {
+                int tid = 0;
+#ifdef _OPENMP
+                tid = omp_get_thread_num();
+#endif
+                Region tile;
+                tile.y0 = out_y0 + (t / tiles_x) * tile_h;
+                tile.x0 = (t % tiles_x) * tile_w;
+                tile.y1 = (tile.y0 + tile_h < out_y1) ? tile.y0 + tile_h : out_y1;
+                tile.x1 = (tile.x0 + tile_w < width) ? tile.x0 + tile_w : width;
+                
+                if (!run_tile(&chain, src, src_y0, dst, &area, &tile, width, height, channels,
+                              &scratch[2 * tid], &scratch[2 * tid + 1])) {
+#pragma omp atomic write
+                    compute_ok = 0;
+                }
+            }
+        }
+        
+#pragma omp taskwait
+    }
+    
+    double elapsed = wall_time() - start_time;
+    
+    fclose(in);
+    if (fclose(out) != 0) write_ok = 0;
+    for (int i = 0; i < 2; i++) {
+        free(in_buf[i]);
+        free(out_buf[i]);
+    }
+    tile_scratch_free(scratch, thread_count);
+    
+    if (!read_ok || !write_ok || !compute_ok) {
+        fprintf(stderr, "Error: %s failed while streaming\n",
+                !read_ok ? "Reading" : !compute_ok ? "Filtering" : "Writing");
+        return 1;
+    }
+    
+    printf("\nProcessing time: %.6f seconds (I/O overlapped)\n", elapsed);
+    printf("I/O time: %.6f seconds (read %.6f, write %.6f, overlapped with compute)\n",
+           read_time + write_time, read_time, write_time);
+    return 0;
+}
+
+// ============================================
+// BATCH MODE (--batch)
+// ============================================
+//
+// Thousands of small frames would each pay process start-up and a fresh
+// thread team. Batch mode loads the list once and reads every header
+// first: images below BATCH_SMALL_PIXELS are independent tasks handed to
+// threads one at a time (--sched dynamic by default) with a
+// single-threaded pipeline each, larger ones run afterwards one by one
+// with the whole team on their rows. With --sched steal there is no
+// phase barrier: every small image and every tile of a large one is a
+// task in the same queue.
+//
+// Large PNG/JPEG/BMP images would leave all but one thread idle while
+// they decode and encode. They go in windows of up to BATCH_CODEC_WINDOW
+// (and BATCH_CODEC_BYTES): the window is decoded one image per thread,
+// each image is filtered by the whole team, and the results are encoded
+// one per thread again.
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int has_image_suffix(const char* name) {
+    size_t n = strlen(name);
+    ImageFormat format = output_format(name);
+    return (n > 4 && (strcmp(name + n - 4, ".ppm") == 0 || strcmp(name + n - 4, ".pgm") == 0 ||
+                      strcmp(name + n - 4, ".pam") == 0)) ||
+           (format != FORMAT_PNM && format != FORMAT_PBM);
+}
+
+// A directory gives its Netpbm, PNG, JPEG and BMP files in name order;
+// anything else is read as a manifest with one path per line (blank
+// lines and # comments skipped). Returns the count, or -1 if `source`
+// cannot be read.
+static int collect_batch_inputs(const char* source, char*** paths_out) {
+    int count = 0, capacity = 64;
+    char** paths = (char**)malloc(capacity * sizeof(char*));
+    char line[4096];
+    
+    DIR* dir = opendir(source);
+    FILE* fp = dir ? NULL : fopen(source, "r");
+    if (!dir && !fp) {
+        free(paths);
+        return -1;
+    }
+    
+    for (;;) {
+        const char* name;
+        if (dir) {
+            struct dirent* entry = readdir(dir);
+            if (!entry) break;
+            if (!has_image_suffix(entry->d_name)) continue;
+            snprintf(line, sizeof(line), "%s/%s", source, entry->d_name);
+            name = line;
+        } else {
+            if (!fgets(line, sizeof(line), fp)) break;
+            line[strcspn(line, "\r\n")] = '\0';
+            name = line;
+            while (isspace((unsigned char)*name)) name++;
+            if (*name == '\0' || *name == '#') continue;
+        }
+        
+        if (count == capacity) {
+            capacity *= 2;
+            paths = (char**)realloc(paths, capacity * sizeof(char*));
+        }
+        paths[count++] = strdup(name);
+    }
+    
+    if (dir) {
+        closedir(dir);
+        qsort(paths, count, sizeof(char*), compare_paths);
+    } else {
+        fclose(fp);
+    }
+    *paths_out = paths;
+    return count;
+}
+
+// <out_dir>/<basename of input>
+static void batch_output_path(char* dst, size_t size, const char* out_dir,
+                              const char* input) {
+    const char* base = strrchr(input, '/');
+    snprintf(dst, size, "%s/%s", out_dir, base ? base + 1 : input);
+}
+
+// The input of one image's chain, reduced to one channel when it can be
+// for a .pgm output; NULL if unreadable or the chain cannot make it gray
+static Image* batch_load(const char* input_file, const char* output_file,
+                         const FilterStage* stages, int stage_count, int use_mmap,
+                         int thread_count) {
+    Image* input = use_mmap ? load_image_mmap(input_file) : load_image(input_file);
+    if (!input) return NULL;
+    
+    if (output_is_pgm(output_file) && input->channels > 1) {
+        if (pipeline_gray_stage(stages, stage_count) < 0) {
+            free_image(input);
+            return NULL;
+        }
+        input = gray_input(input, stages, stage_count, thread_count);
+    }
+    return input;
+}
+
+// Load, filter and save one image; returns 1 on success. With tt the
+// image is split into tile tasks (inside a parallel region). On failure
+// *reason (if given) names the step that failed.
+static int batch_process_one(const char* input_file, const char* output_file,
+                             const FilterStage* stages, int stage_count,
+                             const PipelineOptions* opts, int use_mmap,
+                             const TileTasks* tt, const char** reason) {
+    const char* unused;
+    if (!reason) reason = &unused;
+    *reason = "load-failed";
+    Image* input = batch_load(input_file, output_file, stages, stage_count, use_mmap,
+                              tt ? 1 : opts->thread_count);
+    if (!input) return 0;
+    *reason = "no-memory";
+    
+    int out_channels = output_is_pgm(output_file) ? 1 : input->channels;
+    Image* result = (use_mmap && output_format(output_file) == FORMAT_PNM)
+        ? create_image_mmap(output_file, input->width, input->height, out_channels)
+        : NULL;
+    Image* output = (result && result->channels == input->channels)
+        ? result : create_image(input->width, input->height, input->channels);
+    if (!output || (use_mmap && !result && output_format(output_file) == FORMAT_PNM)) {
+        if (output != result) free_image(output);
+        free_image(result);
+        free_image(input);
+        return 0;
+    }
+    
+    size_t moved = tt ? run_tile_tasks(tt, input, output)
+                      : run_pipeline(input, output, stages, stage_count, opts);
+    if (moved == 0) {
+        if (output != result) free_image(output);
+        free_image(result);
+        free_image(input);
+        *reason = "filter-failed";
+        return 0;
+    }
+    if (output->channels > out_channels) {
+        Image* gray = image_to_gray(output, 0, result, tt ? 1 : opts->thread_count);
+        free_image(output);
+        output = gray;
+    }
+    if (output) *reason = "save-failed";
+    int ok = output && (output->map ? 1 : save_image(output_file, output));
+    free_image(output);
+    free_image(input);
+    return ok;
+}
+
+int run_batch(const char* source, const char* out_dir, const FilterStage* stages,
+              int stage_count, const PipelineOptions* opts, int use_mmap) {
+    char** paths = NULL;
+    int count = collect_batch_inputs(source, &paths);
+    if (count < 0) {
+        fprintf(stderr, "Error: Could not read batch list %s\n", source);
+        return 1;
+    }
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create output directory %s\n", out_dir);
+        for (int i = 0; i < count; i++) free(paths[i]);
+        free(paths);
+        return 1;
+    }
+    
+    // Size every image from its header; unreadable ones count as failed
+    double start = wall_time();
+    long long* pixels = (long long*)malloc((count > 0 ? count : 1) * sizeof(long long));
+    int* compressed = (int*)calloc(count > 0 ? count : 1, sizeof(int));
+    int small = 0, max_width = 1, max_height = 1;
+    for (int i = 0; i < count; i++) {
+        PnmInfo info;
+        pixels[i] = probe_image(paths[i], &info, &compressed[i])
+            ? (long long)info.width * info.height : -1;
+        if (pixels[i] >= 0 && pixels[i] < BATCH_SMALL_PIXELS) small++;
+        if (pixels[i] >= BATCH_SMALL_PIXELS) {
+            if (info.width > max_width) max_width = info.width;
+            if (info.height > max_height) max_height = info.height;
+        }
+    }
+    printf("Batch: %d images (%d small, one per thread; %d large, all threads each)\n",
+           count, small, count - small);
+    
+    log_stages = 0;
+    pixel_pool_enable(1);
+    PipelineOptions single = *opts;
+    single.thread_count = 1;
+    single.sched = SCHED_STATIC;
+    int failed = 0;
+    long long done_pixels = 0;
+    
+    if (opts->sched == SCHED_STEAL) {
+        // Tiles of the large images (the only ones split into tiles)
+        TileTasks tt;
+        int have_tiles = tile_tasks_init(&tt, stages, stage_count, opts, MAX_CHANNELS,
+                                         max_width, max_height);
+        if (!have_tiles) failed = count;
+        
+        // Large images are queued first so their tiles spread over the
+        // team while the small ones fill the gaps
+#pragma omp parallel num_threads(opts->thread_count)
+#pragma omp single
+        for (int pass = 0; have_tiles && pass < 2; pass++) {
+            for (int i = 0; i < count; i++) {
+                int small_image = (pixels[i] >= 0 && pixels[i] < BATCH_SMALL_PIXELS);
+                if (small_image != pass) continue;
+#pragma omp task firstprivate(i, small_image) shared(failed, done_pixels, tt, single)
+                {
+                    char output_file[4096];
+                    batch_output_path(output_file, sizeof(output_file), out_dir, paths[i]);
+                    int ok = pixels[i] >= 0 &&
+                             batch_process_one(paths[i], output_file, stages, stage_count,
+                                               &single, use_mmap, small_image ? NULL : &tt, NULL);
+                    if (ok) {
+#pragma omp atomic
+                        done_pixels += pixels[i];
+                    } else {
+                        fprintf(stderr, "Error: Could not process %s\n", paths[i]);
+#pragma omp atomic
+                        failed++;
+                    }
+                }
+            }
+        }
+        
+        if (have_tiles) tile_tasks_free(&tt);
+    } else {
+#pragma omp parallel for num_threads(opts->thread_count) schedule(runtime) \
+        reduction(+:failed, done_pixels)
+        for (int i = 0; i < count; i++) {
+            if (pixels[i] < 0 || pixels[i] >= BATCH_SMALL_PIXELS) continue;
+            char output_file[4096];
+            batch_output_path(output_file, sizeof(output_file), out_dir, paths[i]);
+            if (batch_process_one(paths[i], output_file, stages, stage_count, &single,
+                                  use_mmap, NULL, NULL)) {
+                done_pixels += pixels[i];
+            } else {
+                fprintf(stderr, "Error: Could not process %s\n", paths[i]);
+                failed++;
+            }
+        }
+        
+        for (int i = 0; i < count; i++) {
+            if (pixels[i] >= 0 && (pixels[i] < BATCH_SMALL_PIXELS || compressed[i])) continue;
+            char output_file[4096];
+            batch_output_path(output_file, sizeof(output_file), out_dir, paths[i]);
+            if (pixels[i] >= 0 &&
+                batch_process_one(paths[i], output_file, stages, stage_count, opts,
+                                  use_mmap, NULL, NULL)) {
+                done_pixels += pixels[i];
+            } else {
+                fprintf(stderr, "Error: Could not process %s\n", paths[i]);
+                failed++;
+            }
+        }
+        
+        int window_max = (opts->thread_count < BATCH_CODEC_WINDOW)
+            ? opts->thread_count : BATCH_CODEC_WINDOW;
+        int next = 0;
+        for (;;) {
+            int window[BATCH_CODEC_WINDOW], n = 0;
+            long long bytes = 0;
+            for (; next < count && n < window_max; next++) {
+                if (pixels[next] < BATCH_SMALL_PIXELS || !compressed[next]) continue;
+                long long image_bytes = pixels[next] * MAX_CHANNELS;
+                if (n > 0 && bytes + image_bytes > BATCH_CODEC_BYTES) break;
+                bytes += image_bytes;
+                window[n++] = next;
+            }
+            if (n == 0) break;
+            
+            Image* images[BATCH_CODEC_WINDOW];
+#pragma omp parallel for num_threads(n) schedule(static, 1)
+            for (int k = 0; k < n; k++) {
+                char output_file[4096];
+                batch_output_path(output_file, sizeof(output_file), out_dir, paths[window[k]]);
+                images[k] = batch_load(paths[window[k]], output_file, stages, stage_count, 0, 1);
+            }
+            
+            for (int k = 0; k < n; k++) {
+                if (!images[k]) continue;
+                char output_file[4096];
+                batch_output_path(output_file, sizeof(output_file), out_dir, paths[window[k]]);
+                Image* output = create_image(images[k]->width, images[k]->height,
+                                             images[k]->channels);
+                if (output && run_pipeline(images[k], output, stages, stage_count, opts) == 0) {
+                    free_image(output);
+                    output = NULL;
+                }
+                if (output) {
+                    if (output_is_pgm(output_file) && output->channels > 1) {
+                        Image* gray = image_to_gray(output, 0, NULL, opts->thread_count);
+                        free_image(output);
+                        output = gray;
+                    }
+                }
+                free_image(images[k]);
+                images[k] = output;
+            }
+            
+#pragma omp parallel for num_threads(n) schedule(static, 1) reduction(+:failed, done_pixels)
+            for (int k = 0; k < n; k++) {
+                char output_file[4096];
+                batch_output_path(output_file, sizeof(output_file), out_dir, paths[window[k]]);
+                if (images[k] && save_image(output_file, images[k])) {
+                    done_pixels += pixels[window[k]];
+                } else {
+                    fprintf(stderr, "Error: Could not process %s\n", paths[window[k]]);
+                    failed++;
+                }
+                free_image(images[k]);
+            }
+        }
+    }
+    log_stages = 1;
+    pixel_pool_enable(0);
+    
+    double elapsed = wall_time() - start;
+    printf("\nBatch time: %.6f seconds (I/O included)\n", elapsed);
+    printf("Processed %d of %d images, %.1f MP", count - failed, count, done_pixels / 1e6);
+    if (elapsed > 0) {
+        printf(": %.1f images/sec, %.1f MP/s", (count - failed) / elapsed,
+               done_pixels / 1e6 / elapsed);
+    }
+    printf("\n");
+    
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    free(pixels);
+    free(compressed);
+    return failed ? 1 : 0;
+}
+
+// ============================================
+// FRAME SEQUENCES (--sequence)
+// ============================================
+//
+// Camera feeds change few pixels from one frame to the next. Sequence
+// mode keeps the previous frame's input and output: the new frame is
+// compared with the old one tile by tile (memcmp of the tile's row spans,
+// which libc vectorizes) and the box of changed pixels kept per tile.
+// Only the output tiles whose area plus the chain's halo overlaps a box
+// run the chain, through run_tile. Every other output tile is the previous frame's, so
+// the result equals a full run. The first frame, and any frame whose
+// size or channel count differs, runs in full. Tiles are TASK_TILE_WIDTH
+// x TASK_TILE_HEIGHT unless --tile is given.
+
+// The box of pixels that differ between cur and prev within each tile
+// (empty: y1 == y0); returns the number of tiles that changed. Rows are
+// compared whole with memcmp and scanned only where they differ.
+static int sequence_diff(const Image* cur, const Image* prev, Region* changes,
+                         int tile_w, int tile_h, int tiles_x, int tile_count,
+                         int thread_count) {
+    int width = cur->width;
+    int height = cur->height;
+    int channels = cur->channels;
+    int changed = 0;
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static) reduction(+:changed)
+    for (int t = 0; t < tile_count; t++) {
+        int y0 = (t / tiles_x) * tile_h;
+        int x0 = (t % tiles_x) * tile_w;
+        int y1 = (y0 + tile_h < height) ? y0 + tile_h : height;
+        size_t span = (size_t)((x0 + tile_w < width) ? tile_w : width - x0) * channels;
+        Region box = {0, 0, INT_MAX, 0};
+        for (int y = y0; y < y1; y++) {
+            size_t off = (size_t)y * cur->pitch + (size_t)x0 * channels;
+            const unsigned char* c = cur->data + off;
+            const unsigned char* p = prev->data + off;
+            if (memcmp(c, p, span) == 0) continue;
+            size_t first = 0, last = span - 1;
+            while (c[first] == p[first]) first++;
+            while (c[last] == p[last]) last--;
+            if (box.y1 == box.y0) box.y0 = y;
+            box.y1 = y + 1;
+            if (x0 + (int)(first / channels) < box.x0) box.x0 = x0 + (int)(first / channels);
+            if (x0 + (int)(last / channels) + 1 > box.x1) box.x1 = x0 + (int)(last / channels) + 1;
+        }
+        changes[t] = box;
+        changed += (box.y1 > box.y0);
+    }
+    return changed;
+}
+
+// Marks the output tiles whose area plus halo overlaps a change; the
+// changes of a tile can reach reach_x/reach_y tiles away
+static int sequence_dilate(const Region* changes, unsigned char* redo, int tile_w, int tile_h,
+                           int tiles_x, int tiles_y, int halo) {
+    int reach_x = (halo + tile_w - 1) / tile_w;
+    int reach_y = (halo + tile_h - 1) / tile_h;
+    int count = 0;
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            int ey0 = ty * tile_h - halo, ey1 = (ty + 1) * tile_h + halo;
+            int ex0 = tx * tile_w - halo, ex1 = (tx + 1) * tile_w + halo;
+            int hit = 0;
+            for (int y = ty - reach_y; y <= ty + reach_y && !hit; y++) {
+                if (y < 0 || y >= tiles_y) continue;
+                for (int x = tx - reach_x; x <= tx + reach_x; x++) {
+                    if (x < 0 || x >= tiles_x) continue;
+                    const Region* c = &changes[y * tiles_x + x];
+                    if (c->y1 > c->y0 && c->y0 < ey1 && c->y1 > ey0 &&
+                        c->x0 < ex1 && c->x1 > ex0) {
+                        hit = 1;
+                        break;
+                    }
+                }
+            }
+            redo[ty * tiles_x + tx] = (unsigned char)hit;
+            count += hit;
+        }
+    }
+    return count;
+}
+
+// The chain for the tiles marked in redo, into the previous output
+static size_t sequence_update(const Image* src, Image* dst, const StageChain* chain,
+                              const unsigned char* redo, int tile_w, int tile_h,
+                              int tiles_x, int tile_count, int thread_count) {
+    int width = src->width;
+    int height = src->height;
+    int channels = src->channels;
+    int halo = chain->halo;
+    size_t buf_size = (size_t)(tile_h + 2 * halo) * (tile_w + 2 * halo) * channels;
+    Region whole = {0, height, 0, width};
+    size_t bytes = 0;
+    int failed = 0;
+    unsigned char** scratch = tile_scratch_alloc(thread_count, buf_size);
+    if (!scratch) return 0;
+    
+#pragma omp parallel num_threads(thread_count) reduction(+:bytes, failed)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        
+#pragma omp for schedule(dynamic)
+        for (int t = 0; t < tile_count; t++) {
+            if (!redo[t]) continue;
+            Region tile;
+            tile.y0 = (t / tiles_x) * tile_h;
+            tile.x0 = (t % tiles_x) * tile_w;
+            tile.y1 = (tile.y0 + tile_h < height) ? tile.y0 + tile_h : height;
+            tile.x1 = (tile.x0 + tile_w < width) ? tile.x0 + tile_w : width;
+            
+            size_t moved = run_tile(chain, src->data, 0, dst->data, &whole, &tile,
+                                    width, height, channels,
+                                    &scratch[2 * tid], &scratch[2 * tid + 1]);
+            bytes += moved;
+            failed += (moved == 0);
+        }
+    }
+    
+    tile_scratch_free(scratch, thread_count);
+    return failed ? 0 : bytes;
+}
+
+int run_sequence(const char* source, const char* out_dir, const FilterStage* stages,
+                 int stage_count, const PipelineOptions* opts, int use_mmap) {
+    char** paths = NULL;
+    int count = collect_batch_inputs(source, &paths);
+    if (count < 0) {
+        fprintf(stderr, "Error: Could not read frame list %s\n", source);
+        return 1;
+    }
+    if (mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create output directory %s\n", out_dir);
+        for (int i = 0; i < count; i++) free(paths[i]);
+        free(paths);
+        return 1;
+    }
+    
+    // Clamped to each keyframe's size
+    int tile_w = tile_extent(opts->tile_width, TASK_TILE_WIDTH, INT_MAX);
+    int tile_h = tile_extent(opts->tile_height, TASK_TILE_HEIGHT, INT_MAX);
+    StageChain chain;
+    stage_chain_init(&chain, stages, stage_count);
+    printf("Sequence: %d frames, %dx%d tiles, halo %d\n", count, tile_w, tile_h, chain.halo);
+    
+    log_stages = 0;
+    Image* prev = NULL;
+    Image* output = NULL;
+    Region* changes = NULL;
+    unsigned char* redo = NULL;
+    int tiles_x = 0, tiles_y = 0, tile_count = 0;
+    long long tiles_total = 0, tiles_run = 0;
+    double compute = 0.0, full_compute = 0.0;
+    int full_frames = 0, failed = 0;
+    double start = wall_time();
+    
+    for (int i = 0; i < count; i++) {
+        char output_file[4096];
+        batch_output_path(output_file, sizeof(output_file), out_dir, paths[i]);
+        Image* input = batch_load(paths[i], output_file, stages, stage_count, use_mmap,
+                                  opts->thread_count);
+        if (!input) {
+            fprintf(stderr, "Error: Could not process %s\n", paths[i]);
+            failed++;
+            continue;
+        }
+        
+        int keyframe = !prev || prev->width != input->width || prev->height != input->height ||
+                       prev->channels != input->channels;
+        double frame_start = wall_time();
+        int changed = 0, run = 0;
+        if (keyframe) {
+            free_image(output);
+            free(changes);
+            free(redo);
+            tile_w = tile_extent(opts->tile_width, TASK_TILE_WIDTH, input->width);
+            tile_h = tile_extent(opts->tile_height, TASK_TILE_HEIGHT, input->height);
+            tiles_x = (input->width + tile_w - 1) / tile_w;
+            tiles_y = (input->height + tile_h - 1) / tile_h;
+            tile_count = tiles_x * tiles_y;
+            output = create_image(input->width, input->height, input->channels);
+            changes = (Region*)malloc(tile_count * sizeof(Region));
+            redo = (unsigned char*)malloc(tile_count);
+            if (!output || !changes || !redo) {
+                fprintf(stderr, "Error: Could not allocate output image\n");
+                free_image(input);
+                failed += count - i;
+                break;
+            }
+            if (run_pipeline(input, output, stages, stage_count, opts) == 0) {
+                free_image(input);
+                failed += count - i;
+                break;
+            }
+            changed = run = tile_count;
+        } else {
+            changed = sequence_diff(input, prev, changes, tile_w, tile_h, tiles_x, tile_count,
+                                    opts->thread_count);
+            run = sequence_dilate(changes, redo, tile_w, tile_h, tiles_x, tiles_y, chain.halo);
+            if (run > 0 && sequence_update(input, output, &chain, redo, tile_w, tile_h,
+                                           tiles_x, tile_count, opts->thread_count) == 0) {
+                free_image(input);
+                failed += count - i;
+                break;
+            }
+        }
+        double frame_time = wall_time() - frame_start;
+        compute += frame_time;
+        if (keyframe) {
+            full_compute += frame_time;
+            full_frames++;
+        }
+        tiles_total += tile_count;
+        tiles_run += run;
+        
+        Image* result = output;
+        if (output_is_pgm(output_file) && output->channels > 1) {
+            result = image_to_gray(output, 0, NULL, opts->thread_count);
+        }
+        if (!result || !save_image(output_file, result)) {
+            fprintf(stderr, "Error: Could not process %s\n", paths[i]);
+            failed++;
+        }
+        if (result != output) free_image(result);
+        printf("Frame %d: %d of %d tiles changed, %d recomputed%s, %.3f ms\n", i, changed,
+               tile_count, run, keyframe ? " (full)" : "", frame_time * 1e3);
+        
+        free_image(prev);
+        prev = input;
+    }
+    log_stages = 1;
+    
+    double elapsed = wall_time() - start;
+    printf("\nSequence time: %.6f seconds (I/O included)\n", elapsed);
+    printf("Compute: %.6f seconds, %.1f%% of tiles recomputed", compute,
+           tiles_total > 0 ? 100.0 * tiles_run / tiles_total : 0.0);
+    int done = count - failed;
+    if (full_frames > 0 && done > 0 && compute > 0) {
+        printf(", %.1fx less than full frames", full_compute / full_frames * done / compute);
+    }
+    printf("\n");
+    
+    free_image(prev);
+    free_image(output);
+    free(changes);
+    free(redo);
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    return failed ? 1 : 0;
+}
+
+// ============================================
+// SERVER MODE (--serve)
+// ============================================
+//
+// A long-running process for request-driven use. A job is one line,
+// "<input.ppm> <output.ppm> <filter[,filter...]>", read from stdin
+// (--serve -) or from connections to a Unix socket (--serve PATH), and
+// is answered in order on the same stream with "ok <ms> <output>" or
+// "error <ms> <input> <reason>"; "quit" stops the server. A line with
+// more or fewer than three tokens, or a filter list of SERVE_MAX_SPEC
+// characters or more, is refused rather than guessed at. The thread team is
+// started once and reused by every job (OMP_WAIT_POLICY=active keeps
+// idle threads spinning instead of sleeping between jobs), and pixel
+// buffers come from the pool, so a steady stream of same-sized images
+// neither allocates nor page-faults after the first job.
+
+#define SERVE_MAX_SPEC 256
+
+typedef struct {
+    double* ms;
+    int count;
+    int capacity;
+} LatencyLog;
+
+static void latency_log_add(LatencyLog* log, double ms) {
+    if (log->count == log->capacity) {
+        log->capacity = log->capacity ? 2 * log->capacity : 1024;
+        log->ms = (double*)realloc(log->ms, log->capacity * sizeof(double));
+    }
+    log->ms[log->count++] = ms;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Index of the q-quantile in n sorted samples
+static int nearest_rank(int n, double q) {
+    int rank = (int)ceil(q * n);
+    return rank < 1 ? 0 : rank - 1;
+}
+
+// Answers the jobs of one stream; returns 1 once "quit" was read
+static int serve_stream(FILE* in, FILE* out, const PipelineOptions* opts, int use_mmap,
+                        LatencyLog* log) {
+    char line[8192];
+    while (fgets(line, sizeof(line), in)) {
+        size_t line_len = strlen(line);
+        int too_long = line_len == sizeof(line) - 1 && line[line_len - 1] != '\n';
+        if (too_long) {
+            // Drop the rest of the line so it is not read as further jobs
+            int c;
+            while ((c = fgetc(in)) != EOF && c != '\n') {}
+        }
+        
+        // Split into whitespace-separated tokens; a job is exactly three
+        char* tokens[4];
+        int fields = 0;
+        for (char* p = line; fields < 4; ) {
+            p += strspn(p, " \t\r\n");
+            if (!*p) break;
+            tokens[fields++] = p;
+            p += strcspn(p, " \t\r\n");
+            if (*p) *p++ = '\0';
+        }
+        if (fields == 0 && !too_long) continue;
+        if (fields == 1 && !too_long && strcmp(tokens[0], "quit") == 0) return 1;
+        
+        double start = wall_time();
+        const char* input_file = (fields >= 1) ? tokens[0] : "-";
+        const char* reason = NULL;
+        FilterStage stages[MAX_STAGES];
+        int stage_count = 0;
+        if (too_long) reason = "line-too-long";
+        else if (fields > 3) reason = "trailing-tokens";
+        else if (fields < 3) reason = "usage";
+        else if (strlen(tokens[2]) >= SERVE_MAX_SPEC) reason = "spec-too-long";
+        else if ((stage_count = parse_pipeline(tokens[2], stages, MAX_STAGES)) <= 0)
+            reason = "bad-spec";
+        else if (use_mmap && strcmp(tokens[0], tokens[1]) == 0) reason = "in-place";
+        else if (batch_process_one(tokens[0], tokens[1], stages, stage_count, opts,
+                                   use_mmap, NULL, &reason)) reason = NULL;
+        double ms = (wall_time() - start) * 1e3;
+        if (!reason) {
+            latency_log_add(log, ms);
+            fprintf(out, "ok %.3f %s\n", ms, tokens[1]);
+        } else {
+            fprintf(out, "error %.3f %s %s\n", ms, input_file, reason);
+        }
+        fflush(out);
+    }
+    return 0;
+}
+
+int run_server(const char* source, const PipelineOptions* opts, int use_mmap) {
+    log_stages = 0;
+    pixel_pool_enable(1);
+    
+    // Start the team now instead of inside the first job
+#pragma omp parallel num_threads(opts->thread_count)
+    {
+        /* nothing: the threads stay in the runtime's pool */
+    }
+    
+    LatencyLog log = {NULL, 0, 0};
+    int status = 0;
+    
+    if (strcmp(source, "-") == 0) {
+        fprintf(stderr, "Serving jobs on stdin with %d threads\n", opts->thread_count);
+        serve_stream(stdin, stdout, opts, use_mmap, &log);
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0 || strlen(source) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Error: Could not create socket %s\n", source);
+            if (listener >= 0) close(listener);
+            pixel_pool_enable(0);
+            return 1;
+        }
+        strcpy(addr.sun_path, source);
+        unlink(source);
+        if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(listener, 8) != 0) {
+            fprintf(stderr, "Error: Could not listen on %s\n", source);
+            close(listener);
+            pixel_pool_enable(0);
+            return 1;
+        }
+        fprintf(stderr, "Serving jobs on %s with %d threads\n", source, opts->thread_count);
+        
+        // One client at a time; its jobs are answered in order
+        int quit = 0;
+        while (!quit) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                status = 1;
+                break;
+            }
+            FILE* in = fdopen(fd, "r");
+            FILE* out = fdopen(dup(fd), "w");
+            if (in && out) quit = serve_stream(in, out, opts, use_mmap, &log);
+            if (in) fclose(in); else close(fd);
+            if (out) fclose(out);
+        }
+        close(listener);
+        unlink(source);
+    }
+    
+    if (log.count > 0) {
+        qsort(log.ms, log.count, sizeof(double), compare_doubles);
+        double total = 0.0;
+        for (int i = 0; i < log.count; i++) total += log.ms[i];
+        fprintf(stderr, "Served %d jobs: mean %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                log.count, total / log.count, log.ms[nearest_rank(log.count, 0.50)],
+                log.ms[nearest_rank(log.count, 0.99)], log.ms[log.count - 1]);
+    }
+    free(log.ms);
+    pixel_pool_enable(0);
+    return status;
+}
+
+// ============================================
+// BENCHMARK MODE (--bench)
+// ============================================
+//
+// Times the pipeline inside one process: each image is loaded (or
+// synthesized) and the output allocated once, then for 1, 2, 4, ... up to
+// the requested thread count the chain runs `warmup` untimed and `reps`
+// timed times. Minimum, median and p95 come from the repetitions, speedup
+// and efficiency from the 1-thread median, so numbers are free of process
+// start-up, file I/O and first-touch page faults. "synthetic" sweeps
+// BENCH_SIZES; "synthetic:WxH,WxH" picks its own sizes. With --device gpu
+// the offloaded chain, uploads and downloads included, is timed after the
+// sweep and compared with the host at the full thread count; the size
+// from which the device stays ahead is the crossover.
+
+typedef struct {
+    int width, height;
+    double host;        /* median seconds, host at opts->thread_count */
+    double device;      /* median seconds offloaded, 0 when not timed */
+} BenchPoint;
+
+// Median of reps timed runs after warmup untimed ones; -1 if a run fails
+static double bench_median(Image* input, Image* output, const FilterStage* stages,
+                           int stage_count, const PipelineOptions* run, int warmup, int reps,
+                           double* samples) {
+    for (int i = 0; i < warmup; i++) {
+        if (run_pipeline(input, output, stages, stage_count, run) == 0) return -1.0;
+    }
+    for (int i = 0; i < reps; i++) {
+        double start = wall_time();
+        size_t moved = run_pipeline(input, output, stages, stage_count, run);
+        samples[i] = wall_time() - start;
+        if (moved == 0) return -1.0;
+    }
+    qsort(samples, reps, sizeof(double), compare_doubles);
+    return samples[nearest_rank(reps, 0.50)];
+}
+
+// Deterministic RGB test pattern: gradients, a checkerboard and hashed
+// noise, so smooth and detailed regions both reach every filter
+static Image* synthetic_image(int width, int height, int thread_count) {
+    Image* img = create_image(width, height, 3);
+    if (!img) return NULL;
+    
+#pragma omp parallel for num_threads(thread_count) schedule(static)
+    for (int y = 0; y < height; y++) {
+        unsigned char* row = img->data + (size_t)y * img->pitch;
+        for (int x = 0; x < width; x++) {
+            unsigned int h = (unsigned int)x * 73856093u ^ (unsigned int)y * 19349663u;
+            h = (h ^ (h >> 13)) * 0x5bd1e995u;
+            int check = (((x >> 5) ^ (y >> 5)) & 1) ? 48 : 0;
+            row[3 * x + 0] = (unsigned char)((x * 255) / (width > 1 ? width - 1 : 1));
+            row[3 * x + 1] = (unsigned char)((y * 255) / (height > 1 ? height - 1 : 1));
+            row[3 * x + 2] = (unsigned char)(((h >> 24) & 0x7f) + check + 40);
+        }
+    }
+    return img;
+}
+
+// Host against device per size, then the smallest size from which the
+// device wins at every larger size too
+static void print_crossover(const BenchPoint* points, int count, int thread_count) {
+    printf("Host (%d thread%s) vs device:\n", thread_count, thread_count == 1 ? "" : "s");
+    printf("%12s %12s %12s %9s\n", "size", "host ms", "device ms", "speedup");
+    int crossover = -1;
+    for (int i = 0; i < count; i++) {
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", points[i].width, points[i].height);
+        double gain = points[i].device > 0 ? points[i].host / points[i].device : 0.0;
+        printf("%12s %12.3f %12.3f %8.2fx\n", size, points[i].host * 1e3,
+               points[i].device * 1e3, gain);
+        if (gain > 1.0) {
+            if (crossover < 0) crossover = i;
+        } else {
+            crossover = -1;
+        }
+    }
+    if (crossover >= 0) {
+        printf("Crossover: device ahead from %dx%d\n\n", points[crossover].width,
+               points[crossover].height);
+    } else {
+        printf("Crossover: none, the device is not ahead at the largest size\n\n");
+    }
+}
+
+// Runs the thread sweep (and the device run) on one image into *point;
+// returns 0 on success
+static int bench_image(Image* input, const char* label, const FilterStage* stages,
+                       int stage_count, const PipelineOptions* opts, int planar,
+                       int warmup, int reps, BenchPoint* point) {
+    int max_threads = opts->thread_count;
+    if (planar) {
+        Image* planes = image_to_planar(input, max_threads);
+        if (!planes) {
+            fprintf(stderr, "Error: Could not allocate planar image\n");
+            return 1;
+        }
+        input = planes;
+    }
+    Image* output = planar
+        ? create_planar_image(input->width, input->height, input->channels)
+        : create_image(input->width, input->height, input->channels);
+    double* samples = (double*)malloc(reps * sizeof(double));
+    if (!output || !samples) {
+        fprintf(stderr, "Error: Could not allocate output image\n");
+        free_image(output);
+        free(samples);
+        if (planar) free_image(input);
+        return 1;
+    }
+    
+    double megapixels = (double)input->width * input->height / 1e6;
+    double base_median = 0.0;
+    printf("%s: %dx%d, %d channels\n", label, input->width, input->height, input->channels);
+    printf("%8s %12s %12s %12s %10s %9s %11s\n", "threads", "min ms", "median ms",
+           "p95 ms", "MP/s", "speedup", "efficiency");
+    
+    PipelineOptions run = *opts;
+    run.device = 0;
+    point->width = input->width;
+    point->height = input->height;
+    point->device = 0.0;
+    int status = 0;
+    for (int t = 1; ; t = (2 * t < max_threads) ? 2 * t : max_threads) {
+        run.thread_count = t;
+        double median = bench_median(input, output, stages, stage_count, &run, warmup, reps,
+                                     samples);
+        if (median < 0) {
+            status = 1;
+            break;
+        }
+        if (t == 1) base_median = median;
+        point->host = median;
+        double speedup = median > 0 ? base_median / median : 0.0;
+        printf("%8d %12.3f %12.3f %12.3f %10.1f %8.2fx %10.1f%%\n", t, samples[0] * 1e3,
+               median * 1e3, samples[nearest_rank(reps, 0.95)] * 1e3,
+               median > 0 ? megapixels / median : 0.0, speedup, 100.0 * speedup / t);
+        if (t == max_threads) break;
+    }
+    if (status == 0 && opts->device) {
+        run.device = 1;
+        double median = bench_median(input, output, stages, stage_count, &run, warmup, reps,
+                                     samples);
+        if (median < 0) status = 1;
+        point->device = median;
+        if (median >= 0) printf("%8s %12.3f %12.3f %12.3f %10.1f %8.2fx\n", "device", samples[0] * 1e3,
+               median * 1e3, samples[nearest_rank(reps, 0.95)] * 1e3,
+               median > 0 ? megapixels / median : 0.0,
+               median > 0 ? base_median / median : 0.0);
+    }
+    printf("\n");
+    
+    free(samples);
+    free_image(output);
+    if (planar) free_image(input);
+    return status;
+}
+
+int run_bench(const char* source, const FilterStage* stages, int stage_count,
+              const PipelineOptions* opts, int planar, int warmup, int reps) {
+    log_stages = 0;
+    
+    if (strncmp(source, "synthetic", 9) != 0) {
+        Image* input = load_image(source);
+        if (!input) {
+            fprintf(stderr, "Error: Could not load image %s\n", source);
+            return 1;
+        }
+        BenchPoint point;
+        int status = bench_image(input, source, stages, stage_count, opts, planar,
+                                 warmup, reps, &point);
+        free_image(input);
+        if (status == 0 && opts->device) print_crossover(&point, 1, opts->thread_count);
+        return status;
+    }
+    
+    const char* sizes = source[9] == ':' ? source + 10 : BENCH_SIZES;
+    if (source[9] != '\0' && source[9] != ':') {
+        fprintf(stderr, "Error: Unknown bench source '%s'\n", source);
+        return 1;
+    }
     
-    char format[3];
-    int width, height, max_val;
-    /* Read PPM header. Expecting: P6\n<width> <height>\n<max_val>\n */
-    int scanned = fscanf(fp, "%2s %d %d %d", format, &width, &height, &max_val);
-    if (scanned != 4) {
-        fclose(fp);
-        return NULL;
+    BenchPoint points[BENCH_MAX_SIZES];
+    int point_count = 0;
+    int status = 0;
+    for (const char* p = sizes; *p && status == 0; ) {
+        int width = 0, height = 0, used = 0;
+        if (sscanf(p, "%dx%d%n", &width, &height, &used) != 2 || width < 1 || height < 1 ||
+            point_count == BENCH_MAX_SIZES) {
+            fprintf(stderr, "Error: Invalid bench size list '%s'\n", sizes);
+            return 1;
+        }
+        p += used;
+        if (*p == ',') p++;
+        
+        Image* input = synthetic_image(width, height, opts->thread_count);
+        if (!input) {
+            fprintf(stderr, "Error: Could not allocate %dx%d image\n", width, height);
+            return 1;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "synthetic %dx%d", width, height);
+        status = bench_image(input, label, stages, stage_count, opts, planar, warmup, reps,
+                             &points[point_count++]);
+        free_image(input);
     }
+    if (status == 0 && opts->device) print_crossover(points, point_count, opts->thread_count);
+    return status;
+}
 
-    if (strcmp(format, "P6") != 0) {
-        fclose(fp);
-        return NULL;
+// ============================================
+// COMPARE MODE (--compare)
+// ============================================
+//
+// Checks one backend's output against another's (regress.sh runs every
+// filter through the scalar kernels, each SIMD set, the tiled, planar
+// and streaming engines and the MPI builds, and compares the results
+// with this). Both files may be any format load_image reads. Samples
+// within `border` pixels of the image edge can be skipped (e.g. for a
+// filter with a different border rule); the verdict is the number of
+// samples that differ by more than tolerance.
+
+int run_compare(const char* file_a, const char* file_b, int tolerance, int border) {
+    Image* a = load_image(file_a);
+    Image* b = a ? load_image(file_b) : NULL;
+    if (!a || !b) {
+        fprintf(stderr, "Error: Could not load %s\n", a ? file_b : file_a);
+        if (a) free_image(a);
+        return 1;
+    }
+    if (a->width != b->width || a->height != b->height || a->channels != b->channels) {
+        fprintf(stderr, "Error: %s is %dx%d with %d channels, %s is %dx%d with %d\n",
+                file_a, a->width, a->height, a->channels,
+                file_b, b->width, b->height, b->channels);
+        free_image(a);
+        free_image(b);
+        return 1;
     }
 
-    if (width <= 0 || height <= 0) {
-        fclose(fp);
-        return NULL;
+    size_t row_size = (size_t)a->width * a->channels;
+    size_t k_begin = (size_t)border * a->channels;
+    size_t k_end = 2 * border < a->width ? row_size - k_begin : k_begin;
+    long long samples = 0, beyond = 0;
+    double squared = 0.0;
+    int max_diff = 0, first_x = -1, first_y = -1;
+    for (int i = border; i < a->height - border; i++) {
+        const unsigned char* pa = a->data + (size_t)i * row_size;
+        const unsigned char* pb = b->data + (size_t)i * row_size;
+        for (size_t k = k_begin; k < k_end; k++) {
+            int d = abs(pa[k] - pb[k]);
+            if (d > max_diff) max_diff = d;
+            if (d > tolerance && beyond++ == 0) {
+                first_x = (int)(k / a->channels);
+                first_y = i;
+            }
+            squared += (double)d * d;
+            samples++;
+        }
+    }
+
+    printf("Compare: %dx%d, %d channels, border %d: max diff %d, %lld of %lld samples "
+           "beyond %d", a->width, a->height, a->channels, border, max_diff, beyond,
+           samples, tolerance);
+    if (squared > 0.0) {
+        printf(", PSNR %.2f dB", 10.0 * log10(255.0 * 255.0 * samples / squared));
+    }
+    if (beyond) printf(" (first at %d,%d)", first_x, first_y);
+    printf("\n");
+
+    free_image(a);
+    free_image(b);
+    return beyond ? 1 : 0;
+}
+
+// ============================================
+// IMAGE I/O (Netpbm: PGM, PPM, PAM)
+// ============================================
+
+// Netpbm headers: P5 <w> <h> <max> (gray), P6 <w> <h> <max> (RGB) and P7
+// (PAM: WIDTH/HEIGHT/DEPTH/MAXVAL/TUPLTYPE lines up to ENDHDR), with
+// '#' comments between the tokens. P5/P6 data starts after the single
+// whitespace byte that ends max_val, P7 data after the ENDHDR line.
+#define PNM_HEADER_MAX 4096
+
+static int header_token(const unsigned char* p, size_t n, size_t* pos, char* tok, size_t size) {
+    for (;;) {
+        while (*pos < n && isspace(p[*pos])) (*pos)++;
+        if (*pos < n && p[*pos] == '#') {
+            while (*pos < n && p[*pos] != '\n') (*pos)++;
+            continue;
+        }
+        break;
+    }
+    size_t len = 0;
+    while (*pos < n && !isspace(p[*pos]) && len + 1 < size) tok[len++] = (char)p[(*pos)++];
+    tok[len] = '\0';
+    return len > 0 && (*pos >= n || isspace(p[*pos]));
+}
+
+static int header_int(const unsigned char* p, size_t n, size_t* pos, int* value) {
+    char tok[16];
+    if (!header_token(p, n, pos, tok, sizeof(tok))) return 0;
+    char* end;
+    long v = strtol(tok, &end, 10);
+    if (*end != '\0' || !isdigit((unsigned char)tok[0]) || v > INT_MAX) return 0;
+    *value = (int)v;
+    return 1;
+}
+
+// Returns the offset of the first pixel byte, or 0 if p does not start
+// with a supported header: 1, 3 or 4 channels of 1..65535
+static size_t parse_pnm_header(const unsigned char* p, size_t n, PnmInfo* info) {
+    char tok[16];
+    size_t pos = 0;
+    if (!header_token(p, n, &pos, tok, sizeof(tok))) return 0;
+    
+    if (strcmp(tok, "P5") == 0 || strcmp(tok, "P6") == 0) {
+        info->channels = (tok[1] == '5') ? 1 : 3;
+        if (!header_int(p, n, &pos, &info->width) ||
+            !header_int(p, n, &pos, &info->height) ||
+            !header_int(p, n, &pos, &info->max_val) || pos >= n) {
+            return 0;
+        }
+        pos++;
+    } else if (strcmp(tok, "P7") == 0) {
+        info->width = info->height = info->channels = info->max_val = 0;
+        for (;;) {
+            if (!header_token(p, n, &pos, tok, sizeof(tok))) return 0;
+            if (strcmp(tok, "ENDHDR") == 0) break;
+            int ok = 1;
+            if (strcmp(tok, "WIDTH") == 0) ok = header_int(p, n, &pos, &info->width);
+            else if (strcmp(tok, "HEIGHT") == 0) ok = header_int(p, n, &pos, &info->height);
+            else if (strcmp(tok, "DEPTH") == 0) ok = header_int(p, n, &pos, &info->channels);
+            else if (strcmp(tok, "MAXVAL") == 0) ok = header_int(p, n, &pos, &info->max_val);
+            else if (strcmp(tok, "TUPLTYPE") == 0) {
+                while (pos < n && p[pos] != '\n') pos++;
+            } else {
+                ok = 0;
+            }
+            if (!ok) return 0;
+        }
+        while (pos < n && p[pos] != '\n') pos++;
+        if (pos >= n) return 0;
+        pos++;
+    } else {
+        return 0;
+    }
+    
+    if (info->width <= 0 || info->height <= 0 || info->max_val < 1 || info->max_val > 65535 ||
+        (info->channels != 1 && info->channels != 3 && info->channels != 4)) {
+        return 0;
+    }
+    return pos;
+}
+
+// P5 for gray, P6 for RGB, P7 RGB_ALPHA for RGBA
+int format_pnm_header(char* buf, size_t size, int width, int height, int channels) {
+    if (channels == 4) {
+        return snprintf(buf, size, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\n"
+                        "TUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
     }
+    return snprintf(buf, size, "P%c\n%d %d\n255\n", (channels == 1) ? '5' : '6',
+                    width, height);
+}
 
-    /* Consume one byte (likely a single newline) before the binary data */
-    int c = fgetc(fp);
-    if (c == EOF) {
+FILE* open_pnm_input(const char* filename, PnmInfo* info) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    
+    unsigned char header[PNM_HEADER_MAX];
+    size_t n = fread(header, 1, sizeof(header), fp);
+    size_t offset = parse_pnm_header(header, n, info);
+    if (offset == 0 || fseek(fp, (long)offset, SEEK_SET) != 0) {
         fclose(fp);
         return NULL;
     }
+    return fp;
+}
 
-    Image* img = create_image(width, height, 3);
+int read_pnm_rows(FILE* fp, const PnmInfo* info, unsigned char* dst, size_t rows) {
+    size_t row_size = (size_t)info->width * info->channels;
+    if (info->max_val <= 255) {
+        return fread(dst, row_size, rows, fp) == rows;
+    }
+    
+    // Big-endian 16-bit samples, rescaled to 0..255 a block of rows at a time
+    size_t block = (rows < 64) ? rows : 64;
+    unsigned char* wide = (unsigned char*)malloc(block * row_size * 2);
+    if (!wide) return 0;
+    unsigned int max_val = (unsigned int)info->max_val;
+    int ok = 1;
+    for (size_t y = 0; y < rows && ok; y += block) {
+        size_t n = (rows - y < block) ? rows - y : block;
+        ok = fread(wide, row_size * 2, n, fp) == n;
+        unsigned char* out = dst + y * row_size;
+        for (size_t i = 0; ok && i < n * row_size; i++) {
+            unsigned int v = ((unsigned int)wide[2 * i] << 8) | wide[2 * i + 1];
+            if (v > max_val) v = max_val;
+            out[i] = (unsigned char)((v * 255 + max_val / 2) / max_val);
+        }
+    }
+    free(wide);
+    return ok;
+}
+
+Image* load_image(const char* filename) {
+    PnmInfo info;
+    FILE* fp = open_pnm_input(filename, &info);
+    if (!fp) return load_image_stb(filename);
+
+    Image* img = create_image(info.width, info.height, info.channels);
     if (!img) {
         fclose(fp);
         return NULL;
     }
 
-    size_t expected = (size_t)width * (size_t)height * 3;
-    size_t nread = fread(img->data, 1, expected, fp);
-    if (nread != expected) {
+    if (!read_pnm_rows(fp, &info, img->data, (size_t)info.height)) {
         free_image(img);
         fclose(fp);
         return NULL;
@@ -308,44 +5513,784 @@ Image* load_image(const char* filename) {
     return img;
 }
 
-void save_image(const char* filename, Image* img) {
+// P4: rows of ceil(width / 8) bytes, most significant bit first, 1 for
+// black. Channel 0 is the value.
+static int save_image_pbm(const char* filename, const Image* img) {
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) return 0;
+    
+    size_t row_bytes = ((size_t)img->width + 7) / 8;
+    unsigned char* bits = (unsigned char*)malloc(row_bytes);
+    int ok = bits && fprintf(fp, "P4\n%d %d\n", img->width, img->height) > 0;
+    for (int y = 0; ok && y < img->height; y++) {
+        const unsigned char* row = img->data + (size_t)y * img->pitch;
+        memset(bits, 0, row_bytes);
+        for (int x = 0; x < img->width; x++) {
+            if (row[(size_t)x * img->channels] < 128) bits[x >> 3] |= (unsigned char)(0x80 >> (x & 7));
+        }
+        ok = fwrite(bits, 1, row_bytes, fp) == row_bytes;
+    }
+    free(bits);
+    return (fclose(fp) == 0 && ok);
+}
+
+int save_image(const char* filename, Image* img) {
+    ImageFormat format = output_format(filename);
+    if (format == FORMAT_PBM) return save_image_pbm(filename, img);
+    if (format != FORMAT_PNM) return save_image_stb(filename, img, format);
+    
     FILE* fp = fopen(filename, "wb");
-    if (!fp) return;
+    if (!fp) return 0;
 
-    if (fprintf(fp, "P6\n%d %d\n255\n", img->width, img->height) < 0) {
+    char header[128];
+    format_pnm_header(header, sizeof(header), img->width, img->height, img->channels);
+    if (fputs(header, fp) < 0) {
         fclose(fp);
-        return;
+        return 0;
     }
 
     size_t expected = (size_t)img->width * (size_t)img->height * (size_t)img->channels;
     size_t nw = fwrite(img->data, 1, expected, fp);
-    (void)nw; /* ignore in release; could check and report errors if needed */
-    fclose(fp);
+    return (fclose(fp) == 0 && nw == expected);
 }
 
 Image* create_image(int width, int height, int channels) {
     Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) return NULL;
     img->width = width;
     img->height = height;
     img->channels = channels;
-    img->data = (unsigned char*)calloc(width * height * channels, sizeof(unsigned char));
+    img->planar = 0;
+    img->pitch = (size_t)width * channels;
+    img->map = NULL;
+    img->map_size = 0;
+    img->data = pixel_buffer_alloc((size_t)width * height * channels, height);
+    if (!img->data) {
+        free(img);
+        return NULL;
+    }
     return img;
 }
 
 void free_image(Image* img) {
     if (img) {
-        free(img->data);
+        if (img->map) {
+            munmap(img->map, img->map_size);
+        } else {
+            size_t planes = img->planar ? (size_t)img->channels : 1;
+            pixel_buffer_release(img->data, img->pitch * img->height * planes);
+        }
         free(img);
     }
 }
 
+// ============================================
+// COMPRESSED FORMATS (stb_image, stb_image_write)
+// ============================================
+//
+// Decoding and encoding are single-threaded and run once per image; the
+// decoded pixels are copied into a regular image buffer so that the
+// filters see the same alignment and page placement as for Netpbm.
+// Batch mode runs several codecs at once (see BATCH MODE).
+
+ImageFormat output_format(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (!dot || strchr(dot, '/')) return FORMAT_PNM;
+    if (strcasecmp(dot, ".png") == 0) return FORMAT_PNG;
+    if (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0) return FORMAT_JPEG;
+    if (strcasecmp(dot, ".bmp") == 0) return FORMAT_BMP;
+    if (strcasecmp(dot, ".pbm") == 0) return FORMAT_PBM;
+    return FORMAT_PNM;
+}
+
+int probe_image(const char* filename, PnmInfo* info, int* compressed) {
+    FILE* fp = open_pnm_input(filename, info);
+    if (fp) {
+        fclose(fp);
+        *compressed = 0;
+        return 1;
+    }
+    
+    int comp;
+    if (!stbi_info(filename, &info->width, &info->height, &comp)) return 0;
+    info->channels = (comp == 2) ? 4 : comp;
+    info->max_val = stbi_is_16_bit(filename) ? 65535 : 255;
+    *compressed = 1;
+    return 1;
+}
+
+Image* load_image_stb(const char* filename) {
+    int width, height, comp;
+    if (!stbi_info(filename, &width, &height, &comp)) return NULL;
+    int channels = (comp == 2) ? 4 : comp;
+    
+    unsigned char* pixels = stbi_load(filename, &width, &height, &comp, channels);
+    if (!pixels) return NULL;
+    Image* img = create_image(width, height, channels);
+    if (img) memcpy(img->data, pixels, (size_t)width * height * channels);
+    stbi_image_free(pixels);
+    return img;
+}
+
+int save_image_stb(const char* filename, const Image* img, ImageFormat format) {
+    int w = img->width, h = img->height, c = img->channels;
+    switch (format) {
+        case FORMAT_PNG:  return stbi_write_png(filename, w, h, c, img->data, (int)img->pitch);
+        case FORMAT_JPEG: return stbi_write_jpg(filename, w, h, c, img->data, JPEG_QUALITY);
+        case FORMAT_BMP:  return stbi_write_bmp(filename, w, h, c, img->data);
+        default:          return 0;
+    }
+}
+
+// ============================================
+// PIXEL BUFFER ALLOCATION
+// ============================================
+//
+// calloc zeroes buffers that a load or a filter overwrites completely,
+// and its pages land on the NUMA node of whichever thread touches them
+// first - the loading thread for the input, and for a large calloc that
+// is a fresh zero mapping, whichever filter thread faults it in. Image
+// buffers instead come 64-byte aligned and unzeroed, and a
+// schedule(static) loop over the image rows writes one byte per page so
+// that each thread's block of rows sits on its own node, exactly the
+// block the static filter loops give it later. --alloc huge additionally
+// places buffers above 1 MB on 2 MB aligned transparent huge pages,
+// which cuts TLB misses on the vertical neighbours of 3x3 and Gaussian
+// windows.
+
+static AllocMode alloc_mode = ALLOC_TOUCH;
+static int alloc_threads = 1;
+
+int parse_alloc(const char* name, AllocMode* mode) {
+    if (strcmp(name, "calloc") == 0) {
+        *mode = ALLOC_CALLOC;
+    } else if (strcmp(name, "touch") == 0) {
+        *mode = ALLOC_TOUCH;
+    } else if (strcmp(name, "huge") == 0) {
+        *mode = ALLOC_HUGE;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// thread_count must match the filters' team for the placement to line up
+void set_alloc_policy(AllocMode mode, int thread_count) {
+    alloc_mode = mode;
+    alloc_threads = thread_count;
+}
+
+static int pool_bucket(size_t bytes) {
+    int b = 0;
+    while (b < POOL_BUCKETS - 1 && ((size_t)1 << b) < bytes) b++;
+    return b;
+}
+
+// Huge buffers are mapped at their power-of-two size class whether or
+// not the pool is on, so release can unmap without knowing which; the
+// untouched tail is address space only.
+static size_t huge_buffer_size(size_t bytes) {
+    return (size_t)1 << pool_bucket(bytes);
+}
+
+static int huge_buffer(size_t bytes) {
+    return alloc_mode == ALLOC_HUGE && huge_buffer_size(bytes) >= HUGE_PAGE_SIZE;
+}
+
+static unsigned char* raw_buffer_alloc(size_t bytes) {
+    if (alloc_mode == ALLOC_CALLOC) return (unsigned char*)calloc(bytes, 1);
+    
+    if (huge_buffer(bytes)) {
+        // Over-map by one huge page and trim to a 2 MB boundary
+        size_t size = huge_buffer_size(bytes);
+        unsigned char* map = (unsigned char*)mmap(NULL, size + HUGE_PAGE_SIZE,
+                                                  PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) return NULL;
+        
+        size_t head = (HUGE_PAGE_SIZE - (uintptr_t)map % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+        unsigned char* data = map + head;
+        if (head > 0) munmap(map, head);
+        munmap(data + size, HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+        return data;
+    }
+    
+    void* data = NULL;
+    return posix_memalign(&data, BUFFER_ALIGN, bytes) == 0 ? (unsigned char*)data : NULL;
+}
+
+static void raw_buffer_free(unsigned char* data, size_t bytes) {
+    if (huge_buffer(bytes)) {
+        munmap(data, huge_buffer_size(bytes));
+    } else {
+        free(data);
+    }
+}
+
+// Nested inside a batch worker this runs on the calling thread alone,
+// which is also the thread that filters that image
+static void first_touch(unsigned char* data, size_t bytes, int rows) {
+    if (rows < 1) return;
+    size_t row_bytes = bytes / rows;
+    if (row_bytes == 0) return;
+    
+#pragma omp parallel for num_threads(alloc_threads) schedule(static)
+    for (int i = 0; i < rows; i++) {
+        unsigned char* row = data + (size_t)i * row_bytes;
+        for (size_t off = 0; off < row_bytes; off += 4096) row[off] = 0;
+        row[row_bytes - 1] = 0;
+    }
+}
+
+// ============================================
+// PIXEL BUFFER POOL
+// ============================================
+//
+// A fresh multi-megabyte buffer is a new mapping: every page faults on
+// first touch, which costs more than grayscale itself on a 1 MP image.
+// With the pool enabled, released buffers go onto a free list by
+// power-of-two size class and the next image of a similar size gets one
+// back with its pages already mapped and placed.
+
+typedef struct {
+    unsigned char* buffers[POOL_PER_BUCKET];
+    int count;
+} PoolBucket;
+
+static PoolBucket pixel_pool[POOL_BUCKETS];
+static int pixel_pool_on = 0;
+
+unsigned char* pixel_buffer_alloc(size_t bytes, int rows) {
+    unsigned char* data = NULL;
+    if (!pixel_pool_on) {
+        data = raw_buffer_alloc(bytes);
+    } else {
+        int b = pool_bucket(bytes);
+#pragma omp critical(pixel_pool)
+        {
+            if (pixel_pool[b].count > 0) data = pixel_pool[b].buffers[--pixel_pool[b].count];
+        }
+        if (data) return data;
+        data = raw_buffer_alloc((size_t)1 << b);
+    }
+    
+    if (data && alloc_mode != ALLOC_CALLOC) first_touch(data, bytes, rows);
+    return data;
+}
+
+void pixel_buffer_release(unsigned char* data, size_t bytes) {
+    if (!data) return;
+    if (!pixel_pool_on) {
+        raw_buffer_free(data, bytes);
+        return;
+    }
+    
+    int b = pool_bucket(bytes);
+    int kept = 0;
+#pragma omp critical(pixel_pool)
+    {
+        if (pixel_pool[b].count < POOL_PER_BUCKET) {
+            pixel_pool[b].buffers[pixel_pool[b].count++] = data;
+            kept = 1;
+        }
+    }
+    if (!kept) raw_buffer_free(data, (size_t)1 << b);
+}
+
+// Disabling frees everything pooled; buffers still in use are freed as
+// usual when released
+void pixel_pool_enable(int enable) {
+    if (!enable) {
+        for (int b = 0; b < POOL_BUCKETS; b++) {
+            while (pixel_pool[b].count > 0) {
+                raw_buffer_free(pixel_pool[b].buffers[--pixel_pool[b].count], (size_t)1 << b);
+            }
+        }
+    }
+    pixel_pool_on = enable;
+}
+
+// ============================================
+// MEMORY-MAPPED I/O (--io mmap)
+// ============================================
+//
+// The input payload is used in place after the header, so there is no
+// zeroed buffer and no kernel-to-user copy; the filter threads take the
+// page faults as they first touch their rows. The output file is created
+// at its final size and mapped shared, filters write straight into the
+// page cache and saving is just the unmap.
+
+// advice: MADV_WILLNEED reads the whole file ahead, MADV_RANDOM nothing
+static Image* map_input(const char* filename, int advice) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 3) {
+        close(fd);
+        return NULL;
+    }
+    
+    size_t size = (size_t)st.st_size;
+    unsigned char* map = (unsigned char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    
+    /* Same header rules as load_image. 16-bit samples and compressed
+       files cannot be used in place; those are read and converted instead */
+    PnmInfo info;
+    size_t pos = parse_pnm_header(map, size < PNM_HEADER_MAX ? size : PNM_HEADER_MAX, &info);
+    if (pos == 0 || info.max_val > 255) {
+        munmap(map, size);
+        return load_image(filename);
+    }
+    int width = info.width, height = info.height, channels = info.channels;
+    
+    size_t expected = (size_t)width * (size_t)height * channels;
+    if (size - pos < expected) {
+        munmap(map, size);
+        return NULL;
+    }
+    
+    // Start readahead now so disk reads overlap with the first rows' work,
+    // or keep the kernel from reading anything not asked for
+    madvise(map, size, advice);
+    
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) {
+        munmap(map, size);
+        return NULL;
+    }
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->planar = 0;
+    img->pitch = (size_t)width * channels;
+    img->data = map + pos;
+    img->map = map;
+    img->map_size = size;
+    return img;
+}
+
+Image* load_image_mmap(const char* filename) {
+    return map_input(filename, MADV_WILLNEED);
+}
+
+Image* load_image_lazy(const char* filename) {
+    return map_input(filename, MADV_RANDOM);
+}
+
+Image* create_image_mmap(const char* filename, int width, int height, int channels) {
+    char header[128];
+    int header_len = format_pnm_header(header, sizeof(header), width, height, channels);
+    size_t size = (size_t)header_len + (size_t)width * height * channels;
+    
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+    
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    unsigned char* map = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    memcpy(map, header, header_len);
+    
+    Image* img = (Image*)malloc(sizeof(Image));
+    if (!img) {
+        munmap(map, size);
+        return NULL;
+    }
+    img->width = width;
+    img->height = height;
+    img->channels = channels;
+    img->planar = 0;
+    img->pitch = (size_t)width * channels;
+    img->data = map + header_len;
+    img->map = map;
+    img->map_size = size;
+    return img;
+}
+
+// Sets the runtime schedule as a side effect; steal keeps loops static
+int parse_sched(const char* name, SchedMode* mode) {
+    if (strcmp(name, "static") == 0) *mode = SCHED_STATIC;
+    else if (strcmp(name, "dynamic") == 0) *mode = SCHED_DYNAMIC;
+    else if (strcmp(name, "guided") == 0) *mode = SCHED_GUIDED;
+    else if (strcmp(name, "steal") == 0) *mode = SCHED_STEAL;
+    else return 0;
+    
+#ifdef _OPENMP
+    omp_set_schedule(*mode == SCHED_DYNAMIC ? omp_sched_dynamic :
+                     *mode == SCHED_GUIDED ? omp_sched_guided : omp_sched_static, 0);
+#endif
+    return 1;
+}
+
+// ============================================
+// METRICS (--metrics json|csv[:FILE])
+// ============================================
+//
+// Phase timers for the single-image path plus a per-thread breakdown of
+// the compute phase: CPU time from CLOCK_THREAD_CPUTIME_ID and, where
+// the kernel allows perf events, user-space cycles, instructions and
+// cache misses. The probes run as parallel regions of the filters' size;
+// the OpenMP runtime keeps those worker threads from one region to the
+// next, so thread t's numbers cover all the work thread t did in
+// between. Threads waiting at a barrier spin for a while before they
+// sleep and that counts as CPU time; OMP_WAIT_POLICY=passive leaves only
+// busy time.
+
+#ifdef __linux__
+static int perf_counter_open(unsigned long long config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+static double thread_cpu_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int parse_metrics(const char* spec, Metrics* m) {
+    const char* colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    
+    if (len == 4 && strncmp(spec, "json", 4) == 0) m->format = METRICS_JSON;
+    else if (len == 3 && strncmp(spec, "csv", 3) == 0) m->format = METRICS_CSV;
+    else return 0;
+    m->path = (colon && colon[1]) ? colon + 1 : NULL;
+    return 1;
+}
+
+void metrics_init(Metrics* m, int thread_count) {
+    memset(m->phase, 0, sizeof(m->phase));
+    m->thread_count = thread_count;
+    m->threads = (ThreadProbe*)calloc(thread_count, sizeof(ThreadProbe));
+    for (int t = 0; t < thread_count; t++) {
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            m->threads[t].fd[e] = -1;
+            m->threads[t].events[e] = -1;
+        }
+    }
+}
+
+void metrics_free(Metrics* m) {
+    for (int t = 0; t < m->thread_count; t++) {
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            if (m->threads[t].fd[e] >= 0) close(m->threads[t].fd[e]);
+        }
+    }
+    free(m->threads);
+}
+
+void metrics_threads_begin(Metrics* m) {
+#pragma omp parallel num_threads(m->thread_count)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        ThreadProbe* p = &m->threads[tid];
+#ifdef __linux__
+        static const unsigned long long events[METRIC_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+        };
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            p->fd[e] = perf_counter_open(events[e]);
+            if (p->fd[e] >= 0) {
+                ioctl(p->fd[e], PERF_EVENT_IOC_RESET, 0);
+                ioctl(p->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+        p->cpu = thread_cpu_time();
+    }
+}
+
+void metrics_threads_end(Metrics* m) {
+#pragma omp parallel num_threads(m->thread_count)
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        ThreadProbe* p = &m->threads[tid];
+        p->cpu = thread_cpu_time() - p->cpu;
+#ifdef __linux__
+        for (int e = 0; e < METRIC_EVENTS; e++) {
+            long long value;
+            if (p->fd[e] < 0) continue;
+            ioctl(p->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(p->fd[e], &value, sizeof(value)) == (ssize_t)sizeof(value)) {
+                p->events[e] = value;
+            }
+        }
+#endif
+    }
+}
+
+// Counter totals over all threads; -1 when any thread lacks the event
+static long long metrics_event_total(const Metrics* m, int e) {
+    long long total = 0;
+    for (int t = 0; t < m->thread_count; t++) {
+        if (m->threads[t].events[e] < 0) return -1;
+        total += m->threads[t].events[e];
+    }
+    return total;
+}
+
+static void json_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') fprintf(fp, "\\%c", ch);
+        else if (ch < 0x20) fprintf(fp, "\\u%04x", ch);
+        else fputc(ch, fp);
+    }
+    fputc('"', fp);
+}
+
+static void json_count(FILE* fp, long long value) {
+    if (value < 0) fprintf(fp, "null");
+    else fprintf(fp, "%lld", value);
+}
+
+static void csv_string(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"') fputc('"', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void csv_count(FILE* fp, long long value) {
+    if (value >= 0) fprintf(fp, "%lld", value);
+}
+
+static const char* const phase_names[PHASE_COUNT] = {
+    "load", "alloc", "convert", "compute", "save"
+};
+
+// One JSON object, or one CSV row (with a header when the file is new)
+int metrics_write(const Metrics* m, const MetricsRun* run) {
+    FILE* fp = stderr;
+    int new_file = 1;
+    if (m->path) {
+        struct stat st;
+        new_file = (stat(m->path, &st) != 0 || st.st_size == 0);
+        fp = fopen(m->path, m->format == METRICS_CSV ? "a" : "w");
+        if (!fp) {
+            fprintf(stderr, "Error: Could not write metrics to %s\n", m->path);
+            return 0;
+        }
+    }
+    
+    double total = 0.0;
+    for (int p = 0; p < PHASE_COUNT; p++) total += m->phase[p];
+    double compute = m->phase[PHASE_COMPUTE];
+    double pixels = (double)run->width * run->height;
+    double mpix_per_s = (compute > 0) ? pixels / compute / 1e6 : 0.0;
+    double gb_per_s = (compute > 0) ? run->bytes_moved / compute / 1e9 : 0.0;
+    long long cycles = metrics_event_total(m, 0);
+    long long instructions = metrics_event_total(m, 1);
+    long long misses = metrics_event_total(m, 2);
+    
+    if (m->format == METRICS_JSON) {
+        fprintf(fp, "{\"backend\": \"omp\", \"input\": ");
+        json_string(fp, run->input);
+        fprintf(fp, ", \"filter\": ");
+        json_string(fp, run->filter);
+        fprintf(fp, ", \"width\": %d, \"height\": %d, \"channels\": %d, \"threads\": %d",
+                run->width, run->height, run->channels, m->thread_count);
+        fprintf(fp, ", \"kernels\": \"%s\", \"layout\": \"%s\", \"io\": \"%s\", "
+                "\"sched\": \"%s\", \"alloc\": \"%s\"",
+                run->kernels, run->layout, run->io, run->sched, run->alloc);
+        fprintf(fp, ", \"phases\": {");
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(fp, "%s\"%s\": %.6f", p ? ", " : "", phase_names[p], m->phase[p]);
+        }
+        fprintf(fp, ", \"total\": %.6f}", total);
+        fprintf(fp, ", \"megapixels_per_s\": %.3f, \"bytes_moved\": %zu, \"gb_per_s\": %.3f",
+                mpix_per_s, run->bytes_moved, gb_per_s);
+        fprintf(fp, ", \"cycles\": ");
+        json_count(fp, cycles);
+        fprintf(fp, ", \"instructions\": ");
+        json_count(fp, instructions);
+        fprintf(fp, ", \"cache_misses\": ");
+        json_count(fp, misses);
+        fprintf(fp, ", \"per_thread\": [");
+        for (int t = 0; t < m->thread_count; t++) {
+            const ThreadProbe* p = &m->threads[t];
+            fprintf(fp, "%s{\"thread\": %d, \"cpu_s\": %.6f, \"cycles\": ", t ? ", " : "",
+                    t, p->cpu);
+            json_count(fp, p->events[0]);
+            fprintf(fp, ", \"instructions\": ");
+            json_count(fp, p->events[1]);
+            fprintf(fp, ", \"ipc\": ");
+            if (p->events[0] > 0 && p->events[1] >= 0) {
+                fprintf(fp, "%.3f", (double)p->events[1] / p->events[0]);
+            } else {
+                fprintf(fp, "null");
+            }
+            fprintf(fp, ", \"cache_misses\": ");
+            json_count(fp, p->events[2]);
+            fprintf(fp, "}");
+        }
+        fprintf(fp, "]}\n");
+    } else {
+        double cpu_min = 0.0, cpu_max = 0.0;
+        for (int t = 0; t < m->thread_count; t++) {
+            double cpu = m->threads[t].cpu;
+            if (t == 0 || cpu < cpu_min) cpu_min = cpu;
+            if (t == 0 || cpu > cpu_max) cpu_max = cpu;
+        }
+        
+        if (new_file) {
+            fprintf(fp, "backend,input,filter,width,height,channels,threads,kernels,layout,io,"
+                    "sched,alloc,load_s,alloc_s,convert_s,compute_s,save_s,total_s,"
+                    "megapixels_per_s,bytes_moved,gb_per_s,thread_cpu_min_s,"
+                    "thread_cpu_max_s,cycles,instructions,ipc,cache_misses\n");
+        }
+        fprintf(fp, "omp,");
+        csv_string(fp, run->input);
+        fputc(',', fp);
+        csv_string(fp, run->filter);
+        fprintf(fp, ",%d,%d,%d,%d,%s,%s,%s,%s,%s", run->width, run->height, run->channels,
+                m->thread_count, run->kernels, run->layout, run->io, run->sched, run->alloc);
+        for (int p = 0; p < PHASE_COUNT; p++) fprintf(fp, ",%.6f", m->phase[p]);
+        fprintf(fp, ",%.6f,%.3f,%zu,%.3f,%.6f,%.6f,", total, mpix_per_s, run->bytes_moved,
+                gb_per_s, cpu_min, cpu_max);
+        csv_count(fp, cycles);
+        fputc(',', fp);
+        csv_count(fp, instructions);
+        fputc(',', fp);
+        if (cycles > 0 && instructions >= 0) fprintf(fp, "%.3f", (double)instructions / cycles);
+        fputc(',', fp);
+        csv_count(fp, misses);
+        fputc('\n', fp);
+    }
+    
+    if (fp != stderr) fclose(fp);
+    else fflush(fp);
+    return 1;
+}
+
 void print_usage(const char* prog_name) {
-    fprintf(stderr, "Usage: %s <input.ppm> <output.ppm> <filter> <num_threads>\n", prog_name);
+    fprintf(stderr, "Usage: %s <input.ppm> <output.ppm> <filter[,filter...]> <num_threads> [options]\n", prog_name);
+    fprintf(stderr, "       %s --serve <-|socket_path> <num_threads> [options]\n", prog_name);
+    fprintf(stderr, "       %s --bench <input.ppm|synthetic[:WxH,...]> <filter[,filter...]> <max_threads>\n"
+                    "              [--warmup M] [--reps N] [options]\n", prog_name);
+    fprintf(stderr, "       %s --compare <a> <b> [--tolerance N] [--border B]\n", prog_name);
     fprintf(stderr, "\nFilters:\n");
     fprintf(stderr, "  grayscale - Convert to grayscale\n");
     fprintf(stderr, "  blur      - Gaussian blur\n");
-    fprintf(stderr, "  edge      - Sobel edge detection\n");
-    fprintf(stderr, "  brighten  - Increase brightness\n");
+    fprintf(stderr, "  edge      - Sobel edge detection; edge:l1 takes |gx| + |gy| instead of\n");
+    fprintf(stderr, "              the exact magnitude (integer only, no sqrt)\n");
+    fprintf(stderr, "  edgemask:T[:l1] - 255 where the edge magnitude is >= T, else 0, without\n");
+    fprintf(stderr, "              computing it (default %d); edge,threshold:T becomes this\n",
+            THRESHOLD_DEFAULT);
+    fprintf(stderr, "  brighten:N - Add N (-255..255) to every channel, saturating (default %d)\n",
+            BRIGHTEN_DEFAULT);
+    fprintf(stderr, "  contrast:F - Scale each channel's distance from mid-grey by F (default %.1f)\n",
+            CONTRAST_DEFAULT);
+    fprintf(stderr, "  gamma:G   - Gamma correction, out = 255 (in/255)^(1/G) (default %.1f)\n",
+            GAMMA_DEFAULT);
+    fprintf(stderr, "  invert    - Negative\n");
+    fprintf(stderr, "  threshold:T - 255 where a channel is >= T, else 0 (default %d)\n",
+            THRESHOLD_DEFAULT);
+    fprintf(stderr, "  gauss:S   - Separable Gaussian blur with sigma S (box approximation\n");
+    fprintf(stderr, "              above sigma %.0f)\n", GAUSS_BOX_SIGMA);
+    fprintf(stderr, "  box:R     - Box blur over a (2R+1)^2 window (default R=%d)\n", BOX_DEFAULT_RADIUS);
+    fprintf(stderr, "  thresh:R:C - Adaptive threshold: white where a pixel exceeds its\n");
+    fprintf(stderr, "              (2R+1)^2 local mean minus C (default %d:%d)\n",
+            THRESH_DEFAULT_RADIUS, THRESH_DEFAULT_OFFSET);
+    fprintf(stderr, "              box and thresh cost the same for any R (integral image)\n");
+    fprintf(stderr, "  equalize  - Histogram equalization, per channel\n");
+    fprintf(stderr, "  autolevels - Stretch each channel's used range to 0..255\n");
+    fprintf(stderr, "  stretch:L:H - Stretch each channel so percentiles L..H span 0..255,\n");
+    fprintf(stderr, "              clipping the rest (default %.0f:%.0f)\n",
+            STRETCH_DEFAULT_LOW, STRETCH_DEFAULT_HIGH);
+    fprintf(stderr, "\nA comma-separated list runs the filters in order in one pass over\n");
+    fprintf(stderr, "the image where possible (per-pixel filters fuse into the next\n");
+    fprintf(stderr, "blur/edge; consecutive brighten/contrast/gamma/invert/threshold\n");
+    fprintf(stderr, "become one lookup table).\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, "  --tile WxH  Run the whole pipeline tile by tile with halos\n");
+    fprintf(stderr, "              (e.g. --tile 256x64; --tile N for square tiles)\n");
+    fprintf(stderr, "  --simd ISA  Row kernels: auto (default), avx2, sse4, neon, scalar\n");
+    fprintf(stderr, "  --layout L  interleaved (default) or planar (one aligned plane per\n");
+    fprintf(stderr, "              channel; converted once at load and save)\n");
+    fprintf(stderr, "  --io MODE   stdio (default) or mmap (input used in place, output\n");
+    fprintf(stderr, "              written straight into a mapped file)\n");
+    fprintf(stderr, "  --roi WxH+X+Y  Compute only that window (tile by tile, e.g. --roi\n");
+    fprintf(stderr, "              512x512+4096+2048); the input is mapped and only the window\n");
+    fprintf(stderr, "              plus the chain's halo is read; the output is the window\n");
+    fprintf(stderr, "  --stream R  Process the file in bands of R rows with overlapped\n");
+    fprintf(stderr, "              read/filter/write; memory stays O(R x width)\n");
+    fprintf(stderr, "  --batch     <input> is a manifest (one path per line) or a directory\n");
+    fprintf(stderr, "              of .ppm files and <output> the directory for the results;\n");
+    fprintf(stderr, "              small images run one per thread, large ones use all threads\n");
+    fprintf(stderr, "  --sequence  Like --batch, but the inputs are consecutive frames: each\n");
+    fprintf(stderr, "              frame is compared with the previous one tile by tile and\n");
+    fprintf(stderr, "              only tiles whose input (plus the chain's halo) changed are\n");
+    fprintf(stderr, "              recomputed; the rest of the output is reused\n");
+    fprintf(stderr, "  --sched S   Loop schedule: static (default), dynamic (batch default),\n");
+    fprintf(stderr, "              guided, or steal (tiles and batch images become OpenMP\n");
+    fprintf(stderr, "              tasks that idle threads take from the queue)\n");
+    fprintf(stderr, "  --alloc A   Image buffers: touch (default; aligned, not zeroed, pages\n");
+    fprintf(stderr, "              first-touched by the threads that filter them), huge\n");
+    fprintf(stderr, "              (touch on 2 MB huge pages) or calloc\n");
+    fprintf(stderr, "  --device D  host (default) or gpu: grayscale, blur, edge and point-op\n");
+    fprintf(stderr, "              chains run as OpenMP target regions with the image kept on\n");
+    fprintf(stderr, "              the device and copied in overlapped %d-row chunks; --bench\n",
+            DEVICE_CHUNK_ROWS);
+    fprintf(stderr, "              adds a host/device crossover table (build with make gpu)\n");
+    fprintf(stderr, "  --metrics F Phase timings, MP/s, GB/s and per-thread CPU time and\n");
+    fprintf(stderr, "              counters as json or csv, on stderr (stdout keeps the text\n");
+    fprintf(stderr, "              report) or appended to a file with json:FILE / csv:FILE\n");
+    fprintf(stderr, "  --warmup M  Bench: untimed runs per thread count (default %d)\n", BENCH_WARMUP);
+    fprintf(stderr, "  --reps N    Bench: timed runs per thread count (default %d)\n", BENCH_REPS);
     fprintf(stderr, "\nExample:\n");
     fprintf(stderr, "  %s input.ppm output.ppm blur 4\n", prog_name);
+    fprintf(stderr, "  %s input.ppm output.ppm grayscale,blur,edge 4\n", prog_name);
+    fprintf(stderr, "  %s input.ppm output.ppm blur,blur,edge 8 --tile 256x64\n", prog_name);
+    fprintf(stderr, "  %s huge.ppm crop.ppm grayscale,blur,edge 8 --roi 1024x768+5000+3000\n", prog_name);
+    fprintf(stderr, "  %s frames/ out/ grayscale,edge 8 --batch\n", prog_name);
+    fprintf(stderr, "  %s camera/ out/ grayscale,blur,edge 8 --sequence\n", prog_name);
+    fprintf(stderr, "  %s --bench synthetic:1024x1024,4096x4096 blur 8 --reps 20\n", prog_name);
+    fprintf(stderr, "  %s --bench synthetic grayscale,blur,edge 8 --device gpu\n", prog_name);
+    fprintf(stderr, "\nServer mode reads jobs \"<input.ppm> <output.ppm> <filters>\", one per\n");
+    fprintf(stderr, "line, from stdin or a Unix socket and answers \"ok <ms> <output>\" or\n");
+    fprintf(stderr, "\"error <ms> <input> <reason>\" per job; \"quit\" stops it.\n");
+    fprintf(stderr, "\nInputs are P5 (gray), P6 (RGB) or P7 PAM (gray, RGB, RGBA) with 8- or\n");
+    fprintf(stderr, "16-bit samples (rescaled to 8 bits on load). Outputs keep the input's\n");
+    fprintf(stderr, "channels; a .pgm output stores one channel and needs grayscale or edge\n");
+    fprintf(stderr, "in the chain (a chain starting with one runs on one channel). A .pbm\n");
+    fprintf(stderr, "output stores one bit per pixel, for edgemask results.\n");
+    fprintf(stderr, "PNG, JPEG and BMP inputs are decoded with stb_image; .png, .jpg/.jpeg\n");
+    fprintf(stderr, "and .bmp outputs are encoded (JPEG quality %d). --stream needs Netpbm.\n",
+            JPEG_QUALITY);
+    fprintf(stderr, "\nBench mode loads the image (synthetic: %s) once and\n", BENCH_SIZES);
+    fprintf(stderr, "reports min/median/p95 time, speedup and efficiency for 1, 2, 4, ...\n");
+    fprintf(stderr, "up to max_threads; nothing is written.\n");
+    fprintf(stderr, "\nCompare mode exits non-zero if any sample of <a> and <b> (same size and\n");
+    fprintf(stderr, "channels, any readable format) outside a B-pixel frame differs by more\n");
+    fprintf(stderr, "than N (default 0); it prints the maximum difference and the PSNR.\n");
 }
\ No newline at end of file
@@ -0,0 +1,288 @@
+#!/bin/bash
+# regress.sh - Cross-backend correctness and performance regression suite
+#
+# Runs every filter on the test images through the scalar reference
+# (OpenMP build, 1 thread, --simd scalar) and then through each other
+# path: OpenMP with all threads, every SIMD kernel set the CPU has,
+# the tiled, work-stealing, planar, streaming and offload engines, and
+# the MPI and hybrid builds on several rank counts and a 2-D grid. Each
+# result is compared with the reference by `image_proc.exe --compare`,
+# bit-exactly and including the border pixels. An RGBA PAM checks that
+# alpha survives on both backends.
+#
+# The performance gate times a few chains on test_gradient_medium.ppm
+# (best MP/s of REPS runs from --metrics csv) and fails if any falls
+# more than PERF_TOLERANCE percent below the baseline. Timings only
+# compare on one machine, so the baseline is not part of the repository:
+# --update-baseline records it (make regress-baseline), and without one
+# the gate is reported as not applied and the suite fails.
+#
+# Usage: ./regress.sh [--update-baseline] [--no-perf] [--no-mpi]
+# Environment: THREADS (default: all cores, at most 8), NP (MPI ranks,
+# default 3), REPS (default 5), PERF_TOLERANCE (percent, default 25),
+# BASELINE (default regress_baseline.txt next to this script), MPIRUN
+# (default mpirun; e.g. "mpirun --oversubscribe"), and OMP_EXE, MPI_EXE,
+# HYBRID_EXE to test prebuilt binaries instead of building them.
+
+ROOT=$(cd "$(dirname "$0")" && pwd)
+NUM_CORES=$(nproc 2>/dev/null || sysctl -n hw.ncpu 2>/dev/null || echo 4)
+THREADS=${THREADS:-$(( NUM_CORES < 8 ? NUM_CORES : 8 ))}
+NP=${NP:-3}
+REPS=${REPS:-5}
+PERF_TOLERANCE=${PERF_TOLERANCE:-25}
+BASELINE=${BASELINE:-$ROOT/regress_baseline.txt}
+MPIRUN=${MPIRUN:-mpirun}
+OUT=$ROOT/regress_out
+
+update_baseline=0
+run_perf=1
+run_mpi=1
+for arg in "$@"; do
+    case "$arg" in
+        --update-baseline) update_baseline=1 ;;
+        --no-perf) run_perf=0 ;;
+        --no-mpi) run_mpi=0 ;;
+        *) echo "Usage: $0 [--update-baseline] [--no-perf] [--no-mpi]"; exit 1 ;;
+    esac
+done
+
+echo "======================================"
+echo "Cross-backend Regression Suite"
+echo "======================================"
+
+# Build whatever was not given
+if [ -z "$OMP_EXE" ]; then
+    make -C "$ROOT/OMP" image_proc.exe > /dev/null || exit 1
+    OMP_EXE=$ROOT/OMP/image_proc.exe
+fi
+if [ $run_mpi -eq 1 ] && [ -z "$MPI_EXE" ]; then
+    if command -v mpicc > /dev/null && command -v mpirun > /dev/null; then
+        make -C "$ROOT/MPI" all > /dev/null || exit 1
+        MPI_EXE=$ROOT/MPI/image_proc_mpi.exe
+        HYBRID_EXE=${HYBRID_EXE:-$ROOT/MPI/image_proc_hybrid.exe}
+    else
+        echo "MPI not found, skipping the MPI backends"
+        run_mpi=0
+    fi
+fi
+
+echo "OpenMP:  $OMP_EXE ($THREADS threads)"
+[ $run_mpi -eq 1 ] && echo "MPI:     $MPI_EXE, $HYBRID_EXE ($NP ranks)"
+
+rm -rf "$OUT"
+mkdir -p "$OUT"
+
+images=(test_gradient_small.ppm test_checkerboard_small.ppm test_circles_small.ppm edgeTest.ppm)
+
+# filter|engines: t = tile and steal, p = planar, s = stream, d = device
+# (equalize, autolevels and stretch need the whole image; the device
+# runs grayscale, blur, edge and the point ops only)
+cases=(
+    "grayscale|tpsd"
+    "blur|tpsd"
+    "edge|tpsd"
+    "edge:l1|tpsd"
+    "edgemask:60|tpsd"
+    "brighten:30|tpsd"
+    "contrast:1.5|tpsd"
+    "gamma:2.2|tpsd"
+    "invert|tpsd"
+    "threshold:100|tpsd"
+    "gauss:1.2|tps"
+    "gauss:12|tps"
+    "box:3|tps"
+    "thresh:7:5|tps"
+    "equalize|p"
+    "autolevels|p"
+    "stretch:1:99|p"
+    "grayscale,blur,edge|tpsd"
+    "brighten:-20,gamma:1.8,invert,blur|tpsd"
+)
+
+# SIMD kernel sets this CPU runs
+simd_sets=()
+for isa in sse4 avx2 neon; do
+    if "$OMP_EXE" "$ROOT/OMP/${images[0]}" "$OUT/probe.ppm" grayscale 1 --simd $isa \
+            > /dev/null 2>&1; then
+        simd_sets+=($isa)
+    fi
+done
+echo "SIMD:    scalar ${simd_sets[*]}"
+
+passed=0
+failed=0
+failures=()
+
+# check NAME REFERENCE RESULT COMMAND...: run the command, then compare
+# its result with the reference
+check() {
+    local name=$1 ref=$2 result=$3
+    shift 3
+    rm -f "$result"
+    if ! "$@" > "$OUT/run.log" 2>&1; then
+        echo "  FAIL $name (run failed: $(grep -m1 Error "$OUT/run.log"))"
+        failed=$((failed + 1))
+        failures+=("$name")
+        return
+    fi
+    if "$OMP_EXE" --compare "$ref" "$result" > "$OUT/compare.log" 2>&1; then
+        passed=$((passed + 1))
+    else
+        echo "  FAIL $name: $(cat "$OUT/compare.log")"
+        failed=$((failed + 1))
+        failures+=("$name")
+    fi
+}
+
+# Correctness: every path against the scalar reference
+for image in "${images[@]}"; do
+    input=$ROOT/OMP/$image
+    if [ ! -f "$input" ]; then
+        echo "Warning: $input not found, skipping..."
+        continue
+    fi
+    echo ""
+    echo "Image: $image"
+    for entry in "${cases[@]}"; do
+        filter=${entry%%|*}
+        engines=${entry##*|}
+        ref=$OUT/ref.ppm
+        out=$OUT/out.ppm
+        label="$image $filter"
+        if ! "$OMP_EXE" "$input" "$ref" "$filter" 1 --simd scalar > "$OUT/run.log" 2>&1; then
+            echo "  FAIL $label (reference failed: $(grep -m1 Error "$OUT/run.log"))"
+            failed=$((failed + 1))
+            failures+=("$label reference")
+            continue
+        fi
+
+        check "$label omp" "$ref" "$out" "$OMP_EXE" "$input" "$out" "$filter" "$THREADS"
+        for isa in "${simd_sets[@]}"; do
+            check "$label simd $isa" "$ref" "$out" \
+                "$OMP_EXE" "$input" "$out" "$filter" "$THREADS" --simd $isa
+        done
+        if [[ $engines == *t* ]]; then
+            check "$label tile" "$ref" "$out" \
+                "$OMP_EXE" "$input" "$out" "$filter" "$THREADS" --tile 128x48
+            check "$label steal" "$ref" "$out" \
+                "$OMP_EXE" "$input" "$out" "$filter" "$THREADS" --sched steal --tile 64
+        fi
+        if [[ $engines == *p* ]]; then
+            check "$label planar" "$ref" "$out" \
+                "$OMP_EXE" "$input" "$out" "$filter" "$THREADS" --layout planar
+        fi
+        if [[ $engines == *s* ]]; then
+            check "$label stream" "$ref" "$out" \
+                "$OMP_EXE" "$input" "$out" "$filter" "$THREADS" --stream 37
+        fi
+        if [[ $engines == *d* ]]; then
+            check "$label device" "$ref" "$out" \
+                "$OMP_EXE" "$input" "$out" "$filter" "$THREADS" --device gpu
+        fi
+
+        if [ $run_mpi -eq 1 ]; then
+            check "$label mpi np 1" "$ref" "$out" \
+                $MPIRUN -np 1 "$MPI_EXE" "$input" "$out" "$filter"
+            check "$label mpi np $NP" "$ref" "$out" \
+                $MPIRUN -np "$NP" "$MPI_EXE" "$input" "$out" "$filter"
+            check "$label mpi grid 2x2" "$ref" "$out" \
+                $MPIRUN -np 4 "$MPI_EXE" "$input" "$out" "$filter" --grid 2x2
+            check "$label hybrid" "$ref" "$out" \
+                $MPIRUN -np 2 --bind-to none "$HYBRID_EXE" "$input" "$out" "$filter" --threads 2
+        fi
+    done
+done
+
+# Alpha: an RGBA PAM through the filters that touch colour channels
+if command -v python3 > /dev/null; then
+    echo ""
+    echo "Image: RGBA PAM (alpha channel)"
+    python3 -c "
+w, h = 211, 97
+px = bytes((x * 3 + y) % 256 if c < 3 else (x * y) % 256
+           for y in range(h) for x in range(w) for c in range(4))
+open('$OUT/alpha.pam', 'wb').write(b'P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\n'
+                                   b'TUPLTYPE RGB_ALPHA\nENDHDR\n' % (w, h) + px)"
+    for filter in grayscale blur edge equalize "grayscale,blur,edge"; do
+        ref=$OUT/ref.pam
+        out=$OUT/out.pam
+        "$OMP_EXE" "$OUT/alpha.pam" "$ref" "$filter" 1 --simd scalar > /dev/null 2>&1
+        check "alpha $filter omp" "$ref" "$out" \
+            "$OMP_EXE" "$OUT/alpha.pam" "$out" "$filter" "$THREADS"
+        if [ $run_mpi -eq 1 ]; then
+            check "alpha $filter mpi np $NP" "$ref" "$out" \
+                $MPIRUN -np "$NP" "$MPI_EXE" "$OUT/alpha.pam" "$out" "$filter"
+        fi
+    done
+fi
+
+echo ""
+echo "Correctness: $passed passed, $failed failed"
+
+# Performance: best MP/s of REPS runs per backend and chain
+# megapixels_per_s column of a --metrics csv file (quoted fields hold commas)
+csv_rate() {
+    awk -F, 'NR == 1 { for (i = 1; i <= NF; i++) if ($i == "megapixels_per_s") col = i; next }
+             { gsub(/"[^"]*"/, "x"); if ($col > best) best = $col }
+             END { print best + 0 }' "$1"
+}
+
+perf_failed=0
+if [ $run_perf -eq 1 ]; then
+    perf_input=$ROOT/OMP/test_gradient_medium.ppm
+    perf_filters=("grayscale,blur,edge" "gauss:3" "brighten:-20,gamma:1.8,invert,blur")
+    declare -A rates
+    keys=()
+    for filter in "${perf_filters[@]}"; do
+        runners=("omp-scalar-1t|$OMP_EXE $perf_input $OUT/perf.ppm $filter 1 --simd scalar"
+                 "omp-${THREADS}t|$OMP_EXE $perf_input $OUT/perf.ppm $filter $THREADS")
+        if [ $run_mpi -eq 1 ]; then
+            runners+=("mpi-np$NP|$MPIRUN -np $NP $MPI_EXE $perf_input $OUT/perf.ppm $filter"
+                      "hybrid-np2x2|$MPIRUN -np 2 --bind-to none $HYBRID_EXE $perf_input $OUT/perf.ppm $filter --threads 2")
+        fi
+        for runner in "${runners[@]}"; do
+            key="${runner%%|*}:$filter"
+            rm -f "$OUT/perf.csv"
+            for ((r = 0; r < REPS; r++)); do
+                ${runner#*|} --metrics csv:"$OUT/perf.csv" > /dev/null 2>&1
+            done
+            rates[$key]=$(csv_rate "$OUT/perf.csv")
+            keys+=("$key")
+        done
+    done
+
+    echo ""
+    if [ $update_baseline -eq 1 ]; then
+        echo "# regress.sh baseline: backend:filter MP/s ($(hostname), $(date))" > "$BASELINE"
+        for key in "${keys[@]}"; do
+            echo "$key ${rates[$key]}" >> "$BASELINE"
+        done
+        echo "Performance baseline recorded in $BASELINE; the gate was not applied"
+    elif [ ! -f "$BASELINE" ]; then
+        echo "Performance gate NOT applied: no baseline at $BASELINE"
+        echo "(record one on this machine with ./regress.sh --update-baseline)"
+        perf_failed=1
+    else
+        printf "%-52s %10s %10s %8s\n" "Backend:filter" "MP/s" "Baseline" "Change"
+        for key in "${keys[@]}"; do
+            base=$(awk -v k="$key" '$1 == k { print $2 }' "$BASELINE")
+            if [ -z "$base" ]; then
+                printf "%-52s %10.1f %10s\n" "$key" "${rates[$key]}" "-"
+                continue
+            fi
+            verdict=$(awk -v now="${rates[$key]}" -v base="$base" -v tol="$PERF_TOLERANCE" \
+                'BEGIN { change = (now / base - 1) * 100;
+                         printf "%+7.1f%%%s", change, (change < -tol) ? "  SLOWER" : "" }')
+            printf "%-52s %10.1f %10.1f %s\n" "$key" "${rates[$key]}" "$base" "$verdict"
+            [[ $verdict == *SLOWER ]] && perf_failed=$((perf_failed + 1))
+        done
+        echo "Performance: $perf_failed of ${#keys[@]} below the baseline by more than $PERF_TOLERANCE%"
+    fi
+fi
+
+if [ $failed -gt 0 ]; then
+    echo ""
+    echo "Failed:"
+    printf '  %s\n' "${failures[@]}"
+fi
+[ $failed -eq 0 ] && [ $perf_failed -eq 0 ]